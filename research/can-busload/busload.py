@@ -0,0 +1,272 @@
+#!/usr/bin/env python3
+"""
+Bus load estimate for canmavlink: standard identifiers with a first frame vs extended identifiers
+carrying the header (canmavlink_msg_to_frames_ext) vs picking the shorter one per message
+(canmavlink_msg_to_frames_shortest, what PROBEWIDE_CAN_EXTID enables).
+
+Message lengths come from the dialect xml, the bitrate from zikush_config.h. Frame times are worst case,
+with maximum bit stuffing. Rates in PROFILE are what the boards send in flight: SCU ones are SCU_final's
+AHRS_SEND_FREQ and SENSORS_SEND_FREQ, use -s to scale them. The ICU puts only ground commands on the bus,
+its own messages come from sysid 0 and router.c never sends those back.
+
+With -l it also gives worst-case latencies by the arbitration priorities from zikush_canroutes.h. A latency
+counts from the moment a message is first in its sender's queue until its last frame is out. It is bounded
+for a priority level if the traffic of that level and above fits the bus, lower levels don't count but
+for blocking: a frame already on the bus is never preempted. It takes a frame losing arbitration to wait
+and go again, which is what every node does with automatic retransmission on (NART off). Error frames
+and their retransmissions are not counted.
+
+-e is on by default when PROBEWIDE_CAN_EXTID is.
+
+Usage: busload.py [-s SCU_RATE_SCALE] [-2] [-l] [-e]
+"""
+
+import argparse
+import math
+import os
+import re
+import xml.etree.ElementTree as ET
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+COMMON = os.path.join(HERE, "../../src/common")
+DEFINITIONS = os.path.join(COMMON, "mavlink/message_definitions/v1.0")
+
+TQ_PER_BIT = 1 + 5 + 2 # SYNC + BS1 + BS2, the same on all boards
+
+
+def config(name):
+	with open(os.path.join(COMMON, "zikush_config.h")) as f:
+		m = re.search(r"#define\s+%s\s+(\d+)" % name, f.read())
+	return int(m.group(1))
+
+
+STATS_HZ = 1000 / config("PROBEWIDE_CAN_STATS_PERIOD_MS")
+
+# (message, sending node, Hz)
+PROFILE = [
+	("HEARTBEAT",				"PCU", 1),
+	("ZIKUSH_POWER_STATE",		"PCU", 1),
+	("ZIKUSH_POWER_CONSUMED",	"PCU", 0.1),
+	("HEARTBEAT",				"SCU", 1),
+	("ATTITUDE_QUATERNION",		"SCU", 2),
+	("LOCAL_POSITION_NED",		"SCU", 2),
+	("SCALED_PRESSURE",			"SCU", 2),
+	("SCALED_PRESSURE2",		"SCU", 2),
+	("ZIKUSH_HUMIDITY",			"SCU", 2),
+	("HEARTBEAT",				"CCU", 1 / 60),
+	("ZIKUSH_CAN_STATS",		"PCU", STATS_HZ),
+	("ZIKUSH_CAN_STATS",		"SCU", STATS_HZ),
+	("ZIKUSH_CAN_STATS",		"CCU", STATS_HZ),
+]
+
+# Commands come from the ground through the ICU, photo requests from the SCU on motion events, and
+# bulk acknowledgments from the ICU.
+# Those are sporadic, (message, sending node, minimum interval in seconds)
+COMMANDS = [
+	("ZIKUSH_CMD_POWERBUS",			"ICU", 1),
+	("ZIKUSH_CMD_POWEROFF",			"ICU", 1),
+	("ZIKUSH_CMD_PREFLIGHTRESET",	"ICU", 1),
+	("ZIKUSH_CMD_TAKE_SPECTRUM",	"ICU", 1),
+	("ZIKUSH_CMD_TAKE_PHOTO",		"SCU", 1),
+	("ZIKUSH_BULK_ACK",				"ICU", 1 / 3), # one for every packet of a spectrum
+]
+
+# A spectrum goes as a burst (CCU_SPECTRUM_OVER_CAN) and is accounted separately, one at most for every
+# ZIKUSH_CMD_TAKE_SPECTRUM. Pictures take the UART backbone unless CCU_BULK_OVER_CAN
+BURST_NODE = "CCU"
+BURST_PERIOD = 1 # s
+BURST = [
+	("ZIKUSH_SPECTRUM_INTENSITY_HEADER",				1),
+	("ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA",	2), # 240 rows, 126 values a packet
+]
+
+TYPE_SIZES = {
+	"char": 1, "int8_t": 1, "uint8_t": 1, "uint8_t_mavlink_version": 1,
+	"int16_t": 2, "uint16_t": 2,
+	"int32_t": 4, "uint32_t": 4, "float": 4,
+	"int64_t": 8, "uint64_t": 8, "double": 8,
+}
+
+
+def field_size(ftype):
+	m = re.match(r"(\w+)\[(\d+)\]", ftype)
+	if m:
+		return TYPE_SIZES[m.group(1)] * int(m.group(2))
+	return TYPE_SIZES[ftype]
+
+
+def load_messages(path, messages=None):
+	if messages is None:
+		messages = {}
+
+	root = ET.parse(path).getroot()
+	for inc in root.findall("include"):
+		load_messages(os.path.join(os.path.dirname(path), inc.text), messages)
+
+	for msg in root.iter("message"):
+		base, ext, extensions = 0, 0, False
+		for child in msg:
+			if child.tag == "extensions":
+				extensions = True
+			elif child.tag == "field":
+				if extensions:
+					ext += field_size(child.get("type"))
+				else:
+					base += field_size(child.get("type"))
+
+		messages[msg.get("name")] = (int(msg.get("id")), base, base + ext)
+
+	return messages
+
+
+def priorities():
+	with open(os.path.join(COMMON, "zikush_canroutes.h")) as f:
+		text = f.read()
+	levels = {name: int(v) for name, v in re.findall(r"#define\s+ZIKUSH_CANPRIO_(\w+)\s+(\d+)", text)}
+	table = {msg: levels[level] for msg, level in re.findall(r"\{\s*MAVLINK_MSG_ID_(\w+),[^}]*ZIKUSH_CANPRIO_(\w+)\s*\}", text)}
+	return table, max(levels.values())
+
+
+def bitrate():
+	return config("PROBEWIDE_CAN_TICKRATE") / TQ_PER_BIT
+
+
+def extid():
+	return config("PROBEWIDE_CAN_EXTID") != 0
+
+
+# Worst case frame length in bits, stuffing included (SOF to the end of interframe space)
+def std_frame_bits(dlc):
+	return 47 + 8 * dlc + (34 + 8 * dlc - 1) // 4
+
+
+def ext_frame_bits(dlc):
+	return 67 + 8 * dlc + (54 + 8 * dlc - 1) // 4
+
+
+def split(datalen):
+	return [min(8, datalen - i) for i in range(0, datalen, 8)]
+
+
+# The same layouts as canmavlink_msg_to_frames() and canmavlink_msg_to_frames_ext(), bits of every frame
+def std_frames(msgid, length, v2):
+	hdr = 8 if v2 else 5
+	return [std_frame_bits(d) for d in [hdr] + split(length + 2)]
+
+
+def ext_frames(msgid, length, v2):
+	if msgid >= 256:
+		return None
+	return [ext_frame_bits(d) for d in split(length + 2)]
+
+
+def shortest(msgid, length, v2):
+	# The encoder decides on lengths without stuffing, so it is redone here the same way
+	data = length + 2
+	count = math.ceil(data / 8)
+	stdbits = (count + 1) * 47 + (data + (8 if v2 else 5)) * 8
+	extbits = count * 67 + data * 8
+	if extbits < stdbits and msgid < 256:
+		return ext_frames(msgid, length, v2)
+	return std_frames(msgid, length, v2)
+
+
+# Messages which don't fit an extended identifier go in standard frames
+def frame_bits(fn, msgid, length, v2):
+	return fn(msgid, length, v2) or std_frames(msgid, length, v2)
+
+
+# Response time analysis as for fixed priority scheduling with non-preemptive frames. Blocking by a lower
+# priority frame is counted before every frame of the message: senders which load one frame at a time leave
+# the bus to anybody in between. Traffic of the same level from other nodes counts as interference, ties
+# are decided by compid then. Messages of the sender itself are queued in order, so they don't count
+def latency(job, jobs, br):
+	name, node, prio, bits, period = job
+	lower = [max(j[3]) for j in jobs if j[2] > prio]
+	base = sum(bits) + (max(lower) if lower else 0) * len(bits)
+	r = base
+	while r <= period * br:
+		interference = sum(math.ceil(r / (j[4] * br)) * sum(j[3]) for j in jobs if j[1] != node and j[2] <= prio)
+		if base + interference == r:
+			return r / br
+		r = base + interference
+	return None
+
+
+def print_latencies(messages, args, br):
+	table, lowest = priorities()
+	fn = shortest if args.extid else std_frames
+	length = lambda name: messages[name][2] if args.v2 else messages[name][1]
+
+	jobs = []
+	for name, node, hz in PROFILE:
+		if node == "SCU":
+			hz *= args.scu_scale
+		jobs.append((name, node, table.get(name, lowest), frame_bits(fn, messages[name][0], length(name), args.v2), 1 / hz))
+	for name, node, interval in COMMANDS:
+		jobs.append((name, node, table.get(name, lowest), frame_bits(fn, messages[name][0], length(name), args.v2), interval))
+
+	burst = []
+	for name, count in BURST:
+		burst += frame_bits(fn, messages[name][0], length(name), args.v2) * count
+	jobs.append(("spectrum burst", BURST_NODE, lowest, burst, BURST_PERIOD))
+
+	print("\nworst-case latency, %s identifiers:" % ("shortest" if args.extid else "standard"))
+	print("%4s %-28s %4s %6s %9s" % ("prio", "message", "node", "frames", "ms"))
+	for job in sorted(jobs, key=lambda j: (j[2], j[0])):
+		r = latency(job, jobs, br)
+		print("%4d %-28s %4s %6d %9s" % (job[2], job[0], job[1], len(job[3]), "%.1f" % (r * 1000) if r is not None else "> period"))
+
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+	parser.add_argument("-s", "--scu-scale", type=float, default=1.0, help="scale SCU rates")
+	parser.add_argument("-2", "--v2", action="store_true", help="MAVLink 2 framing with extensions")
+	parser.add_argument("-l", "--latency", action="store_true", help="worst-case latency by priority")
+	parser.add_argument("-e", "--extid", action="store_true", help="senders pick the shorter format (PROBEWIDE_CAN_EXTID)")
+	args = parser.parse_args()
+	args.extid = args.extid or extid()
+
+	messages = load_messages(os.path.join(DEFINITIONS, "zikush.xml"))
+	br = bitrate()
+	encoders = [("std", std_frames), ("ext", ext_frames), ("shortest", shortest)]
+
+	print("bitrate %d bit/s, %s\n" % (br, "MAVLink 2" if args.v2 else "MAVLink 1"))
+	print("%-28s %4s %5s %6s | %-14s | %-14s | %-14s" % ("message", "node", "Hz", "len", "std fr/bits", "ext fr/bits", "shortest fr/bits"))
+
+	totals = {name: [0.0, 0.0] for name, _ in encoders}
+	for name, node, hz in PROFILE:
+		if node == "SCU":
+			hz *= args.scu_scale
+
+		msgid, base, full = messages[name]
+		length = full if args.v2 else base
+
+		cols = []
+		for enc, fn in encoders:
+			frames = frame_bits(fn, msgid, length, args.v2)
+			totals[enc][0] += len(frames) * hz
+			totals[enc][1] += sum(frames) * hz
+			cols.append("%3d / %-8d" % (len(frames), sum(frames)))
+
+		print("%-28s %4s %5g %6d | %s | %s | %s" % (name, node, hz, length, *cols))
+
+	print()
+	for enc, _ in encoders:
+		fps, bps = totals[enc]
+		print("%-9s %7.1f frames/s %9.0f bit/s  load %5.1f%%" % (enc, fps, bps, 100 * bps / br))
+
+	print("\nspectrum burst:")
+	for enc, fn in encoders:
+		bits = 0
+		for name, count in BURST:
+			msgid, base, full = messages[name]
+			bits += sum(frame_bits(fn, msgid, full if args.v2 else base, args.v2)) * count
+		print("%-9s %9d bits  %6.2f s on an idle bus" % (enc, bits, bits / br))
+
+	if args.latency:
+		print_latencies(messages, args, br)
+
+
+if __name__ == "__main__":
+	main()
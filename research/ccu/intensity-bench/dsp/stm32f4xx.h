@@ -0,0 +1,21 @@
+/*
+ * 	The Cortex-M4 SIMD intrinsic intensity.c uses, in plain C, so its DSP path can be checked on the host.
+ * 	Takes the place of the device header with -Idsp -D__ARM_FEATURE_DSP=1. Timing of it means nothing
+ */
+
+#ifndef INTENSITYBENCH_DSP_H_
+#define INTENSITYBENCH_DSP_H_
+
+#include <stdint.h>
+
+static inline uint32_t __USADA8(uint32_t op1, uint32_t op2, uint32_t op3)
+{
+	for(int i = 0; i < 32; i += 8)
+	{
+		const int a = (op1 >> i) & 0xFF, b = (op2 >> i) & 0xFF;
+		op3 += a > b ? a - b : b - a;
+	}
+	return op3;
+}
+
+#endif /* INTENSITYBENCH_DSP_H_ */
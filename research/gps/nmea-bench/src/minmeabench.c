@@ -0,0 +1,219 @@
+/*
+ * 	Parsing benchmark of minmea
+ *
+ * 	Replays NMEA logs through minmea_sentence_id() and the minmea_parse_*() of each sentence, the way the ICU
+ * 	GPS task does, and reports sentences per second for the whole log and for each sentence type. Then
+ * 	compares the generic GGA and RMC parsers, which interpret a format string with minmea_scan(), with the
+ * 	specialized ones, and checks that both give the same frames.
+ *
+ * 	Without log files it makes up one hour of a balloon flight, see nmealog.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <minmea.h>
+
+#include "nmealog.h"
+
+#define TYPES	(MINMEA_SENTENCE_ZDA + 2) //from MINMEA_INVALID
+#define TRIALS	5
+
+static const char * const _names[TYPES] = {
+		"invalid", "unknown", "RMC", "GGA", "GSA", "GLL", "GST", "GSV", "VTG", "ZDA"
+};
+
+// Lines by their type
+static const char ** _groups[TYPES];
+static unsigned _group_count[TYPES];
+
+static volatile int _sink;
+
+
+static uint64_t _ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// What gps_task does with a sentence, true if it parsed
+static inline bool _parse(const char * line, bool fast)
+{
+	switch(minmea_sentence_id(line, false))
+	{
+	case MINMEA_SENTENCE_RMC:
+	{
+		struct minmea_sentence_rmc f;
+		return fast ? minmea_parse_rmc_fast(&f, line) : minmea_parse_rmc(&f, line);
+	}
+
+	case MINMEA_SENTENCE_GGA:
+	{
+		struct minmea_sentence_gga f;
+		return fast ? minmea_parse_gga_fast(&f, line) : minmea_parse_gga(&f, line);
+	}
+
+	case MINMEA_SENTENCE_GSA: { struct minmea_sentence_gsa f; return minmea_parse_gsa(&f, line); }
+	case MINMEA_SENTENCE_GLL: { struct minmea_sentence_gll f; return minmea_parse_gll(&f, line); }
+	case MINMEA_SENTENCE_GST: { struct minmea_sentence_gst f; return minmea_parse_gst(&f, line); }
+	case MINMEA_SENTENCE_GSV: { struct minmea_sentence_gsv f; return minmea_parse_gsv(&f, line); }
+	case MINMEA_SENTENCE_VTG: { struct minmea_sentence_vtg f; return minmea_parse_vtg(&f, line); }
+	case MINMEA_SENTENCE_ZDA: { struct minmea_sentence_zda f; return minmea_parse_zda(&f, line); }
+	default: return false;
+	}
+}
+
+static bool _replay(const char * line) { return _parse(line, false); }
+static bool _replay_fast(const char * line) { return _parse(line, true); }
+
+// Best of a few trials, the host is not quiet
+static double _rate(const char ** lines, unsigned count, int repeat, bool (*replay)(const char *))
+{
+	double best = 0;
+
+	for(int trial = 0; trial < TRIALS; trial++)
+	{
+		const uint64_t start = _ns();
+
+		for(int r = 0; r < repeat; r++)
+			for(unsigned i = 0; i < count; i++)
+				_sink += replay(lines[i]);
+
+		const double rate = (double)count * repeat * 1e9 / (_ns() - start);
+		best = rate > best ? rate : best;
+	}
+
+	return best;
+}
+
+
+// Parsers alone, the sentence is known to be of the type
+static bool _gga(const char * line) { struct minmea_sentence_gga f; return minmea_parse_gga(&f, line); }
+static bool _gga_fast(const char * line) { struct minmea_sentence_gga f; return minmea_parse_gga_fast(&f, line); }
+static bool _rmc(const char * line) { struct minmea_sentence_rmc f; return minmea_parse_rmc(&f, line); }
+static bool _rmc_fast(const char * line) { struct minmea_sentence_rmc f; return minmea_parse_rmc_fast(&f, line); }
+
+// Both parsers on every GGA and RMC, the number of differences
+static unsigned _compare(void)
+{
+	unsigned differ = 0;
+
+	for(unsigned i = 0; i < nmealog_count; i++)
+	{
+		const char * line = nmealog_lines[i];
+		struct minmea_sentence_gga gga[2];
+		struct minmea_sentence_rmc rmc[2];
+
+		memset(gga, 0, sizeof(gga));
+		memset(rmc, 0, sizeof(rmc));
+
+		const bool gga_ok = minmea_parse_gga(&gga[0], line);
+		const bool rmc_ok = minmea_parse_rmc(&rmc[0], line);
+
+		if(gga_ok != minmea_parse_gga_fast(&gga[1], line) || (gga_ok && memcmp(&gga[0], &gga[1], sizeof(gga[0]))))
+			differ++;
+		if(rmc_ok != minmea_parse_rmc_fast(&rmc[1], line) || (rmc_ok && memcmp(&rmc[0], &rmc[1], sizeof(rmc[0]))))
+			differ++;
+	}
+
+	return differ;
+}
+
+
+static void _usage(const char * name)
+{
+	printf("Usage: %s [-n repeat] [log.nmea ...]\n"
+			"	-n	passes over the sentences in each of the trials, 20 by default\n"
+			"	without logs a synthetic hour of flight is used\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+	int repeat = 20;
+
+	int opt;
+	while( (opt = getopt(argc, argv, "n:h")) != -1 )
+	{
+		switch(opt)
+		{
+		case 'n': repeat = atoi(optarg); break;
+
+		default:
+			_usage(argv[0]);
+			return opt == 'h' ? 0 : EINVAL;
+		}
+	}
+
+	if(repeat < 1)
+	{
+		_usage(argv[0]);
+		return EINVAL;
+	}
+
+	for(int i = optind; i < argc; i++)
+	{
+		const int rc = nmealog_load(argv[i]);
+		if(rc < 0)
+		{
+			fprintf(stderr, "can't read %s: %s\n", argv[i], strerror(-rc));
+			return -rc;
+		}
+	}
+
+	if(optind == argc)
+		nmealog_synthesize();
+
+	if(0 == nmealog_count)
+	{
+		fprintf(stderr, "no sentences\n");
+		return 1;
+	}
+
+	for(int t = 0; t < TYPES; t++)
+		_groups[t] = calloc(nmealog_count, sizeof(char *));
+
+	unsigned parsed = 0;
+	for(unsigned i = 0; i < nmealog_count; i++)
+	{
+		const int t = minmea_sentence_id(nmealog_lines[i], false) - MINMEA_INVALID;
+		_groups[t][_group_count[t]++] = nmealog_lines[i];
+		parsed += _replay(nmealog_lines[i]);
+	}
+
+	printf("%u sentences, %u parsed, %d passes\n", nmealog_count, parsed, repeat);
+
+	_rate((const char **)nmealog_lines, nmealog_count, 1, _replay); //warm up
+	printf("%-10s %8s %14s\n", "", "count", "sentences/s");
+	printf("%-10s %8u %14.0f\n", "all", nmealog_count,
+			_rate((const char **)nmealog_lines, nmealog_count, repeat, _replay));
+
+	for(int t = 0; t < TYPES; t++)
+		if(_group_count[t])
+			printf("%-10s %8u %14.0f\n", _names[t], _group_count[t],
+					_rate(_groups[t], _group_count[t], repeat, _replay));
+
+	const int gga = MINMEA_SENTENCE_GGA - MINMEA_INVALID, rmc = MINMEA_SENTENCE_RMC - MINMEA_INVALID;
+
+	printf("\ngeneric against specialized, sentences/s\n");
+	printf("%-10s %14.0f %14.0f\n", "all", _rate((const char **)nmealog_lines, nmealog_count, repeat, _replay),
+			_rate((const char **)nmealog_lines, nmealog_count, repeat, _replay_fast));
+	if(_group_count[gga])
+		printf("%-10s %14.0f %14.0f\n", "GGA parse", _rate(_groups[gga], _group_count[gga], repeat, _gga),
+				_rate(_groups[gga], _group_count[gga], repeat, _gga_fast));
+	if(_group_count[rmc])
+		printf("%-10s %14.0f %14.0f\n", "RMC parse", _rate(_groups[rmc], _group_count[rmc], repeat, _rmc),
+				_rate(_groups[rmc], _group_count[rmc], repeat, _rmc_fast));
+
+	const unsigned differ = _compare();
+	printf("\n%u differences between the generic and specialized parsers\n", differ);
+
+	return differ ? 1 : 0;
+}
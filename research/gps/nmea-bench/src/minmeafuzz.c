@@ -0,0 +1,309 @@
+/*
+ * 	Fuzzing of minmea and of the ICU sentence assembler
+ *
+ * 	Every input goes through nmealine as a byte stream, and by itself as a sentence, through
+ * 	minmea_sentence_id(), minmea_talker_id() and every minmea_parse_*(). The specialized GGA and RMC
+ * 	parsers must agree with the generic ones, otherwise it aborts. Built with sanitizers to catch
+ * 	reads past the end and overflows.
+ *
+ * 	With -DMINMEAFUZZ_LIBFUZZER it is a libFuzzer target (clang -fsanitize=fuzzer). Otherwise it runs
+ * 	the corpus given on the command line and then random mutations of it, with checksums mostly fixed up
+ * 	so that the mutants get past minmea_check() into the parsers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <minmea.h>
+#include <nmealine.h>
+
+#define INPUT_MAX	256
+
+
+static void _differ(const char * what, const char * sentence)
+{
+	fprintf(stderr, "%s: generic and specialized parsers differ on \"%s\"\n", what, sentence);
+	abort();
+}
+
+static void _sentence(const char * sentence)
+{
+	char talker[3];
+
+	minmea_sentence_id(sentence, true);
+	minmea_sentence_id(sentence, false);
+	minmea_talker_id(talker, sentence);
+
+	struct minmea_sentence_rmc rmc[2];
+	struct minmea_sentence_gga gga[2];
+	memset(rmc, 0, sizeof(rmc));
+	memset(gga, 0, sizeof(gga));
+
+	const bool rmc_ok = minmea_parse_rmc(&rmc[0], sentence);
+	if(rmc_ok != minmea_parse_rmc_fast(&rmc[1], sentence) || (rmc_ok && memcmp(&rmc[0], &rmc[1], sizeof(rmc[0]))))
+		_differ("RMC", sentence);
+
+	const bool gga_ok = minmea_parse_gga(&gga[0], sentence);
+	if(gga_ok != minmea_parse_gga_fast(&gga[1], sentence) || (gga_ok && memcmp(&gga[0], &gga[1], sizeof(gga[0]))))
+		_differ("GGA", sentence);
+
+	struct minmea_sentence_gsa gsa;
+	struct minmea_sentence_gll gll;
+	struct minmea_sentence_gst gst;
+	struct minmea_sentence_gsv gsv;
+	struct minmea_sentence_vtg vtg;
+	struct minmea_sentence_zda zda;
+	minmea_parse_gsa(&gsa, sentence);
+	minmea_parse_gll(&gll, sentence);
+	minmea_parse_gst(&gst, sentence);
+	minmea_parse_gsv(&gsv, sentence);
+	minmea_parse_vtg(&vtg, sentence);
+	if(minmea_parse_zda(&zda, sentence))
+	{
+		struct timespec ts;
+		minmea_gettime(&ts, &zda.date, &zda.time);
+	}
+
+	// The conversions of the ICU GPS task
+	if(rmc_ok)
+	{
+		minmea_tocoord_e7(&rmc[0].latitude);
+		minmea_tocoord_e7(&rmc[0].longitude);
+		minmea_rescale(&rmc[0].speed, 100);
+		minmea_rescale(&rmc[0].course, 100);
+	}
+
+	if(gga_ok)
+	{
+		minmea_tocoord_e7(&gga[0].latitude);
+		minmea_tocoord_e7(&gga[0].longitude);
+		minmea_rescale(&gga[0].altitude, 1000);
+		minmea_rescale(&gga[0].hdop, 100);
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+	char buff[INPUT_MAX + 1];
+
+	if(size > INPUT_MAX)
+		size = INPUT_MAX;
+
+	// As a stream, the way the GPS task gets it, in two pieces
+	nmealine_t lines;
+	nmealine_init(&lines, false);
+	for(size_t offset = 0, piece = size / 2; offset < size; )
+	{
+		const uint16_t len = offset < piece ? piece - offset : size - offset;
+		uint16_t used;
+		const char * sentence = nmealine_feed(&lines, data + offset, len, &used);
+		offset += used;
+		if(sentence)
+			_sentence(sentence);
+	}
+
+	memcpy(buff, data, size);
+	buff[size] = '\0';
+	_sentence(buff);
+
+	return 0;
+}
+
+
+#ifndef MINMEAFUZZ_LIBFUZZER
+
+typedef struct
+{
+	uint8_t data[INPUT_MAX];
+	size_t size;
+} input_t;
+
+static input_t * _corpus;
+static unsigned _corpus_count;
+
+static void _add(const uint8_t * data, size_t size)
+{
+	_corpus = realloc(_corpus, (_corpus_count + 1) * sizeof(*_corpus));
+	input_t * const input = &_corpus[_corpus_count++];
+	input->size = size < INPUT_MAX ? size : INPUT_MAX;
+	memcpy(input->data, data, input->size);
+}
+
+static int _load_file(const char * path)
+{
+	uint8_t data[INPUT_MAX];
+
+	FILE * f = fopen(path, "rb");
+	if(!f)
+		return -errno;
+
+	const size_t size = fread(data, 1, sizeof(data), f);
+	fclose(f);
+
+	_add(data, size);
+	return 0;
+}
+
+static int _load(const char * path)
+{
+	DIR * dir = opendir(path);
+	if(!dir)
+		return _load_file(path);
+
+	struct dirent * entry;
+	while( (entry = readdir(dir)) )
+	{
+		if(entry->d_name[0] == '.')
+			continue;
+
+		char name[1024];
+		snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+		const int rc = _load_file(name);
+		if(rc < 0)
+		{
+			closedir(dir);
+			return rc;
+		}
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+
+// Characters that mean something to the parsers
+static const char _interesting[] = ",*.+-$ 0123456789ABCDEFNSEWTMKV\r\n";
+
+static void _mutate(input_t * input)
+{
+	const int count = 1 + rand() % 4;
+
+	for(int m = 0; m < count; m++)
+	{
+		const size_t at = input->size ? rand() % input->size : 0;
+
+		switch(rand() % 6)
+		{
+		case 0: //flip a bit
+			if(input->size)
+				input->data[at] ^= 1 << (rand() % 8);
+			break;
+
+		case 1: //put a character that matters
+			if(input->size)
+				input->data[at] = _interesting[rand() % (sizeof(_interesting) - 1)];
+			break;
+
+		case 2: //insert
+			if(input->size < INPUT_MAX)
+			{
+				memmove(input->data + at + 1, input->data + at, input->size - at);
+				input->data[at] = _interesting[rand() % (sizeof(_interesting) - 1)];
+				input->size++;
+			}
+			break;
+
+		case 3: //delete
+			if(input->size)
+			{
+				memmove(input->data + at, input->data + at + 1, input->size - at - 1);
+				input->size--;
+			}
+			break;
+
+		case 4: //a run of digits, for overflows
+		{
+			const size_t len = 1 + rand() % 16;
+			for(size_t i = 0; i < len && at + i < INPUT_MAX; i++)
+				input->data[at + i] = '0' + rand() % 10;
+			if(at + len > input->size)
+				input->size = at + len < INPUT_MAX ? at + len : INPUT_MAX;
+			break;
+		}
+
+		default: //cut
+			input->size = at;
+			break;
+		}
+	}
+
+	// Fix the checksum up mostly, or the mutant stops at minmea_check()
+	uint8_t * star = memchr(input->data, '*', input->size);
+	if(star && star + 2 < input->data + input->size && rand() % 4)
+	{
+		uint8_t sum = 0;
+		for(uint8_t * p = input->data + (input->data[0] == '$'); p < star; p++)
+			sum ^= *p;
+
+		static const char hex[] = "0123456789ABCDEF";
+		star[1] = hex[sum >> 4];
+		star[2] = hex[sum & 0xF];
+	}
+}
+
+
+static void _usage(const char * name)
+{
+	printf("Usage: %s [-r runs] [-S seed] corpus ...\n"
+			"	-r	mutations to run after the corpus, 100000 by default\n"
+			"	-S	random seed, 1 by default\n"
+			"	corpus is a directory with an input per file, or files\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+	long runs = 100000;
+	unsigned seed = 1;
+
+	int opt;
+	while( (opt = getopt(argc, argv, "r:S:h")) != -1 )
+	{
+		switch(opt)
+		{
+		case 'r': runs = atol(optarg); break;
+		case 'S': seed = atoi(optarg); break;
+
+		default:
+			_usage(argv[0]);
+			return opt == 'h' ? 0 : EINVAL;
+		}
+	}
+
+	for(int i = optind; i < argc; i++)
+	{
+		const int rc = _load(argv[i]);
+		if(rc < 0)
+		{
+			fprintf(stderr, "can't read %s: %s\n", argv[i], strerror(-rc));
+			return -rc;
+		}
+	}
+
+	if(0 == _corpus_count)
+	{
+		_usage(argv[0]);
+		return EINVAL;
+	}
+
+	for(unsigned i = 0; i < _corpus_count; i++)
+		LLVMFuzzerTestOneInput(_corpus[i].data, _corpus[i].size);
+
+	srand(seed);
+	for(long r = 0; r < runs; r++)
+	{
+		input_t input = _corpus[rand() % _corpus_count];
+		_mutate(&input);
+		LLVMFuzzerTestOneInput(input.data, input.size);
+	}
+
+	printf("%u inputs and %ld mutations, no differences\n", _corpus_count, runs);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * 	Benchmark of the NMEA conversions of the ICU GPS task
+ *
+ * 	Compares the float path the task used to take (minmea_tocoord() and minmea_tofloat(), then multiplying
+ * 	by 1e7 and 1000) with the integer one (minmea_tocoord_e7() and minmea_rescale()) on GGA and RMC
+ * 	sentences of NMEA logs. Times the conversions alone and the whole sentence with parsing, and checks
+ * 	how far the float results are from the integer ones.
+ *
+ * 	Without log files it makes up one hour of a balloon flight, see nmealog.h.
+ *
+ * 	The host has an FPU, so the float path here is much cheaper than the soft-float one on the Cortex-M3 of
+ * 	the ICU. The numbers show how much arithmetic each path does, not the ICU timing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include <minmea.h>
+
+#include "nmealog.h"
+
+typedef struct
+{
+	struct minmea_float lat, lon, alt;
+} coords_t;
+
+typedef struct
+{
+	int32_t lat, lon, alt;
+} fixed_t;
+
+static coords_t * _coords;
+static unsigned _coord_count;
+
+static volatile int32_t _sink;
+
+
+static uint64_t _ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t _cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+
+// What the task did before
+static inline void _convert_float(coords_t * c, fixed_t * out)
+{
+	out->lat = minmea_tocoord(&c->lat) * 10000000;
+	out->lon = minmea_tocoord(&c->lon) * 10000000;
+	out->alt = minmea_tofloat(&c->alt) * 1000;
+}
+
+static inline void _convert_fixed(coords_t * c, fixed_t * out)
+{
+	out->lat = minmea_tocoord_e7(&c->lat);
+	out->lon = minmea_tocoord_e7(&c->lon);
+	out->alt = minmea_rescale(&c->alt, 1000);
+}
+
+// GGA and RMC carry coordinates, altitude is in GGA only
+static bool _parse(const char * line, coords_t * c)
+{
+	switch(minmea_sentence_id(line, false))
+	{
+	case MINMEA_SENTENCE_GGA:
+	{
+		struct minmea_sentence_gga gga;
+		if(!minmea_parse_gga(&gga, line))
+			return false;
+		c->lat = gga.latitude;
+		c->lon = gga.longitude;
+		c->alt = gga.altitude;
+		return true;
+	}
+
+	case MINMEA_SENTENCE_RMC:
+	{
+		struct minmea_sentence_rmc rmc;
+		if(!minmea_parse_rmc(&rmc, line))
+			return false;
+		c->lat = rmc.latitude;
+		c->lon = rmc.longitude;
+		c->alt = (struct minmea_float){ 0, 1 };
+		return true;
+	}
+
+	default:
+		return false;
+	}
+}
+
+
+typedef struct
+{
+	uint64_t ns, cycles;
+} result_t;
+
+static result_t _time_conversions(bool fixed, int repeat)
+{
+	fixed_t out;
+	const uint64_t ns = _ns(), cycles = _cycles();
+
+	for(int r = 0; r < repeat; r++)
+		for(unsigned i = 0; i < _coord_count; i++)
+		{
+			if(fixed)
+				_convert_fixed(&_coords[i], &out);
+			else
+				_convert_float(&_coords[i], &out);
+			_sink += out.lat ^ out.lon ^ out.alt;
+		}
+
+	return (result_t){ _ns() - ns, _cycles() - cycles };
+}
+
+static result_t _time_sentences(bool fixed, int repeat)
+{
+	coords_t c;
+	fixed_t out;
+	const uint64_t ns = _ns(), cycles = _cycles();
+
+	for(int r = 0; r < repeat; r++)
+		for(unsigned i = 0; i < nmealog_count; i++)
+		{
+			if(!_parse(nmealog_lines[i], &c))
+				continue;
+			if(fixed)
+				_convert_fixed(&c, &out);
+			else
+				_convert_float(&c, &out);
+			_sink += out.lat ^ out.lon ^ out.alt;
+		}
+
+	return (result_t){ _ns() - ns, _cycles() - cycles };
+}
+
+static void _print(const char * what, result_t result, double count)
+{
+	printf("%-28s %8.1f ns", what, result.ns / count);
+#ifdef HAVE_TSC
+	printf(" %8.1f TSC cycles", result.cycles / count);
+#endif
+	printf("\n");
+}
+
+
+static void _usage(const char * name)
+{
+	printf("Usage: %s [-n repeat] [log.nmea ...]\n"
+			"	-n	passes over the sentences, 100 by default\n"
+			"	without logs a synthetic hour of flight is used\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+	int repeat = 100;
+
+	int opt;
+	while( (opt = getopt(argc, argv, "n:h")) != -1 )
+	{
+		switch(opt)
+		{
+		case 'n': repeat = atoi(optarg); break;
+
+		default:
+			_usage(argv[0]);
+			return opt == 'h' ? 0 : EINVAL;
+		}
+	}
+
+	if(repeat < 1)
+	{
+		_usage(argv[0]);
+		return EINVAL;
+	}
+
+	for(int i = optind; i < argc; i++)
+	{
+		const int rc = nmealog_load(argv[i]);
+		if(rc < 0)
+		{
+			fprintf(stderr, "can't read %s: %s\n", argv[i], strerror(-rc));
+			return -rc;
+		}
+	}
+
+	if(optind == argc)
+		nmealog_synthesize();
+
+	_coords = calloc(nmealog_count ? nmealog_count : 1, sizeof(*_coords));
+	for(unsigned i = 0; i < nmealog_count; i++)
+		if(_parse(nmealog_lines[i], &_coords[_coord_count]))
+			_coord_count++;
+
+	if(0 == _coord_count)
+	{
+		fprintf(stderr, "no GGA or RMC sentences with coordinates\n");
+		return 1;
+	}
+
+	// How far the float path is off, the integer one rounds exactly
+	int32_t worst_deg = 0, worst_mm = 0;
+	for(unsigned i = 0; i < _coord_count; i++)
+	{
+		fixed_t a, b;
+		_convert_float(&_coords[i], &a);
+		_convert_fixed(&_coords[i], &b);
+		worst_deg = abs(a.lat - b.lat) > worst_deg ? abs(a.lat - b.lat) : worst_deg;
+		worst_deg = abs(a.lon - b.lon) > worst_deg ? abs(a.lon - b.lon) : worst_deg;
+		worst_mm = abs(a.alt - b.alt) > worst_mm ? abs(a.alt - b.alt) : worst_mm;
+	}
+
+	printf("%u sentences, %u with coordinates, %d passes\n", nmealog_count, _coord_count, repeat);
+	printf("float path off by up to %d degE7 (%.1f cm of latitude) and %d mm\n",
+			worst_deg, worst_deg * 1.11, worst_mm);
+
+	// Warm up the caches and the branch predictors. Sentence times are per GGA or RMC, with the other ones read too
+	_time_conversions(false, 1);
+	_time_conversions(true, 1);
+
+	_print("conversion, float:", _time_conversions(false, repeat), (double)_coord_count * repeat);
+	_print("conversion, integer:", _time_conversions(true, repeat), (double)_coord_count * repeat);
+	_print("sentence, float:", _time_sentences(false, repeat), (double)_coord_count * repeat);
+	_print("sentence, integer:", _time_sentences(true, repeat), (double)_coord_count * repeat);
+
+	return 0;
+}
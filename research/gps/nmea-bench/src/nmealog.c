@@ -0,0 +1,88 @@
+/*
+ * 	NMEA logs for the benchmarks, see nmealog.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <minmea.h>
+
+#include "nmealog.h"
+
+char * nmealog_lines[NMEALOG_LINES_MAX];
+unsigned nmealog_count;
+
+
+static void _add_line(const char * line)
+{
+	if(nmealog_count < NMEALOG_LINES_MAX)
+		nmealog_lines[nmealog_count++] = strdup(line);
+}
+
+static void _add_sentence(const char * body)
+{
+	char line[128];
+	snprintf(line, sizeof(line), "$%s*%02X\r\n", body, minmea_checksum(body));
+	_add_line(line);
+}
+
+static void _coord(char * out, size_t size, double deg, int degdigits, char pos, char neg)
+{
+	const char hemi = deg >= 0 ? pos : neg;
+	deg = deg >= 0 ? deg : -deg;
+	const int whole = (int)deg;
+	snprintf(out, size, "%0*d%08.5f,%c", degdigits, whole, (deg - whole) * 60, hemi);
+}
+
+
+int nmealog_load(const char * path)
+{
+	FILE * f = fopen(path, "r");
+	if(!f)
+		return -errno;
+
+	char line[256];
+	while(fgets(line, sizeof(line), f))
+		if(line[0] == '$' && strlen(line) <= MINMEA_MAX_LENGTH + 2)
+			_add_line(line);
+
+	fclose(f);
+	return 0;
+}
+
+void nmealog_synthesize(void)
+{
+	srand(1);
+
+	for(int t = 0; t < 3600; t++)
+	{
+		char body[100], lat[24], lon[24];
+		const int hh = 9 + t / 3600, mm = t / 60 % 60, ss = t % 60;
+		const double alt = 150 + 5.0 * t + (rand() % 100) / 100.0;
+		const double knots = 20 + (rand() % 500) / 100.0;
+		const double course = 80 + (rand() % 1000) / 100.0;
+
+		_coord(lat, sizeof(lat), 55.7 + t * 2e-6, 2, 'N', 'S');
+		_coord(lon, sizeof(lon), 37.6 + t * 3.5e-6, 3, 'E', 'W');
+
+		snprintf(body, sizeof(body), "GPRMC,%02d%02d%02d.00,A,%s,%s,%.3f,%.2f,230926,,,A",
+				hh, mm, ss, lat, lon, knots, course);
+		_add_sentence(body);
+		snprintf(body, sizeof(body), "GPVTG,%.2f,T,,M,%.3f,N,%.3f,K,A", course, knots, knots * 1.852);
+		_add_sentence(body);
+		snprintf(body, sizeof(body), "GPGGA,%02d%02d%02d.00,%s,%s,1,%02d,%.2f,%.1f,M,14.2,M,,",
+				hh, mm, ss, lat, lon, 7 + rand() % 5, 0.8 + (rand() % 50) / 100.0, alt);
+		_add_sentence(body);
+		snprintf(body, sizeof(body), "GPGSA,A,3,04,05,09,12,17,24,,,,,,,%.2f,%.2f,%.2f",
+				1.5 + (rand() % 50) / 100.0, 0.8 + (rand() % 50) / 100.0, 1.2 + (rand() % 50) / 100.0);
+		_add_sentence(body);
+		snprintf(body, sizeof(body), "GPGSV,2,1,07,04,%02d,%03d,%02d,05,61,045,41,09,12,301,28,12,33,210,36",
+				40 + t / 400, 100 + t / 60, 30 + rand() % 15);
+		_add_sentence(body);
+		snprintf(body, sizeof(body), "GPGSV,2,2,07,17,08,150,%02d,24,52,080,44,25,03,330,",
+				15 + rand() % 10);
+		_add_sentence(body);
+	}
+}
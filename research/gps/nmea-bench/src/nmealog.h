@@ -0,0 +1,20 @@
+/*
+ * 	NMEA logs for the benchmarks: loaded from files or made up
+ */
+
+#ifndef NMEALOG_H_
+#define NMEALOG_H_
+
+#define NMEALOG_LINES_MAX	(1 << 20)
+
+extern char * nmealog_lines[NMEALOG_LINES_MAX];
+extern unsigned nmealog_count;
+
+// Adds the sentences of a log, one per line. Returns 0 or -errno
+int nmealog_load(const char * path);
+
+// One hour of a balloon going up from near Moscow at 5 m/s and drifting east: RMC, VTG, GGA, GSA
+// and two GSV every second, like a receiver at 1 Hz
+void nmealog_synthesize(void);
+
+#endif /* NMEALOG_H_ */
@@ -0,0 +1,215 @@
+/*
+ * 	Round trip of the compact downlink: the ICU encoder here, the ground decoder in downlinkcheck.py
+ *
+ * 	Telemetry of the bench goes through downlink.c into buffers of the Iridium MO size. A buffer is
+ * 	acknowledged only after the given number of later ones is sent, like sessions that take longer than
+ * 	keyframe periods, and every given one is lost and never acknowledged. Each buffer starts with a plain
+ * 	MAVLink 2 frame, as the CAN boards send them.
+ *
+ * 	Prints "MSG <hex>" for every message as a plain MAVLink 1 frame and "SBD <hex>" for every buffer that
+ * 	reached the ground, in the order they were made. downlinkcheck.py takes that on stdin.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <mavlink/zikush/mavlink.h>
+
+#include <downlink.h>
+
+#include <zikush_config.h>
+
+#define DELAY_MAX	16
+
+typedef struct
+{
+	uint32_t msgid;
+	uint32_t period_ms;
+	uint32_t next;
+} stream_t;
+
+// Those of ir9602bench.c that have a schema and are compacted
+static stream_t _streams[] = {
+		{ MAVLINK_MSG_ID_HIL_GPS,				10000 },
+		{ MAVLINK_MSG_ID_ZIKUSH_POWER_STATE,	20000 },
+		{ MAVLINK_MSG_ID_SCALED_PRESSURE,		2000 },
+};
+
+typedef struct
+{
+	uint8_t data[ICU_IR_TX_ACCUMULATOR_SIZE];
+	uint16_t len;
+} buffer_t;
+
+static downlink_t _downlink;
+static buffer_t _sent[DELAY_MAX + 1];	//ring of the ones waiting for acknowledgment
+static unsigned _buffers;
+
+
+static void _print(const char * tag, const uint8_t * data, uint16_t len)
+{
+	printf("%s ", tag);
+	for(int i = 0; i < len; i++)
+		printf("%02x", data[i]);
+	printf("\n");
+}
+
+// Telemetry of a balloon going up at 5 m/s, as in ir9602bench.c
+static void _make(uint32_t msgid, uint32_t now, mavlink_message_t * msg)
+{
+	const double t = now / 1000.0;
+
+	switch(msgid)
+	{
+	case MAVLINK_MSG_ID_HIL_GPS:
+	{
+		mavlink_hil_gps_t gps = {
+				.time_usec = (uint64_t)now * 1000,
+				.fix_type = 3,
+				.lat = 557000000 + (int32_t)(t * 20),
+				.lon = 376000000 + (int32_t)(t * 35),
+				.alt = 150000 + (int32_t)(t * 5000),
+				.eph = 120 + rand() % 20,
+				.epv = 180 + rand() % 30,
+				.vel = 300 + rand() % 50,
+				.vn = 200, .ve = 350, .vd = -500,
+				.cog = 6000,
+				.satellites_visible = 8 + rand() % 3,
+		};
+		mavlink_msg_hil_gps_encode(0, ZIKUSH_ICU, msg, &gps);
+		break;
+	}
+
+	case MAVLINK_MSG_ID_ZIKUSH_POWER_STATE:
+	{
+		mavlink_zikush_power_state_t power = {
+				.time_boot_ms = now,
+				.buses_state = 0x07,
+				.icu_current = 0.12f + (rand() % 10) * 0.001f,
+				.icu_power = 0.6f + (rand() % 10) * 0.005f,
+				.scu_current = 0.05f + (rand() % 10) * 0.001f,
+				.scu_power = 0.25f + (rand() % 10) * 0.005f,
+				.ccu_current = 0.3f + (rand() % 10) * 0.001f,
+				.ccu_power = 1.5f + (rand() % 10) * 0.005f,
+		};
+		mavlink_msg_zikush_power_state_encode(0, ZIKUSH_PCU, msg, &power);
+		break;
+	}
+
+	default:
+	{
+		mavlink_scaled_pressure_t pressure = {
+				.time_boot_ms = now,
+				.press_abs = 1000.0f - t * 0.6f,
+				.press_diff = 0,
+				.temperature = 2000 - (int16_t)(t * 3),
+		};
+		mavlink_msg_scaled_pressure_encode(0, ZIKUSH_SCU, msg, &pressure);
+		break;
+	}
+	}
+}
+
+static void _start(buffer_t * buffer)
+{
+	mavlink_message_t msg;
+	mavlink_heartbeat_t heartbeat = { .type = MAV_TYPE_GENERIC, .autopilot = MAV_AUTOPILOT_INVALID };
+
+	mavlink_msg_heartbeat_encode_chan(0, ZIKUSH_SCU, MAVLINK_COMM_1, &msg, &heartbeat);
+	buffer->len = mavlink_msg_to_send_buffer(buffer->data, &msg);
+}
+
+static void _send(buffer_t * buffer, int delay, int loss)
+{
+	const bool lost = loss && _buffers % loss == loss - 1;
+	if(!lost)
+		_print("SBD", buffer->data, buffer->len);
+
+	_sent[_buffers % (DELAY_MAX + 1)] = *buffer;
+	if(lost)
+		_sent[_buffers % (DELAY_MAX + 1)].len = 0;
+
+	if(_buffers >= delay)
+	{
+		const buffer_t * acked = &_sent[(_buffers - delay) % (DELAY_MAX + 1)];
+		downlink_ack(&_downlink, acked->data, acked->len);
+	}
+
+	_buffers++;
+	_start(buffer);
+}
+
+static void _usage(const char * name)
+{
+	printf("Usage: %s [-n messages] [-d buffers] [-l every]\n"
+			"	-n	messages to encode, 2000 by default\n"
+			"	-d	buffers sent before one is acknowledged, 2 by default, up to %d\n"
+			"	-l	every that many buffers one is lost, none by default\n", name, DELAY_MAX);
+}
+
+int main(int argc, char ** argv)
+{
+	int count = 2000, delay = 2, loss = 0;
+
+	int opt;
+	while( (opt = getopt(argc, argv, "n:d:l:h")) != -1 )
+	{
+		switch(opt)
+		{
+		case 'n': count = atoi(optarg); break;
+		case 'd': delay = atoi(optarg); break;
+		case 'l': loss = atoi(optarg); break;
+
+		default:
+			_usage(argv[0]);
+			return opt == 'h' ? 0 : EINVAL;
+		}
+	}
+
+	if(count < 1 || delay < 0 || delay > DELAY_MAX || loss < 0)
+	{
+		_usage(argv[0]);
+		return EINVAL;
+	}
+
+	mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
+	srand(1);
+
+	buffer_t buffer;
+	_start(&buffer);
+
+	uint32_t now = 0;
+	for(int n = 0; n < count; now += 100)
+	{
+		for(int i = 0; i < sizeof(_streams) / sizeof(_streams[0]) && n < count; i++)
+		{
+			stream_t * stream = &_streams[i];
+			if((int32_t)(now - stream->next) < 0)
+				continue;
+
+			mavlink_message_t msg;
+			uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+
+			_make(stream->msgid, now, &msg);
+			stream->next += stream->period_ms;
+			n++;
+
+			_print("MSG", frame, downlink_plain(&msg, frame, sizeof(frame)));
+
+			const uint16_t len = downlink_encode(&_downlink, &msg, frame, ICU_IR_PACK_FRAMESIZE);
+			if(buffer.len + len > sizeof(buffer.data))
+				_send(&buffer, delay, loss);
+
+			memcpy(buffer.data + buffer.len, frame, len);
+			buffer.len += len;
+		}
+	}
+
+	_send(&buffer, delay, loss);
+	return 0;
+}
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""
+Ground side of the downlink round trip: decodes buffers of downlinkcheck with grain-server's downlink.py
+and compares every message it gets back with the plain MAVLink 1 frame the encoder was given.
+
+Messages of lost buffers are missed, anything decoded must match. Prints how many messages came through
+and the size of their frames against plain MAVLink 1 ones, the MAVLink 2 frames of the buffers aside.
+Exits with 1 on a mismatch, a frame the decoder drops or if nothing came through, and with -r if the size
+is over the given percentage of plain frames: that is a stream that never gets its keyframes acknowledged.
+
+Usage: downlinkcheck | downlinkcheck.py [-r PERCENT]
+"""
+
+import argparse
+import os
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.join(HERE, "../../../..")
+MSGDEF = os.path.join(ROOT, "src/common/mavlink/message_definitions/v1.0/zikush.xml")
+
+sys.path.insert(0, os.path.join(ROOT, "src/ground/grain-server/common"))
+from downlink import DownlinkDecoder, MAVLINK1_STX, MAVLINK1_NON_PAYLOAD_LEN # noqa: E402
+
+
+def _key(frame):
+	""" compid, msgid and payload of a MAVLink 1 frame, seq and sysid don't matter """
+	return frame[4], frame[5], bytes(frame[6:-2])
+
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument("-r", "--ratio", type=float, help="largest size against plain frames, %%")
+	args = parser.parse_args()
+
+	decoder = DownlinkDecoder(MSGDEF)
+	expected = []
+	buffers = []
+
+	for line in sys.stdin:
+		tag, data = line.split()
+		(expected if tag == "MSG" else buffers).append(bytes.fromhex(data))
+
+	pos = 0
+	matched = mismatched = 0
+	compact_bytes = plain_bytes = 0
+
+	for buff in buffers:
+		frames = decoder.feed(buff)
+		compact_bytes += len(buff)
+
+		for frame in frames:
+			if frame[0] != MAVLINK1_STX:
+				compact_bytes -= len(frame)
+				continue
+
+			key = _key(frame) if len(frame) >= MAVLINK1_NON_PAYLOAD_LEN else None
+			found = next((i for i in range(pos, len(expected)) if _key(expected[i]) == key), None)
+			if found is None:
+				mismatched += 1
+				continue
+
+			matched += 1
+			plain_bytes += len(expected[found])
+			pos = found + 1
+
+	print("messages:   %d sent, %d matched, %d mismatched, %d frames dropped by the decoder"
+	      % (len(expected), matched, mismatched, decoder.dropped))
+	ratio = 100.0 * compact_bytes / plain_bytes if plain_bytes else 0
+	print("size:       %d B for %d B of plain MAVLink 1, %.0f%%" % (compact_bytes, plain_bytes, ratio))
+
+	if args.ratio is not None and ratio > args.ratio:
+		return 1
+	return 1 if mismatched or decoder.dropped or not matched else 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,353 @@
+/*
+ * 	Benchmark of the ICU Iridium path against a modem on a serial port, the emulator normally
+ *
+ * 	Runs what iridium_task does, with the ICU sources themselves: the ir9602 driver, sbdpack, irsched and
+ * 	downlink. Telemetry comes at the rates the router lets through to Iridium, values drift slowly like
+ * 	in flight. Time runs faster by the given factor, the emulator should get session and reply times
+ * 	divided by the same factor (see the Makefile).
+ *
+ * 	At the end it prints session success rate, MO throughput, how full the sent buffers were and
+ * 	delivery latency, in virtual time. Exits with 1 if no message got through.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+
+#include <mavlink/zikush/mavlink.h>
+
+#include <ir9602.h>
+#include <sbdpack.h>
+#include <irsched.h>
+#include <downlink.h>
+
+#include <zikush_config.h>
+
+typedef struct
+{
+	uint32_t msgid;
+	uint32_t period_ms;	//virtual
+	uint32_t next;
+} stream_t;
+
+// What the router divider table lets through with the rates the boards send at
+static stream_t _streams[] = {
+		{ MAVLINK_MSG_ID_ZIKUSH_ICU_STATS,		5000 },
+		{ MAVLINK_MSG_ID_HIL_GPS,				10000 },
+		{ MAVLINK_MSG_ID_ZIKUSH_POWER_STATE,	20000 },
+		{ MAVLINK_MSG_ID_SCALED_PRESSURE,		2000 },
+};
+
+typedef struct
+{
+	int fd;
+	ir9602_t ir;
+	downlink_t downlink;
+	bool compact;
+
+	uint8_t accum[ICU_IR_TX_ACCUMULATOR_SIZE];
+	uint16_t accum_carret;
+	sbdpack_stamps_t stamps;
+	uint8_t mt[IR9602_MT_MSG_MAX_SIZE];
+
+	mavlink_zikush_icu_stats_t stats;
+
+	unsigned offered, dropped, delivered, delivered_bytes, buffers_sent, mt_received;
+} bench_t;
+
+static bench_t _bench;
+
+static uint64_t _start_ms;
+static int _speedup = 100;
+
+
+static uint64_t _real_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t _now(void)
+{
+	return (_real_ms() - _start_ms) * _speedup;
+}
+
+static int _putch(void * user_arg, uint8_t byte)
+{
+	bench_t * bench = user_arg;
+
+	for(;;)
+	{
+		int rc = write(bench->fd, &byte, 1);
+		if(rc == 1)
+			return 0;
+		if(rc < 0 && errno != EINTR && errno != EAGAIN)
+			return -errno;
+	}
+}
+
+
+static void _session_done(bench_t * bench, const ir9602_evt_session_t * session)
+{
+	const uint32_t now = _now();
+	const bool ok = 0 == session->rc && IR9602_EVT_SBDMSTATUS_ERROR != session->sbdi.mo_status;
+
+	irsched_done(ok, now);
+	if(ok)
+	{
+		if(session->mo_written && IR9602_EVT_SBDMSTATUS_YES == session->sbdi.mo_status)
+		{
+			irsched_delivered(bench->stamps.count, bench->stamps.count * now - bench->stamps.stamp_sum);
+			if(bench->compact)
+				downlink_ack(&bench->downlink, bench->accum, bench->accum_carret);
+
+			bench->delivered += bench->stamps.count;
+			bench->delivered_bytes += bench->accum_carret;
+			bench->buffers_sent++;
+		}
+
+		bench->accum_carret = 0;
+	}
+	irsched_report(&bench->stats);
+
+	if(session->rc != 0)
+	{
+		bench->stats.iridium_errors++;
+		return;
+	}
+
+	if(IR9602_EVT_SBDMSTATUS_YES == session->sbdi.mt_status && session->mt_size > 0)
+		bench->mt_received++;
+}
+
+static void _event_hook(void * user_arg, const ir9602_evt_t * event)
+{
+	bench_t * bench = user_arg;
+
+	if(IR9602_EVT_CIEV == event->code && IR9602_EVT_CIEV_KIND_SIGIND == event->arg.ciev.type)
+	{
+		bench->stats.iridium_sigind = event->arg.ciev.value;
+		irsched_sigind(event->arg.ciev.value, _now());
+	}
+
+	if(IR9602_EVT_CIEV == event->code && IR9602_EVT_CIEV_KIND_NETAVAIL == event->arg.ciev.type)
+		irsched_netavail(event->arg.ciev.value, _now());
+
+	if(IR9602_EVT_SESSION == event->code)
+		_session_done(bench, &event->arg.session);
+}
+
+
+// Telemetry of a balloon going up at 5 m/s somewhere near Moscow
+static void _make(bench_t * bench, uint32_t msgid, uint32_t now, mavlink_message_t * msg)
+{
+	const double t = now / 1000.0;
+
+	switch(msgid)
+	{
+	case MAVLINK_MSG_ID_HIL_GPS:
+	{
+		mavlink_hil_gps_t gps = {
+				.time_usec = (uint64_t)now * 1000,
+				.fix_type = 3,
+				.lat = 557000000 + (int32_t)(t * 20),
+				.lon = 376000000 + (int32_t)(t * 35),
+				.alt = 150000 + (int32_t)(t * 5000),
+				.eph = 120 + rand() % 20,
+				.epv = 180 + rand() % 30,
+				.vel = 300 + rand() % 50,
+				.vn = 200, .ve = 350, .vd = -500,
+				.cog = 6000,
+				.satellites_visible = 8 + rand() % 3,
+		};
+		mavlink_msg_hil_gps_encode(0, ZIKUSH_ICU, msg, &gps);
+		break;
+	}
+
+	case MAVLINK_MSG_ID_ZIKUSH_POWER_STATE:
+	{
+		mavlink_zikush_power_state_t power = {
+				.time_boot_ms = now,
+				.buses_state = 0x07,
+				.icu_current = 0.12f + (rand() % 10) * 0.001f,
+				.icu_power = 0.6f + (rand() % 10) * 0.005f,
+				.scu_current = 0.05f + (rand() % 10) * 0.001f,
+				.scu_power = 0.25f + (rand() % 10) * 0.005f,
+				.ccu_current = 0.3f + (rand() % 10) * 0.001f,
+				.ccu_power = 1.5f + (rand() % 10) * 0.005f,
+		};
+		mavlink_msg_zikush_power_state_encode(0, ZIKUSH_PCU, msg, &power);
+		break;
+	}
+
+	case MAVLINK_MSG_ID_SCALED_PRESSURE:
+	{
+		mavlink_scaled_pressure_t pressure = {
+				.time_boot_ms = now,
+				.press_abs = 1000.0f - t * 0.6f,
+				.press_diff = 0,
+				.temperature = 2000 - (int16_t)(t * 3),
+		};
+		mavlink_msg_scaled_pressure_encode(0, ZIKUSH_SCU, msg, &pressure);
+		break;
+	}
+
+	default:
+		mavlink_msg_zikush_icu_stats_encode(0, ZIKUSH_ICU, msg, &bench->stats);
+		break;
+	}
+}
+
+static void _telemetry(bench_t * bench, uint32_t now)
+{
+	for(int i = 0; i < sizeof(_streams) / sizeof(_streams[0]); i++)
+	{
+		stream_t * stream = &_streams[i];
+
+		while((int32_t)(now - stream->next) >= 0)
+		{
+			mavlink_message_t msg;
+			uint8_t frame[ICU_IR_PACK_FRAMESIZE];
+
+			_make(bench, stream->msgid, stream->next, &msg);
+			stream->next += stream->period_ms;
+
+			const uint16_t len = bench->compact
+					? downlink_encode(&bench->downlink, &msg, frame, sizeof(frame))
+					: downlink_plain(&msg, frame, sizeof(frame));
+
+			bench->offered++;
+			if(!sbdpack_put(msg.msgid, msg.compid, frame, len, now))
+				bench->dropped++;
+		}
+	}
+}
+
+
+static int _open_port(const char * path)
+{
+	int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(fd < 0)
+		return -errno;
+
+	struct termios tio;
+	tcgetattr(fd, &tio);
+	cfmakeraw(&tio);
+	cfsetspeed(&tio, B19200);
+	tcsetattr(fd, TCSANOW, &tio);
+
+	return fd;
+}
+
+static void _usage(const char * name)
+{
+	printf("Usage: %s [-x speedup] [-d seconds] [-p] port\n"
+			"	-x	virtual time runs that many times faster, 100 by default\n"
+			"	-d	virtual duration, 3600 s by default\n"
+			"	-p	plain MAVLink frames instead of the compact downlink encoding\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+	bench_t * const bench = &_bench;
+	uint32_t duration = 3600;
+
+	bench->compact = true;
+
+	int opt;
+	while( (opt = getopt(argc, argv, "x:d:ph")) != -1 )
+	{
+		switch(opt)
+		{
+		case 'x': _speedup = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); break;
+		case 'p': bench->compact = false; break;
+
+		default:
+			_usage(argv[0]);
+			return opt == 'h' ? 0 : EINVAL;
+		}
+	}
+
+	if(optind >= argc || _speedup < 1)
+	{
+		_usage(argv[0]);
+		return EINVAL;
+	}
+
+	bench->fd = _open_port(argv[optind]);
+	if(bench->fd < 0)
+	{
+		fprintf(stderr, "can't open %s: %s\n", argv[optind], strerror(-bench->fd));
+		return -bench->fd;
+	}
+
+	mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
+	srand(1);
+
+	_start_ms = _real_ms();
+	ir9602_init(&bench->ir, bench, _putch, _event_hook);
+	irsched_init(_now());
+	if(ir9602_indicators(&bench->ir, true, true) < 0)
+		bench->stats.iridium_errors++;
+
+	// The loop of iridium_task, polling instead of notifications
+	while(_now() < duration * 1000)
+	{
+		struct pollfd pfd = { .fd = bench->fd, .events = POLLIN };
+		poll(&pfd, 1, 1);
+
+		uint8_t buff[256];
+		int len = read(bench->fd, buff, sizeof(buff));
+		for(int i = 0; i < len; i++)
+			ir9602_feed(&bench->ir, buff[i], _now());
+
+		ir9602_tick(&bench->ir, _now());
+
+		_telemetry(bench, _now());
+
+		if(ir9602_busy(&bench->ir))
+			continue;
+
+		if(!irsched_due(sbdpack_pending() >= sizeof(bench->accum), _now()))
+			continue;
+
+		if(0 == bench->accum_carret)
+			bench->accum_carret = sbdpack_pack(bench->accum, sizeof(bench->accum), &bench->stamps);
+
+		irsched_started(_now());
+		const int rc = ir9602_session_start(&bench->ir, bench->accum, bench->accum_carret,
+				bench->mt, sizeof(bench->mt), _now());
+		if(rc < 0)
+		{
+			bench->stats.iridium_errors++;
+			irsched_done(false, _now());
+			irsched_report(&bench->stats);
+		}
+	}
+
+	const double minutes = duration / 60.0;
+	printf("%u s virtual, %s encoding\n", duration, bench->compact ? "compact" : "plain");
+	printf("sessions:   %u, %u%% successful, %u errors\n",
+			bench->stats.iridium_sessions, bench->stats.iridium_success, bench->stats.iridium_errors);
+	printf("messages:   %u offered, %u delivered, %u refused by the pool, %u evicted or still waiting\n",
+			bench->offered, bench->delivered, bench->dropped, bench->offered - bench->delivered - bench->dropped);
+	printf("throughput: %u MO bytes, %.1f B/min, %.1f messages/min\n",
+			bench->delivered_bytes, bench->delivered_bytes / minutes, bench->delivered / minutes);
+	printf("packing:    %.1f%% of the MO buffer used on average\n",
+			bench->buffers_sent ? 100.0 * bench->delivered_bytes / bench->buffers_sent / ICU_IR_TX_ACCUMULATOR_SIZE : 0.0);
+	printf("latency:    %u s on average\n", bench->stats.iridium_latency);
+	printf("MT:         %u messages received\n", bench->mt_received);
+
+	close(bench->fd);
+	return bench->delivered ? 0 : 1;
+}
@@ -0,0 +1,621 @@
+/*
+ * 	Iridium 9602 modem emulator on a pseudo-terminal
+ *
+ * 	Speaks the part of the AT command set the ICU driver uses: SBDWB, SBDD, SBDI and SBDIX, SBDRB, SBDTC,
+ * 	CIER with CIEV reports, and a few harmless ones (AT, ATE, AT&K, AT+CSQ). Echo is off, as the driver
+ * 	expects.
+ *
+ * 	The signal (0-5) is fixed or walks randomly by one step. A session takes the given latency with
+ * 	+-25% jitter and gets through with the probability of signal/5, less the given failure rate. MT
+ * 	messages are queued from the command line and delivered one per successful session, like the
+ * 	gateway does.
+ *
+ * 	Like the real modem, it says nothing unsolicited while a command is being typed, the driver relies
+ * 	on that for SBDRB. Binary data of SBDWB starts right after the CR of the command, so a LF sent
+ * 	after it would be taken for the first byte of the message. A bad checksum or a timeout of SBDWB leaves
+ * 	the MO buffer as it was.
+ *
+ * 	Every MO message that gets through is written to stdout as "MO <momsn> <len> <hex>", session
+ * 	outcomes and everything else go to stderr.
+ */
+
+#define _GNU_SOURCE //for ptsname_r()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <termios.h>
+
+#define MO_MAX		340
+#define MT_MAX		270
+#define MT_QUEUE	16
+#define LINE_MAX	64
+
+#define SBDWB_TIMEOUT_MS	60000
+
+typedef enum
+{
+	MODE_COMMAND,
+	MODE_SBDWB,		//binary MO message is coming
+	MODE_SBDI,		//a session is in progress, commands are not taken
+} emu_mode_t;
+
+typedef struct
+{
+	uint8_t data[MT_MAX];
+	uint16_t len;
+} mt_msg_t;
+
+typedef struct
+{
+	// Settings
+	int session_ms;
+	int reply_ms;
+	int walk_ms;
+	double fail_rate;
+
+	// Modem
+	int fd;
+	emu_mode_t mode;
+	char line[LINE_MAX];
+	int linelen;
+
+	uint8_t mo[MO_MAX];
+	int mo_len;			//0 if the buffer is empty
+	uint8_t sbdwb[MO_MAX + 2];	//data of SBDWB with the checksum, goes to mo only if that matches
+	int sbdwb_len;		//expected, checksum not counted
+	int sbdwb_got;
+
+	uint8_t mt[MT_MAX];
+	int mt_len;
+	mt_msg_t mt_queue[MT_QUEUE];
+	int mt_queued;
+
+	uint16_t momsn, mtmsn;
+	bool sbdix;
+
+	bool cier, cier_sig, cier_net;
+	int sig;
+	int reported_sig, reported_net;
+
+	uint64_t deadline;		//of SBDWB data or of the session, ms
+	uint64_t next_walk;
+
+	// Stats
+	unsigned sessions, sessions_ok, mo_bytes, mt_delivered;
+} emu_t;
+
+static volatile sig_atomic_t _stop;
+
+
+static uint64_t _now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void _sleep_ms(int ms)
+{
+	if(ms <= 0)
+		return;
+
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+}
+
+static void _write(emu_t * emu, const void * data, int len)
+{
+	const uint8_t * p = data;
+
+	while(len > 0)
+	{
+		int rc = write(emu->fd, p, len);
+		if(rc < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN)
+			{
+				_sleep_ms(1);
+				continue;
+			}
+			if(errno == EIO)
+				return; //nobody on the other side yet
+
+			perror("write");
+			return;
+		}
+
+		p += rc;
+		len -= rc;
+	}
+}
+
+static void _puts(emu_t * emu, const char * str)
+{
+	_write(emu, str, strlen(str));
+}
+
+static void _reply(emu_t * emu, const char * str)
+{
+	_sleep_ms(emu->reply_ms);
+	_puts(emu, str);
+}
+
+static uint16_t _checksum(const uint8_t * data, int len)
+{
+	uint16_t sum = 0;
+	for(int i = 0; i < len; i++)
+		sum += data[i];
+
+	return sum;
+}
+
+static int _hex(char c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+
+// ================================================================
+// ================================================================
+
+static void _report_indicators(emu_t * emu, bool force)
+{
+	char buff[32];
+	const int net = emu->sig > 0;
+
+	if(!emu->cier || emu->mode == MODE_SBDWB || emu->linelen > 0)
+		return; //the modem keeps quiet while a command is typed
+
+	if(emu->cier_sig && (force || emu->sig != emu->reported_sig))
+	{
+		snprintf(buff, sizeof(buff), "+CIEV:0,%d\r\n", emu->sig);
+		_puts(emu, buff);
+		emu->reported_sig = emu->sig;
+	}
+
+	if(emu->cier_net && (force || net != emu->reported_net))
+	{
+		snprintf(buff, sizeof(buff), "+CIEV:1,%d\r\n", net);
+		_puts(emu, buff);
+		emu->reported_net = net;
+	}
+}
+
+static void _session_end(emu_t * emu)
+{
+	char buff[80];
+	int mo_status, mt_status = 0;
+
+	emu->mode = MODE_COMMAND;
+	emu->sessions++;
+
+	// Weaker signal, fewer sessions get through: all of them with 5 bars but for the failure rate, none with 0
+	const bool ok = drand48() < (1 - emu->fail_rate) * emu->sig / 5;
+	if(ok)
+	{
+		emu->sessions_ok++;
+
+		mo_status = 0;
+		if(emu->mo_len > 0)
+		{
+			mo_status = 1;
+			emu->mo_bytes += emu->mo_len;
+
+			printf("MO %u %d ", (unsigned)emu->momsn, emu->mo_len);
+			for(int i = 0; i < emu->mo_len; i++)
+				printf("%02x", emu->mo[i]);
+			printf("\n");
+			fflush(stdout);
+		}
+
+		if(emu->mt_queued > 0)
+		{
+			mt_status = 1;
+			emu->mtmsn++;
+			emu->mt_delivered++;
+			memcpy(emu->mt, emu->mt_queue[0].data, emu->mt_queue[0].len);
+			emu->mt_len = emu->mt_queue[0].len;
+			memmove(emu->mt_queue, emu->mt_queue + 1, --emu->mt_queued * sizeof(mt_msg_t));
+		}
+	}
+	else
+	{
+		// SBDI has one failure code, SBDIX tells why. 32 - no network service, 35 - busy
+		mo_status = emu->sbdix ? (emu->sig > 0 ? 35 : 32) : 2;
+		mt_status = 2;
+	}
+
+	fprintf(stderr, "session %u: %s, sig %d, mo %d bytes, mt %s, %d queued\n", emu->sessions, ok ? "ok" : "failed",
+			emu->sig, emu->mo_len, mt_status == 1 ? "received" : "none", emu->mt_queued);
+
+	snprintf(buff, sizeof(buff), "+SBDI%s: %d, %u, %d, %u, %d, %d\r\n\r\nOK\r\n", emu->sbdix ? "X" : "",
+			mo_status, (unsigned)emu->momsn, mt_status, (unsigned)emu->mtmsn,
+			mt_status == 1 ? emu->mt_len : 0, emu->mt_queued);
+	_puts(emu, buff);
+
+	// MOMSN goes to the next message once this one is sent
+	if(mo_status == 1)
+		emu->momsn++;
+
+	_report_indicators(emu, false);
+}
+
+static void _sbdwb_byte(emu_t * emu, uint8_t byte)
+{
+	emu->sbdwb[emu->sbdwb_got++] = byte;
+	if(emu->sbdwb_got < emu->sbdwb_len + 2)
+		return;
+
+	emu->mode = MODE_COMMAND;
+
+	const uint16_t sum = _checksum(emu->sbdwb, emu->sbdwb_len);
+	const uint16_t rxsum = emu->sbdwb[emu->sbdwb_len] << 8 | emu->sbdwb[emu->sbdwb_len + 1];
+	if(sum != rxsum)
+	{
+		fprintf(stderr, "SBDWB: checksum %04x, expected %04x\n", rxsum, sum);
+		_reply(emu, "2\r\n\r\nOK\r\n");
+		return;
+	}
+
+	memcpy(emu->mo, emu->sbdwb, emu->sbdwb_len);
+	emu->mo_len = emu->sbdwb_len;
+	_reply(emu, "0\r\n\r\nOK\r\n");
+}
+
+static void _sbdrb(emu_t * emu)
+{
+	uint8_t buff[MT_MAX + 4];
+	const uint16_t sum = _checksum(emu->mt, emu->mt_len);
+
+	buff[0] = emu->mt_len >> 8;
+	buff[1] = emu->mt_len & 0xFF;
+	memcpy(buff + 2, emu->mt, emu->mt_len);
+	buff[2 + emu->mt_len] = sum >> 8;
+	buff[3 + emu->mt_len] = sum & 0xFF;
+
+	_sleep_ms(emu->reply_ms);
+	_write(emu, buff, emu->mt_len + 4);
+	_puts(emu, "\r\nOK\r\n");
+}
+
+static void _command(emu_t * emu, const char * cmd, uint64_t now)
+{
+	char buff[96];
+	int a, b, c;
+
+	if(strncasecmp(cmd, "AT", 2) != 0)
+	{
+		_reply(emu, "ERROR\r\n");
+		return;
+	}
+	cmd += 2;
+
+	if(strncasecmp(cmd, "+SBDWB=", 7) == 0)
+	{
+		const int len = atoi(cmd + 7);
+		if(len < 1 || len > MO_MAX)
+		{
+			_reply(emu, "3\r\n\r\nOK\r\n");
+			return;
+		}
+
+		emu->mode = MODE_SBDWB;
+		emu->sbdwb_len = len;
+		emu->sbdwb_got = 0;
+		emu->deadline = now + SBDWB_TIMEOUT_MS;
+		_reply(emu, "READY\r\n");
+	}
+	else if(strcasecmp(cmd, "+SBDIX") == 0 || strcasecmp(cmd, "+SBDIXA") == 0 || strcasecmp(cmd, "+SBDI") == 0)
+	{
+		emu->sbdix = strncasecmp(cmd, "+SBDIX", 6) == 0;
+		emu->mode = MODE_SBDI;
+
+		const int jitter = emu->session_ms / 4;
+		emu->deadline = now + emu->session_ms + (jitter ? (int)(drand48() * 2 * jitter) - jitter : 0);
+	}
+	else if(strcasecmp(cmd, "+SBDRB") == 0)
+	{
+		_sbdrb(emu);
+	}
+	else if(strncasecmp(cmd, "+SBDD", 5) == 0)
+	{
+		const int what = atoi(cmd + 5);
+		if(what == 0 || what == 2)
+			emu->mo_len = 0;
+		if(what == 1 || what == 2)
+			emu->mt_len = 0;
+
+		_reply(emu, "0\r\n\r\nOK\r\n");
+	}
+	else if(strcasecmp(cmd, "+SBDTC") == 0)
+	{
+		const int len = emu->mo_len < MT_MAX ? emu->mo_len : MT_MAX;
+		memcpy(emu->mt, emu->mo, len);
+		emu->mt_len = len;
+
+		snprintf(buff, sizeof(buff), "SBDTC: Outbound SBD Copied to Inbound SBD: size = %d\r\n\r\nOK\r\n", len);
+		_reply(emu, buff);
+	}
+	else if(sscanf(cmd, "+CIER=%d,%d,%d", &a, &b, &c) == 3)
+	{
+		emu->cier = a;
+		emu->cier_sig = b;
+		emu->cier_net = c;
+		_reply(emu, "OK\r\n");
+
+		// Enabling the reports gives the current values at once
+		_report_indicators(emu, true);
+	}
+	else if(strcasecmp(cmd, "+CSQ") == 0)
+	{
+		snprintf(buff, sizeof(buff), "+CSQ:%d\r\n\r\nOK\r\n", emu->sig);
+		_reply(emu, buff);
+	}
+	else if(*cmd == '\0' || strncasecmp(cmd, "E", 1) == 0 || strncasecmp(cmd, "&K", 2) == 0)
+	{
+		_reply(emu, "OK\r\n");
+	}
+	else
+	{
+		fprintf(stderr, "unknown command AT%s\n", cmd);
+		_reply(emu, "ERROR\r\n");
+	}
+}
+
+static void _byte(emu_t * emu, uint8_t byte, uint64_t now)
+{
+	switch(emu->mode)
+	{
+	case MODE_SBDWB:
+		_sbdwb_byte(emu, byte);
+		return;
+
+	case MODE_SBDI:
+		return; //the real modem ignores input during a session too
+
+	default:
+		break;
+	}
+
+	if(byte == '\n')
+		return;
+
+	if(byte != '\r')
+	{
+		if(emu->linelen < LINE_MAX - 1)
+			emu->line[emu->linelen++] = byte;
+		return;
+	}
+
+	emu->line[emu->linelen] = '\0';
+	emu->linelen = 0;
+	if(emu->line[0] != '\0')
+		_command(emu, emu->line, now);
+}
+
+static void _timers(emu_t * emu, uint64_t now)
+{
+	if(emu->mode == MODE_SBDWB && now >= emu->deadline)
+	{
+		emu->mode = MODE_COMMAND;
+		_reply(emu, "1\r\n\r\nOK\r\n");
+	}
+
+	if(emu->mode == MODE_SBDI && now >= emu->deadline)
+		_session_end(emu);
+
+	if(emu->walk_ms > 0 && now >= emu->next_walk)
+	{
+		emu->next_walk = now + emu->walk_ms;
+		emu->sig += (int)(drand48() * 3) - 1;
+		if(emu->sig < 0) emu->sig = 0;
+		if(emu->sig > 5) emu->sig = 5;
+
+		if(emu->mode != MODE_SBDI)
+			_report_indicators(emu, false);
+	}
+}
+
+static int _timeout(const emu_t * emu, uint64_t now)
+{
+	uint64_t next = now + 1000;
+
+	if(emu->mode != MODE_COMMAND && emu->deadline < next)
+		next = emu->deadline;
+	if(emu->walk_ms > 0 && emu->next_walk < next)
+		next = emu->next_walk;
+
+	return next > now ? (int)(next - now) : 0;
+}
+
+
+// ================================================================
+// ================================================================
+
+static int _queue_mt(emu_t * emu, const char * arg)
+{
+	if(emu->mt_queued >= MT_QUEUE)
+		return -ENOSPC;
+
+	mt_msg_t * msg = &emu->mt_queue[emu->mt_queued];
+	msg->len = 0;
+
+	// hex:0102ab... or just text
+	if(strncmp(arg, "hex:", 4) == 0)
+	{
+		for(arg += 4; arg[0] && arg[1]; arg += 2)
+		{
+			const int hi = _hex(arg[0]), lo = _hex(arg[1]);
+			if(hi < 0 || lo < 0 || msg->len >= MT_MAX)
+				return -EINVAL;
+
+			msg->data[msg->len++] = hi << 4 | lo;
+		}
+	}
+	else
+	{
+		msg->len = strlen(arg) < MT_MAX ? strlen(arg) : MT_MAX;
+		memcpy(msg->data, arg, msg->len);
+	}
+
+	emu->mt_queued++;
+	return 0;
+}
+
+static int _open_pty(const char * link)
+{
+	char name[128];
+
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0 || ptsname_r(fd, name, sizeof(name)) != 0)
+	{
+		perror("pty");
+		return -1;
+	}
+
+	// Raw on our side too, or the line discipline would echo and mangle binary data
+	struct termios tio;
+	tcgetattr(fd, &tio);
+	cfmakeraw(&tio);
+	cfsetspeed(&tio, B19200);
+	tcsetattr(fd, TCSANOW, &tio);
+
+	// Keep the slave open ourselves, so reads don't give EIO until a client opens it
+	int slave = open(name, O_RDWR | O_NOCTTY);
+	if(slave >= 0)
+	{
+		tcgetattr(slave, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(slave, TCSANOW, &tio);
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	if(link)
+	{
+		unlink(link);
+		if(symlink(name, link) < 0)
+			perror("symlink");
+	}
+
+	fprintf(stderr, "modem is on %s%s%s\n", name, link ? ", linked as " : "", link ? link : "");
+	return fd;
+}
+
+static void _on_signal(int signum)
+{
+	(void)signum;
+	_stop = 1;
+}
+
+static void _usage(const char * name)
+{
+	printf("Usage: %s [-l link] [-t session_ms] [-r reply_ms] [-s signal] [-w walk_ms] [-f fail_rate]\n"
+			"          [-m message]... [-S seed]\n"
+			"	-l	make a symlink to the pty, for the client to open\n"
+			"	-t	session duration, +-25%%, 20000 by default\n"
+			"	-r	delay before a reply to other commands, 50 by default\n"
+			"	-s	signal 0-5, 5 by default. A session gets through with the probability of signal/5\n"
+			"	-w	the signal steps randomly by one every that many ms\n"
+			"	-f	probability of a failed session with full signal\n"
+			"	-m	queue an MT message, text or hex:0102ab..\n"
+			"	-S	random seed\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+	static emu_t emu;
+	const char * link = NULL;
+	long seed = time(NULL);
+
+	emu.session_ms = 20000;
+	emu.reply_ms = 50;
+	emu.sig = 5;
+	emu.reported_sig = emu.reported_net = -1;
+
+	int opt;
+	while( (opt = getopt(argc, argv, "l:t:r:s:w:f:m:S:h")) != -1 )
+	{
+		switch(opt)
+		{
+		case 'l': link = optarg; break;
+		case 't': emu.session_ms = atoi(optarg); break;
+		case 'r': emu.reply_ms = atoi(optarg); break;
+		case 's': emu.sig = atoi(optarg); break;
+		case 'w': emu.walk_ms = atoi(optarg); break;
+		case 'f': emu.fail_rate = atof(optarg); break;
+		case 'S': seed = atol(optarg); break;
+
+		case 'm':
+			if(_queue_mt(&emu, optarg) != 0)
+			{
+				fprintf(stderr, "can't queue MT message %s\n", optarg);
+				return EINVAL;
+			}
+			break;
+
+		default:
+			_usage(argv[0]);
+			return opt == 'h' ? 0 : EINVAL;
+		}
+	}
+
+	if(emu.sig < 0 || emu.sig > 5)
+	{
+		_usage(argv[0]);
+		return EINVAL;
+	}
+
+	srand48(seed);
+
+	emu.fd = _open_pty(link);
+	if(emu.fd < 0)
+		return EIO;
+
+	signal(SIGINT, _on_signal);
+	signal(SIGTERM, _on_signal);
+
+	emu.next_walk = _now_ms() + emu.walk_ms;
+	while(!_stop)
+	{
+		struct pollfd pfd = { .fd = emu.fd, .events = POLLIN };
+		int rc = poll(&pfd, 1, _timeout(&emu, _now_ms()));
+		if(rc < 0 && errno != EINTR)
+		{
+			perror("poll");
+			break;
+		}
+
+		if(rc > 0 && (pfd.revents & POLLIN))
+		{
+			uint8_t buff[256];
+			int len = read(emu.fd, buff, sizeof(buff));
+			for(int i = 0; i < len; i++)
+				_byte(&emu, buff[i], _now_ms());
+		}
+
+		_timers(&emu, _now_ms());
+	}
+
+	fprintf(stderr, "%u sessions, %u ok, %u MO bytes delivered, %u MT messages delivered\n",
+			emu.sessions, emu.sessions_ok, emu.mo_bytes, emu.mt_delivered);
+
+	if(link)
+		unlink(link);
+
+	return 0;
+}
@@ -1,6 +1,8 @@
 #ifndef CAN_H_
 #define CAN_H_
 
+#include <stdbool.h>
+
 #include <mavlink/zikush/mavlink.h>
 
 typedef enum {
@@ -13,8 +15,23 @@ extern can_spectrum_request_t can_spectrum_request;
 extern uint16_t can_spectrum_processing_y_start, can_spectrum_processing_y_end, can_spectrum_processing_x_start, can_spectrum_processing_x_end;
 extern bool can_nadircam_request, can_zenithcam_request;
 
+// Counted in the TX IRQ. can_tx_mav is a number of messages whose last frame has left the mailbox
+extern volatile uint32_t can_tx_frames, can_tx_errors, can_tx_mav;
+
 
 void can_init(void);
-void can_mavlink_transmit(mavlink_message_t * msg);
+
+// Queues a message for transmission and returns immediately. False if there is no room for it
+bool can_mavlink_transmit(mavlink_message_t * msg);
+
+// Builds data message seq of a bulk transfer. A lost one is asked for again, so it should come out the same
+typedef void (*can_bulk_packet_t)(uint16_t seq, mavlink_message_t * msg);
+
+// Sends a bulk transfer paced by the receiver, see canmavlink_bulk.h. Returns when every packet is acknowledged,
+// false if the receiver is silent for PROBEWIDE_CAN_BULK_ABORT_MS
+bool can_bulk_transfer(mavlink_message_t * headers, uint8_t headercount, uint32_t msgid, uint16_t packets, can_bulk_packet_t packet);
+
+// Sends ZIKUSH_CAN_STATS if PROBEWIDE_CAN_STATS_PERIOD_MS has passed since the last one. Call it often
+void can_stats_update(void);
 
 #endif //#ifndef CAN_H_
@@ -0,0 +1 @@
+../../../common/mavlink/custom/canmavlink_stats.h
\ No newline at end of file
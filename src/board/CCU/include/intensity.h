@@ -0,0 +1,24 @@
+/*
+ * intensity.h
+ *
+ *	Intensity profiles of an 8-bit image: sums along rows or columns.
+ *	Row sums use the Cortex-M4 SIMD instructions when the compiler has them, plain C otherwise
+ */
+
+#ifndef INTENSITY_H_
+#define INTENSITY_H_
+
+#include <stdint.h>
+
+// out[i] is the sum of x_start..x_end (not included) of row i, saturated at UINT16_MAX, for rows rows
+// from image on. stride is the distance between rows in bytes, the caller keeps the range in the image
+void intensity_rows(const uint8_t * image, uint16_t stride, uint16_t x_start, uint16_t x_end, uint16_t rows,
+		uint16_t * out);
+
+// The sum of len bytes, not saturated
+uint32_t intensity_sum(const uint8_t * data, uint16_t len);
+
+// acc[i] += data[i] for len values, saturating at UINT16_MAX. Column sums, a row at a time
+void intensity_accumulate(uint16_t * acc, const uint8_t * data, uint16_t len);
+
+#endif /* INTENSITY_H_ */
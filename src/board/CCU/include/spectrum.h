@@ -35,21 +35,56 @@
 #define SPECTRUM_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "mt9v034.h"
+#include "zikush_config.h"
 
 #define DCMI_DR_ADDRESS       0x50050028
 
+/* Row sums of one frame */
+typedef struct {
+	uint32_t frame;			// spectrum_get_frame_counter() when it came in, 0 if none yet
+	uint32_t time_boot_ms;
+	uint16_t y_start;
+	uint16_t count;
+	uint16_t intensities[CCU_SPECTRUM_HEIGHT];
+} spectrum_profile_t;
+
+/* Frames that needed the DMA restarted after a DCMI overrun, profiles not kept because the other one was acquired */
+extern volatile uint32_t spectrum_resyncs, spectrum_profiles_dropped;
+
+/**
+ * @brief Starts continuous capture, each frame is summed over the region as it comes in
+ */
 void spectrum_init_capture(void);
 
 /**
- * @brief Send spectrum image with MAVLINK over USB
+ * @brief Region of the row sums, from the next frame on
+ */
+void spectrum_set_region(uint16_t y_start, uint16_t y_end, uint16_t x_start, uint16_t x_end);
+
+/**
+ * @brief The latest profile of a frame later than after or NULL. The caller owns it until release,
+ * capture goes on into the other buffer
+ */
+const spectrum_profile_t * spectrum_profile_acquire(uint32_t after);
+void spectrum_profile_release(void);
+
+/**
+ * @brief Stops capture at the end of the first frame later than after, the image is the caller's until resume
+ */
+void spectrum_freeze(uint32_t after);
+void spectrum_resume(void);
+
+/**
+ * @brief Send the frozen spectrum image with MAVLINK
  */
-void send_spectrum_photo(void);
+void spectrum_send_photo(void);
 
 /**
- * @brief Send spectrum data with MAVLINK over CAN
+ * @brief Send an acquired profile with MAVLINK
  */
-void send_spectrum_data(uint16_t y_start, uint16_t y_end, uint16_t x_start, uint16_t x_end);
+void spectrum_send_data(const spectrum_profile_t * profile);
 
 /*
  * @brief Wrapper for two previous functions
@@ -11,7 +11,10 @@
 #include <stm32f4xx_hal_can.h>
 
 #include <mavlink/zikush/mavlink.h>
+#include <zikush_canroutes.h>
 #include <canmavlink_hal.h>
+#include <canmavlink_bulk.h>
+#include <canmavlink_stats.h>
 
 #include "zikush_config.h"
 
@@ -28,9 +31,60 @@ uint16_t can_spectrum_processing_y_start = CCU_SPECTRUM_Y_START,\
 bool can_nadircam_request = false;
 bool can_zenithcam_request = false;
 
+volatile uint32_t can_tx_frames = 0, can_tx_errors = 0, can_tx_mav = 0;
+
 
 static CAN_HandleTypeDef hcan;
 
+// TX frames ring. Filled by can_mavlink_transmit(), emptied into mailboxes by the TX IRQ
+static CANMAVLINK_TX_FRAME_T _txring[CCU_CAN_TXRINGSIZE];
+static bool _txring_last[CCU_CAN_TXRINGSIZE]; //last frame of a MAVLink message
+static volatile uint16_t _txhead = 0, _txtail = 0;
+static bool _mailbox_last[3];
+
+static canmavlink_stats_t _stats;
+
+// The last acknowledgment of the bulk transfer, left by the RX IRQ for can_bulk_transfer()
+static volatile uint32_t _bulk_msgid = 0;
+static volatile bool _bulk_ack_pending = false;
+static mavlink_zikush_bulk_ack_t _bulk_ack;
+
+
+static uint16_t _txring_free(void)
+{
+	return (_txtail + CCU_CAN_TXRINGSIZE - _txhead - 1) % CCU_CAN_TXRINGSIZE;
+}
+
+// The same what HAL_CAN_Transmit() does, but without waiting
+static void _mailbox_load(uint8_t mailbox, const CANMAVLINK_TX_FRAME_T * frame)
+{
+	CAN_TxMailBox_TypeDef * mb = &hcan.Instance->sTxMailBox[mailbox];
+
+	if(frame->IDE == CAN_ID_STD)
+		mb->TIR = (frame->StdId << 21) | frame->RTR;
+	else
+		mb->TIR = (frame->ExtId << 3) | frame->IDE | frame->RTR;
+
+	mb->TDTR = (mb->TDTR & ~CAN_TDT0R_DLC) | (frame->DLC & 0x0F);
+	mb->TDLR = frame->Data[0] | (frame->Data[1] << 8) | (frame->Data[2] << 16) | ((uint32_t)frame->Data[3] << 24);
+	mb->TDHR = frame->Data[4] | (frame->Data[5] << 8) | (frame->Data[6] << 16) | ((uint32_t)frame->Data[7] << 24);
+
+	mb->TIR |= CAN_TI0R_TXRQ;
+}
+
+// Loads every free mailbox. Transmit FIFO priority is on, so frames go out in the order they are loaded
+static void _tx_refill(void)
+{
+	while(_txtail != _txhead && (hcan.Instance->TSR & (CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2)))
+	{
+		uint8_t mailbox = (hcan.Instance->TSR & CAN_TSR_CODE) >> 24; //Number of the next empty mailbox
+
+		_mailbox_load(mailbox, &_txring[_txtail]);
+		_mailbox_last[mailbox] = _txring_last[_txtail];
+		_txtail = (_txtail + 1) % CCU_CAN_TXRINGSIZE;
+	}
+}
+
 
 void can_init(void)
 {
@@ -56,39 +110,166 @@ void can_init(void)
 	hcan.Init.TTCM = DISABLE;
 	hcan.Init.ABOM = ENABLE;
 	hcan.Init.AWUM = DISABLE;
-	hcan.Init.NART = ENABLE;
+	hcan.Init.NART = DISABLE; //A frame losing arbitration waits for the bus, latencies in zikush_canroutes.h count on it
 	hcan.Init.RFLM = DISABLE;
-	hcan.Init.TXFP = DISABLE;
+	hcan.Init.TXFP = ENABLE; //Frames of a message should leave mailboxes in order
 	HAL_CAN_Init(&hcan);
 
-	CAN_FilterConfTypeDef filter = {
-		.FilterMaskIdLow = 0xFF,
-		.FilterIdLow = MAVLINK_MSG_ID_ZIKUSH_CMD_TAKE_SPECTRUM,
-		.FilterMaskIdHigh = 0xFF,
-		.FilterIdHigh = MAVLINK_MSG_ID_ZIKUSH_CMD_TAKE_PHOTO,
-		.FilterMode = CAN_FILTERMODE_IDMASK,
-		.FilterActivation = ENABLE,
-		.FilterFIFOAssignment = CAN_FILTER_FIFO0,
-		.FilterScale = CAN_FILTERSCALE_16BIT,
-		.BankNumber = 0
-	};
-
-	HAL_CAN_ConfigFilter(&hcan, &filter);
+	canmavlink_filter_t filters[ZIKUSH_CANROUTES_COUNT];
+	uint8_t filtercount = canmavlink_filters_build(filters, CANMAVLINK_FILTERS_CAPACITY(PROBEWIDE_CAN_FILTERBANKS, PROBEWIDE_CAN_EXTID),
+			zikush_canroutes, ZIKUSH_CANROUTES_COUNT, ZIKUSH_CCU);
+	canmavlink_filters_apply(hcan.Instance, 0, PROBEWIDE_CAN_FILTERBANKS, filters, filtercount, PROBEWIDE_CAN_EXTID);
 
 	HAL_NVIC_SetPriority(CAN1_RX0_IRQn, CCU_CAN_IRQ_PRIO, 0);
 	NVIC_EnableIRQ(CAN1_RX0_IRQn);
 	hcan.Instance->IER |= CAN_IER_FMPIE0;
+
+	HAL_NVIC_SetPriority(CAN1_TX_IRQn, CCU_CAN_IRQ_PRIO, 0);
+	NVIC_EnableIRQ(CAN1_TX_IRQn);
+	hcan.Instance->IER |= CAN_IER_TMEIE;
 }
 
-void can_mavlink_transmit(mavlink_message_t * msg)
+bool can_mavlink_transmit(mavlink_message_t * msg)
 {
-	CANMAVLINK_TX_FRAME_T canframes[34];
+	static CANMAVLINK_TX_FRAME_T canframes[CANMAVLINK_MAXFRAMES];
+#if PROBEWIDE_CAN_EXTID
+	uint8_t canframecount = canmavlink_msg_to_frames_shortest(canframes, msg);
+#else
 	uint8_t canframecount = canmavlink_msg_to_frames(canframes, msg);
-	for(int i = 0; i < canframecount; i++) //FIXME rewrite with IRQs
+#endif
+
+	if(canframecount == 0 || _txring_free() < canframecount)
+		return false;
+
+	uint16_t head = _txhead;
+	for(int i = 0; i < canframecount; i++)
+	{
+		_txring[head] = canframes[i];
+		_txring_last[head] = (i == canframecount - 1);
+		head = (head + 1) % CCU_CAN_TXRINGSIZE;
+	}
+
+	NVIC_DisableIRQ(CAN1_TX_IRQn);
+	_txhead = head;
+	_tx_refill();
+	NVIC_EnableIRQ(CAN1_TX_IRQn);
+
+	return true;
+}
+
+bool can_bulk_transfer(mavlink_message_t * headers, uint8_t headercount, uint32_t msgid, uint16_t packets, can_bulk_packet_t packet)
+{
+	canmavlink_bulk_tx_t tx;
+	mavlink_zikush_bulk_ack_t ack;
+	mavlink_message_t msg;
+	int32_t built = -1;
+	uint8_t headers_queued = 0;
+
+	NVIC_DisableIRQ(CAN1_RX0_IRQn);
+	_bulk_msgid = msgid;
+	_bulk_ack_pending = false;
+	NVIC_EnableIRQ(CAN1_RX0_IRQn);
+
+	canmavlink_bulk_tx_start(&tx, packets, HAL_GetTick(), PROBEWIDE_CAN_BULK_RTO_MS, PROBEWIDE_CAN_BULK_ABORT_MS);
+
+	while(true)
+	{
+		if(_bulk_ack_pending)
+		{
+			NVIC_DisableIRQ(CAN1_RX0_IRQn);
+			ack = _bulk_ack;
+			_bulk_ack_pending = false;
+			NVIC_EnableIRQ(CAN1_RX0_IRQn);
+
+			canmavlink_bulk_tx_ack(&tx, ack.next, ack.received, ack.window, HAL_GetTick());
+		}
+
+		int32_t next = canmavlink_bulk_tx_poll(&tx, HAL_GetTick());
+
+		if(next == CANMAVLINK_BULK_DONE || next == CANMAVLINK_BULK_FAILED)
+		{
+			_bulk_msgid = 0;
+			return next == CANMAVLINK_BULK_DONE;
+		}
+
+		// Headers go as the ring has room. Frames are retried until acknowledged, so with the ICU away
+		// there may never be any, and the transfer is given up at PROBEWIDE_CAN_BULK_ABORT_MS
+		if(next == CANMAVLINK_BULK_HEADER)
+		{
+			while(headers_queued < headercount && can_mavlink_transmit(&headers[headers_queued]))
+				headers_queued++;
+
+			if(headers_queued == headercount)
+			{
+				headers_queued = 0;
+				canmavlink_bulk_tx_header_sent(&tx, HAL_GetTick());
+				continue;
+			}
+		}
+
+		if(next >= 0)
+		{
+			if(next != built)
+			{
+				packet(next, &msg);
+				built = next;
+			}
+
+			if(can_mavlink_transmit(&msg))
+			{
+				canmavlink_bulk_tx_sent(&tx, next);
+				built = -1;
+				continue;
+			}
+		}
+
+		// Waiting for an acknowledgment or for ring room, SysTick wakes us up at least
+		can_stats_update();
+		__WFI();
+	}
+}
+
+void can_stats_update(void)
+{
+	uint32_t now = HAL_GetTick();
+
+	if(now - _stats.stamp < PROBEWIDE_CAN_STATS_PERIOD_MS)
+		return;
+
+	mavlink_message_t msg;
+	mavlink_zikush_can_stats_t report;
+
+	canmavlink_stats_report(&_stats, hcan.Instance, now, &report);
+	report.reasm_evicted = canmavlink_get_reasm()->evicted;
+
+	mavlink_msg_zikush_can_stats_encode(0, ZIKUSH_CCU, &msg, &report);
+	can_mavlink_transmit(&msg); //Skipped with no ring room, the next one has the counters anyway
+}
+
+void CAN1_TX_IRQHandler(void)
+{
+	static const uint32_t rqcp[3] = { CAN_TSR_RQCP0, CAN_TSR_RQCP1, CAN_TSR_RQCP2 };
+	static const uint32_t txok[3] = { CAN_TSR_TXOK0, CAN_TSR_TXOK1, CAN_TSR_TXOK2 };
+
+	uint32_t tsr = hcan.Instance->TSR;
+	for(int i = 0; i < 3; i++)
 	{
-		hcan.pTxMsg = canframes + i; //DELICIOUS!!
-		HAL_CAN_Transmit(&hcan, 100);
+		if( !(tsr & rqcp[i]) )
+			continue;
+
+		hcan.Instance->TSR = rqcp[i]; //Clears RQCP, TXOK, ALST and TERR of the mailbox
+
+		if(tsr & txok[i])
+			can_tx_frames++;
+		else
+			can_tx_errors++;
+		canmavlink_stats_tx_done(&_stats, hcan.Instance, i, tsr);
+
+		if(_mailbox_last[i])
+			can_tx_mav++;
 	}
+
+	_tx_refill();
 }
 
 void USB_LP_CAN1_RX0_IRQHandler(void)
@@ -99,8 +280,11 @@ void USB_LP_CAN1_RX0_IRQHandler(void)
 	static mavlink_zikush_cmd_take_photo_t cmd_photo;
 	static mavlink_zikush_cmd_take_spectrum_t cmd_spectrum;
 
+	canmavlink_stats_rx_overrun(&_stats, hcan.Instance);
+
 	hcan.pRxMsg = &frame;
 	HAL_CAN_Receive(&hcan, 0, 0);
+	canmavlink_stats_rx(&_stats, frame.IDE == CAN_ID_EXT, frame.DLC);
 
 	volatile uint8_t result = canmavlink_parse_frame(&frame, &msg, &status);
 
@@ -138,6 +322,15 @@ void USB_LP_CAN1_RX0_IRQHandler(void)
 
 			break;
 
+		case MAVLINK_MSG_ID_ZIKUSH_BULK_ACK:
+			if(mavlink_msg_zikush_bulk_ack_get_target_compid(&msg) == ZIKUSH_CCU && mavlink_msg_zikush_bulk_ack_get_msgid(&msg) == _bulk_msgid)
+			{
+				mavlink_msg_zikush_bulk_ack_decode(&msg, &_bulk_ack);
+				_bulk_ack_pending = true;
+			}
+
+			break;
+
 		default:
 			break;
 		}
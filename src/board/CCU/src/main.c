@@ -31,7 +31,6 @@ void SysTick_Handler(void)
 
 int main(int argc, char* argv[])
 {
-	mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
 	mavlink_heartbeat_t heartbeat =
 	{
 		.type = MAV_TYPE_CAMERA,
@@ -52,11 +51,12 @@ int main(int argc, char* argv[])
 	can_init();
 
 
+	uint32_t heartbeat_time = HAL_GetTick();
+	can_mavlink_transmit(&msg);
+	usart2_mavlink_transmit(&msg);
+
 	while(true)
 	{
-		can_mavlink_transmit(&msg);
-		usart2_mavlink_transmit(&msg);
-
 		if(can_spectrum_request)
 		{
 			spectrum_take(can_spectrum_request == SPRQ_FULL, can_spectrum_processing_y_start, can_spectrum_processing_y_end, \
@@ -68,10 +68,19 @@ int main(int argc, char* argv[])
 		//TODO add cam requests processing
 
 
-		HAL_Delay(60000); //TODO Add transition into true sleep mode?
+		can_stats_update();
+
+		if(HAL_GetTick() - heartbeat_time >= 60000)
+		{
+			heartbeat_time += 60000;
+			can_mavlink_transmit(&msg);
+			usart2_mavlink_transmit(&msg);
 
 #ifdef CCU_TESTMODE
-		can_spectrum_request = SPRQ_FULL;
+			can_spectrum_request = SPRQ_FULL;
 #endif
+		}
+
+		__WFI(); //SysTick wakes us up every ms, TODO Add transition into true sleep mode?
 	}
 }
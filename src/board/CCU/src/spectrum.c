@@ -48,6 +48,7 @@
 
 #include <mavlink/zikush/mavlink.h>
 #include <spectrum.h>
+#include <intensity.h>
 #include <usart.h>
 #include <can.h>
 
@@ -57,10 +58,36 @@
 
 /* counters */
 static volatile uint32_t spectrum_frame_counter;
+volatile uint32_t spectrum_resyncs, spectrum_profiles_dropped;
 
-/* image buffers */
-static uint8_t spectrum_image_buffer_8bit[FULL_IMAGE_SIZE * 4];
-static uint32_t buffer_size = FULL_IMAGE_SIZE; // buffer size in date unit (word)
+/* image buffer, DMA double-buffer mode fills its halves in turn: M0AR the top one, M1AR the bottom one */
+#define SPECTRUM_HALF_ROWS	(CCU_SPECTRUM_HEIGHT / 2)
+#define SPECTRUM_HALF_WORDS	(FULL_IMAGE_SIZE / 2)
+
+static uint8_t spectrum_image_buffer_8bit[FULL_IMAGE_SIZE * 4] __attribute__((aligned(4)));
+
+/* row sums, the DMA IRQ fills one while the other is ready or being sent */
+static spectrum_profile_t _profiles[2];
+static uint8_t _profile_fill = 0;
+static volatile uint8_t _profile_ready = 1;
+static volatile bool _profile_held = false;
+static const spectrum_profile_t * _profile_sending;
+
+/* region for the next frame and the one of the frame coming in, taken at its start. Ends are not included */
+typedef struct {
+	uint16_t x_start, x_end;
+	uint16_t y_start, y_end;
+} _region_t;
+
+static volatile _region_t _region = {
+	CCU_SPECTRUM_X_START, CCU_SPECTRUM_X_END, CCU_SPECTRUM_Y_START, CCU_SPECTRUM_Y_END
+};
+static _region_t _frame_region;
+static bool _top_done = false;
+
+/* capture stops after frame _freeze_after + 1 or later with _freeze set */
+static volatile bool _freeze = false, _frozen = false;
+static volatile uint32_t _freeze_after;
 
 /* Various handlers */
 I2C_HandleTypeDef hi2c2; //not static, cause it's referenced in mt9v034 code and i have no time to rewrite it
@@ -72,6 +99,7 @@ static DMA_HandleTypeDef hdma;
 static void _dcmi_dma_enable(void);
 static void _dcmi_dma_disable(void);
 static void _reset_frame_counter(void);
+static void _profile_half(uint8_t half);
 static void _dcmi_clock_init(void);
 static void _dcmi_hw_init(void);
 static void _dcmi_dma_init(void);
@@ -90,43 +118,196 @@ void spectrum_init_capture(void)
 }
 
 /**
- * @brief Calibration image collection routine restart
+ * @brief Sets the region of the row sums, taken from the next frame that begins
  */
-void spectrum_restart_calibration_routine(void)
+void spectrum_set_region(uint16_t y_start, uint16_t y_end, uint16_t x_start, uint16_t x_end)
 {
-	/* wait until we have an image */
-	while(spectrum_frame_counter < 1){}
-	spectrum_frame_counter = 0;
+	__disable_irq();
+	_region.x_start = x_start;
+	_region.x_end = x_end;
+	_region.y_start = y_start;
+	_region.y_end = y_end;
+	__enable_irq();
+}
+
+/**
+ * @brief The latest profile of a frame later than after, NULL if there is none yet.
+ * It stays the caller's until spectrum_profile_release(), the next ones go to the other buffer
+ */
+const spectrum_profile_t * spectrum_profile_acquire(uint32_t after)
+{
+	const spectrum_profile_t * profile = NULL;
+
+	__disable_irq();
+	if(_profiles[_profile_ready].frame > after)
+	{
+		_profile_held = true;
+		profile = &_profiles[_profile_ready];
+	}
+	__enable_irq();
+
+	return profile;
+}
+
+void spectrum_profile_release(void)
+{
+	_profile_held = false;
+}
+
+/**
+ * @brief Stops capture at the end of the first frame later than after and waits for it.
+ * The image buffer is the caller's until spectrum_resume()
+ */
+void spectrum_freeze(uint32_t after)
+{
+	_freeze_after = after;
+	_frozen = false;
+	_freeze = true;
+
+	while(!_frozen){}
+}
+
+void spectrum_resume(void)
+{
+	_freeze = false;
+	_frozen = false;
 	_dcmi_dma_enable();
 }
 
 /**
- * @brief Interrupt handler of DCMI DMA stream
+ * @brief Row sums of the region over one half of the frame, the DMA fills the other one meanwhile
+ */
+static void _profile_half(uint8_t half)
+{
+	spectrum_profile_t * const profile = &_profiles[_profile_fill];
+	const uint16_t top = half * SPECTRUM_HALF_ROWS;
+	uint16_t y_start = _frame_region.y_start, y_end = _frame_region.y_end;
+
+	if(y_start < top)
+		y_start = top;
+	if(y_end > top + SPECTRUM_HALF_ROWS)
+		y_end = top + SPECTRUM_HALF_ROWS;
+	if(y_start >= y_end)
+		return;
+
+	intensity_rows(spectrum_image_buffer_8bit + (uint32_t)y_start * FULL_IMAGE_ROW_SIZE * 2, FULL_IMAGE_ROW_SIZE * 2,
+			_frame_region.x_start, _frame_region.x_end, y_end - y_start, profile->intensities + (y_start - _frame_region.y_start));
+}
+
+/**
+ * @brief Interrupt handler of DCMI DMA stream. Each half of the frame is summed as soon as it is in
  */
 void DMA2_Stream1_IRQHandler(void)
 {
-	/* transfer completed - we've received a frame!*/
-	if (DMA2->LISR & DMA_LISR_TCIF1)
+	if (!(DMA2->LISR & DMA_LISR_TCIF1))
+		return;
+
+	DMA2->LIFCR |= DMA_LIFCR_CTCIF1;
+
+	/* CT already points to the half being filled now */
+	if (DMA2_Stream1->CR & DMA_SxCR_CT)
+	{
+		_frame_region = _region;
+		if(_frame_region.x_end > CCU_SPECTRUM_WIDTH)
+			_frame_region.x_end = CCU_SPECTRUM_WIDTH;
+		if(_frame_region.y_end > CCU_SPECTRUM_HEIGHT)
+			_frame_region.y_end = CCU_SPECTRUM_HEIGHT;
+
+		_profile_half(0);
+		_top_done = true;
+		return;
+	}
+
+	/* we've received a frame! */
+	spectrum_frame_counter++;
+	if(!_top_done)
+		return; //after a resync
+
+	_top_done = false;
+	_profile_half(1);
+
+	spectrum_profile_t * const profile = &_profiles[_profile_fill];
+	profile->frame = spectrum_frame_counter;
+	profile->time_boot_ms = HAL_GetTick();
+	profile->y_start = _frame_region.y_start;
+	profile->count = _frame_region.y_start < _frame_region.y_end ? _frame_region.y_end - _frame_region.y_start : 0;
+
+	/* the one being sent stays as it is, this one will be filled again */
+	if(_profile_held)
+		spectrum_profiles_dropped++;
+	else
+	{
+		_profile_fill = _profile_ready;
+		_profile_ready ^= 1;
+	}
+
+	/* vertical blanking, the DMA has written nothing of the next frame yet */
+	if(_freeze && spectrum_frame_counter > _freeze_after)
 	{
-		DMA2->LIFCR |= DMA_LIFCR_CTCIF1;
-		spectrum_frame_counter++;
 		_dcmi_dma_disable();
+		_frozen = true;
 	}
 }
 
+/**
+ * @brief Frame end. The DMA should be at the top of the buffer again, it is not after a DCMI overrun
+ */
+void DCMI_IRQHandler(void)
+{
+	if (!(DCMI->MISR & DCMI_MISR_FRAME_MIS))
+		return;
+
+	DCMI->ICR = DCMI_ICR_FRAME_ISC;
+
+	const uint32_t ndtr = DMA2_Stream1->NDTR;
+	const bool bottom = DMA2_Stream1->CR & DMA_SxCR_CT;
+
+	/* the last word may still be on its way */
+	if((!bottom && ndtr == SPECTRUM_HALF_WORDS) || (bottom && ndtr <= 1))
+		return;
+
+	if(!(DMA2_Stream1->CR & DMA_SxCR_EN))
+		return;
+
+	spectrum_resyncs++;
+	_top_done = false;
+	_dcmi_dma_disable();
+	_dcmi_dma_enable();
+}
+
 uint32_t spectrum_get_frame_counter(void){
 	return spectrum_frame_counter;
 }
 
 /**
- * @brief Send spectrum image with MAVLINK over USART2
- *
- * @param image_buffer_fast_1 Image buffer in fast RAM
- * @param image_buffer_fast_2 Image buffer in fast RAM
+ * @brief Data message seq of the picture, can_bulk_packet_t
  */
-void spectrum_send_photo() {
+static void _photo_packet(uint16_t seq, mavlink_message_t * msg)
+{
+	mavlink_encapsulated_data_t encdata = { .seqnr = seq };
+	uint32_t offset = (uint32_t)seq * MAVLINK_MSG_ENCAPSULATED_DATA_FIELD_DATA_LEN;
 
-	mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1; //We do it there, cause channel status is a static variable, thus not system-wide
+	memcpy(encdata.data, spectrum_image_buffer_8bit + offset, MIN(MAVLINK_MSG_ENCAPSULATED_DATA_FIELD_DATA_LEN, FULL_IMAGE_SIZE * 4 - offset));
+	mavlink_msg_encapsulated_data_encode(0, ZIKUSH_CCU, msg, &encdata);
+}
+
+/**
+ * @brief Data message seq of the spectrum, can_bulk_packet_t
+ */
+static void _spectrum_packet(uint16_t seq, mavlink_message_t * msg)
+{
+	mavlink_zikush_spectrum_intensity_encapsulated_data_t encdata = { .seqnr = seq };
+	uint16_t offset = seq * MAVLINK_MSG_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA_FIELD_DATA_LEN;
+
+	memcpy(encdata.data, _profile_sending->intensities + offset,
+			MIN(MAVLINK_MSG_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA_FIELD_DATA_LEN, _profile_sending->count - offset) * sizeof(uint16_t));
+	mavlink_msg_zikush_spectrum_intensity_encapsulated_data_encode(0, ZIKUSH_CCU, msg, &encdata);
+}
+
+/**
+ * @brief Send spectrum image with MAVLINK, over CAN with CCU_BULK_OVER_CAN, over USART2 otherwise
+ */
+void spectrum_send_photo() {
 
 	/*  transmit raw 8-bit image */
 	/* TODO image is too large for this transmission protocol (too much packets), but it works */
@@ -149,117 +330,111 @@ void spectrum_send_photo() {
 		.time_boot_ms = HAL_GetTick(),
 	};
 
-	mavlink_encapsulated_data_t encdata = {};
-	mavlink_message_t msg;
+	mavlink_message_t headers[2];
 
 
 	/*We send both data_transmission_handshake and zikush_picture_header so it can be received by spectrum_viewer,
 	 * 	QGriund control and Grain MCC
 	 */
-	mavlink_msg_data_transmission_handshake_encode(0, ZIKUSH_CCU, &msg, &handshake);
-	usart2_mavlink_transmit(&msg);
-#ifdef CCU_TESTMODE
-	usart3_mavlink_transmit(&msg);
-#endif
+	mavlink_msg_data_transmission_handshake_encode(0, ZIKUSH_CCU, &headers[0], &handshake);
+	mavlink_msg_zikush_picture_header_encode(0, ZIKUSH_CCU, &headers[1], &picture_header);
+
+#if CCU_BULK_OVER_CAN
+	// The ICU paces it and asks for lost packets again
+	can_bulk_transfer(headers, 2, MAVLINK_MSG_ID_ENCAPSULATED_DATA, handshake.packets, _photo_packet);
+#else
+	mavlink_message_t msg;
 
-	mavlink_msg_zikush_picture_header_encode(0, ZIKUSH_CCU, &msg, &picture_header);
-	usart2_mavlink_transmit(&msg);
+	for(int i = 0; i < 2; i++)
+	{
+		usart2_mavlink_transmit(&headers[i]);
 #ifdef CCU_TESTMODE
-	usart3_mavlink_transmit(&msg);
+		usart3_mavlink_transmit(&headers[i]);
 #endif
+	}
 
-	uint16_t frame = 0;
-	uint8_t * frame_buffer = encdata.data;
-
-	for(uint32_t i = 0; i < (FULL_IMAGE_SIZE * 4); i += MAVLINK_MSG_ENCAPSULATED_DATA_FIELD_DATA_LEN)
+	// No pause between packets: usart2_mavlink_transmit() waits for room in the TX ring, so the line paces it
+	for(uint16_t frame = 0; frame < handshake.packets; frame++)
 	{
-		int copylen = MIN(MAVLINK_MSG_ENCAPSULATED_DATA_FIELD_DATA_LEN, FULL_IMAGE_SIZE - i);
-		memcpy(frame_buffer, spectrum_image_buffer_8bit + i, copylen);
-
-		encdata.seqnr = frame;
-		mavlink_msg_encapsulated_data_encode(0, ZIKUSH_CCU, &msg, &encdata);
+		_photo_packet(frame, &msg);
 		usart2_mavlink_transmit(&msg);
 #ifdef CCU_TESTMODE
 		usart3_mavlink_transmit(&msg);
 #endif
-		HAL_Delay(70);
-
-		frame++;
 	}
+#endif
 }
 
 /**
- * @brief Send spectrum data with MAVLINK over USART2
- *
- * @param image_buffer_fast_1 Image buffer in fast RAM
- * @param image_buffer_fast_2 Image buffer in fast RAM
+ * @brief Send spectrum data with MAVLINK, over CAN with CCU_SPECTRUM_OVER_CAN, over USART2 otherwise.
+ * Intensities are row sums saturated at UINT16_MAX, an acquired profile stays as it is, so a lost packet could be built again
  */
-void spectrum_send_data(uint16_t y_start, uint16_t y_end, uint16_t x_start, uint16_t x_end)
+void spectrum_send_data(const spectrum_profile_t * profile)
 {
-	mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1; //We do it there, cause channel status is a static variable, thus not system-wide
+	if(0 == profile->count)
+		return;
+
+	_profile_sending = profile;
 
-	uint8_t * rowdata;
 	mavlink_zikush_spectrum_intensity_header_t spectrum_header = {
-		.size =	(y_end - y_start) * 2,
-		.packets = (y_end - y_start) / \
-					MAVLINK_MSG_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA_FIELD_DATA_LEN + 1, //FIXME correct ceiling?
-		.y_upleft_crop = y_start,
-		.time_boot_ms = HAL_GetTick()
-	};
-	mavlink_zikush_spectrum_intensity_encapsulated_data_t encdata = {
-			.seqnr = 0
+		.size =	profile->count * 2,
+		.packets = (profile->count + MAVLINK_MSG_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA_FIELD_DATA_LEN - 1) / \
+					MAVLINK_MSG_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA_FIELD_DATA_LEN,
+		.y_upleft_crop = profile->y_start,
+		.time_boot_ms = profile->time_boot_ms
 	};
-	mavlink_message_t msg;
+	mavlink_message_t header;
+
+
+	mavlink_msg_zikush_spectrum_intensity_header_encode(0, ZIKUSH_CCU, &header, &spectrum_header);
 
+#if CCU_SPECTRUM_OVER_CAN
+	can_bulk_transfer(&header, 1, MAVLINK_MSG_ID_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA, spectrum_header.packets, _spectrum_packet);
+#else
+	mavlink_message_t msg;
 
-	mavlink_msg_zikush_spectrum_intensity_header_encode(0, ZIKUSH_CCU, &msg, &spectrum_header);
-	usart2_mavlink_transmit(&msg);
+	usart2_mavlink_transmit(&header);
 #ifdef CCU_TESTMODE
-	usart3_mavlink_transmit(&msg);
+	usart3_mavlink_transmit(&header);
 #endif
 
-
-	//iterating over rows
-	for(int row = y_start; row < y_end; row++)
+	for(uint16_t seq = 0; seq < spectrum_header.packets; seq++)
 	{
-		int relrow = row - y_start;
-		rowdata = spectrum_image_buffer_8bit + (FULL_IMAGE_ROW_SIZE * 2 * row);
-
-
-		encdata.data[relrow % MAVLINK_MSG_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA_FIELD_DATA_LEN] = 0;
-		for(int col = x_start; col < x_end; col++)
-		{
-			encdata.data[relrow % MAVLINK_MSG_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA_FIELD_DATA_LEN] += rowdata[col];
-		}
-
-		//send packet if it's full or if it is the last row
-		if( ( (relrow + 1) % MAVLINK_MSG_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA_FIELD_DATA_LEN == 0 && row != 0) \
-				|| row == (y_end - 1))
-		{
-			mavlink_msg_zikush_spectrum_intensity_encapsulated_data_encode(0, ZIKUSH_CCU, &msg, &encdata);
-			usart2_mavlink_transmit(&msg);
+		_spectrum_packet(seq, &msg);
+		usart2_mavlink_transmit(&msg);
 #ifdef CCU_TESTMODE
-			usart3_mavlink_transmit(&msg);
+		usart3_mavlink_transmit(&msg);
 #endif
-
-			HAL_Delay(100);
-
-			encdata.seqnr++;
-		}
 	}
+#endif
 }
 
+/**
+ * @brief Photo and spectrum of a frame taken after the request, capture goes on while they are sent
+ */
 void spectrum_take(bool sendphoto, uint16_t y_start, uint16_t y_end, uint16_t x_start, uint16_t x_end)
 {
-	spectrum_restart_calibration_routine();
+	const spectrum_profile_t * profile;
 
-	/* waiting for all parts */
-	while(spectrum_get_frame_counter() < 1){}
+	spectrum_set_region(y_start, y_end, x_start, x_end);
+
+	/* the frame coming in now could have begun with the previous region */
+	const uint32_t after = spectrum_get_frame_counter() + 1;
 
 	if(sendphoto)
+	{
+		spectrum_freeze(after);
+		profile = spectrum_profile_acquire(after); //of the frozen frame
 		spectrum_send_photo();
+		spectrum_resume();
+	}
+	else
+	{
+		while(NULL == (profile = spectrum_profile_acquire(after))){}
+	}
 
-	spectrum_send_data(y_start, y_end, x_start, x_end);
+	spectrum_send_data(profile);
+	spectrum_profile_release();
 }
 
 /**
@@ -267,20 +442,27 @@ void spectrum_take(bool sendphoto, uint16_t y_start, uint16_t y_end, uint16_t x_
  */
 static void _dcmi_dma_enable(void)
 {
-	/* Enable DMA2 stream 1 and DCMI interface then start image capture */
-	HAL_DMA_Start(&hdma, DCMI_DR_ADDRESS, spectrum_image_buffer_8bit, buffer_size);
+	/* Enable DMA2 stream 1 in double-buffer mode from the top half and DCMI interface then start image capture */
+	DMA2_Stream1->CR &= ~DMA_SxCR_CT;
+	HAL_DMAEx_MultiBufferStart(&hdma, DCMI_DR_ADDRESS, (uint32_t)spectrum_image_buffer_8bit,
+			(uint32_t)(spectrum_image_buffer_8bit + SPECTRUM_HALF_ROWS * CCU_SPECTRUM_WIDTH), SPECTRUM_HALF_WORDS);
 
 	DCMI->CR &= ~(DCMI_CR_CM);
 	DCMI->CR |= (DCMI_MODE_CONTINUOUS);
 	DCMI->CR |= DCMI_CR_ENABLE;
 	DCMI->CR |= DCMI_CR_CAPTURE;
 
-	/* Enable the DMA global Interrupt */
+	/* Enable the DMA global Interrupt and the frame end one of DCMI */
 	HAL_NVIC_SetPriority(DMA2_Stream1_IRQn, CCU_DMA_IRQ_PRIO, 0);
 	HAL_NVIC_EnableIRQ(DMA2_Stream1_IRQn);
 
-	// Enable HT and TC interrupts
-	DMA2_Stream1->CR |= DMA_SxCR_HTIE | DMA_SxCR_TCIE;
+	DCMI->ICR = DCMI_ICR_FRAME_ISC;
+	DCMI->IER |= DCMI_IER_FRAME_IE;
+	HAL_NVIC_SetPriority(DCMI_IRQn, CCU_DMA_IRQ_PRIO, 0);
+	HAL_NVIC_EnableIRQ(DCMI_IRQn);
+
+	// Enable TC interrupt, it comes at the end of each half
+	DMA2_Stream1->CR |= DMA_SxCR_TCIE;
 
 	/*uint32_t dmadump[] = {DMA2_Stream1->CR, DMA2_Stream1->NDTR, DMA2_Stream1->PAR, DMA2_Stream1->M0AR, DMA2_Stream1->M1AR, DMA2_Stream1->FCR};
 	usart3_tx_ringbuffer_push(dmadump, 24);
@@ -295,6 +477,8 @@ static void _dcmi_dma_enable(void)
 static void _dcmi_dma_disable(void)
 {
 	HAL_NVIC_DisableIRQ(DMA2_Stream1_IRQn);
+	HAL_NVIC_DisableIRQ(DCMI_IRQn);
+	DCMI->IER &= ~DCMI_IER_FRAME_IE;
 
 	/* Disable DMA2 stream 1 and DCMI interface then stop image capture */
 	HAL_DMA_Abort(&hdma);
@@ -358,11 +542,10 @@ static void _dcmi_clock_init(void)
  */
 static void _dcmi_hw_init(void)
 {
-	uint16_t image_size = FULL_IMAGE_ROW_SIZE * FULL_IMAGE_COLUMN_SIZE * 4;
 	GPIO_InitTypeDef gpio_init;
 
 	/* Reset image buffers */
-	memset(spectrum_image_buffer_8bit, 0, image_size);
+	memset(spectrum_image_buffer_8bit, 0, sizeof(spectrum_image_buffer_8bit));
 
 	/*** Configures the DCMI GPIOs to interface with the OV2640 camera module ***/
 	/* Enable DCMI GPIOs clocks */
@@ -3,6 +3,9 @@
  *
  *  Created on: 5 мая 2019 г.
  *      Author: snork
+ *
+ *  Драйвер не блокируется: байты из уарта и ход времени подаются снаружи (ir9602_feed, ir9602_tick),
+ *  сеанс идет по состояниям и по окончанию отдает IR9602_EVT_SESSION в хук.
  */
 
 #include "ir9602.h"
@@ -11,6 +14,9 @@
 #include <assert.h>
 #include <errno.h>
 
+//! Сколько ждать строк, которые модем мог успеть выдать до начала SBDRB (мс)
+#define IR9602_SBDRB_FLUSH_TIME (100)
+
 
 //! Контрольная сумма для протокола SBD
 static uint16_t _sbd_checksum(const void * data_, int datasize)
@@ -24,120 +30,38 @@ static uint16_t _sbd_checksum(const void * data_, int datasize)
 }
 
 
-static uint16_t _swap_endian(uint16_t value)
-{
-	return (value >> 8) | (value << 8);
-}
-
-
 // ================================================================
 // ================================================================
 
 
-static int _send_cmd(ir9602_t * device, const ir9602_cmd_t * command)
+static int _send_str(ir9602_t * device, const char * str)
 {
-	int len = ir9602_serialize_command(device->cmdevt_buffer, IR9602_CMDEVT_BUFFER_SIZE, command);
-	if (len <= 0)
-		return len;
-
-	const char * carret = device->cmdevt_buffer;
-	while(*carret)
+	while (*str)
 	{
-		const uint8_t ch = *(uint8_t*)(carret++);
-		int rc = device->putch(device->user_arg, ch);
+		int rc = device->putch(device->user_arg, *(const uint8_t*)(str++));
 		if (rc < 0)
 			return rc;
 	}
 
-	return len;
-}
-
-
-static int _read_event(ir9602_t * device, ir9602_evt_t * evt, bool should_block)
-{
-	int carret = 0;
-	uint8_t * const buffer = (uint8_t*)device->cmdevt_buffer;
-
-	while (1)
-	{
-		// Если наш буфер переполнен
-		if (carret >= IR9602_CMDEVT_BUFFER_SIZE)
-			return -EOVERFLOW;
-
-		// Есть чего?
-		int character = device->getch(device->user_arg, should_block);
-		if (character < 0)
-			return character;
-
-		// окей, это символ, а не ошибка - акумулируем его
-		buffer[carret] = (uint8_t)(character & 0xFF);
-		carret++;
-
-		if (carret < 2)
-			continue;	// если у нас нет и двух символов - строки у нас точно нет
-
-		if (buffer[carret-2] == '\r' && buffer[carret-1] == '\n')
-		{
-			// Модем имеет дурную привычку часто скидывать пустые \r\n без ничего кроме
-			// Будем их игнорить
-			if (2 == carret)
-				carret = 0;
-			else
-				break; // Если не пустой \r\n - то нужно обрабатывать
-		}
-	}
-
-	// Если мы дошли до сюда, значит мы накопили строку!
-
-	// Тут же её терминируем
-	// Если буфер не станет переполнен
-	if (carret >= IR9602_CMDEVT_BUFFER_SIZE)
-		return -EOVERFLOW;
-
-	buffer[carret] = '\0';
-
-	// Парсим пришедшее событие
-	const bool parsed = ir9602_probe_events((char*)buffer, evt);
-
-	if (!parsed)
-		return -EBADMSG; 	// Это какая-то неожиданная дичь
-
-	// Все ок! Передаем пользовательскому хуку (если он конечно у нас есть)
-	if (device->evt_hook != NULL)
-		device->evt_hook(device->user_arg, evt);
-
 	return 0;
 }
 
 
-static int _wait_for_events(ir9602_t * device, const ir9602_evt_code_t * expected_events,
-		ir9602_evt_t * evt
-)
+static int _send_cmd(ir9602_t * device, const ir9602_cmd_t * command)
 {
-	int rcved_event_counter = 0;
-	int rc;
-again:
-	rc = _read_event(device, evt, true);
-	if (rc < 0)
-		return rc;
+	// Буфер дескриптора занят под строку, которую модем может присылать прямо сейчас
+	char buffer[IR9602_CMDEVT_BUFFER_SIZE];
 
-	rcved_event_counter++;
-	const ir9602_evt_code_t * expected_events_carret = expected_events;
-	for (; *expected_events_carret != 0; expected_events_carret++)
-	{
-		if (*expected_events_carret == evt->code)
-			return rcved_event_counter;
-	}
+	int len = ir9602_serialize_command(buffer, sizeof(buffer), command);
+	if (len <= 0)
+		return len;
 
-	goto again;
+	return _send_str(device, buffer);
 }
 
+
 static int _send_mo_data(ir9602_t * device, const uint8_t * data, int datasize)
 {
-	// проверяем что у нас все влезает с размером и контрольной суммой
-	if (datasize > IR9602_MO_MSG_MAX_SIZE)
-		return -EOVERFLOW;
-
 	// отправляем сообщение
 	for (int i = 0; i < datasize; i++)
 	{
@@ -146,290 +70,362 @@ static int _send_mo_data(ir9602_t * device, const uint8_t * data, int datasize)
 			return rc;
 	}
 
-	// считаем и отправляем контрольную сумму
-	uint16_t checksum_word = _swap_endian(_sbd_checksum(data, datasize));
-	const uint8_t * ptr = (uint8_t*)&checksum_word;
-	for (int i = 0; i < sizeof(checksum_word); i++)
-	{
-		int rc = device->putch(device->user_arg, ptr[i]);
-		if (rc < 0)
-			return rc;
-	}
+	// считаем и отправляем контрольную сумму, старшим байтом вперед
+	uint16_t checksum = _sbd_checksum(data, datasize);
+	int rc = device->putch(device->user_arg, checksum >> 8);
+	if (rc < 0)
+		return rc;
 
-	return 0;
+	return device->putch(device->user_arg, checksum & 0xFF);
 }
 
 
-static int _read_blob(ir9602_t * device, void * buffer, int buffer_size, bool should_block)
+static void _enter(ir9602_t * device, ir9602_state_t state, uint32_t now, uint32_t timeout)
 {
-	uint8_t * const u8_buffer = (uint8_t *)buffer;
-	for (int i = 0; i < buffer_size; i++)
-	{
-		int rc = device->getch(device->user_arg, should_block);
-		if (rc < 0)
-		{
-			if (!should_block && -EWOULDBLOCK == rc)
-				return i;
-			else
-				return rc;
-		}
+	device->state = state;
+	device->deadline = now + timeout;
+}
 
-		u8_buffer[i] = (uint8_t)(rc & 0xFF);
-	}
 
-	return buffer_size;
-}
+//! Сеанс закончен, что бы там ни было
+static void _finish(ir9602_t * device, int rc)
+{
+	device->state = IR9602_STATE_IDLE;
+	device->session.rc = rc;
 
+	if (device->evt_hook != NULL)
+	{
+		ir9602_evt_t evt = { .code = IR9602_EVT_SESSION, .arg = { .session = device->session } };
+		device->evt_hook(device->user_arg, &evt);
+	}
+}
 
-// ===========================================================================
-// ===========================================================================
 
-void ir9602_init(ir9602_t * device, void * user_arg,
-		ir9602_uart_getch_t getch, ir9602_uart_putch_t putch,
-		ir9602_evt_hook_t evt_hook
-)
+//! Чтение MT сообщения не удалось, но сам сеанс прошел
+static void _finish_mt(ir9602_t * device, int mt_rc)
 {
-	device->getch = getch;
-	device->putch = putch;
-	device->user_arg = user_arg;
-	device->evt_hook = evt_hook;
-	device->cmdevt_buffer[0] = 0;
+	device->session.mt_size = mt_rc;
+	_finish(device, 0);
 }
 
 
-int ir9602_flush_events(ir9602_t * device, ir9602_evt_t * evt_buff)
+static void _start_sbdi(ir9602_t * device, uint32_t now)
 {
-	int rcved_event_counter = 0;
-	int rc;
-again:
-	rc = _read_event(device, evt_buff, false);
+	ir9602_cmd_t cmd = { .code = IR9602_CMD_SBDI };
 
-	if (-EWOULDBLOCK == rc)
-		return rcved_event_counter; // нас наконец-то сблочило
-
-	if (rc != -EOVERFLOW && rc != -EBADMSG)
+	int rc = _send_cmd(device, &cmd);
+	if (rc < 0)
 	{
-		// Произошло что-то более страшное, чем ошибка в разборе эвента
-		// это уже не к нам
-		return rc;
+		_finish(device, rc);
+		return;
 	}
 
-	rcved_event_counter++;
-
-	goto again;
+	_enter(device, IR9602_STATE_SBDI, now, IR9602_SBDI_TIMEOUT);
 }
 
 
-int ir9602_sbdwb(ir9602_t * device, const void * data, int data_size, ir9602_evt_errcode_t * err_evt)
+static void _start_sbdrb(ir9602_t * device, uint32_t now)
 {
-	int rc;
+	// Действуем тонко.
+	// Сперва засылаем модему команду SBDRB, но не шлем \r\n
+	// Эксперименты показали, что модем молчит, если кто-то начал отправлять
+	// ему команду, но еще не отправил \r\n. То что он успел выдать до этого дочитаем как строки,
+	// а \r\n пошлем по ir9602_tick()
+	int rc = _send_str(device, "AT+SBDRB");
+	if (rc < 0)
+	{
+		_finish_mt(device, rc);
+		return;
+	}
 
-	// Готовим команду и отправляем
-	ir9602_cmd_t cmd = {
-			.code = IR9602_CMD_SBDWB,
-			.arg = { .sbdwb = { .message_length = data_size }}
-	};
-	rc = _send_cmd(device, &cmd);
-	if (rc < 0 )
-		return rc;
+	_enter(device, IR9602_STATE_SBDRB_FLUSH, now, IR9602_SBDRB_FLUSH_TIME);
+}
 
-	// ждем события READY или кода ошибки, если что-то не так
-	ir9602_evt_code_t expected_events[] = {
-			IR9602_EVT_READY,
-			IR9602_EVT_ERROR,
-			IR9602_EVT_ERRCODE,
-			0
-	};
 
-	ir9602_evt_t evt;
-	rc = _wait_for_events(device, expected_events, &evt);
-	if (rc < 0)
-		return rc;
+//! Ход сеанса по событиям модема
+static void _on_event(ir9602_t * device, const ir9602_evt_t * evt, uint32_t now)
+{
+	int rc;
 
-	// Мы должны были получить READY
-	switch (evt.code)
+	switch (device->state)
 	{
-	// Если это вот прям сразу ошибка - возвращаем ошибку
-	case IR9602_EVT_ERRCODE:
-		if (err_evt != NULL)
-			*err_evt = evt.arg.errcode;
-
-		return evt.arg.errcode.code;
-		break;
+	case IR9602_STATE_SBDD:
+		// Код результата, потом OK, который не нужен
+		if (IR9602_EVT_ERRCODE == evt->code)
+		{
+			if (evt->arg.errcode.code != IR9602_EVT_SBDDERR_OK)
+			{
+				_finish(device, -EIO);
+				return;
+			}
 
-	case IR9602_EVT_ERROR:
-		return -EINVAL;
+			_start_sbdi(device, now);
+		}
+		else if (IR9602_EVT_ERROR == evt->code)
+			_finish(device, -EINVAL);
 		break;
 
-	// если это READY, то продолжаем
-	case IR9602_EVT_READY:
+	case IR9602_STATE_SBDWB_READY:
+		if (IR9602_EVT_READY == evt->code)
+		{
+			rc = _send_mo_data(device, device->mo, device->mo_size);
+			if (rc < 0)
+			{
+				_finish(device, rc);
+				return;
+			}
+
+			_enter(device, IR9602_STATE_SBDWB_RESULT, now, IR9602_CMD_TIMEOUT);
+		}
+		else if (IR9602_EVT_ERRCODE == evt->code)
+			_finish(device, evt->arg.errcode.code);
+		else if (IR9602_EVT_ERROR == evt->code)
+			_finish(device, -EINVAL);
 		break;
 
-	// если это черт знает что такое - возвращаем соответствующую ошибку
-	default:
-		return -EBADMSG;
+	case IR9602_STATE_SBDWB_RESULT:
+		if (IR9602_EVT_ERRCODE == evt->code)
+		{
+			if (evt->arg.errcode.code != IR9602_EVT_SBDWBERR_OK)
+			{
+				_finish(device, evt->arg.errcode.code);
+				return;
+			}
+
+			device->session.mo_written = true;
+			_start_sbdi(device, now);
+		}
+		else if (IR9602_EVT_ERROR == evt->code)
+			_finish(device, -EINVAL);
 		break;
-	};
 
-	// Окей! мы получили реди - продолжаем
-	rc = _send_mo_data(device, data, data_size);
-	if (rc < 0)
-		return rc;
-
-	// Теперь ждем код ошибки (и только его)
-	// Делаем хитрый хак и используем тот же самый массив-список
-	rc = _wait_for_events(device, expected_events+2, &evt);
-	if (rc < 0)
-		return rc;
-
-	if (IR9602_EVT_ERRCODE != evt.code)
-		return -EBADMSG;
+	case IR9602_STATE_SBDI:
+		if (IR9602_EVT_SBDI == evt->code)
+		{
+			device->session.sbdi = evt->arg.sbdi;
 
-	if (err_evt != NULL)
-		*err_evt = evt.arg.errcode;
+			if (IR9602_EVT_SBDMSTATUS_YES == evt->arg.sbdi.mt_status && device->mt != NULL)
+				_start_sbdrb(device, now);
+			else
+				_finish(device, 0);
+		}
+		else if (IR9602_EVT_ERROR == evt->code)
+			_finish(device, -EINVAL);
+		break;
 
-	// Там еще должен быть OK от модема (наверное)
-	// но мы его проигнорируем
-	return evt.arg.errcode.code; // Если все ок - должно вернуть нолик
+	default:
+		// Остальное модем шлет сам по себе, это дело хука
+		break;
+	}
 }
 
 
-int ir9602_sbdi(ir9602_t * device, ir9602_evt_sbdi_t * evt_sbdi)
+//! Байт бинарного ответа SBDRB. Возвращает false, если это не он
+static bool _feed_blob(ir9602_t * device, uint8_t byte)
 {
-	int rc;
+	switch (device->state)
+	{
+	case IR9602_STATE_SBDRB_LEN:
+		device->blob_len = device->blob_len << 8 | byte;
+		if (++device->blob_carret < 2)
+			break;
 
-	// Прям вот так сходу берем и отправляем команду. Чего ждать то
-	ir9602_cmd_t cmd;
-	cmd.code = IR9602_CMD_SBDI;
-	rc = _send_cmd(device, &cmd);
-	if (rc < 0)
-		return rc;
+		device->blob_carret = 0;
+		device->state = device->blob_len ? IR9602_STATE_SBDRB_DATA : IR9602_STATE_SBDRB_SUM;
+		break;
 
-	ir9602_evt_code_t expected_events[] = {
-			IR9602_EVT_ERROR,
-			IR9602_EVT_SBDI,
-			0
-	};
+	case IR9602_STATE_SBDRB_DATA:
+		// Что не влезает, все равно вычитываем, чтобы не принять за строки
+		if (device->blob_carret < device->mt_buffer_size)
+			device->mt[device->blob_carret] = byte;
 
-	ir9602_evt_t evt;
-	rc = _wait_for_events(device, expected_events, &evt);
-	switch (evt.code)
-	{
-	case IR9602_EVT_ERROR:
-		return -EINVAL;
+		device->blob_sum += byte;
+		if (++device->blob_carret < device->blob_len)
+			break;
+
+		device->blob_carret = 0;
+		device->state = IR9602_STATE_SBDRB_SUM;
 		break;
 
-	case IR9602_EVT_SBDI:
-		if (evt_sbdi)
-			*evt_sbdi = evt.arg.sbdi;
+	case IR9602_STATE_SBDRB_SUM:
+		device->blob_rxsum = device->blob_rxsum << 8 | byte;
+		if (++device->blob_carret < 2)
+			break;
+
+		if (device->blob_len > device->mt_buffer_size)
+			_finish_mt(device, -EMSGSIZE);
+		else if (device->blob_rxsum != device->blob_sum)
+			_finish_mt(device, -EBADMSG);	// Не совпало - ну значит не совпало
+		else
+			_finish_mt(device, device->blob_len);
 		break;
 
 	default:
-		return -EBADMSG;
-		break;
-	};
+		return false;
+	}
 
-	return 0;
+	return true;
 }
 
 
-int ir9602_sbdrb(ir9602_t * device, void * buffer, int buffer_size)
+// ===========================================================================
+// ===========================================================================
+
+void ir9602_init(ir9602_t * device, void * user_arg,
+		ir9602_uart_putch_t putch, ir9602_evt_hook_t evt_hook
+)
+{
+	memset(device, 0, sizeof(*device));
+	device->putch = putch;
+	device->user_arg = user_arg;
+	device->evt_hook = evt_hook;
+	device->state = IR9602_STATE_IDLE;
+}
+
+
+int ir9602_session_start(ir9602_t * device, const void * mo, int mo_size, void * mt, int mt_buffer_size, uint32_t now)
 {
 	int rc;
 
-	// Действуем тонко.
-	// Сперва засылаем модему команду SBDRB, но не шлем \r\n
-	const char * cmd = "AT+SBDRB";
-	while (*cmd != 0)
+	if (ir9602_busy(device))
+		return -EBUSY;
+
+	// проверяем что у нас все влезает
+	if (mo_size > IR9602_MO_MSG_MAX_SIZE)
+		return -EOVERFLOW;
+
+	device->mo = (const uint8_t*)mo;
+	device->mo_size = mo_size;
+	device->mt = (uint8_t*)mt;
+	device->mt_buffer_size = mt_buffer_size;
+	device->session = (ir9602_evt_session_t){ 0 };
+
+	if (mo_size > 0)
 	{
-		rc = device->putch(device->user_arg, *cmd++);
+		// ждем события READY или кода ошибки, если что-то не так
+		ir9602_cmd_t cmd = {
+				.code = IR9602_CMD_SBDWB,
+				.arg = { .sbdwb = { .message_length = mo_size }}
+		};
+		rc = _send_cmd(device, &cmd);
 		if (rc < 0)
 			return rc;
-	}
-
-	// Теперь вычитываем из нашего RX буфера все все все что там лежит
-	// что модем мог успеть накидать до этих пор
-	// Эксперименты показали, что модем молчит, если кто-то начал отправлять
-	// ему команду, но еще не отправил \r\n
-	// поэтому считаем что лишнего он нам не накидает
-	ir9602_evt_t evt;
-	rc = ir9602_flush_events(device, &evt);
-	if (rc < 0 && rc != -EWOULDBLOCK)
-		return rc;
 
-	// Теперь засылаем \r\n
-	cmd = "\r\n";
-	while (*cmd != 0)
+		_enter(device, IR9602_STATE_SBDWB_READY, now, IR9602_CMD_TIMEOUT);
+	}
+	else
 	{
-		rc = device->putch(device->user_arg, *cmd++);
+		// Отправлять нечего - чистим MO буфер, иначе сессия отправит прошлое сообщение еще раз
+		ir9602_cmd_t cmd = {
+				.code = IR9602_CMD_SBDD,
+				.arg = { .sbdd = { .clear_type = IR9202_CMD_SBDD_CLEAR_MO }}
+		};
+		rc = _send_cmd(device, &cmd);
 		if (rc < 0)
 			return rc;
-	}
 
-	// Теперь вычитываем два байта - это длина сообщения
-	uint16_t msglen;
-	rc = _read_blob(device, &msglen, sizeof(msglen), true);
-	if (rc < 0)
-		return rc;
+		_enter(device, IR9602_STATE_SBDD, now, IR9602_CMD_TIMEOUT);
+	}
 
-	msglen = _swap_endian(msglen);
+	return 0;
+}
 
-	// в буфере место то хватит?
-	if (msglen > buffer_size)
-		return -EMSGSIZE;
 
-	// вычитываем тело сообщения
-	rc = _read_blob(device, buffer, msglen, true);
-	if (rc < 0)
-		return rc;
+int ir9602_indicators(ir9602_t * device, bool sigind, bool netavail)
+{
+	if (ir9602_busy(device))
+		return -EBUSY;
 
-	// вычитываем контрольную сумму
-	uint16_t chksum;
-	rc = _read_blob(device, &chksum, sizeof(chksum), true);
-	if (rc < 0)
-		return rc;
+	ir9602_cmd_t cmd = {
+			.code = IR9602_CMD_CIER,
+			.arg = { .cier = { .enable_signal_level_events = sigind, .enable_network_present_events = netavail }}
+	};
 
-	chksum = _swap_endian(chksum);
+	return _send_cmd(device, &cmd);
+}
 
-	// Не совпало - ну значит не совпало
-	if (chksum != _sbd_checksum(buffer, msglen))
-		return - EBADMSG;
 
-	// А совпало - так совпало!
-	return msglen;
+bool ir9602_busy(const ir9602_t * device)
+{
+	return device->state != IR9602_STATE_IDLE;
 }
 
 
-int ir9602_sbdtc(ir9602_t * device)
+void ir9602_feed(ir9602_t * device, uint8_t byte, uint32_t now)
 {
-	int rc;
+	if (_feed_blob(device, byte))
+		return;
 
-	// Готовим команду и отправляем
-	ir9602_cmd_t cmd = {
-			.code = IR9602_CMD_SBDTC,
-	};
-	rc = _send_cmd(device, &cmd);
-	if (rc < 0 )
-		return rc;
+	char * const buffer = device->cmdevt_buffer;
 
-	// ждем события READY или кода ошибки, если что-то не так
-	ir9602_evt_code_t expected_events[] = {
-			IR9602_EVT_SBDTC,
-			IR9602_EVT_ERROR,
-			0
-	};
+	// Если наш буфер переполнен - эту строку выкидываем (место под терминирующий ноль тоже нужно)
+	if (device->cmdevt_carret >= IR9602_CMDEVT_BUFFER_SIZE - 1)
+		device->cmdevt_carret = 0;
+
+	buffer[device->cmdevt_carret++] = byte;
+
+	const int carret = device->cmdevt_carret;
+	if (carret < 2 || buffer[carret-2] != '\r' || buffer[carret-1] != '\n')
+		return;
+
+	device->cmdevt_carret = 0;
+
+	// Модем имеет дурную привычку часто скидывать пустые \r\n без ничего кроме
+	// Будем их игнорить
+	if (2 == carret)
+		return;
 
+	buffer[carret] = '\0';
+
+	// Парсим пришедшее событие
 	ir9602_evt_t evt;
-	rc = _wait_for_events(device, expected_events+2, &evt);
-	if (rc < 0)
-		return rc;
+	if (!ir9602_probe_events(buffer, &evt))
+		return;	// Это какая-то неожиданная дичь
+
+	// Передаем пользовательскому хуку (если он конечно у нас есть)
+	if (device->evt_hook != NULL)
+		device->evt_hook(device->user_arg, &evt);
+
+	_on_event(device, &evt, now);
+}
+
+
+void ir9602_tick(ir9602_t * device, uint32_t now)
+{
+	if (IR9602_STATE_IDLE == device->state)
+		return;
+
+	if ((int32_t)(now - device->deadline) < 0)
+		return;
 
-	switch (evt.code)
+	switch (device->state)
 	{
-	default:
-	case IR9602_EVT_ERROR:
-		return -EBADMSG;
+	case IR9602_STATE_SBDRB_FLUSH:
+	{
+		// Все что модем успел накидать до команды уже вычитано - теперь засылаем \r\n
+		int rc = _send_str(device, "\r\n");
+		if (rc < 0)
+		{
+			_finish_mt(device, rc);
+			return;
+		}
+
+		device->blob_carret = 0;
+		device->blob_len = 0;
+		device->blob_sum = 0;
+		device->blob_rxsum = 0;
+		_enter(device, IR9602_STATE_SBDRB_LEN, now, IR9602_CMD_TIMEOUT);
+		break;
 	}
 
-	return evt.arg.sbdtc.size;
+	case IR9602_STATE_SBDRB_LEN:
+	case IR9602_STATE_SBDRB_DATA:
+	case IR9602_STATE_SBDRB_SUM:
+		_finish_mt(device, -ETIMEDOUT);
+		break;
+
+	default:
+		_finish(device, -ETIMEDOUT);
+		break;
+	}
 }
@@ -24,46 +24,93 @@
 //! Максимальный размер MT сообщения для 9602
 #define IR9602_MT_MSG_MAX_SIZE (279)
 
+//! Сколько ждать ответа на обычную команду (мс)
+#ifndef IR9602_CMD_TIMEOUT
+#define IR9602_CMD_TIMEOUT (5000)
+#endif
+
+//! Сколько ждать окончания SBD сессии (мс). Сама сессия идет секунд 20
+#ifndef IR9602_SBDI_TIMEOUT
+#define IR9602_SBDI_TIMEOUT (60000)
+#endif
 
-//! Указатель на функцию для чтения данных из уарта связанного с модемом
-/*! Функция читает ровно один байт, если может. Если не может - дает ошибку <0 */
-typedef int (*ir9602_uart_getch_t)(void * user_arg, bool block);
 
 //! Указатель на функцию для записи данных в уарт связанный с модемом
 /*! Функция пишет ровно один байт, если может. Если не может - дает ошибку <0 */
 typedef int (*ir9602_uart_putch_t)(void * user_arg, uint8_t byte);
 
 //! Пользовательский хук для обработки абсолютно любых событий, получаемых от модема
-/*! Можно использовать а можно и нет */
+/*! Сюда же приходит IR9602_EVT_SESSION по окончанию сеанса */
 typedef void (*ir9602_evt_hook_t)(void * user_arg, const ir9602_evt_t * event);
 
 
+//! Состояние автомата сеанса
+typedef enum
+{
+	IR9602_STATE_IDLE = 0,
+	//! Ждем очистки MO буфера (когда отправлять нечего)
+	IR9602_STATE_SBDD,
+	//! Ждем READY на SBDWB
+	IR9602_STATE_SBDWB_READY,
+	//! Данные отправлены, ждем кода результата
+	IR9602_STATE_SBDWB_RESULT,
+	//! Идет сессия
+	IR9602_STATE_SBDI,
+	//! Команда SBDRB начата без перевода строки, дочитываем строки которые модем успел выдать
+	IR9602_STATE_SBDRB_FLUSH,
+	//! Бинарный ответ SBDRB: длина, тело, контрольная сумма
+	IR9602_STATE_SBDRB_LEN,
+	IR9602_STATE_SBDRB_DATA,
+	IR9602_STATE_SBDRB_SUM,
+} ir9602_state_t;
+
+
 //! Дескриптор устройства 9602
 typedef struct
 {
 	void * user_arg;
-	ir9602_uart_getch_t getch;
 	ir9602_uart_putch_t putch;
 	ir9602_evt_hook_t evt_hook;
 	char cmdevt_buffer[IR9602_CMDEVT_BUFFER_SIZE];
+	int cmdevt_carret;
+
+	ir9602_state_t state;
+	uint32_t deadline;		//! Когда текущее состояние таймаутнется (мс)
+
+	const uint8_t * mo;
+	int mo_size;
+	uint8_t * mt;
+	int mt_buffer_size;
+	uint16_t blob_carret;	//! Байт бинарного ответа принято
+	uint16_t blob_len;
+	uint16_t blob_sum;		//! Посчитанная
+	uint16_t blob_rxsum;	//! Присланная модемом
+
+	ir9602_evt_session_t session;
 } ir9602_t;
 
 
 //! Инициализация дескриптора модема
 /*! Настривает все поля дескриптора и больше ничего. */
 void ir9602_init(ir9602_t * device, void * user_arg,
-		ir9602_uart_getch_t getch, ir9602_uart_putch_t putch,
-		ir9602_evt_hook_t evt_hook
+		ir9602_uart_putch_t putch, ir9602_evt_hook_t evt_hook
 );
 
-int ir9602_flush_events(ir9602_t * device, ir9602_evt_t * evt_buff);
+//! Начинает сеанс: SBDWB (или очистка MO буфера, если mo_size = 0), SBDI и SBDRB, если что-то пришло
+/*! Буферы должны жить до IR9602_EVT_SESSION. Возвращает -EBUSY, если сеанс уже идет */
+int ir9602_session_start(ir9602_t * device, const void * mo, int mo_size, void * mt, int mt_buffer_size, uint32_t now);
 
-int ir9602_sbdwb(ir9602_t * device, const void * data, int data_size, ir9602_evt_errcode_t * err_evt);
+//! Включает или выключает отчеты CIEV об уровне сигнала и наличии сети
+/*! Только вне сеанса, иначе -EBUSY. Ответ OK ждать не нужно, а текущие значения модем присылает сразу */
+int ir9602_indicators(ir9602_t * device, bool sigind, bool netavail);
 
-int ir9602_sbdi(ir9602_t * device, ir9602_evt_sbdi_t * evt_sbdi);
+//! Идет ли сеанс
+bool ir9602_busy(const ir9602_t * device);
 
-int ir9602_sbdrb(ir9602_t * device, void * buffer, int buffer_size);
+//! Очередной байт из уарта
+void ir9602_feed(ir9602_t * device, uint8_t byte, uint32_t now);
 
-int ir9602_sbdtc(ir9602_t * device);
+//! Ход времени, для таймаутов. Звать почаще, раз в 100 мс хватит
+void ir9602_tick(ir9602_t * device, uint32_t now);
 
 #endif /* IR9602_H_ */
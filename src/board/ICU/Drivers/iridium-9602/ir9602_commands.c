@@ -40,9 +40,10 @@ static int _serialize_cier(char * buffer, int buffer_size, const ir9602_cmd_t *
 
 static int _serialize_sbdwb(char * buffer, int buffer_size, const ir9602_cmd_t * command)
 {
+	// Только \r: все, что придет после него, модем считает уже самим сообщением
 	const int rc = snprintf(
 			buffer, buffer_size,
-			"AT+SBDWB=%d\r\n",
+			"AT+SBDWB=%d\r",
 			(int)command->arg.sbdwb.message_length
 	);
 
@@ -85,7 +85,7 @@ typedef struct
 		struct
 		{
 			//! Длина отправляемого сообщения
-			uint8_t message_length;
+			uint16_t message_length;
 		} sbdwb;
 
 		struct
@@ -32,6 +32,8 @@ typedef enum
 	IR9602_EVT_SBDI,
 	//! Сообщение вида size=<size> о размере скопированного сообщения
 	IR9602_EVT_SBDTC,
+	//! Сеанс закончен. Его шлет сам драйвер, от модема такого не приходит
+	IR9602_EVT_SESSION,
 } ir9602_evt_code_t;
 
 
@@ -142,6 +144,19 @@ typedef struct
 	uint16_t size;
 } ir9602_evt_sbdtc_t;
 
+//! Итог сеанса
+typedef struct
+{
+	//! 0, отрицательный errno или код ошибки SBDWB
+	int rc;
+	//! В MO буфере модема были наши данные
+	bool mo_written;
+	//! Отчет о сессии, если до нее дошло
+	ir9602_evt_sbdi_t sbdi;
+	//! Длина прочитанного MT сообщения, 0 если ничего не пришло, <0 если прочитать не вышло
+	int mt_size;
+} ir9602_evt_session_t;
+
 // ===========================================================================
 // ===========================================================================
 // ===========================================================================
@@ -160,6 +175,7 @@ typedef struct
 		ir9602_evt_errcode_t errcode;
 		ir9602_evt_sbdi_t sbdi;
 		ir9602_evt_sbdtc_t sbdtc;
+		ir9602_evt_session_t session;
 	} arg;
 } ir9602_evt_t;
 
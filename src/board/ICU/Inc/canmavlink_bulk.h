@@ -0,0 +1 @@
+../../../common/mavlink/custom/canmavlink_bulk.h
\ No newline at end of file
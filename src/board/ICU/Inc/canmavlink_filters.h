@@ -0,0 +1 @@
+../../../common/mavlink/custom/canmavlink_filters.h
\ No newline at end of file
@@ -0,0 +1,66 @@
+/*
+ * 	Compact downlink encoding of telemetry
+ *
+ * 	A stream (compid, msgid) goes as keyframes, the whole payload, and deltas against the last keyframe known
+ * 	to have reached the ground. Integers are varints (zigzag for signed ones), a delta has a bitmap of the
+ * 	elements that changed and their differences. Floats go raw in keyframes and as differences of their bit
+ * 	patterns in deltas, which are small for close values. Fields are taken from the mavgen message info of
+ * 	zikush.xml, only for the messages listed in downlink.c, anything else goes as a plain MAVLink 1 frame.
+ *
+ * 	A keyframe goes every ICU_DOWNLINK_KEYFRAME_PERIOD messages of a stream and waits for its acknowledgment
+ * 	among the last ICU_DOWNLINK_KEYFRAMES_KEPT ones, by its number. Until the first one is acknowledged, the
+ * 	messages in between go plain.
+ *
+ * 	Frame:	STX | len | key:1 num:7 | compid | msgid | body[len] | crc16
+ * 	The crc is the MAVLink one, from len to the end of the body, with crc_extra of the message.
+ * 	The ground decoder is src/ground/grain-server/common/downlink.py
+ */
+
+#ifndef DOWNLINK_H_
+#define DOWNLINK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mavlink/zikush/mavlink.h>
+
+#include <zikush_config.h>
+
+#define DOWNLINK_STX		0xA5
+#define DOWNLINK_HEADER_LEN	5
+#define DOWNLINK_KEYFLAG	0x80
+
+// Keyframe encoded and not acknowledged yet. It may wait in the Iridium pool for several keyframe periods
+typedef struct {
+	bool valid;
+	uint8_t num;
+	uint8_t payload[ICU_DOWNLINK_PAYLOAD];
+} downlink_keyframe_t;
+
+typedef struct {
+	uint32_t msgid;
+	uint8_t compid;
+	bool used;
+	bool ref_valid;
+	uint8_t ref_num, last_num;		//keyframe numbers, 7 bits. last_num is of the last one encoded
+	uint8_t since_key;				//messages since a keyframe was encoded
+	uint8_t pending_next;			//slot of pending for the next keyframe, the oldest one
+	uint8_t ref[ICU_DOWNLINK_PAYLOAD];	//keyframe the ground has
+	downlink_keyframe_t pending[ICU_DOWNLINK_KEYFRAMES_KEPT];
+} downlink_stream_t;
+
+// State of one link
+typedef struct {
+	downlink_stream_t streams[ICU_DOWNLINK_STREAMS];
+} downlink_t;
+
+// Plain MAVLink frame. Returns its length, 0 if it is longer than size
+uint16_t downlink_plain(const mavlink_message_t * msg, uint8_t * buff, uint16_t size);
+
+// Compact frame if the message has a schema and a stream slot, plain otherwise. Returns length, 0 if nothing fits
+uint16_t downlink_encode(downlink_t * link, const mavlink_message_t * msg, uint8_t * buff, uint16_t size);
+
+// Frames in buff have reached the ground, the latest keyframe of a stream among them becomes its reference for deltas
+void downlink_ack(downlink_t * link, const uint8_t * buff, uint16_t len);
+
+#endif /* DOWNLINK_H_ */
@@ -0,0 +1,45 @@
+/*
+ * 	GNSS fix out of NMEA sentences
+ *
+ * 	A receiver sends a burst of sentences every epoch, each with a part of the solution: GGA the position,
+ * 	altitude and satellites, RMC and VTG the ground speed and course, GSA the fix type and DOPs, RMC and ZDA
+ * 	the date. They are put together into one HIL_GPS per epoch. An epoch ends when a sentence with another
+ * 	UTC time comes, or when the line goes quiet (gpsfix_flush). Whatever a receiver does not send is left
+ * 	unknown as MAVLink says.
+ */
+
+#ifndef GPSFIX_H_
+#define GPSFIX_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mavlink/zikush/mavlink.h>
+#include <minmea.h>
+
+typedef struct {
+	mavlink_hil_gps_t fix;		//epoch being put together
+	bool started;				//some sentence of it has come
+	bool timed;					//its UTC time is known
+	struct minmea_time time;
+	struct minmea_date date;	//the last one seen, kept over epochs
+	bool dated;
+	uint32_t boot_ms;			//when the epoch began, for the timestamp while there is no date
+	int gga_quality;			//-1 if no GGA
+	int gsa_fix;				//0 if no GSA
+
+	uint32_t epochs;
+	uint32_t sentences;
+	uint32_t rejected;			//failed to parse
+} gpsfix_t;
+
+void gpsfix_init(gpsfix_t * self);
+
+// Takes a sentence, boot_ms is the time it came. Returns true if it began a new epoch, the previous
+// one is then in *out
+bool gpsfix_feed(gpsfix_t * self, const char * sentence, uint32_t boot_ms, mavlink_hil_gps_t * out);
+
+// Ends the current epoch. False if nothing has come since the last one
+bool gpsfix_flush(gpsfix_t * self, mavlink_hil_gps_t * out);
+
+#endif /* GPSFIX_H_ */
@@ -0,0 +1,39 @@
+/*
+ * 	Scheduling of Iridium SBD sessions
+ *
+ * 	A session is owed once the period expires or the MO buffer is full, and is held back while the modem
+ * 	reports no signal (CIEV sigind below ICU_IR_SIGIND_MIN or no network). Before the first report the
+ * 	signal counts as good, and without a signal a session still goes once a probe period, in case the
+ * 	report is wrong. A failed session is retried after a backoff doubling with every failure in a row,
+ * 	up to ICU_IR_BACKOFF_MAX. When the signal comes back the backoff is dropped and an owed session goes
+ * 	at once. Times are in ms.
+ */
+
+#ifndef IRSCHED_H_
+#define IRSCHED_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mavlink/zikush/mavlink.h>
+
+void irsched_init(uint32_t now);
+
+// CIEV from the modem
+void irsched_sigind(uint8_t sigind, uint32_t now);
+void irsched_netavail(bool available, uint32_t now);
+
+// Whether to start a session now. full - the MO buffer would be filled
+bool irsched_due(bool full, uint32_t now);
+
+// A session has started, and how it ended
+void irsched_started(uint32_t now);
+void irsched_done(bool ok, uint32_t now);
+
+// Messages of a successful session and the sum of their ages, for the latency
+void irsched_delivered(uint16_t count, uint32_t age_sum);
+
+// Fills the session fields of the ICU stats
+void irsched_report(mavlink_zikush_icu_stats_t * stats);
+
+#endif /* IRSCHED_H_ */
@@ -208,13 +208,22 @@ bool minmea_parse_gsv(struct minmea_sentence_gsv *frame, const char *sentence);
 bool minmea_parse_vtg(struct minmea_sentence_vtg *frame, const char *sentence);
 bool minmea_parse_zda(struct minmea_sentence_zda *frame, const char *sentence);
 
+/**
+ * The same as minmea_parse_rmc() and minmea_parse_gga(), specialized at compile
+ * time instead of interpreting a format string. For the sentences that come
+ * with every fix.
+ */
+bool minmea_parse_rmc_fast(struct minmea_sentence_rmc *frame, const char *sentence);
+bool minmea_parse_gga_fast(struct minmea_sentence_gga *frame, const char *sentence);
+
 /**
  * Convert GPS UTC date/time representation to a UNIX timestamp.
  */
 int minmea_gettime(struct timespec *ts, const struct minmea_date *date, const struct minmea_time *time_);
 
 /**
- * Rescale a fixed-point value to a different scale. Rounds towards zero.
+ * Rescale a fixed-point value to a different scale. Rounds half away from zero,
+ * saturates values that do not fit.
  */
 static inline int_least32_t minmea_rescale(struct minmea_float *f, int_least32_t new_scale)
 {
@@ -222,10 +231,16 @@ static inline int_least32_t minmea_rescale(struct minmea_float *f, int_least32_t
         return 0;
     if (f->scale == new_scale)
         return f->value;
-    if (f->scale > new_scale)
-        return (f->value + ((f->value > 0) - (f->value < 0)) * f->scale/new_scale/2) / (f->scale/new_scale);
-    else
-        return f->value * (new_scale/f->scale);
+    if (f->scale > new_scale) {
+        int_least32_t divisor = f->scale/new_scale;
+        return f->value / divisor + f->value % divisor * 2 / divisor;
+    }
+    int_least32_t factor = new_scale/f->scale;
+    if (f->value > INT_LEAST32_MAX / factor)
+        return INT_LEAST32_MAX;
+    if (f->value < INT_LEAST32_MIN / factor)
+        return INT_LEAST32_MIN;
+    return f->value * factor;
 }
 
 /**
@@ -252,6 +267,30 @@ static inline float minmea_tocoord(struct minmea_float *f)
     return (float) degrees + (float) minutes / (60 * f->scale);
 }
 
+/**
+ * Convert a raw coordinate to degrees * 1E7 with integer arithmetic only,
+ * for targets without an FPU. Rounds to nearest. Returns 0 for "unknown" values
+ * and for ones beyond 180 degrees, which do not fit.
+ */
+static inline int_least32_t minmea_tocoord_e7(struct minmea_float *f)
+{
+    if (f->scale == 0)
+        return 0;
+    /* Digits past 1E-5 minute are below 2 cm, and the scale would not fit. */
+    int_least32_t value = f->value, scale = f->scale;
+    while (scale > 100000) {
+        value /= 10;
+        scale /= 10;
+    }
+    int_least32_t degrees = value / (scale * 100);
+    if (degrees > 180 || degrees < -180)
+        return 0;
+    struct minmea_float minutes = { value % (scale * 100), scale };
+    /* 1E-5 minute is 5/3 of 1E-7 degree, and 60E5 * 5 still fits 32 bits. */
+    int_least32_t fraction = minmea_rescale(&minutes, 100000) * 5;
+    return degrees * 10000000 + (fraction + (fraction >= 0 ? 1 : -1)) / 3;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,40 @@
+/*
+ * 	NMEA sentence assembler
+ *
+ * 	Takes the received stream as it comes, in chunks of any size, and gives out whole sentences checked for
+ * 	$...*hh framing: printable characters only, no longer than MINMEA_MAX_LENGTH, and a matching checksum
+ * 	(sentences without one pass unless it is required). Garbage between sentences is skipped.
+ *
+ * 	There are two line buffers: a finished sentence stays where it was assembled and the next one goes
+ * 	into the other buffer, so a sentence is handed out by pointer and stays valid until the next one
+ * 	is finished.
+ */
+
+#ifndef NMEALINE_H_
+#define NMEALINE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <minmea.h>
+
+// Sentence, \r\n and the terminating zero
+#define NMEALINE_MAX	(MINMEA_MAX_LENGTH + 3)
+
+typedef struct {
+	char lines[2][NMEALINE_MAX];
+	uint8_t current;	//line being assembled
+	uint8_t len;		//0 outside of a sentence
+	bool strict;		//checksum required
+
+	uint32_t good;
+	uint32_t bad;		//broken framing, bad checksum or too long
+} nmealine_t;
+
+void nmealine_init(nmealine_t * self, bool strict);
+
+// Takes bytes until a sentence is finished, *used tells how many. Returns the sentence with its \r\n,
+// NULL if the data has run out first
+const char * nmealine_feed(nmealine_t * self, const uint8_t * data, uint16_t len, uint16_t * used);
+
+#endif /* NMEALINE_H_ */
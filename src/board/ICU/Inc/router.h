@@ -23,6 +23,8 @@ typedef enum
 
 
 router_status_t router_route(mavlink_message_t * msg, TickType_t xTicksToWait);
+// The same for messages the caller keeps on SD itself, their bulk data is not logged again
+router_status_t router_route_stored(mavlink_message_t * msg, TickType_t xTicksToWait);
 bool router_set_ir_divider(uint8_t mav_msg_id, uint16_t divider);
 
 #endif /* ROUTER_H_ */
@@ -0,0 +1,35 @@
+/*
+ * 	Packing of Iridium SBD sessions
+ *
+ * 	Messages for Iridium wait in a pool until a session. Every stream (compid, msgid) keeps several samples,
+ * 	a session takes the set of them worth the most which fits the MO buffer (0/1 knapsack). A sample is worth
+ * 	the weight of its stream, halved for every newer sample of the same stream, and one more weight for every
+ * 	session the stream has been passed over, so low priority streams get through sooner or later. Among sets
+ * 	worth the same the fuller one is taken.
+ */
+
+#ifndef SBDPACK_H_
+#define SBDPACK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mavlink/zikush/mavlink.h>
+
+// Arrival times of a packed set. Sums wrap, count * now - stamp_sum is the total age of the set
+typedef struct {
+	uint16_t count;
+	uint32_t stamp_sum;
+} sbdpack_stamps_t;
+
+// Keeps a serialized message until a session takes it, stamp is its arrival time. If the pool is full, the
+// sample worth the least goes. False if the frame is too long for a slot or worth less than anything in the pool
+bool sbdpack_put(uint32_t msgid, uint8_t compid, const uint8_t * frame, uint8_t len, uint32_t stamp);
+
+// Bytes waiting in the pool
+uint16_t sbdpack_pending(void);
+
+// Serializes the best set of messages into buff, those leave the pool. Returns bytes written
+uint16_t sbdpack_pack(uint8_t * buff, uint16_t size, sbdpack_stamps_t * stamps);
+
+#endif /* SBDPACK_H_ */
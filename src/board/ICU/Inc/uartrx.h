@@ -0,0 +1,55 @@
+/*
+ * 	UART reception through DMA into a circular buffer
+ *
+ * 	The DMA channel writes received bytes into the buffer on its own, interrupts come only at half and full
+ * 	buffer (DMA) and when the line goes idle after a burst (USART IDLE), not for every byte. Each of them
+ * 	accounts what has arrived since the previous one and notifies the consumer task, which takes the bytes
+ * 	in place as contiguous spans. A span never wraps, so a burst across the end of the buffer comes as two.
+ *
+ * 	If the consumer falls behind by more than the buffer, what it has not taken is lost and counted
+ * 	as overrun, it goes on from the newest data.
+ */
+
+#ifndef UARTRX_H_
+#define UARTRX_H_
+
+#include <stdint.h>
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include "stm32f1xx_hal.h"
+
+typedef struct {
+	USART_TypeDef * usart;
+	DMA_Channel_TypeDef * dma;
+	uint32_t dma_flags;			//bits of the channel in DMA1->ISR
+	TaskHandle_t * task;		//notified on new data, may hold NULL
+
+	uint8_t * buff;
+	uint16_t size;
+	uint16_t pos;				//where the DMA was at the last interrupt
+	uint16_t tail;				//where the consumer is
+	volatile uint32_t pending;	//bytes up to pos the consumer has not taken, can exceed size
+
+	uint32_t irqs;
+	uint32_t errors;			//framing, noise, parity and overrun of the USART itself
+	uint32_t overruns;			//bytes lost because the consumer fell behind
+} uartrx_t;
+
+// Starts reception on an initialised USART with the given DMA1 channel (USART1 - 5, USART2 - 6, USART3 - 3).
+// The USART interrupt should be enabled by the caller, the DMA one gets the same priority
+void uartrx_start(uartrx_t * rx, USART_TypeDef * usart, uint8_t dma_channel, uint8_t * buff, uint16_t size,
+		TaskHandle_t * task, uint32_t irq_prio);
+
+// Next contiguous span of received bytes, in place. Returns its length, 0 if there is nothing
+uint16_t uartrx_span(uartrx_t * rx, const uint8_t ** data);
+
+// The consumer is done with len bytes of the span
+void uartrx_consume(uartrx_t * rx, uint16_t len);
+
+// For USARTx_IRQHandler and DMA1_ChannelN_IRQHandler
+void uartrx_usart_irq(uartrx_t * rx);
+void uartrx_dma_irq(uartrx_t * rx);
+
+#endif /* UARTRX_H_ */
@@ -0,0 +1 @@
+../../../common/zikush_canroutes.h
\ No newline at end of file
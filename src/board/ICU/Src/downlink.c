@@ -0,0 +1,365 @@
+/*
+ * 	Compact downlink encoding, see downlink.h
+ */
+#include <string.h>
+
+#include <downlink.h>
+
+// Streams worth compacting, those Iridium takes. mavgen lists fields in wire order
+static const mavlink_message_info_t _schemas[] = {
+		MAVLINK_MESSAGE_INFO_HIL_GPS,
+		MAVLINK_MESSAGE_INFO_SCALED_PRESSURE,
+		MAVLINK_MESSAGE_INFO_SCALED_PRESSURE2,
+		MAVLINK_MESSAGE_INFO_ZIKUSH_POWER_STATE,
+		MAVLINK_MESSAGE_INFO_ZIKUSH_HUMIDITY,
+		MAVLINK_MESSAGE_INFO_ZIKUSH_ICU_STATS,
+		MAVLINK_MESSAGE_INFO_ZIKUSH_PICTURE_HEADER,
+		MAVLINK_MESSAGE_INFO_ZIKUSH_SPECTRUM_INTENSITY_HEADER,
+};
+
+typedef struct {
+	uint8_t * buff;
+	uint16_t pos, size;	//pos runs past size if it doesn't fit
+} _writer_t;
+
+
+static const mavlink_message_info_t * _schema(uint32_t msgid)
+{
+	for(int i = 0; i < sizeof(_schemas) / sizeof(_schemas[0]); i++)
+		if(_schemas[i].msgid == msgid)
+			return &_schemas[i];
+
+	return NULL;
+}
+
+static uint8_t _type_size(mavlink_message_type_t type)
+{
+	switch(type)
+	{
+	case MAVLINK_TYPE_UINT16_T: case MAVLINK_TYPE_INT16_T:
+		return 2;
+
+	case MAVLINK_TYPE_UINT32_T: case MAVLINK_TYPE_INT32_T: case MAVLINK_TYPE_FLOAT:
+		return 4;
+
+	case MAVLINK_TYPE_UINT64_T: case MAVLINK_TYPE_INT64_T: case MAVLINK_TYPE_DOUBLE:
+		return 8;
+
+	default:
+		return 1;
+	}
+}
+
+static bool _type_signed(mavlink_message_type_t type)
+{
+	return type == MAVLINK_TYPE_INT8_T || type == MAVLINK_TYPE_INT16_T || type == MAVLINK_TYPE_INT32_T || type == MAVLINK_TYPE_INT64_T;
+}
+
+static bool _type_float(mavlink_message_type_t type)
+{
+	return type == MAVLINK_TYPE_FLOAT || type == MAVLINK_TYPE_DOUBLE;
+}
+
+// Payload is little endian whatever the field
+static uint64_t _read(const uint8_t * p, uint8_t size)
+{
+	uint64_t value = 0;
+
+	for(int i = size - 1; i >= 0; i--)
+		value = value << 8 | p[i];
+
+	return value;
+}
+
+static int64_t _sign_extend(uint64_t value, uint8_t size)
+{
+	uint8_t shift = 64 - 8 * size;
+	return (int64_t)(value << shift) >> shift;
+}
+
+static uint64_t _zigzag(int64_t value)
+{
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static void _put(_writer_t * w, uint8_t byte)
+{
+	if(w->pos < w->size)
+		w->buff[w->pos] = byte;
+
+	w->pos++;
+}
+
+static void _put_varint(_writer_t * w, uint64_t value)
+{
+	while(value >= 0x80)
+	{
+		_put(w, value | 0x80);
+		value >>= 7;
+	}
+
+	_put(w, value);
+}
+
+/**
+ * @brief Calls back for every element of fields within len, arrays element by element
+ *
+ * @return Elements visited
+ */
+typedef void (*_element_cb_t)(void * arg, uint16_t index, mavlink_message_type_t type, uint8_t offset, uint8_t size);
+
+static uint16_t _elements(const mavlink_message_info_t * info, uint8_t len, _element_cb_t cb, void * arg)
+{
+	uint16_t index = 0;
+
+	for(int i = 0; i < info->num_fields; i++)
+	{
+		const mavlink_field_info_t * field = &info->fields[i];
+		uint8_t size = _type_size(field->type);
+		uint8_t count = field->array_length ? field->array_length : 1;
+
+		for(int j = 0; j < count; j++)
+		{
+			uint8_t offset = field->wire_offset + j * size;
+			if(offset + size > len)
+				return index; //extensions are not sent in MAVLink 1
+
+			if(cb)
+				cb(arg, index, field->type, offset, size);
+
+			index++;
+		}
+	}
+
+	return index;
+}
+
+typedef struct {
+	_writer_t * w;
+	const uint8_t * payload;
+	const uint8_t * ref;	//NULL for a keyframe
+	uint8_t * bitmap;
+	bool write;				//first pass marks changes, the second one writes them
+} _body_t;
+
+static void _body_element(void * arg, uint16_t index, mavlink_message_type_t type, uint8_t offset, uint8_t size)
+{
+	_body_t * body = (_body_t *)arg;
+	uint64_t value = _read(body->payload + offset, size);
+
+	if(!body->ref)
+	{
+		if(_type_float(type))
+			for(int i = 0; i < size; i++)
+				_put(body->w, body->payload[offset + i]);
+		else if(_type_signed(type))
+			_put_varint(body->w, _zigzag(_sign_extend(value, size)));
+		else
+			_put_varint(body->w, value);
+
+		return;
+	}
+
+	uint64_t delta = value - _read(body->ref + offset, size);
+
+	if(!body->write)
+	{
+		if(_sign_extend(delta, size))
+			body->bitmap[index / 8] |= 1 << (index % 8);
+	}
+	else if(body->bitmap[index / 8] & (1 << (index % 8)))
+	{
+		_put_varint(body->w, _zigzag(_sign_extend(delta, size)));
+	}
+}
+
+static downlink_stream_t * _stream(downlink_t * link, uint32_t msgid, uint8_t compid, bool add)
+{
+	downlink_stream_t * free = NULL;
+
+	for(int i = 0; i < ICU_DOWNLINK_STREAMS; i++)
+	{
+		downlink_stream_t * stream = &link->streams[i];
+
+		if(stream->used && stream->msgid == msgid && stream->compid == compid)
+			return stream;
+
+		if(!stream->used && !free)
+			free = stream;
+	}
+
+	if(!add || !free)
+		return NULL;
+
+	*free = (downlink_stream_t){ .msgid = msgid, .compid = compid, .used = true };
+	return free;
+}
+
+static bool _pending(const downlink_stream_t * stream)
+{
+	for(int i = 0; i < ICU_DOWNLINK_KEYFRAMES_KEPT; i++)
+		if(stream->pending[i].valid)
+			return true;
+
+	return false;
+}
+
+
+uint16_t downlink_plain(const mavlink_message_t * msg, uint8_t * buff, uint16_t size)
+{
+	uint8_t signature_len, header_len;
+	uint8_t length = msg->len;
+
+	if (msg->magic == MAVLINK_STX_MAVLINK1) {
+		signature_len = 0;
+		header_len = MAVLINK_CORE_HEADER_MAVLINK1_LEN;
+	} else {
+		length = _mav_trim_payload(_MAV_PAYLOAD(msg), length);
+		header_len = MAVLINK_CORE_HEADER_LEN;
+		signature_len = (msg->incompat_flags & MAVLINK_IFLAG_SIGNED)?MAVLINK_SIGNATURE_BLOCK_LEN:0;
+	}
+
+	if(header_len + 1 + 2 + (uint16_t)length + (uint16_t)signature_len > size)
+		return 0;
+
+	return mavlink_msg_to_send_buffer(buff, msg);
+}
+
+uint16_t downlink_encode(downlink_t * link, const mavlink_message_t * msg, uint8_t * buff, uint16_t size)
+{
+	const mavlink_message_info_t * info = _schema(msg->msgid);
+	const mavlink_msg_entry_t * entry = mavlink_get_msg_entry(msg->msgid);
+
+	// Keyframe numbers are per the board, so only onboard messages
+	if(!info || !entry || msg->sysid != 0 || entry->min_msg_len > ICU_DOWNLINK_PAYLOAD)
+		return downlink_plain(msg, buff, size);
+
+	downlink_stream_t * stream = _stream(link, msg->msgid, msg->compid, true);
+	if(!stream)
+		return downlink_plain(msg, buff, size);
+
+	uint8_t len = entry->min_msg_len;
+	uint8_t payload[ICU_DOWNLINK_PAYLOAD] = {0}; //MAVLink 2 trims zeros
+	memcpy(payload, _MAV_PAYLOAD(msg), msg->len < len ? msg->len : len);
+
+	// Keyframes go once a period whatever comes back, so the ones the ground keeps are those pending here.
+	// Until one of them is acknowledged, messages in between go plain
+	bool key = stream->since_key + 1 >= ICU_DOWNLINK_KEYFRAME_PERIOD || (!stream->ref_valid && !_pending(stream));
+	if(!key && !stream->ref_valid)
+	{
+		stream->since_key++;
+		return downlink_plain(msg, buff, size);
+	}
+
+	uint8_t num = key ? (stream->last_num + 1) & ~DOWNLINK_KEYFLAG : stream->ref_num;
+
+	_writer_t w = { .buff = buff, .size = size };
+	_put(&w, DOWNLINK_STX);
+	_put(&w, 0); //len, when the body is there
+	_put(&w, num | (key ? DOWNLINK_KEYFLAG : 0));
+	_put(&w, msg->compid);
+	_put(&w, msg->msgid);
+
+	uint8_t bitmap[(ICU_DOWNLINK_PAYLOAD + 7) / 8] = {0};
+	_body_t body = { .w = &w, .payload = payload, .ref = key ? NULL : stream->ref, .bitmap = bitmap };
+
+	uint16_t count = _elements(info, len, _body_element, &body);
+	if(!key)
+	{
+		for(int i = 0; i < (count + 7) / 8; i++)
+			_put(&w, bitmap[i]);
+
+		body.write = true;
+		_elements(info, len, _body_element, &body);
+	}
+
+	uint16_t bodylen = w.pos - DOWNLINK_HEADER_LEN;
+	if(bodylen > UINT8_MAX || w.pos + 2 > size)
+		return downlink_plain(msg, buff, size); //a keyframe can be longer than the plain message
+
+	buff[1] = bodylen;
+
+	uint16_t crc = crc_calculate(buff + 1, w.pos - 1);
+	crc_accumulate(entry->crc_extra, &crc);
+	_put(&w, crc & 0xFF);
+	_put(&w, crc >> 8);
+
+	if(key)
+	{
+		downlink_keyframe_t * keyframe = &stream->pending[stream->pending_next];
+		memcpy(keyframe->payload, payload, sizeof(keyframe->payload));
+		keyframe->num = num;
+		keyframe->valid = true;
+
+		stream->pending_next = (stream->pending_next + 1) % ICU_DOWNLINK_KEYFRAMES_KEPT;
+		stream->last_num = num;
+		stream->since_key = 0;
+
+		// The ground keeps as many of the last keyframes, the reference is gone there if it is older
+		if(((uint8_t)(num - stream->ref_num) & ~DOWNLINK_KEYFLAG) >= ICU_DOWNLINK_KEYFRAMES_KEPT)
+			stream->ref_valid = false;
+	}
+	else if(stream->since_key < UINT8_MAX)
+	{
+		stream->since_key++;
+	}
+
+	return w.pos;
+}
+
+// The keyframe becomes the reference, older pending ones are of no use any more
+static void _stream_ack(downlink_stream_t * stream, uint8_t num)
+{
+	for(int i = 0; i < ICU_DOWNLINK_KEYFRAMES_KEPT; i++)
+	{
+		downlink_keyframe_t * keyframe = &stream->pending[(stream->pending_next + i) % ICU_DOWNLINK_KEYFRAMES_KEPT];
+		if(!keyframe->valid || keyframe->num != num)
+			continue;
+
+		memcpy(stream->ref, keyframe->payload, sizeof(stream->ref));
+		stream->ref_num = num;
+		stream->ref_valid = true;
+
+		for(int j = 0; j <= i; j++)
+			stream->pending[(stream->pending_next + j) % ICU_DOWNLINK_KEYFRAMES_KEPT].valid = false;
+
+		return;
+	}
+}
+
+void downlink_ack(downlink_t * link, const uint8_t * buff, uint16_t len)
+{
+	uint16_t pos = 0;
+
+	while(pos + 2 < len)
+	{
+		const uint8_t * frame = buff + pos;
+
+		if(frame[0] == MAVLINK_STX_MAVLINK1)
+		{
+			pos += MAVLINK_CORE_HEADER_MAVLINK1_LEN + 1 + frame[1] + MAVLINK_NUM_CHECKSUM_BYTES; //the headers are of MAVLink 2
+			continue;
+		}
+
+		if(frame[0] == MAVLINK_STX)
+		{
+			// Plain MAVLink 2 of the CAN boards
+			pos += MAVLINK_NUM_NON_PAYLOAD_BYTES + frame[1];
+			if(frame[2] & MAVLINK_IFLAG_SIGNED)
+				pos += MAVLINK_SIGNATURE_BLOCK_LEN;
+			continue;
+		}
+
+		if(frame[0] != DOWNLINK_STX || pos + DOWNLINK_HEADER_LEN > len)
+			return; //nothing else is sent, the rest can't be parsed
+
+		pos += DOWNLINK_HEADER_LEN + frame[1] + 2;
+
+		if( !(frame[2] & DOWNLINK_KEYFLAG) )
+			continue;
+
+		downlink_stream_t * stream = _stream(link, frame[4], frame[3], false);
+		if(stream)
+			_stream_ack(stream, frame[2] & ~DOWNLINK_KEYFLAG);
+	}
+}
@@ -0,0 +1,333 @@
+/*
+ * 	GNSS fix out of NMEA sentences, see gpsfix.h
+ */
+#include <string.h>
+
+#include <gpsfix.h>
+
+#include <zikush_config.h>
+
+#define GPSFIX_UNKNOWN	UINT16_MAX
+
+
+// Integer rescaling, so that 0.97 does not turn into 0 on the way
+static uint16_t _scaled(struct minmea_float * f, int32_t scale)
+{
+	if(0 == f->scale || f->value < 0)
+		return GPSFIX_UNKNOWN;
+
+	const int32_t value = minmea_rescale(f, scale);
+	return value < GPSFIX_UNKNOWN ? value : GPSFIX_UNKNOWN - 1;
+}
+
+static uint16_t _knots(struct minmea_float * f)
+{
+	if(0 == f->scale || f->value < 0)
+		return GPSFIX_UNKNOWN;
+
+	// 1 knot is 51.44 cm/s, in hundredths of a knot it stays in 32 bits up to 4000 knots
+	const int32_t knots = minmea_rescale(f, 100);
+	const int32_t cms = knots < 400000 ? (knots * 5144 + 5000) / 10000 : GPSFIX_UNKNOWN;
+	return cms < GPSFIX_UNKNOWN ? cms : GPSFIX_UNKNOWN - 1;
+}
+
+static uint16_t _kph(struct minmea_float * f)
+{
+	if(0 == f->scale || f->value < 0)
+		return GPSFIX_UNKNOWN;
+
+	// 1 km/h is 100/3.6 cm/s
+	const int32_t kph = minmea_rescale(f, 100);
+	const int32_t cms = kph < 10000000 ? (kph * 10 + 18) / 36 : GPSFIX_UNKNOWN;
+	return cms < GPSFIX_UNKNOWN ? cms : GPSFIX_UNKNOWN - 1;
+}
+
+static uint16_t _course(struct minmea_float * f)
+{
+	const uint16_t cdeg = _scaled(f, 100);
+	return cdeg == GPSFIX_UNKNOWN ? cdeg : cdeg % 36000;
+}
+
+// sin(i degrees) * 2^14, a quarter of the circle
+static const int16_t _sin_q14[91] = {
+		0, 286, 572, 857, 1143, 1428, 1713, 1997, 2280, 2563,
+		2845, 3126, 3406, 3686, 3964, 4240, 4516, 4790, 5063, 5334,
+		5604, 5872, 6138, 6402, 6664, 6924, 7182, 7438, 7692, 7943,
+		8192, 8438, 8682, 8923, 9162, 9397, 9630, 9860, 10087, 10311,
+		10531, 10749, 10963, 11174, 11381, 11585, 11786, 11982, 12176, 12365,
+		12551, 12733, 12911, 13085, 13255, 13421, 13583, 13741, 13894, 14044,
+		14189, 14330, 14466, 14598, 14726, 14849, 14968, 15082, 15191, 15296,
+		15396, 15491, 15582, 15668, 15749, 15826, 15897, 15964, 16026, 16083,
+		16135, 16182, 16225, 16262, 16294, 16322, 16344, 16362, 16374, 16382,
+		16384,
+};
+
+// sin of an angle in centidegrees * 2^14, interpolated between whole degrees. The ICU has no FPU
+static int32_t _sin(int32_t cdeg)
+{
+	cdeg %= 36000;
+	const int32_t sign = cdeg >= 18000 ? -1 : 1;
+	if(cdeg >= 18000)
+		cdeg -= 18000;
+	if(cdeg > 9000)
+		cdeg = 18000 - cdeg;
+
+	const int32_t i = cdeg / 100, frac = cdeg % 100;
+	const int32_t value = i < 90 ? _sin_q14[i] + (_sin_q14[i + 1] - _sin_q14[i]) * frac / 100 : _sin_q14[90];
+	return sign * value;
+}
+
+// timegm() is not in newlib, days from 1970-01-01 after H. Hinnant
+static int64_t _unix_usec(const struct minmea_date * date, const struct minmea_time * time)
+{
+	int32_t y = date->year < 80 ? 2000 + date->year : date->year < 100 ? 1900 + date->year : date->year;
+	const int32_t m = date->month;
+	y -= m <= 2;
+
+	const int32_t era = (y >= 0 ? y : y - 399) / 400;
+	const int32_t yoe = y - era * 400;
+	const int32_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + date->day - 1;
+	const int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	const int64_t days = (int64_t)era * 146097 + doe - 719468;
+
+	const int64_t sec = days * 86400 + time->hours * 3600 + time->minutes * 60 + time->seconds;
+	return sec * 1000000 + time->microseconds;
+}
+
+
+static void _begin(gpsfix_t * self, uint32_t boot_ms)
+{
+	memset(&self->fix, 0, sizeof(self->fix));
+	self->fix.eph = GPSFIX_UNKNOWN;
+	self->fix.epv = GPSFIX_UNKNOWN;
+	self->fix.vel = GPSFIX_UNKNOWN;
+	self->fix.cog = GPSFIX_UNKNOWN;
+	self->fix.satellites_visible = UINT8_MAX;
+
+	self->started = true;
+	self->timed = false;
+	self->boot_ms = boot_ms;
+	self->gga_quality = -1;
+	self->gsa_fix = 0;
+}
+
+static void _finish(gpsfix_t * self, mavlink_hil_gps_t * out)
+{
+	mavlink_hil_gps_t * const fix = &self->fix;
+
+	if(self->gsa_fix)
+		fix->fix_type = self->gsa_fix;
+	else if(self->gga_quality >= 0)
+		fix->fix_type = self->gga_quality > 0 ? 3 : 1; //GGA gives altitude, so take it as 3D
+	else
+		fix->fix_type = 0;
+
+	if(self->timed && self->dated)
+		fix->time_usec = _unix_usec(&self->date, &self->time);
+	else
+		fix->time_usec = (uint64_t)self->boot_ms * 1000;
+
+	if(fix->vel != GPSFIX_UNKNOWN && fix->cog != GPSFIX_UNKNOWN)
+	{
+		fix->vn = (fix->vel * _sin(fix->cog + 9000) + (1 << 13)) >> 14;
+		fix->ve = (fix->vel * _sin(fix->cog) + (1 << 13)) >> 14;
+	}
+
+	*out = *fix;
+	self->started = false;
+	self->epochs++;
+}
+
+// A sentence with UTC time. True if it closed the previous epoch
+static bool _time(gpsfix_t * self, const struct minmea_time * time, uint32_t boot_ms, mavlink_hil_gps_t * out)
+{
+	bool finished = false;
+
+	if(time->hours < 0)
+		return false;
+
+	if(self->started && self->timed && 0 != memcmp(time, &self->time, sizeof(*time)))
+	{
+		_finish(self, out);
+		finished = true;
+	}
+
+	if(!self->started)
+		_begin(self, boot_ms);
+
+	self->time = *time;
+	self->timed = true;
+	return finished;
+}
+
+static void _date(gpsfix_t * self, const struct minmea_date * date)
+{
+	if(date->year < 0 || date->month < 1 || date->month > 12 || date->day < 1)
+		return;
+
+	self->date = *date;
+	self->dated = true;
+}
+
+static void _position(gpsfix_t * self, struct minmea_float * lat, struct minmea_float * lon)
+{
+	if(0 == lat->scale || 0 == lon->scale)
+		return;
+
+	self->fix.lat = minmea_tocoord_e7(lat);
+	self->fix.lon = minmea_tocoord_e7(lon);
+}
+
+
+void gpsfix_init(gpsfix_t * self)
+{
+	memset(self, 0, sizeof(*self));
+}
+
+
+bool gpsfix_feed(gpsfix_t * self, const char * sentence, uint32_t boot_ms, mavlink_hil_gps_t * out)
+{
+	bool finished = false;
+	bool parsed = true;
+
+	switch( minmea_sentence_id(sentence, ICU_GPS_FORCECHECKSUMM) )
+	{
+	case MINMEA_SENTENCE_GGA:
+	{
+		struct minmea_sentence_gga frame;
+		if( !(parsed = minmea_parse_gga_fast(&frame, sentence)) )
+			break;
+
+		finished = _time(self, &frame.time, boot_ms, out);
+		if(!self->started)
+			_begin(self, boot_ms);
+
+		self->gga_quality = frame.fix_quality;
+		if(frame.fix_quality > 0)
+		{
+			_position(self, &frame.latitude, &frame.longitude);
+			if(frame.altitude.scale)
+				self->fix.alt = minmea_rescale(&frame.altitude, 1000); //mm
+		}
+		if(frame.satellites_tracked >= 0)
+			self->fix.satellites_visible = frame.satellites_tracked;
+		if(self->fix.eph == GPSFIX_UNKNOWN)
+			self->fix.eph = _scaled(&frame.hdop, 100);
+		break;
+	}
+
+	case MINMEA_SENTENCE_RMC:
+	{
+		struct minmea_sentence_rmc frame;
+		if( !(parsed = minmea_parse_rmc_fast(&frame, sentence)) )
+			break;
+
+		finished = _time(self, &frame.time, boot_ms, out);
+		if(!self->started)
+			_begin(self, boot_ms);
+
+		_date(self, &frame.date);
+		if(frame.valid)
+		{
+			if(self->gga_quality < 0)
+				_position(self, &frame.latitude, &frame.longitude);
+			if(self->fix.vel == GPSFIX_UNKNOWN)
+				self->fix.vel = _knots(&frame.speed);
+			if(self->fix.cog == GPSFIX_UNKNOWN)
+				self->fix.cog = _course(&frame.course);
+		}
+		break;
+	}
+
+	case MINMEA_SENTENCE_VTG:
+	{
+		struct minmea_sentence_vtg frame;
+		if( !(parsed = minmea_parse_vtg(&frame, sentence)) )
+			break;
+
+		if(!self->started)
+			_begin(self, boot_ms);
+
+		if(frame.faa_mode == MINMEA_FAA_MODE_NOT_VALID)
+			break;
+
+		// km/h are given with a finer resolution than knots
+		const uint16_t vel = frame.speed_kph.scale ? _kph(&frame.speed_kph) : _knots(&frame.speed_knots);
+		if(vel != GPSFIX_UNKNOWN)
+			self->fix.vel = vel;
+
+		const uint16_t cog = _course(&frame.true_track_degrees);
+		if(cog != GPSFIX_UNKNOWN)
+			self->fix.cog = cog;
+		break;
+	}
+
+	case MINMEA_SENTENCE_GSA:
+	{
+		struct minmea_sentence_gsa frame;
+		if( !(parsed = minmea_parse_gsa(&frame, sentence)) )
+			break;
+
+		if(!self->started)
+			_begin(self, boot_ms);
+
+		// Receivers with several constellations send a GSA for each, the first one is enough
+		if(self->gsa_fix)
+			break;
+
+		self->gsa_fix = frame.fix_type >= MINMEA_GPGSA_FIX_NONE && frame.fix_type <= MINMEA_GPGSA_FIX_3D
+				? frame.fix_type : MINMEA_GPGSA_FIX_NONE;
+
+		const uint16_t hdop = _scaled(&frame.hdop, 100);
+		if(hdop != GPSFIX_UNKNOWN)
+			self->fix.eph = hdop;
+		self->fix.epv = _scaled(&frame.vdop, 100);
+		break;
+	}
+
+	case MINMEA_SENTENCE_ZDA:
+	{
+		struct minmea_sentence_zda frame;
+		if( !(parsed = minmea_parse_zda(&frame, sentence)) )
+			break;
+
+		finished = _time(self, &frame.time, boot_ms, out);
+		_date(self, &frame.date);
+		break;
+	}
+
+	case MINMEA_SENTENCE_GST:
+	{
+		struct minmea_sentence_gst frame;
+		if( !(parsed = minmea_parse_gst(&frame, sentence)) )
+			break;
+
+		finished = _time(self, &frame.time, boot_ms, out);
+		break;
+	}
+
+	case MINMEA_INVALID:
+		parsed = false;
+		break;
+
+	default:
+		return false;
+	}
+
+	if(parsed)
+		self->sentences++;
+	else
+		self->rejected++;
+
+	return finished;
+}
+
+
+bool gpsfix_flush(gpsfix_t * self, mavlink_hil_gps_t * out)
+{
+	if(!self->started)
+		return false;
+
+	_finish(self, out);
+	return true;
+}
@@ -0,0 +1,134 @@
+/*
+ * 	Scheduling of Iridium SBD sessions, see irsched.h
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <irsched.h>
+
+#include <zikush_config.h>
+
+static bool _known;			//the modem has reported the signal at least once
+static uint8_t _sigind;
+static bool _netavail;
+
+static bool _owed;			//a session is wanted and has not happened yet
+static uint32_t _last;		//when the last session started
+static uint32_t _retry_at;	//no session before that
+static uint8_t _failures;	//in a row
+
+static uint16_t _sessions;
+static uint16_t _sessions_ok;
+static uint32_t _delivered;
+static uint32_t _latency_sum;	//seconds
+
+
+static bool _signal(void)
+{
+	return !_known || (_netavail && _sigind >= ICU_IR_SIGIND_MIN);
+}
+
+static void _signal_changed(bool had, uint32_t now)
+{
+	// Signal is back, whatever failed before failed without it
+	if(!had && _signal())
+	{
+		_failures = 0;
+		_retry_at = now;
+	}
+}
+
+
+void irsched_init(uint32_t now)
+{
+	_known = false;
+	_sigind = 0;
+	_netavail = true;
+
+	_owed = false;
+	_last = now;
+	_retry_at = now;
+	_failures = 0;
+}
+
+void irsched_sigind(uint8_t sigind, uint32_t now)
+{
+	const bool had = _signal();
+
+	_known = true;
+	_sigind = sigind;
+	_signal_changed(had, now);
+}
+
+void irsched_netavail(bool available, uint32_t now)
+{
+	const bool had = _signal();
+
+	_known = true;
+	_netavail = available;
+	_signal_changed(had, now);
+}
+
+bool irsched_due(bool full, uint32_t now)
+{
+	if(full || now - _last >= ICU_IR_SESSION_PERIOD)
+		_owed = true;
+
+	if(!_owed || (int32_t)(now - _retry_at) < 0)
+		return false;
+
+	return _signal() || now - _last >= ICU_IR_PROBE_PERIOD;
+}
+
+void irsched_started(uint32_t now)
+{
+	_owed = false;
+	_last = now;
+
+	if(_sessions < UINT16_MAX)
+		_sessions++;
+}
+
+void irsched_done(bool ok, uint32_t now)
+{
+	if(ok)
+	{
+		_failures = 0;
+		_retry_at = now;
+
+		if(_sessions_ok < UINT16_MAX)
+			_sessions_ok++;
+
+		return;
+	}
+
+	// What did not get through is still owed
+	_owed = true;
+
+	if(_failures < 31)
+		_failures++;
+
+	uint32_t backoff = ICU_IR_BACKOFF_MIN;
+	for(int i = 1; i < _failures && backoff < ICU_IR_BACKOFF_MAX; i++)
+		backoff *= 2;
+
+	if(backoff > ICU_IR_BACKOFF_MAX)
+		backoff = ICU_IR_BACKOFF_MAX;
+
+	_retry_at = now + backoff;
+}
+
+void irsched_delivered(uint16_t count, uint32_t age_sum)
+{
+	_delivered += count;
+	_latency_sum += age_sum / 1000;
+}
+
+void irsched_report(mavlink_zikush_icu_stats_t * stats)
+{
+	stats->iridium_sessions = _sessions;
+	stats->iridium_success = _sessions ? (uint32_t)_sessions_ok * 100 / _sessions : 0;
+
+	const uint32_t latency = _delivered ? _latency_sum / _delivered : 0;
+	stats->iridium_latency = latency > UINT16_MAX ? UINT16_MAX : latency;
+}
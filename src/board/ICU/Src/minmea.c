@@ -89,244 +89,296 @@ static inline bool minmea_isfield(char c) {
     return isprint((unsigned char) c) && c != ',' && c != '*';
 }
 
-bool minmea_scan(const char *sentence, const char *format, ...)
+/*
+ * Field scanners shared by minmea_scan() and the specialized parsers. Each one
+ * reads the current field, which may be missing (NULL), and moves to the next.
+ */
+struct minmea_cursor {
+    const char *sentence;
+    const char *field;
+};
+
+static inline void minmea_next_field(struct minmea_cursor *c)
 {
-    bool result = false;
-    bool optional = false;
-    va_list ap;
-    va_start(ap, format);
+    // Progress to the next field.
+    while (minmea_isfield(*c->sentence))
+        c->sentence++;
+    // Make sure there is a field there.
+    if (*c->sentence == ',') {
+        c->sentence++;
+        c->field = c->sentence;
+    } else {
+        c->field = NULL;
+    }
+}
 
-    const char *field = sentence;
-#define next_field() \
-    do { \
-        /* Progress to the next field. */ \
-        while (minmea_isfield(*sentence)) \
-            sentence++; \
-        /* Make sure there is a field there. */ \
-        if (*sentence == ',') { \
-            sentence++; \
-            field = sentence; \
-        } else { \
-            field = NULL; \
-        } \
-    } while (0)
+static inline bool minmea_scan_char(struct minmea_cursor *c, char *out)
+{
+    // Single character field (char).
+    const char *field = c->field;
+    char value = '\0';
 
-    while (*format) {
-        char type = *format++;
+    if (field && minmea_isfield(*field))
+        value = *field;
 
-        if (type == ';') {
-            // All further fields are optional.
-            optional = true;
-            continue;
-        }
+    *out = value;
+    minmea_next_field(c);
+    return true;
+}
 
-        if (!field && !optional) {
-            // Field requested but we ran out if input. Bail out.
-            goto parse_error;
+static inline bool minmea_scan_direction(struct minmea_cursor *c, int *out)
+{
+    // Single character direction field (int).
+    const char *field = c->field;
+    int value = 0;
+
+    if (field && minmea_isfield(*field)) {
+        switch (*field) {
+            case 'N':
+            case 'E':
+                value = 1;
+                break;
+            case 'S':
+            case 'W':
+                value = -1;
+                break;
+            default:
+                return false;
         }
+    }
 
-        switch (type) {
-            case 'c': { // Single character field (char).
-                char value = '\0';
-
-                if (field && minmea_isfield(*field))
-                    value = *field;
-
-                *va_arg(ap, char *) = value;
-            } break;
-
-            case 'd': { // Single character direction field (int).
-                int value = 0;
-
-                if (field && minmea_isfield(*field)) {
-                    switch (*field) {
-                        case 'N':
-                        case 'E':
-                            value = 1;
-                            break;
-                        case 'S':
-                        case 'W':
-                            value = -1;
-                            break;
-                        default:
-                            goto parse_error;
-                    }
-                }
+    *out = value;
+    minmea_next_field(c);
+    return true;
+}
 
-                *va_arg(ap, int *) = value;
-            } break;
-
-            case 'f': { // Fractional value with scale (struct minmea_float).
-                int sign = 0;
-                int_least32_t value = -1;
-                int_least32_t scale = 0;
-
-                if (field) {
-                    while (minmea_isfield(*field)) {
-                        if (*field == '+' && !sign && value == -1) {
-                            sign = 1;
-                        } else if (*field == '-' && !sign && value == -1) {
-                            sign = -1;
-                        } else if (isdigit((unsigned char) *field)) {
-                            int digit = *field - '0';
-                            if (value == -1)
-                                value = 0;
-                            if (value > (INT_LEAST32_MAX-digit) / 10) {
-                                /* we ran out of bits, what do we do? */
-                                if (scale) {
-                                    /* truncate extra precision */
-                                    break;
-                                } else {
-                                    /* integer overflow. bail out. */
-                                    goto parse_error;
-                                }
-                            }
-                            value = (10 * value) + digit;
-                            if (scale)
-                                scale *= 10;
-                        } else if (*field == '.' && scale == 0) {
-                            scale = 1;
-                        } else if (*field == ' ') {
-                            /* Allow spaces at the start of the field. Not NMEA
-                             * conformant, but some modules do this. */
-                            if (sign != 0 || value != -1 || scale != 0)
-                                goto parse_error;
-                        } else {
-                            goto parse_error;
-                        }
-                        field++;
+static inline bool minmea_scan_float(struct minmea_cursor *c, struct minmea_float *out)
+{
+    // Fractional value with scale (struct minmea_float).
+    const char *field = c->field;
+    int sign = 0;
+    int_least32_t value = -1;
+    int_least32_t scale = 0;
+
+    if (field) {
+        while (minmea_isfield(*field)) {
+            if (*field == '+' && !sign && value == -1) {
+                sign = 1;
+            } else if (*field == '-' && !sign && value == -1) {
+                sign = -1;
+            } else if (isdigit((unsigned char) *field)) {
+                int digit = *field - '0';
+                if (value == -1)
+                    value = 0;
+                if (value > (INT_LEAST32_MAX-digit) / 10 || scale > INT_LEAST32_MAX / 10) {
+                    /* we ran out of bits, what do we do? */
+                    if (scale) {
+                        /* truncate extra precision */
+                        break;
+                    } else {
+                        /* integer overflow. bail out. */
+                        return false;
                     }
                 }
+                value = (10 * value) + digit;
+                if (scale)
+                    scale *= 10;
+            } else if (*field == '.' && scale == 0) {
+                scale = 1;
+            } else if (*field == ' ') {
+                /* Allow spaces at the start of the field. Not NMEA
+                 * conformant, but some modules do this. */
+                if (sign != 0 || value != -1 || scale != 0)
+                    return false;
+            } else {
+                return false;
+            }
+            field++;
+        }
+    }
 
-                if ((sign || scale) && value == -1)
-                    goto parse_error;
+    if ((sign || scale) && value == -1)
+        return false;
 
-                if (value == -1) {
-                    /* No digits were scanned. */
-                    value = 0;
-                    scale = 0;
-                } else if (scale == 0) {
-                    /* No decimal point. */
-                    scale = 1;
-                }
-                if (sign)
-                    value *= sign;
+    if (value == -1) {
+        /* No digits were scanned. */
+        value = 0;
+        scale = 0;
+    } else if (scale == 0) {
+        /* No decimal point. */
+        scale = 1;
+    }
+    if (sign)
+        value *= sign;
 
-                *va_arg(ap, struct minmea_float *) = (struct minmea_float) {value, scale};
-            } break;
+    *out = (struct minmea_float) {value, scale};
+    minmea_next_field(c);
+    return true;
+}
 
-            case 'i': { // Integer value, default 0 (int).
-                int value = 0;
+static inline bool minmea_scan_int(struct minmea_cursor *c, int *out)
+{
+    // Integer value, default 0 (int).
+    const char *field = c->field;
+    int value = 0;
+
+    if (field) {
+        char *endptr;
+        value = strtol(field, &endptr, 10);
+        if (minmea_isfield(*endptr))
+            return false;
+    }
 
-                if (field) {
-                    char *endptr;
-                    value = strtol(field, &endptr, 10);
-                    if (minmea_isfield(*endptr))
-                        goto parse_error;
-                }
+    *out = value;
+    minmea_next_field(c);
+    return true;
+}
 
-                *va_arg(ap, int *) = value;
-            } break;
+static inline bool minmea_scan_string(struct minmea_cursor *c, char *buf)
+{
+    // String value (char *).
+    const char *field = c->field;
 
-            case 's': { // String value (char *).
-                char *buf = va_arg(ap, char *);
+    if (field) {
+        while (minmea_isfield(*field))
+            *buf++ = *field++;
+    }
 
-                if (field) {
-                    while (minmea_isfield(*field))
-                        *buf++ = *field++;
-                }
+    *buf = '\0';
+    minmea_next_field(c);
+    return true;
+}
 
-                *buf = '\0';
-            } break;
-
-            case 't': { // NMEA talker+sentence identifier (char *).
-                // This field is always mandatory.
-                if (!field)
-                    goto parse_error;
-
-                if (field[0] != '$')
-                    goto parse_error;
-                for (int f=0; f<5; f++)
-                    if (!minmea_isfield(field[1+f]))
-                        goto parse_error;
-
-                char *buf = va_arg(ap, char *);
-                memcpy(buf, field+1, 5);
-                buf[5] = '\0';
-            } break;
-
-            case 'D': { // Date (int, int, int), -1 if empty.
-                struct minmea_date *date = va_arg(ap, struct minmea_date *);
-
-                int d = -1, m = -1, y = -1;
-
-                if (field && minmea_isfield(*field)) {
-                    // Always six digits.
-                    for (int f=0; f<6; f++)
-                        if (!isdigit((unsigned char) field[f]))
-                            goto parse_error;
-
-                    char dArr[] = {field[0], field[1], '\0'};
-                    char mArr[] = {field[2], field[3], '\0'};
-                    char yArr[] = {field[4], field[5], '\0'};
-                    d = strtol(dArr, NULL, 10);
-                    m = strtol(mArr, NULL, 10);
-                    y = strtol(yArr, NULL, 10);
-                }
+static inline bool minmea_scan_type(struct minmea_cursor *c, char *buf)
+{
+    // NMEA talker+sentence identifier (char *).
+    // This field is always mandatory.
+    const char *field = c->field;
 
-                date->day = d;
-                date->month = m;
-                date->year = y;
-            } break;
-
-            case 'T': { // Time (int, int, int, int), -1 if empty.
-                struct minmea_time *time_ = va_arg(ap, struct minmea_time *);
-
-                int h = -1, i = -1, s = -1, u = -1;
-
-                if (field && minmea_isfield(*field)) {
-                    // Minimum required: integer time.
-                    for (int f=0; f<6; f++)
-                        if (!isdigit((unsigned char) field[f]))
-                            goto parse_error;
-
-                    char hArr[] = {field[0], field[1], '\0'};
-                    char iArr[] = {field[2], field[3], '\0'};
-                    char sArr[] = {field[4], field[5], '\0'};
-                    h = strtol(hArr, NULL, 10);
-                    i = strtol(iArr, NULL, 10);
-                    s = strtol(sArr, NULL, 10);
-                    field += 6;
-
-                    // Extra: fractional time. Saved as microseconds.
-                    if (*field++ == '.') {
-                        uint32_t value = 0;
-                        uint32_t scale = 1000000LU;
-                        while (isdigit((unsigned char) *field) && scale > 1) {
-                            value = (value * 10) + (*field++ - '0');
-                            scale /= 10;
-                        }
-                        u = value * scale;
-                    } else {
-                        u = 0;
-                    }
-                }
+    if (!field)
+        return false;
 
-                time_->hours = h;
-                time_->minutes = i;
-                time_->seconds = s;
-                time_->microseconds = u;
-            } break;
+    if (field[0] != '$')
+        return false;
+    for (int f=0; f<5; f++)
+        if (!minmea_isfield(field[1+f]))
+            return false;
 
-            case '_': { // Ignore the field.
-            } break;
+    memcpy(buf, field+1, 5);
+    buf[5] = '\0';
+    minmea_next_field(c);
+    return true;
+}
+
+static inline bool minmea_scan_date(struct minmea_cursor *c, struct minmea_date *date)
+{
+    // Date (int, int, int), -1 if empty.
+    const char *field = c->field;
+    int d = -1, m = -1, y = -1;
+
+    if (field && minmea_isfield(*field)) {
+        // Always six digits.
+        for (int f=0; f<6; f++)
+            if (!isdigit((unsigned char) field[f]))
+                return false;
+
+        d = (field[0] - '0') * 10 + (field[1] - '0');
+        m = (field[2] - '0') * 10 + (field[3] - '0');
+        y = (field[4] - '0') * 10 + (field[5] - '0');
+    }
 
-            default: { // Unknown.
-                goto parse_error;
+    date->day = d;
+    date->month = m;
+    date->year = y;
+    minmea_next_field(c);
+    return true;
+}
+
+static inline bool minmea_scan_time(struct minmea_cursor *c, struct minmea_time *time_)
+{
+    // Time (int, int, int, int), -1 if empty.
+    const char *field = c->field;
+    int h = -1, i = -1, s = -1, u = -1;
+
+    if (field && minmea_isfield(*field)) {
+        // Minimum required: integer time.
+        for (int f=0; f<6; f++)
+            if (!isdigit((unsigned char) field[f]))
+                return false;
+
+        h = (field[0] - '0') * 10 + (field[1] - '0');
+        i = (field[2] - '0') * 10 + (field[3] - '0');
+        s = (field[4] - '0') * 10 + (field[5] - '0');
+        field += 6;
+
+        // Extra: fractional time. Saved as microseconds.
+        if (*field++ == '.') {
+            uint32_t value = 0;
+            uint32_t scale = 1000000LU;
+            while (isdigit((unsigned char) *field) && scale > 1) {
+                value = (value * 10) + (*field++ - '0');
+                scale /= 10;
             }
+            u = value * scale;
+        } else {
+            u = 0;
         }
+    }
+
+    time_->hours = h;
+    time_->minutes = i;
+    time_->seconds = s;
+    time_->microseconds = u;
+    minmea_next_field(c);
+    return true;
+}
+
+static inline bool minmea_scan_skip(struct minmea_cursor *c)
+{
+    // Ignore the field.
+    minmea_next_field(c);
+    return true;
+}
+
+bool minmea_scan(const char *sentence, const char *format, ...)
+{
+    bool result = false;
+    bool optional = false;
+    va_list ap;
+    va_start(ap, format);
+
+    struct minmea_cursor c = { sentence, sentence };
 
-        next_field();
+    while (*format) {
+        char type = *format++;
+        bool ok;
+
+        if (type == ';') {
+            // All further fields are optional.
+            optional = true;
+            continue;
+        }
+
+        if (!c.field && !optional) {
+            // Field requested but we ran out if input. Bail out.
+            goto parse_error;
+        }
+
+        switch (type) {
+            case 'c': ok = minmea_scan_char(&c, va_arg(ap, char *)); break;
+            case 'd': ok = minmea_scan_direction(&c, va_arg(ap, int *)); break;
+            case 'f': ok = minmea_scan_float(&c, va_arg(ap, struct minmea_float *)); break;
+            case 'i': ok = minmea_scan_int(&c, va_arg(ap, int *)); break;
+            case 's': ok = minmea_scan_string(&c, va_arg(ap, char *)); break;
+            case 't': ok = minmea_scan_type(&c, va_arg(ap, char *)); break;
+            case 'D': ok = minmea_scan_date(&c, va_arg(ap, struct minmea_date *)); break;
+            case 'T': ok = minmea_scan_time(&c, va_arg(ap, struct minmea_time *)); break;
+            case '_': ok = minmea_scan_skip(&c); break;
+            default: ok = false; break; // Unknown.
+        }
+
+        if (!ok)
+            goto parse_error;
     }
 
     result = true;
@@ -436,6 +488,81 @@ bool minmea_parse_gga(struct minmea_sentence_gga *frame, const char *sentence)
     return true;
 }
 
+/*
+ * The same as minmea_parse_rmc() and minmea_parse_gga(), with the format
+ * unrolled at compile time: the fields are scanned in a fixed order by the
+ * same scanners, without the varargs and the format walk of minmea_scan().
+ */
+#define MINMEA_FIELD(scanner, ...) \
+    if (!c.field || !scanner(&c, __VA_ARGS__)) \
+        return false
+
+bool minmea_parse_rmc_fast(struct minmea_sentence_rmc *frame, const char *sentence)
+{
+    struct minmea_cursor c = { sentence, sentence };
+    char type[6];
+    char validity;
+    int latitude_direction;
+    int longitude_direction;
+    int variation_direction;
+
+    MINMEA_FIELD(minmea_scan_type, type);
+    if (strcmp(type+2, "RMC"))
+        return false;
+    MINMEA_FIELD(minmea_scan_time, &frame->time);
+    MINMEA_FIELD(minmea_scan_char, &validity);
+    MINMEA_FIELD(minmea_scan_float, &frame->latitude);
+    MINMEA_FIELD(minmea_scan_direction, &latitude_direction);
+    MINMEA_FIELD(minmea_scan_float, &frame->longitude);
+    MINMEA_FIELD(minmea_scan_direction, &longitude_direction);
+    MINMEA_FIELD(minmea_scan_float, &frame->speed);
+    MINMEA_FIELD(minmea_scan_float, &frame->course);
+    MINMEA_FIELD(minmea_scan_date, &frame->date);
+    MINMEA_FIELD(minmea_scan_float, &frame->variation);
+    MINMEA_FIELD(minmea_scan_direction, &variation_direction);
+
+    frame->valid = (validity == 'A');
+    frame->latitude.value *= latitude_direction;
+    frame->longitude.value *= longitude_direction;
+    frame->variation.value *= variation_direction;
+
+    return true;
+}
+
+bool minmea_parse_gga_fast(struct minmea_sentence_gga *frame, const char *sentence)
+{
+    struct minmea_cursor c = { sentence, sentence };
+    char type[6];
+    int latitude_direction;
+    int longitude_direction;
+
+    MINMEA_FIELD(minmea_scan_type, type);
+    if (strcmp(type+2, "GGA"))
+        return false;
+    MINMEA_FIELD(minmea_scan_time, &frame->time);
+    MINMEA_FIELD(minmea_scan_float, &frame->latitude);
+    MINMEA_FIELD(minmea_scan_direction, &latitude_direction);
+    MINMEA_FIELD(minmea_scan_float, &frame->longitude);
+    MINMEA_FIELD(minmea_scan_direction, &longitude_direction);
+    MINMEA_FIELD(minmea_scan_int, &frame->fix_quality);
+    MINMEA_FIELD(minmea_scan_int, &frame->satellites_tracked);
+    MINMEA_FIELD(minmea_scan_float, &frame->hdop);
+    MINMEA_FIELD(minmea_scan_float, &frame->altitude);
+    MINMEA_FIELD(minmea_scan_char, &frame->altitude_units);
+    MINMEA_FIELD(minmea_scan_float, &frame->height);
+    MINMEA_FIELD(minmea_scan_char, &frame->height_units);
+    MINMEA_FIELD(minmea_scan_float, &frame->dgps_age);
+    if (!c.field)
+        return false;
+
+    frame->latitude.value *= latitude_direction;
+    frame->longitude.value *= longitude_direction;
+
+    return true;
+}
+
+#undef MINMEA_FIELD
+
 bool minmea_parse_gsa(struct minmea_sentence_gsa *frame, const char *sentence)
 {
     // $GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1*39
@@ -0,0 +1,97 @@
+/*
+ * 	NMEA sentence assembler, see nmealine.h
+ */
+#include <string.h>
+
+#include <nmealine.h>
+
+static int _hex(char c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+// line is "$...[*hh]" without the line end
+static bool _valid(const char * line, uint8_t len, bool strict)
+{
+	uint8_t sum = 0;
+	uint8_t i;
+
+	for(i = 1; i < len && line[i] != '*'; i++)
+		sum ^= line[i];
+
+	if(i == len)
+		return !strict;
+
+	if(len - i != 3)
+		return false;
+
+	const int hi = _hex(line[i + 1]), lo = _hex(line[i + 2]);
+	return hi >= 0 && lo >= 0 && (hi << 4 | lo) == sum;
+}
+
+
+void nmealine_init(nmealine_t * self, bool strict)
+{
+	memset(self, 0, sizeof(*self));
+	self->strict = strict;
+}
+
+
+const char * nmealine_feed(nmealine_t * self, const uint8_t * data, uint16_t len, uint16_t * used)
+{
+	for(uint16_t i = 0; i < len; i++)
+	{
+		const char c = data[i];
+		char * const line = self->lines[self->current];
+
+		if(c == '$')
+		{
+			if(self->len > 0)
+				self->bad++; //the previous one has not ended
+
+			line[0] = c;
+			self->len = 1;
+			continue;
+		}
+
+		if(self->len == 0)
+			continue; //between sentences
+
+		if(c == '\r')
+			continue; //the line ends with \n, \r is put back below
+
+		if(c == '\n')
+		{
+			const uint8_t linelen = self->len;
+			self->len = 0;
+
+			if(!_valid(line, linelen, self->strict))
+			{
+				self->bad++;
+				continue;
+			}
+
+			memcpy(line + linelen, "\r\n", 3);
+			self->current ^= 1;
+			self->good++;
+
+			*used = i + 1;
+			return line;
+		}
+
+		if(c < 0x20 || c > 0x7E || self->len >= MINMEA_MAX_LENGTH)
+		{
+			self->bad++;
+			self->len = 0;
+			continue;
+		}
+
+		line[self->len++] = c;
+	}
+
+	*used = len;
+	return NULL;
+}
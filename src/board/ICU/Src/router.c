@@ -10,11 +10,11 @@
 #include <FreeRTOS/queue.h>
 
 #include <mavlink/zikush/mavlink.h>
-#include <canmavlink_hal.h>
+#include <main.h>
+#include <zikush_canroutes.h>
 
 #include <router.h>
 
-#include <main.h>
 #include <zikush_config.h>
 
 typedef struct {
@@ -51,6 +51,43 @@ static _ir_divider_t * _ir_divider_find_entry(uint8_t msg_id)
 }
 
 
+// Bulk data takes the radio at ICU_RADIO_BULK_RATE, token bucket in byte-milliseconds. Spectra always go
+// and take their part of it, pictures get what is left; the rest of them stays on SD
+static int32_t _radio_bulk_tokens = ICU_RADIO_BULK_BURST * 1000;
+static TickType_t _radio_bulk_stamp;
+
+static bool _radio_bulk_shape(const mavlink_message_t * msg, bool always)
+{
+	const int32_t cost = (MAVLINK_NUM_NON_PAYLOAD_BYTES + msg->len) * 1000;
+	bool pass = true;
+
+	taskENTER_CRITICAL();
+
+	const TickType_t now = xTaskGetTickCount();
+	const uint32_t elapsed_ms = (now - _radio_bulk_stamp) * portTICK_PERIOD_MS;
+	_radio_bulk_stamp = now;
+
+	// Credit stops at the burst, debt of spectra is paid off at the rate however long the gap
+	const uint32_t room = ICU_RADIO_BULK_BURST * 1000 - _radio_bulk_tokens;
+	if (elapsed_ms >= room / ICU_RADIO_BULK_RATE)
+		_radio_bulk_tokens = ICU_RADIO_BULK_BURST * 1000;
+	else
+		_radio_bulk_tokens += elapsed_ms * ICU_RADIO_BULK_RATE;
+
+	if (always || _radio_bulk_tokens >= cost)
+		_radio_bulk_tokens -= cost;
+	else
+		pass = false;
+
+	taskEXIT_CRITICAL();
+
+	if (!pass)
+		global_stats.radio_bulk_shaped++;
+
+	return pass;
+}
+
+
 extern QueueHandle_t	ICU_queue_handle;
 extern QueueHandle_t	can_queue_handle;
 extern QueueHandle_t	sd_queue_handle;
@@ -58,13 +95,13 @@ extern QueueHandle_t	radio_queue_handle;
 
 static bool _table_ICU(mavlink_message_t * msg);
 static bool _table_CAN(mavlink_message_t * msg);
-static bool _table_SD(mavlink_message_t * msg);
+static bool _table_SD(mavlink_message_t * msg, bool stored);
 static bool _table_radio(mavlink_message_t * msg);
 static bool _table_Iridium(mavlink_message_t * msg);
 
-router_status_t router_route(mavlink_message_t * msg, TickType_t xTicksToWait)
+static router_status_t _route(mavlink_message_t * msg, TickType_t xTicksToWait, bool stored)
 {
-	if(_table_SD(msg))
+	if(_table_SD(msg, stored))
 	{
 		if (xQueueSendToBack(sd_queue_handle, msg, xTicksToWait) != pdTRUE)
 			global_stats.rt_drops_sd++;
@@ -96,12 +133,25 @@ router_status_t router_route(mavlink_message_t * msg, TickType_t xTicksToWait)
 	{
 		if (xQueueSendToBack(iridium_queue_handle, msg, xTicksToWait) != pdTRUE)
 			global_stats.rt_drops_iridium++;
+
+		xTaskNotifyGive(iridium_task_handle);
 	}
 
 	return ROUTER_OK;
 }
 
 
+router_status_t router_route(mavlink_message_t * msg, TickType_t xTicksToWait)
+{
+	return _route(msg, xTicksToWait, false);
+}
+
+router_status_t router_route_stored(mavlink_message_t * msg, TickType_t xTicksToWait)
+{
+	return _route(msg, xTicksToWait, true);
+}
+
+
 bool router_set_ir_divider(uint8_t mav_msg_id, uint16_t divider)
 {
 	_ir_divider_t * const entry = _ir_divider_find_entry(mav_msg_id);
@@ -114,11 +164,21 @@ bool router_set_ir_divider(uint8_t mav_msg_id, uint16_t divider)
 
 
 /*Routing 'tables'*/
-static bool _table_SD(mavlink_message_t * msg)
+static bool _table_SD(mavlink_message_t * msg, bool stored)
 {
 	if (NULL == sd_task_handle || NULL == sd_queue_handle)
 		return false;
 
+	if (stored)
+	{
+		switch (msg->msgid)
+		{
+		case MAVLINK_MSG_ID_ENCAPSULATED_DATA:
+		case MAVLINK_MSG_ID_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA:
+			return false; // Уже лежит на карте как есть, в общий лог только заголовки
+		}
+	}
+
 	return msg != NULL;
 }
 
@@ -127,11 +187,11 @@ static bool _table_CAN(mavlink_message_t * msg)
 	if (NULL == can_task_handle || NULL == can_queue_handle)
 		return false;
 
-	if(msg->sysid != 0)
-		return true;
+	if(msg->sysid == 0)
+		return false; // Onboard messages are on the bus already
 
-	// На данный момент в CAN не форвардится ничего
-	return false;
+	// Only what some other node takes, the rest would be dropped by their filters anyway
+	return (zikush_canroute_nodes(msg->msgid) & ~ZIKUSH_CANROUTE_ICU) != 0;
 }
 
 static bool _table_radio(mavlink_message_t * msg)
@@ -139,10 +199,19 @@ static bool _table_radio(mavlink_message_t * msg)
 	if (NULL == radio_task_handle || NULL == radio_queue_handle)
 		return false;
 
-	if(msg->sysid == 0)
-		return true;
+	if(msg->sysid != 0)
+		return false;
 
-	return false;
+	switch (msg->msgid)
+	{
+	case MAVLINK_MSG_ID_ENCAPSULATED_DATA:
+		return _radio_bulk_shape(msg, false);
+
+	case MAVLINK_MSG_ID_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA:
+		return _radio_bulk_shape(msg, true);
+	}
+
+	return true;
 }
 
 static bool _table_Iridium(mavlink_message_t * msg)
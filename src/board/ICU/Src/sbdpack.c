@@ -0,0 +1,213 @@
+/*
+ * 	Packing of Iridium SBD sessions, see sbdpack.h
+ */
+#include <stdbool.h>
+#include <string.h>
+
+#include <mavlink/zikush/mavlink.h>
+#include <sbdpack.h>
+
+#include <zikush_config.h>
+
+#if ICU_IR_PACK_SLOTS > 32
+#error "sbdpack keeps chosen slots in a 32 bit mask"
+#endif
+
+typedef struct {
+	uint32_t msgid;
+	uint8_t weight;
+} _sbdpack_weight_t;
+
+// Stream weights, anything not listed weighs 1
+static const _sbdpack_weight_t _weights[] = {
+		{ MAVLINK_MSG_ID_HIL_GPS, 4 }, //where to look for the probe
+		{ MAVLINK_MSG_ID_ZIKUSH_POWER_STATE, 2 },
+		{ MAVLINK_MSG_ID_ZIKUSH_ICU_STATS, 2 },
+		{ MAVLINK_MSG_ID_ZIKUSH_PICTURE_HEADER, 2 },
+		{ MAVLINK_MSG_ID_ZIKUSH_SPECTRUM_INTENSITY_HEADER, 2 },
+};
+
+typedef struct {
+	uint8_t frame[ICU_IR_PACK_FRAMESIZE];
+	uint8_t len;		//0 if the slot is free
+	uint8_t compid;
+	uint8_t waited;		//sessions the stream has been passed over
+	uint32_t msgid;
+	uint32_t seq;		//arrival order
+	uint32_t stamp;		//arrival time
+} _sbdpack_slot_t;
+
+static _sbdpack_slot_t _pool[ICU_IR_PACK_SLOTS];
+static uint32_t _seq;
+
+// Knapsack tables, too large for the task stack
+static uint32_t _best[ICU_IR_TX_ACCUMULATOR_SIZE + 1];
+static uint32_t _chosen[ICU_IR_TX_ACCUMULATOR_SIZE + 1];
+
+
+static uint8_t _weight(uint32_t msgid)
+{
+	for(int i = 0; i < sizeof(_weights) / sizeof(_weights[0]); i++)
+		if(_weights[i].msgid == msgid)
+			return _weights[i].weight;
+
+	return 1;
+}
+
+static bool _same_stream(const _sbdpack_slot_t * a, const _sbdpack_slot_t * b)
+{
+	return a->msgid == b->msgid && a->compid == b->compid;
+}
+
+// Value of a sample, with its length below for ties. Weights are small, so 32 of those fit
+static uint32_t _value(uint8_t weight, uint8_t waited, uint8_t newer, uint16_t len)
+{
+	if(newer > 6)
+		newer = 6; //older ones are worth the same, more than any length still
+
+	return ((uint32_t)weight * (1 + waited) << 16 >> newer) + len;
+}
+
+static uint32_t _slot_value(int index)
+{
+	const _sbdpack_slot_t * slot = &_pool[index];
+	uint8_t newer = 0;
+
+	for(int i = 0; i < ICU_IR_PACK_SLOTS; i++)
+		if(_pool[i].len && _same_stream(&_pool[i], slot) && _pool[i].seq > slot->seq)
+			newer++;
+
+	return _value(_weight(slot->msgid), slot->waited, newer, slot->len);
+}
+
+
+bool sbdpack_put(uint32_t msgid, uint8_t compid, const uint8_t * frame, uint8_t len, uint32_t stamp)
+{
+	if(!len || len > ICU_IR_PACK_FRAMESIZE)
+		return false;
+
+	_sbdpack_slot_t probe = { .msgid = msgid, .compid = compid };
+	int index = -1;
+
+	// A new sample waits as long as its stream does
+	for(int i = 0; i < ICU_IR_PACK_SLOTS; i++)
+	{
+		if(!_pool[i].len)
+		{
+			if(index < 0) index = i;
+		}
+		else if(_same_stream(&_pool[i], &probe) && _pool[i].waited > probe.waited)
+			probe.waited = _pool[i].waited;
+	}
+
+	if(index < 0)
+	{
+		uint32_t least = UINT32_MAX;
+
+		for(int i = 0; i < ICU_IR_PACK_SLOTS; i++)
+		{
+			uint32_t value = _slot_value(i);
+			if(value < least)
+			{
+				least = value;
+				index = i;
+			}
+		}
+
+		if(_value(_weight(msgid), probe.waited, 0, len) < least)
+			return false;
+	}
+
+	_sbdpack_slot_t * slot = &_pool[index];
+	memcpy(slot->frame, frame, len);
+	slot->len = len;
+	slot->compid = probe.compid;
+	slot->msgid = probe.msgid;
+	slot->waited = probe.waited;
+	slot->seq = _seq++;
+	slot->stamp = stamp;
+
+	return true;
+}
+
+uint16_t sbdpack_pending(void)
+{
+	uint16_t pending = 0;
+
+	for(int i = 0; i < ICU_IR_PACK_SLOTS; i++)
+		pending += _pool[i].len;
+
+	return pending;
+}
+
+uint16_t sbdpack_pack(uint8_t * buff, uint16_t size, sbdpack_stamps_t * stamps)
+{
+	uint32_t values[ICU_IR_PACK_SLOTS];
+
+	if(size > ICU_IR_TX_ACCUMULATOR_SIZE)
+		size = ICU_IR_TX_ACCUMULATOR_SIZE;
+
+	for(int i = 0; i < ICU_IR_PACK_SLOTS; i++)
+		values[i] = _pool[i].len ? _slot_value(i) : 0;
+
+	// _best[c] is the most a set no longer than c is worth, _chosen[c] is the set
+	memset(_best, 0, sizeof(_best));
+	memset(_chosen, 0, sizeof(_chosen));
+
+	for(int i = 0; i < ICU_IR_PACK_SLOTS; i++)
+	{
+		uint8_t len = _pool[i].len;
+		if(!len)
+			continue;
+
+		for(int c = size; c >= len; c--)
+		{
+			if(_best[c - len] + values[i] > _best[c])
+			{
+				_best[c] = _best[c - len] + values[i];
+				_chosen[c] = _chosen[c - len] | (1UL << i);
+			}
+		}
+	}
+
+	uint32_t chosen = _chosen[size];
+
+	// Streams passed over wait one more session, those which got through start again
+	for(int i = 0; i < ICU_IR_PACK_SLOTS; i++)
+	{
+		if(!_pool[i].len || (chosen & (1UL << i)))
+			continue;
+
+		bool sent = false;
+		for(int j = 0; j < ICU_IR_PACK_SLOTS; j++)
+			if((chosen & (1UL << j)) && _same_stream(&_pool[i], &_pool[j]))
+				sent = true;
+
+		if(sent)
+			_pool[i].waited = 0;
+		else if(_pool[i].waited < UINT8_MAX)
+			_pool[i].waited++;
+	}
+
+	// Oldest first, so samples of a stream go in order
+	uint16_t written = 0;
+	stamps->count = 0;
+	stamps->stamp_sum = 0;
+	while(chosen)
+	{
+		int oldest = -1;
+		for(int i = 0; i < ICU_IR_PACK_SLOTS; i++)
+			if((chosen & (1UL << i)) && (oldest < 0 || _pool[i].seq < _pool[oldest].seq))
+				oldest = i;
+
+		memcpy(buff + written, _pool[oldest].frame, _pool[oldest].len);
+		written += _pool[oldest].len;
+		stamps->count++;
+		stamps->stamp_sum += _pool[oldest].stamp;
+
+		_pool[oldest].len = 0;
+		chosen &= ~(1UL << oldest);
+	}
+
+	return written;
+}
@@ -47,6 +47,8 @@ void HAL_CAN_MspInit(CAN_HandleTypeDef* hcan)
 		/* CAN1 interrupt Init */
 		HAL_NVIC_SetPriority(USB_LP_CAN1_RX0_IRQn, ICU_CAN_IRQ_PRIO, 0);
 		HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+		HAL_NVIC_SetPriority(USB_HP_CAN1_TX_IRQn, ICU_CAN_IRQ_PRIO, 0);
+		HAL_NVIC_EnableIRQ(USB_HP_CAN1_TX_IRQn);
 	}
 }
 
@@ -71,6 +73,7 @@ void HAL_CAN_MspDeInit(CAN_HandleTypeDef* hcan)
 
 		/* CAN1 interrupt DeInit */
 		HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+		HAL_NVIC_DisableIRQ(USB_HP_CAN1_TX_IRQn);
 	}
 }
 
@@ -7,7 +7,10 @@
 
 #include <main.h>
 
+#include <zikush_canroutes.h>
 #include <canmavlink_hal.h>
+#include <canmavlink_bulk.h>
+#include <canmavlink_stats.h>
 
 
 static CAN_HandleTypeDef hcan;
@@ -21,14 +24,172 @@ static StaticQueue_t _rxqueue;
 static CANMAVLINK_RX_FRAME_T _rxbuff[ICU_CAN_RXBUFFSIZE];
 static QueueHandle_t	_rxqueue_handle;
 
+// TX frames ring. Filled by the task, emptied into mailboxes by the TX IRQ (and by the task with IRQs masked)
+typedef struct {
+	CANMAVLINK_TX_FRAME_T frame;
+	bool last; //last frame of a MAVLink message
+} _txslot_t;
+
+static _txslot_t _txring[ICU_CAN_TXRINGSIZE];
+static volatile uint16_t _txhead, _txtail;
+static bool _mailbox_last[3]; //whether a frame in the mailbox finishes a message
+
+static canmavlink_stats_t _stats;
+
+static uint16_t _txring_free(void)
+{
+	return (_txtail + ICU_CAN_TXRINGSIZE - _txhead - 1) % ICU_CAN_TXRINGSIZE;
+}
+
+// Loads every free mailbox. Transmit FIFO priority is on, so frames go out in the order they are loaded
+static void _tx_refill(void)
+{
+	while(_txtail != _txhead && HAL_CAN_GetTxMailboxesFreeLevel(&hcan) > 0)
+	{
+		_txslot_t * slot = &_txring[_txtail];
+		uint32_t mailbox;
+
+		if(HAL_CAN_AddTxMessage(&hcan, &( slot->frame.Header ), slot->frame.Data, &mailbox) != HAL_OK)
+			break;
+
+		_mailbox_last[mailbox >> 1] = slot->last; //CAN_TX_MAILBOX0..2 are 1, 2, 4
+		_txtail = (_txtail + 1) % ICU_CAN_TXRINGSIZE;
+	}
+}
+
+// Puts a message to the ring if all its frames fit
+static bool _tx_push(mavlink_message_t * msg)
+{
+	static CANMAVLINK_TX_FRAME_T framebuff[CANMAVLINK_MAXFRAMES];
+#if PROBEWIDE_CAN_EXTID
+	uint8_t framecount = canmavlink_msg_to_frames_shortest(framebuff, msg);
+#else
+	uint8_t framecount = canmavlink_msg_to_frames(framebuff, msg);
+#endif
+
+	if(framecount == 0 || _txring_free() < framecount)
+		return false;
+
+	uint16_t head = _txhead;
+	for(int i = 0; i < framecount; i++)
+	{
+		_txring[head].frame = framebuff[i];
+		_txring[head].last = (i == framecount - 1);
+		head = (head + 1) % ICU_CAN_TXRINGSIZE;
+	}
+
+	__DMB(); //The IRQ should see the whole message at once
+	_txhead = head;
+
+	return true;
+}
+
+
+// Bulk transfer from the CCU, see canmavlink_bulk.h. One at a time, a new header takes the place
+static canmavlink_bulk_rx_t _bulk;
+static uint8_t _bulk_window; //the last one sent
+
+// Packets in flight the ICU takes now: a received one goes to the SD queue first
+static uint8_t _bulk_credit(void)
+{
+	UBaseType_t spaces = uxQueueSpacesAvailable(sd_queue_handle);
+	return spaces < PROBEWIDE_CAN_BULK_WINDOW ? spaces : PROBEWIDE_CAN_BULK_WINDOW;
+}
+
+static void _bulk_ack(void)
+{
+	mavlink_message_t msg;
+	mavlink_zikush_bulk_ack_t ack = {
+		.target_compid = _bulk.compid,
+		.msgid = _bulk.msgid,
+		.next = _bulk.next,
+		.received = _bulk.received,
+		.window = _bulk_credit()
+	};
+
+	mavlink_msg_zikush_bulk_ack_encode(0, ZIKUSH_ICU, &msg, &ack);
+
+	// Lost with no ring room, the sender times out and sends again then
+	_bulk_window = _tx_push(&msg) ? ack.window : 0;
+}
+
+// Accounts headers and data of bulk transfers. False if a message is a duplicate and should be dropped
+static bool _bulk_receive(mavlink_message_t * msg)
+{
+	uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+
+	switch(msg->msgid)
+	{
+	case MAVLINK_MSG_ID_DATA_TRANSMISSION_HANDSHAKE:
+		canmavlink_bulk_rx_start(&_bulk, msg->compid, MAVLINK_MSG_ID_ENCAPSULATED_DATA, mavlink_msg_data_transmission_handshake_get_packets(msg), now);
+		break;
+
+	case MAVLINK_MSG_ID_ZIKUSH_PICTURE_HEADER:
+		canmavlink_bulk_rx_start(&_bulk, msg->compid, MAVLINK_MSG_ID_ENCAPSULATED_DATA, mavlink_msg_zikush_picture_header_get_packets(msg), now);
+		break;
+
+	case MAVLINK_MSG_ID_ZIKUSH_SPECTRUM_INTENSITY_HEADER:
+		canmavlink_bulk_rx_start(&_bulk, msg->compid, MAVLINK_MSG_ID_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA,
+				mavlink_msg_zikush_spectrum_intensity_header_get_packets(msg), now);
+		break;
+
+	case MAVLINK_MSG_ID_ENCAPSULATED_DATA:
+	case MAVLINK_MSG_ID_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA:
+		if(!_bulk.active || msg->msgid != _bulk.msgid || msg->compid != _bulk.compid)
+			return true;
+
+		// seqnr is the first field of both
+		if(!canmavlink_bulk_rx_packet(&_bulk, mavlink_msg_encapsulated_data_get_seqnr(msg), now))
+		{
+			_bulk_ack(); //the acknowledgment could be lost
+			return false;
+		}
+		break;
+
+	default:
+		return true;
+	}
+
+	_bulk_ack();
+	return true;
+}
+
+// Sends ZIKUSH_CAN_STATS every PROBEWIDE_CAN_STATS_PERIOD_MS, to SD and the radio
+static void _stats_update(void)
+{
+	uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+
+	if(now - _stats.stamp < PROBEWIDE_CAN_STATS_PERIOD_MS)
+		return;
+
+	mavlink_message_t msg;
+	mavlink_zikush_can_stats_t report;
+
+	canmavlink_stats_report(&_stats, hcan.Instance, now, &report);
+	report.reasm_evicted = canmavlink_get_reasm()->evicted;
+
+	mavlink_msg_zikush_can_stats_encode(0, ZIKUSH_ICU, &msg, &report);
+	router_route(&msg, 0);
+}
+
+// Reopens a closed window once there is room again, the sender would wait forever otherwise
+static void _bulk_update(void)
+{
+	if(!_bulk.active || canmavlink_bulk_rx_done(&_bulk))
+		return;
+
+	if(xTaskGetTickCount() * portTICK_PERIOD_MS - _bulk.stamp > PROBEWIDE_CAN_BULK_ABORT_MS)
+		_bulk.active = false;
+	else if(_bulk_window == 0 && _bulk_credit() > 0)
+		_bulk_ack();
+}
+
 
 void can_task (void *pvParameters)
 {
 	CANMAVLINK_RX_FRAME_T receivedframe;
 	mavlink_message_t msg;
 
-	mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
-
 	MX_CAN_Init();
 	can_init();
 
@@ -36,7 +197,8 @@ void can_task (void *pvParameters)
 
 	while(1)
 	{
-		xTaskNotifyWait(0, 0, NULL, 0xFFFFFFFF);
+		// While a bulk transfer is open the window is looked after, see _bulk_update()
+		xTaskNotifyWait(0, 0, NULL, pdMS_TO_TICKS(_bulk.active ? PROBEWIDE_CAN_BULK_RTO_MS / 4 : PROBEWIDE_CAN_STATS_PERIOD_MS));
 
 		while( xQueueReceive(_rxqueue_handle, &receivedframe, 0) != errQUEUE_EMPTY )
 		{
@@ -47,31 +209,23 @@ void can_task (void *pvParameters)
 
 			if(result == MAVLINK_FRAMING_OK)
 			{
-				router_route(&msg, 0);
+				if(_bulk_receive(&msg))
+					router_route(&msg, 0);
 				global_stats.can_rx_mav++;
 			}
 		}
 
-		while( xQueueReceive(can_queue_handle,&msg, 0) != errQUEUE_EMPTY )
-		{
-			canmavlink_TX_frame_t framebuff[34];
-			uint8_t framecount = canmavlink_msg_to_frames(framebuff, &msg);
-
-			for(int i = 0; i < framecount; i++)
-			{
-				uint32_t mailbox;
-				HAL_CAN_AddTxMessage(&hcan, &( framebuff[i].Header ), framebuff[i].Data, &mailbox);
-
-				bool pending;
-				do {
-					pending = HAL_CAN_IsTxMessagePending(&hcan, mailbox); //TODO consider yielding here, but notice that for proper canmavlink functionality messages should come serially
-				} while(pending);
+		_bulk_update();
+		_stats_update();
 
-				global_stats.can_tx++;
-			}
+		// Messages are taken only when the whole message fits, the rest waits in the queue
+		// until the TX IRQ reports some message is out
+		while( _txring_free() >= CANMAVLINK_MAXFRAMES && xQueueReceive(can_queue_handle,&msg, 0) != errQUEUE_EMPTY )
+			_tx_push(&msg);
 
-			global_stats.can_tx_mav++;
-		}
+		taskENTER_CRITICAL();
+		_tx_refill();
+		taskEXIT_CRITICAL();
 	}
 
 	vTaskDelete(NULL);
@@ -81,21 +235,15 @@ static void can_init()
 {
 	HAL_CAN_Start(&hcan);
 
-	CAN_FilterTypeDef filter = {
-		.FilterMaskIdHigh = 0,
-		.FilterMaskIdLow = 0,
-		.FilterMode = CAN_FILTERMODE_IDMASK,
-		.FilterActivation = CAN_FILTER_ENABLE,
-		.FilterFIFOAssignment = CAN_FILTER_FIFO0,
-		.FilterScale = CAN_FILTERSCALE_16BIT,
-		.FilterBank = 0,
-		.SlaveStartFilterBank = 14,
-	};
-
-	HAL_CAN_ConfigFilter(&hcan, &filter);
+	// Only messages routed to the ICU pass, the rest never makes an interrupt
+	canmavlink_filter_t filters[ZIKUSH_CANROUTES_COUNT];
+	uint8_t filtercount = canmavlink_filters_build(filters, CANMAVLINK_FILTERS_CAPACITY(PROBEWIDE_CAN_FILTERBANKS, PROBEWIDE_CAN_EXTID),
+			zikush_canroutes, ZIKUSH_CANROUTES_COUNT, ZIKUSH_ICU);
+	canmavlink_filters_apply(hcan.Instance, 0, PROBEWIDE_CAN_FILTERBANKS, filters, filtercount, PROBEWIDE_CAN_EXTID);
 
 	hcan.Instance->IER |= CAN_IER_FMPIE0;
 	hcan.Instance->IER |= CAN_IER_FOVIE0;
+	hcan.Instance->IER |= CAN_IER_TMEIE;
 }
 
 /**
@@ -106,8 +254,7 @@ void USB_LP_CAN1_RX0_IRQHandler(void)
 	CANMAVLINK_RX_FRAME_T receivedframe;
 	BaseType_t callcontextswitch = false;
 
-	if(hcan.Instance->RF0R & CAN_RF0R_FOVR0) //Handling overrun condition
-		hcan.Instance->RF0R |= CAN_RF0R_RFOM0;
+	canmavlink_stats_rx_overrun(&_stats, hcan.Instance);
 
 	uint8_t filllevel = hcan.Instance->RF0R & CAN_RF0R_FMP0;
 	for(uint8_t i = 0; i < filllevel; i++)
@@ -115,7 +262,9 @@ void USB_LP_CAN1_RX0_IRQHandler(void)
 		if( HAL_CAN_GetRxMessage(&hcan, CAN_RX_FIFO0, &( receivedframe.Header ), receivedframe.Data) != HAL_OK)
 			continue;
 
-		xQueueSendToBackFromISR(_rxqueue_handle, &receivedframe, &callcontextswitch);
+		canmavlink_stats_rx(&_stats, receivedframe.Header.IDE == CAN_ID_EXT, receivedframe.Header.DLC);
+		if(xQueueSendToBackFromISR(_rxqueue_handle, &receivedframe, &callcontextswitch) != pdTRUE)
+			_stats.rx_dropped++;
 	}
 
 	xTaskNotifyFromISR(can_task_handle, 0, eNoAction, &callcontextswitch);
@@ -123,6 +272,43 @@ void USB_LP_CAN1_RX0_IRQHandler(void)
 	portEND_SWITCHING_ISR(callcontextswitch);
 }
 
+/**
+  * @brief This function handles USB high priority or CAN TX interrupts.
+  */
+void USB_HP_CAN1_TX_IRQHandler(void)
+{
+	static const uint32_t rqcp[3] = { CAN_TSR_RQCP0, CAN_TSR_RQCP1, CAN_TSR_RQCP2 };
+	static const uint32_t txok[3] = { CAN_TSR_TXOK0, CAN_TSR_TXOK1, CAN_TSR_TXOK2 };
+	BaseType_t callcontextswitch = false;
+	bool msgdone = false;
+
+	uint32_t tsr = hcan.Instance->TSR;
+	for(int i = 0; i < 3; i++)
+	{
+		if( !(tsr & rqcp[i]) )
+			continue;
+
+		hcan.Instance->TSR = rqcp[i]; //Clears RQCP, TXOK, ALST and TERR of the mailbox
+
+		if(tsr & txok[i])
+			global_stats.can_tx++;
+		canmavlink_stats_tx_done(&_stats, hcan.Instance, i, tsr);
+
+		if(_mailbox_last[i])
+		{
+			global_stats.can_tx_mav++;
+			msgdone = true;
+		}
+	}
+
+	_tx_refill();
+
+	if(msgdone) //There is room for one more message at least
+		xTaskNotifyFromISR(can_task_handle, 0, eNoAction, &callcontextswitch);
+
+	portEND_SWITCHING_ISR(callcontextswitch);
+}
+
 //Those functions has been fetched from CubeMX generated code
 /**
   * @brief CAN Initialization Function
@@ -140,9 +326,9 @@ static void MX_CAN_Init(void)
 	hcan.Init.TimeTriggeredMode = DISABLE;
 	hcan.Init.AutoBusOff = DISABLE;
 	hcan.Init.AutoWakeUp = DISABLE;
-	hcan.Init.AutoRetransmission = DISABLE;
+	hcan.Init.AutoRetransmission = ENABLE; //A frame losing arbitration waits for the bus, latencies in zikush_canroutes.h count on it
 	hcan.Init.ReceiveFifoLocked = DISABLE;
-	hcan.Init.TransmitFifoPriority = DISABLE;
+	hcan.Init.TransmitFifoPriority = ENABLE; //Frames of a message should leave mailboxes in order
 	if (HAL_CAN_Init(&hcan) != HAL_OK)
 	{
 		Error_Handler();
@@ -1,5 +1,5 @@
 /*
- * Camera backbone task. Receives pictures over UART2 and reintegrates it to on-board network
+ * Camera backbone task. Receives pictures over UART2, keeps them on SD and reintegrates them to on-board network
  */
 
 #include <FreeRTOS.h>
@@ -13,141 +13,129 @@
 #include <stm32f1xx_hal_uart.h>
 #include <stm32f1xx_hal_rcc.h>
 
+#include <mavlink/zikush/mavlink.h>
+
+#include <uartrx.h>
+#include <router.h>
+
 #include <zikush_config.h>
 
-typedef struct {
-	uint8_t data[ICU_CBBNE_BUFFLEN];
-	uint16_t txpointer;
-	void * next;
-} cbbne_buffer_t;
+extern TaskHandle_t cbbne_task_handle;
 
-static cbbne_buffer_t buffers[ICU_CBBNE_BUFFCOUNT];
+// DMA writes the stream into ICU_CBBNE_BUFFCOUNT blocks in a ring, the ISR only counts what has come
+// and wakes the task. It goes to the card as is, and back to the on-board network as MAVLink
+static uint8_t _rxbuff[ICU_CBBNE_BUFFLEN * ICU_CBBNE_BUFFCOUNT];
+static uartrx_t _rx;
 
-cbbne_buffer_t * cbbne_list_root = buffers + 0;
+static mavlink_message_t _msg;
+static mavlink_status_t _status;
 
 static UART_HandleTypeDef huart2;
 
 static void uart_init(void);
 
-cbbne_buffer_t * linkedlist_last(cbbne_buffer_t * root)
-{
-	while(root->next != NULL)
-		root = (cbbne_buffer_t *) root->next;
-	return root;
-}
-
-cbbne_buffer_t * linkedlist_firstnotfull(cbbne_buffer_t * root)
-{
-	while(root->next != NULL && root->txpointer == ICU_CBBNE_BUFFLEN)
-		root = (cbbne_buffer_t *) root->next;
-	return root;
-}
 
-void cbbne_task (void *pvParameters)
+static void _file_write(FIL * file, const uint8_t * data, uint16_t len)
 {
-	static FIL file;
 	static int16_t filenum = -1;
 
-	buffers[ICU_CBBNE_BUFFCOUNT - 1].txpointer = 0;
-	for(int i = 0; i < ICU_CBBNE_BUFFCOUNT - 1; i++)
+	if(file->fs == NULL || file->fsize > ICU_SD_MAXFILELEN)
 	{
-		buffers[i].next = buffers + i + 1;
-		buffers[i].txpointer = 0;
+		filenum += 1;
+
+		if(file->fs != NULL)
+		{
+			f_sync(file);
+			f_close(file);
+		}
+
+		char filename[ICU_SD_MAXFILENAMELEN];
+		sprintf(filename, ICU_SD_TELFILENAMEFMT, zikush_runsessnum, "spectr", filenum);
+
+		f_open(file, filename, FA_CREATE_NEW | FA_WRITE);
 	}
 
-	uart_init();
+	UINT infactwritten = 0;
+	f_write(file, data, len, &infactwritten);
+	global_stats.cbbne_rx += infactwritten;
+}
 
-	static uint32_t allwritten;
 
-	while(1)
+// Messages of the CCU off the stream, to the router. No waiting for queues, the ring should keep draining:
+// the radio takes bulk at its own rate (see router.c), what does not fit is left to the card. Bulk data
+// is in the spectr file already, it doesn't go to the SD log
+static void _reintegrate(const uint8_t * data, uint16_t len)
+{
+	for(uint16_t i = 0; i < len; i++)
 	{
-		if(cbbne_list_root->txpointer == ICU_CBBNE_BUFFLEN)
+		if(mavlink_parse_char(ICU_CBBNE_MAVLINK_CHAN, data[i], &_msg, &_status))
 		{
-			xSemaphoreTake(sd_mutex_handle, portMAX_DELAY);
-
-			if(file.fs == NULL || file.fsize > ICU_SD_MAXFILELEN)
-			{
-				filenum += 1;
+			global_stats.cbbne_rx_mav++;
+			router_route_stored(&_msg, 0);
+		}
+	}
+}
 
-				if(file.fs != NULL)
-				{
-					f_sync(&file);
-					f_close(&file);
-				}
 
-				char filename[ICU_SD_MAXFILENAMELEN];
-				sprintf(filename, ICU_SD_TELFILENAMEFMT, zikush_runsessnum, "spectr", filenum);
+void cbbne_task (void *pvParameters)
+{
+	static FIL file;
+	const uint8_t * span;
+	uint16_t span_len;
+	bool unsynced = false;
 
-				f_open(&file, filename, FA_CREATE_NEW | FA_WRITE);
-			}
+	uart_init();
 
-			UINT infactwritten;
-			FRESULT result = f_write(&file, cbbne_list_root->data, ICU_CBBNE_BUFFLEN, &infactwritten);
-			allwritten += infactwritten;
+	while(1)
+	{
+		// Woken on each half of the ring and when the line goes quiet, that is after every message of the CCU.
+		// Nothing for a period - the picture is over
+		const bool quiet = 0 == ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ICU_CBBNE_PERIOD_MS));
 
-			result = f_sync(&file);
+		global_stats.cbbne_lost = _rx.overruns;
+		global_stats.cbbne_errors = _rx.errors;
 
+		// FatFs keeps partial sectors in the file buffer, small writes are cheap
+		while( (span_len = uartrx_span(&_rx, &span)) > 0 )
+		{
+			xSemaphoreTake(sd_mutex_handle, portMAX_DELAY);
+			_file_write(&file, span, span_len);
 			xSemaphoreGive(sd_mutex_handle);
 
-			HAL_NVIC_DisableIRQ(USART2_IRQn);
-			linkedlist_last(cbbne_list_root)->next = cbbne_list_root;
-			cbbne_buffer_t * nextroot = (cbbne_buffer_t *) cbbne_list_root->next;
-			cbbne_list_root->next = NULL;
-			cbbne_list_root->txpointer = 0;
-			cbbne_list_root = nextroot;
-			HAL_NVIC_EnableIRQ(USART2_IRQn);
+			_reintegrate(span, span_len);
+
+			uartrx_consume(&_rx, span_len);
+			unsynced = true;
 		}
 
-		vTaskDelay(ICU_CBBNE_PERIOD_MS * portTICK_PERIOD_MS);
+		// The directory entry is updated once per picture, not for every write
+		if(quiet && unsynced)
+		{
+			xSemaphoreTake(sd_mutex_handle, portMAX_DELAY);
+			f_sync(&file);
+			xSemaphoreGive(sd_mutex_handle);
+			unsynced = false;
+		}
 	}
 
 	vTaskDelete(NULL);
 }
 
-/**
-  * @brief This function handles USB low priority or CAN RX0 interrupts.
-  */
+
 void USART2_IRQHandler(void)
 {
-	UART_HandleTypeDef * const huart = &huart2;
-	BaseType_t callcontextswitch = false;
-
-	uint32_t isrflags   = READ_REG(huart->Instance->SR);
-	uint32_t errorflags = 0x00U;
-
-	/* If no error occurs */
-	errorflags = (isrflags & (uint32_t)(USART_SR_PE | USART_SR_FE | USART_SR_ORE | USART_SR_NE));
-	/* UART in mode Receiver -------------------------------------------------*/
-	if( (isrflags & USART_SR_RXNE) != RESET) //TODO while
-	{
-		cbbne_buffer_t * buff = linkedlist_firstnotfull(cbbne_list_root);
-		if(buff->txpointer == ICU_CBBNE_BUFFLEN)
-			goto buffers_full;
-		buff->data[buff->txpointer++] = (uint8_t)(huart->Instance->DR & 0xFF);
-	}
+	uartrx_usart_irq(&_rx);
+}
 
-buffers_full:
 
-	/* If some errors occur */
-	if(errorflags != RESET)
-	{
-		// Если у нас случилась ошибка и зажегся какой-то бит ошибки
-		// никто за нас его не снимет
-		// Сдалем вид что не было никакой ошибки и продолжим работать
-		// Ошибки пускай ловит драйвер выше. Тут слишком геморно передавать наверх что случилось
-
-		// Сбрасываем все биты ошибок
-		// Согласно даташиту такая последовательность должна помочь
-		__disable_irq();
-		READ_REG(huart->Instance->SR);
-		READ_REG(huart->Instance->DR); // надеемся, что там ничего не повяилось с тех пор как мы проверяли последний раз
-		__enable_irq();
-	} /* End if some error occurs */
+void DMA1_Channel6_IRQHandler(void)
+{
+	uartrx_dma_irq(&_rx);
 }
 
 //Those functions has been fetched from CubeMX generated code
 /**
-  * @brief CAN Initialization Function
+  * @brief USART2 Initialization Function
   * @param None
   * @retval None
   */
@@ -175,8 +163,7 @@ static void uart_init(void)
 	huart2.Init.HwFlowCtl = UART_HWCONTROL_NONE;
 	HAL_UART_Init(&huart2);
 
-	__HAL_UART_ENABLE_IT(&huart2, UART_IT_RXNE);
-	__HAL_UART_ENABLE_IT(&huart2, UART_IT_ERR);
+	uartrx_start(&_rx, USART2, 6, _rxbuff, sizeof(_rxbuff), &cbbne_task_handle, ICU_CBBNE_IRQ_PRIO);
 
 	HAL_NVIC_SetPriority(USART2_IRQn, ICU_CBBNE_IRQ_PRIO, 0);
 	HAL_NVIC_EnableIRQ(USART2_IRQn);
@@ -11,123 +11,90 @@
 #include <stm32f1xx_hal_uart.h>
 #include <stm32f1xx_hal_rcc.h>
 
-#include <minmea.h>
-#define NMEA_MAX_LENGTH	(MINMEA_MAX_LENGTH + 3)
+#include <gpsfix.h>
+#include <nmealine.h>
+#include <uartrx.h>
 
 static UART_HandleTypeDef huart3;
 
+// The UART never stops: DMA fills the ring, sentences are put together straight from it
+static uint8_t _rxbuff[ICU_GPS_RXBUFFLEN];
+static uartrx_t _rx;
+static nmealine_t _lines;
+static gpsfix_t _fix;
+
 
 static void uart_init(void);
 
-static char _rxbuff[NMEA_MAX_LENGTH];
-static uint8_t _rxbuff_received = 0;
 
-static char _processingbuff[NMEA_MAX_LENGTH];
+static void _publish(const mavlink_hil_gps_t * fix)
+{
+	mavlink_message_t msg;
+
+	mavlink_msg_hil_gps_encode(0, ZIKUSH_ICU, &msg, fix);
+	router_route(&msg, 200);
+}
+
 
 void gps_task (void *pvParameters)
 {
-	volatile int good = 0;
-	uint8_t dummy;
-	struct minmea_sentence_gga frame;
-	mavlink_hil_gps_t hil_gps;
-	mavlink_message_t msg;
+	const uint8_t * span;
+	uint16_t span_len;
+	mavlink_hil_gps_t fix;
 
 	mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
 
+	nmealine_init(&_lines, ICU_GPS_FORCECHECKSUMM);
+	gpsfix_init(&_fix);
 	uart_init();
 
 	while(1)
 	{
-		xTaskNotifyWait(0, 0xFFFFFFFF, NULL, 0xFFFFFFFF);
-
-		memcpy(_processingbuff, _rxbuff, _rxbuff_received);
-		_rxbuff_received = 0;
-		HAL_UART_Init(&huart3); //maybe not the best way, TODO make it simpler
-
-		switch( minmea_sentence_id(_processingbuff, ICU_GPS_FORCECHECKSUMM) )
+		// Woken on a pause in the line, that is after every burst of sentences, or on each half of the ring.
+		// If the line stays quiet for a while, the burst of the epoch is over
+		if( 0 == ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ICU_GPS_EPOCH_GAP_MS)) )
 		{
-		case MINMEA_SENTENCE_GGA:
-			if( !minmea_parse_gga(&frame, _processingbuff) )
-				continue;
-
-			hil_gps.time_usec = HAL_GetTick() * 1000;
-			hil_gps.lat = minmea_tocoord(&frame.latitude) * 10000000;
-			hil_gps.lon = minmea_tocoord(&frame.longitude) * 10000000;
-			hil_gps.alt = minmea_tofloat(&frame.altitude) * 1000;
-			hil_gps.fix_type = frame.fix_quality;
-			hil_gps.satellites_visible = frame.satellites_tracked;
-			hil_gps.eph =(uint16_t)minmea_tofloat(&frame.hdop) * 100;
-
-			mavlink_msg_hil_gps_encode(0, ZIKUSH_ICU, &msg, &hil_gps);
-			router_route(&msg, 200);
-
-			break;
-
-		case MINMEA_INVALID:
-			break;
-
-		default:
-			good++;
+			if( gpsfix_flush(&_fix, &fix) )
+				_publish(&fix);
 			continue;
 		}
+
+		while( (span_len = uartrx_span(&_rx, &span)) > 0 )
+		{
+			uint16_t offset = 0;
+			while(offset < span_len)
+			{
+				uint16_t used;
+				const char * sentence = nmealine_feed(&_lines, span + offset, span_len - offset, &used);
+				offset += used;
+
+				// One message for the whole epoch, when the next one begins
+				if( sentence && gpsfix_feed(&_fix, sentence, HAL_GetTick(), &fix) )
+					_publish(&fix);
+			}
+
+			uartrx_consume(&_rx, span_len);
+		}
 	}
 
 	vTaskDelete(NULL);
 }
 
-/**
-  * @brief This function handles USB low priority or CAN RX0 interrupts.
-  */
+
 void USART3_IRQHandler(void)
 {
-	UART_HandleTypeDef * const huart = &huart3;
-
-	uint32_t isrflags   = READ_REG(huart->Instance->SR);
-	uint32_t errorflags = 0x00U;
-
-	/* If no error occurs */
-	errorflags = (isrflags & (uint32_t)(USART_SR_PE | USART_SR_FE | USART_SR_ORE | USART_SR_NE));
-	/* UART in mode Receiver -------------------------------------------------*/
-	if((isrflags & USART_SR_RXNE) != RESET)
-	{
-		_rxbuff[_rxbuff_received++] = (uint8_t)(huart->Instance->DR & 0xFF);
-
-		if(_rxbuff[0] != '$')
-		{
-			_rxbuff_received = 0;
-			return;
-		}
-
-		if(_rxbuff[_rxbuff_received - 1] == '\n' || _rxbuff_received == NMEA_MAX_LENGTH) //If we've finished sentence receiveing or the buffer overflow occured
-		{
-			xTaskNotifyGive(gps_task_handle);
-			HAL_UART_DeInit(huart);
-		}
-
+	uartrx_usart_irq(&_rx);
+}
 
-		return;
-	}
 
-	/* If some errors occur */
-	if(errorflags != RESET)
-	{
-		// Если у нас случилась ошибка и зажегся какой-то бит ошибки
-		// никто за нас его не снимет
-		// Сдалем вид что не было никакой ошибки и продолжим работать
-		// Ошибки пускай ловит драйвер выше. Тут слишком геморно передавать наверх что случилось
-
-		// Сбрасываем все биты ошибок
-		// Согласно даташиту такая последовательность должна помочь
-		__disable_irq();
-		READ_REG(huart->Instance->SR);
-		READ_REG(huart->Instance->DR); // надеемся, что там ничего не повяилось с тех пор как мы проверяли последний раз
-		__enable_irq();
-	} /* End if some error occurs */
+void DMA1_Channel3_IRQHandler(void)
+{
+	uartrx_dma_irq(&_rx);
 }
 
 //Those functions has been fetched from CubeMX generated code
 /**
-  * @brief CAN Initialization Function
+  * @brief USART3 Initialization Function
   * @param None
   * @retval None
   */
@@ -149,7 +116,7 @@ static void uart_init(void)
 
 	huart3.Instance = USART3;
 	huart3.Init.Mode = UART_MODE_RX;
-	huart3.Init.BaudRate = 9600;
+	huart3.Init.BaudRate = ICU_GPS_BAUDRATE;
 	huart3.Init.WordLength = UART_WORDLENGTH_8B;
 	huart3.Init.StopBits = UART_STOPBITS_1;
 	huart3.Init.Parity = UART_PARITY_NONE;
@@ -157,8 +124,7 @@ static void uart_init(void)
 	huart3.Init.HwFlowCtl = UART_HWCONTROL_NONE;
 	HAL_UART_Init(&huart3);
 
-	__HAL_UART_ENABLE_IT(&huart3, UART_IT_RXNE);
-	__HAL_UART_ENABLE_IT(&huart3, UART_IT_ERR);
+	uartrx_start(&_rx, USART3, 3, _rxbuff, sizeof(_rxbuff), &gps_task_handle, ICU_GPS_IRQ_PRIO);
 
 	HAL_NVIC_SetPriority(USART3_IRQn, ICU_GPS_IRQ_PRIO, 0);
 	HAL_NVIC_EnableIRQ(USART3_IRQn);
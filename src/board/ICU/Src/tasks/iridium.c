@@ -7,9 +7,17 @@
 #include <main.h>
 
 #include <ir9602.h>
+#include <sbdpack.h>
+#include <downlink.h>
+#include <irsched.h>
+#include <uartrx.h>
 
 static ir9602_t _ir;
 
+#if ICU_IR_COMPACT
+static downlink_t _ir_downlink;
+#endif
+
 
 typedef struct
 {
@@ -18,32 +26,18 @@ typedef struct
 	mavlink_message_t mavmsgbuf;
 	mavlink_message_t outmavmsgbuf;
 
-	QueueHandle_t rx_queue;
-	StaticQueue_t rx_queue_object;
+	uartrx_t rx;
 	uint8_t rx_buffer[ICU_IR_UART_RX_BUFFER_SIZE];
 
 	uint8_t accum[ICU_IR_TX_ACCUMULATOR_SIZE];
 	uint16_t accum_carret;
+	sbdpack_stamps_t stamps;	//когда пришло то, что в буфере
+	uint8_t mt[IR9602_MT_MSG_MAX_SIZE];
 } ir9602_user_struct_t;
 
 static ir9602_user_struct_t _ir_user_struct;
 
 
-static int _ir_uart_getch(void * user_arg, bool should_block)
-{
-	ir9602_user_struct_t * const user_struct = (ir9602_user_struct_t *)user_arg;
-
-	const TickType_t to_wait = should_block ? ICU_IR_UART_RX_QUEUE_WAIT : 0;
-
-	uint8_t byte;
-	const BaseType_t status = xQueueReceive(user_struct->rx_queue, &byte, to_wait);
-	if (pdTRUE != status)
-		return should_block ? -ETIMEDOUT: -EWOULDBLOCK;
-
-	return byte;
-}
-
-
 // Отправка байта в уарт.
 static int _ir_uart_putch_t(void * user_arg, uint8_t byte)
 {
@@ -72,13 +66,89 @@ static int _ir_uart_putch_t(void * user_arg, uint8_t byte)
 }
 
 
+static uint32_t _now(void)
+{
+	return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+
+static void _session_done(ir9602_user_struct_t * user, const ir9602_evt_session_t * session)
+{
+	const uint32_t now = _now();
+	const bool ok = 0 == session->rc && IR9602_EVT_SBDMSTATUS_ERROR != session->sbdi.mo_status;
+
+	irsched_done(ok, now);
+	if (ok)
+	{
+		// Что было в буфере - ушло. Иначе оставляем его до следующей попытки
+		if (session->mo_written && IR9602_EVT_SBDMSTATUS_YES == session->sbdi.mo_status)
+		{
+			irsched_delivered(user->stamps.count, user->stamps.count * now - user->stamps.stamp_sum);
+#if ICU_IR_COMPACT
+			// Шлюз подтвердил прием - ключевые кадры из буфера теперь есть на земле
+			downlink_ack(&_ir_downlink, user->accum, user->accum_carret);
+#endif
+		}
+
+		user->accum_carret = 0;
+	}
+	irsched_report(&global_stats);
+
+	if (session->rc != 0)
+	{
+		global_stats.iridium_errors++;
+		return;
+	}
+
+	// чего-нибудь нам пришло?
+	global_stats.iridium_tx = session->sbdi.momsn;
+
+#if ICU_IR_PROCESS_UPLINK
+
+	if (IR9602_EVT_SBDMSTATUS_YES != session->sbdi.mt_status)
+		return; // Если ничего не пришло - больше ничего и не делаем
+
+	// Теперь, если что-то нам пришло..
+	global_stats.iridium_rx = session->sbdi.mtmsn;
+
+	if (session->mt_size < 0)
+	{
+		global_stats.iridium_errors++;
+		return;
+	}
+
+	// Ничего себе! оно вытянулось!
+	for (int i = 0; i < session->mt_size; i++)
+	{
+		mavlink_status_t status;
+		uint8_t parsed = mavlink_parse_char(MAVLINK_COMM_0, user->mt[i], &user->outmavmsgbuf, &status);
+		if (parsed)
+		{
+			// оно еще и распарсилось!
+			global_stats.iridium_rx_mav++;
+			router_route(&user->outmavmsgbuf, ICU_IR_ROUTE_WAIT);
+		}
+	}
+#endif //ICU_IR_PROCESS_UPLINK
+}
+
+
 static void _ir_event_hook(void * user_arg, const ir9602_evt_t * event)
 {
+	ir9602_user_struct_t * const user = (ir9602_user_struct_t *)user_arg;
+
 	// Смотрим уровень сигнала и запоминаем
 	if (IR9602_EVT_CIEV == event->code && IR9602_EVT_CIEV_KIND_SIGIND == event->arg.ciev.type)
 	{
 		global_stats.iridium_sigind = event->arg.ciev.value;
+		irsched_sigind(event->arg.ciev.value, _now());
 	}
+
+	if (IR9602_EVT_CIEV == event->code && IR9602_EVT_CIEV_KIND_NETAVAIL == event->arg.ciev.type)
+		irsched_netavail(event->arg.ciev.value, _now());
+
+	if (IR9602_EVT_SESSION == event->code)
+		_session_done(user, &event->arg.session);
 }
 
 
@@ -120,102 +190,15 @@ static void _hw_init(void)
 	if (HAL_UART_Init(&_ir_user_struct.uart) != HAL_OK)
 		Error_Handler();
 
-	__HAL_UART_ENABLE_IT(&_ir_user_struct.uart, UART_IT_ERR);
-	__HAL_UART_ENABLE_IT(&_ir_user_struct.uart, UART_IT_RXNE);
+	// Прием идет через DMA, прерывания только на паузах в линии, половине буфера и ошибках
+	uartrx_start(&_ir_user_struct.rx, USART1, 5, _ir_user_struct.rx_buffer, sizeof(_ir_user_struct.rx_buffer),
+			&iridium_task_handle, ICU_IR_UART_RX_IT_PRIO);
 
 	HAL_NVIC_SetPriority(USART1_IRQn, ICU_IR_UART_RX_IT_PRIO, 0);
 	HAL_NVIC_EnableIRQ(USART1_IRQn);
 }
 
 
-static int mavmsg_len(const mavlink_message_t * msg)
-{
-	uint8_t signature_len, header_len;
-	uint8_t length = msg->len;
-
-	if (msg->magic == MAVLINK_STX_MAVLINK1) {
-		signature_len = 0;
-		header_len = MAVLINK_CORE_HEADER_MAVLINK1_LEN;
-	} else {
-		length = _mav_trim_payload(_MAV_PAYLOAD(msg), length);
-		header_len = MAVLINK_CORE_HEADER_LEN;
-		signature_len = (msg->incompat_flags & MAVLINK_IFLAG_SIGNED)?MAVLINK_SIGNATURE_BLOCK_LEN:0;
-	}
-	return header_len + 1 + 2 + (uint16_t)length + (uint16_t)signature_len;
-}
-
-
-static int _perform_sbd(ir9602_t * ir, const uint8_t * data, int datasize)
-{
-	ir9602_user_struct_t * const user = (ir9602_user_struct_t*)ir->user_arg;
-
-	int rc;
-	// Сфлушим все эвенты из нашего RX буфера, которые могли успеть там накопиться
-	{
-		ir9602_evt_t evtbuf;
-		ir9602_flush_events(ir, &evtbuf);
-	}
-
-	if (user->accum_carret > 0) // Если есть что отправлять, то попытаемся
-	{
-		ir9602_evt_errcode_t err_evt;
-		rc = ir9602_sbdwb(ir, data, datasize, &err_evt);
-		if (rc < 0)
-			global_stats.iridium_errors++;
-	}
-
-	// Даже если у нас не получилось заложить сообщение в модем
-	// сеанс всеравно будем проводить. Вдруг что-то придет сверху
-	// Так и так, считаем что отправлять нам теперь уж точно нечего
-	user->accum_carret = 0;
-
-	ir9602_evt_sbdi_t evt_sbdi = {};
-	rc = ir9602_sbdi(ir, &evt_sbdi);
-	if (rc < 0)
-	{
-		global_stats.iridium_errors++;
-		return rc;
-	}
-
-	// чего-нибудь нам пришло?
-//	if (IR9602_EVT_SBDMSTATUS_YES == evt_sbdi.mo_status)
-//		global_stats.iridium_tx++;
-	global_stats.iridium_tx = evt_sbdi.momsn;
-
-#if ICU_IR_PROCESS_UPLINK
-
-	if (IR9602_EVT_SBDMSTATUS_YES != evt_sbdi.mt_status)
-		return 0; // Если ничего не пришло - больше ничего и не делаем
-
-	// Теперь, если что-то нам пришло..
-	global_stats.iridium_rx = evt_sbdi.mtmsn;
-
-	// Вытяигваем сообщение
-	rc = ir9602_sbdrb(ir, user->accum, sizeof(user->accum));
-	if (rc < 0)
-	{
-		global_stats.iridium_errors++;
-		return rc;
-	}
-
-	// Ничего себе! оно вытянулось!
-	for (int i = 0; i < rc; i++)
-	{
-		mavlink_status_t status;
-		uint8_t parsed = mavlink_parse_char(MAVLINK_COMM_0, user->accum[i], &user->outmavmsgbuf, &status);
-		if (parsed)
-		{
-			// оно еще и распарсилось!
-			global_stats.iridium_rx_mav++;
-			router_route(&user->outmavmsgbuf, ICU_IR_ROUTE_WAIT);
-		}
-	}
-#endif //ICU_IR_PROCESS_UPLINK
-
-	return 0;
-}
-
-
 void iridium_task(void *pvParameters)
 {
 	(void)pvParameters;
@@ -224,49 +207,67 @@ void iridium_task(void *pvParameters)
 	mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
 
 	user->accum_carret = 0;
-	user->rx_queue = xQueueCreateStatic(ICU_IR_UART_RX_BUFFER_SIZE, 1,
-			user->rx_buffer, &user->rx_queue_object
-	);
 
-	ir9602_init(&_ir, user, _ir_uart_getch, _ir_uart_putch_t, _ir_event_hook);
+	ir9602_init(&_ir, user, _ir_uart_putch_t, _ir_event_hook);
 
 	// Неможко не логично включать железо в последнюю очередь, но мы должны
 	// быть готовы взаранее
 	_hw_init();
 
-	// запомним когда мы начали
-	// portTickType timemark = xTaskGetTickCount();
+	// Модем сам будет сообщать об уровне сигнала, по нему и планируем сеансы
+	irsched_init(_now());
+	if (ir9602_indicators(&_ir, true, true) < 0)
+		global_stats.iridium_errors++;
+
+	// Сеанс проводим раз в период, или раньше, если набралось на полный буфер, но только когда есть сигнал.
+	// Пока он идет, продолжаем принимать сообщения - модем отвечает через прерывание и нотификацию
 	for(;;)
 	{
-//		int i;
-//		for (i = 0; i < 100; i++)
-//			user->accum[i] = i;
-//
-//		user->accum_carret = i;
-
-		const BaseType_t status = xQueueReceive(iridium_queue_handle, &_ir_user_struct.mavmsgbuf, ICU_IR_TASK_PERIOD);
-		if (pdTRUE != status)
+		ulTaskNotifyTake(pdTRUE, ICU_IR_TICK);
+
+		// Сперва все что пришло от модема, события идут по порядку. Читаем прямо из буфера DMA
+		const uint8_t * span;
+		uint16_t span_len;
+		while ((span_len = uartrx_span(&user->rx, &span)) > 0)
 		{
-			// Мы таймаутнулись - нужно сливать буфер даже если он не полный
-			_perform_sbd(&_ir, user->accum, user->accum_carret);
+			for (uint16_t i = 0; i < span_len; i++)
+				ir9602_feed(&_ir, span[i], _now());
+
+			uartrx_consume(&user->rx, span_len);
 		}
-		else
+
+		ir9602_tick(&_ir, _now());
+
+		while (pdTRUE == xQueueReceive(iridium_queue_handle, &user->mavmsgbuf, 0))
 		{
-			// оп, что-то пришло - пробуем сложить в буфер
-			const uint8_t msglen = mavmsg_len(&user->mavmsgbuf);
-			if (msglen > sizeof(user->accum) - user->accum_carret)
-			{
-				// Сообщение не влезает в буфер - сливаем буфер
-				_perform_sbd(&_ir, user->accum, user->accum_carret);
-			}
-
-			// ну теперь то влезает? Всеравно проверим на всякий
-			// если нет - ну нет
-			if (msglen > sizeof(user->accum) - user->accum_carret)
-				continue;
-
-			// Влезает - пушим сообщение дальше
-			mavlink_msg_to_send_buffer(user->accum, &user->mavmsgbuf);
+			uint8_t frame[ICU_IR_PACK_FRAMESIZE];
+#if ICU_IR_COMPACT
+			const uint16_t len = downlink_encode(&_ir_downlink, &user->mavmsgbuf, frame, sizeof(frame));
+#else
+			const uint16_t len = downlink_plain(&user->mavmsgbuf, frame, sizeof(frame));
+#endif
+			if (!sbdpack_put(user->mavmsgbuf.msgid, user->mavmsgbuf.compid, frame, len, _now()))
+				global_stats.rt_drops_iridium++;
+		}
+
+		if (ir9602_busy(&_ir))
+			continue;
+
+		if (!irsched_due(sbdpack_pending() >= sizeof(user->accum), _now()))
+			continue;
+
+		// Пора - набираем в буфер самое ценное из того, что ждет, если там не лежит неотправленное с прошлого раза
+		// Даже если отправлять нечего, сеанс всеравно проводим. Вдруг что-то придет сверху
+		if (0 == user->accum_carret)
+			user->accum_carret = sbdpack_pack(user->accum, sizeof(user->accum), &user->stamps);
+
+		irsched_started(_now());
+		const int rc = ir9602_session_start(&_ir, user->accum, user->accum_carret, user->mt, sizeof(user->mt), _now());
+		if (rc < 0)
+		{
+			global_stats.iridium_errors++;
+			irsched_done(false, _now());
+			irsched_report(&global_stats);
 		}
 	}
 }
@@ -274,42 +275,11 @@ void iridium_task(void *pvParameters)
 
 void USART1_IRQHandler(void)
 {
-	ir9602_user_struct_t * const user_struct = (ir9602_user_struct_t *)_ir.user_arg;
-	UART_HandleTypeDef * const huart = &user_struct->uart;
-
-	uint32_t isrflags   = READ_REG(huart->Instance->SR);
-	uint32_t cr1its     = READ_REG(huart->Instance->CR1);
-	uint32_t cr3its     = READ_REG(huart->Instance->CR3);
-	uint32_t errorflags = 0x00U;
-	(void)cr1its;
-	(void)cr3its;
-
-	/* If no error occurs */
-	errorflags = (isrflags & (uint32_t)(USART_SR_PE | USART_SR_FE | USART_SR_ORE | USART_SR_NE));
-	/* UART in mode Receiver -------------------------------------------------*/
-	if((isrflags & USART_SR_RXNE) != RESET)
-	{
-		const uint8_t rx_byte = (uint8_t)(huart->Instance->DR & (uint8_t)0x00FF);
-		BaseType_t callcontextswitch = false;
-		xQueueSendToBackFromISR(user_struct->rx_queue, &rx_byte, &callcontextswitch);
-		portEND_SWITCHING_ISR(callcontextswitch);
-		return;
-	}
-
-	if(errorflags != RESET)
-	{
-		// Если у нас случилась ошибка и зажегся какой-то бит ошибки
-		// никто за нас его не снимет
-		// Сдалем вид что не было никакой ошибки и продолжим работать
-		// Ошибки пускай ловит драйвер выше. Тут слишком геморно передавать наверх что случилось
-
-		// Сбрасываем все биты ошибок
-		// Согласно даташиту такая последовательность должна помочь
-		__disable_irq();
-		READ_REG(huart->Instance->SR);
-		READ_REG(huart->Instance->DR); // надеемся, что там ничего не повяилось с тех пор как мы проверяли последний раз
-		__enable_irq();
-	}
+	uartrx_usart_irq(&_ir_user_struct.rx);
 }
 
 
+void DMA1_Channel5_IRQHandler(void)
+{
+	uartrx_dma_irq(&_ir_user_struct.rx);
+}
@@ -8,6 +8,7 @@
 #include <main.h>
 
 #include <sx1268.h>
+#include <downlink.h>
 
 
 static SPI_HandleTypeDef hspi2;
@@ -17,6 +18,10 @@ static sx1268_t radio;
 static sx1268_stm32_t radio_specific;
 static uint8_t radio_rxbuf[ICU_RADIO_RXBUFFLEN], radio_txbuf[ICU_RADIO_TXBUFFLEN];
 
+#if ICU_RADIO_COMPACT
+static downlink_t radio_downlink;
+#endif
+
 
 static void MX_SPI2_Init(void);
 static void MX_GPIO_Init(void);
@@ -52,7 +57,13 @@ void radio_task (void *pvParameters)
 		{
 			while( xQueueReceive(radio_queue_handle, &msg, 0) != errQUEUE_EMPTY )
 			{
+#if ICU_RADIO_COMPACT
+				// No way back from the ground, what goes to the air counts as delivered
+				uint16_t len = downlink_encode(&radio_downlink, &msg, framebuff, sizeof(framebuff));
+				downlink_ack(&radio_downlink, framebuff, len);
+#else
 				uint16_t len = mavlink_msg_to_send_buffer(framebuff, &msg);
+#endif
 				sx1268_send(&radio, framebuff, len);
 
 				sx1268_event(&radio);
@@ -0,0 +1,121 @@
+/*
+ * 	UART reception through DMA, see uartrx.h
+ */
+#include <stdbool.h>
+
+#include <uartrx.h>
+
+static DMA_Channel_TypeDef * const _channels[] = {
+		DMA1_Channel1, DMA1_Channel2, DMA1_Channel3, DMA1_Channel4, DMA1_Channel5, DMA1_Channel6, DMA1_Channel7
+};
+
+static const IRQn_Type _irqs[] = {
+		DMA1_Channel1_IRQn, DMA1_Channel2_IRQn, DMA1_Channel3_IRQn, DMA1_Channel4_IRQn,
+		DMA1_Channel5_IRQn, DMA1_Channel6_IRQn, DMA1_Channel7_IRQn
+};
+
+
+// Whatever interrupt it was, takes account of the bytes the DMA has written since the previous one.
+// Interrupts come at least every half of the buffer, so the distance modulo size is never ambiguous
+static void _update(uartrx_t * rx)
+{
+	const uint16_t pos = (rx->size - rx->dma->CNDTR) % rx->size;
+	BaseType_t callcontextswitch = pdFALSE;
+
+	rx->pending += (pos + rx->size - rx->pos) % rx->size;
+	rx->pos = pos;
+	rx->irqs++;
+
+	if(*rx->task != NULL)
+		vTaskNotifyGiveFromISR(*rx->task, &callcontextswitch);
+
+	portEND_SWITCHING_ISR(callcontextswitch);
+}
+
+
+void uartrx_start(uartrx_t * rx, USART_TypeDef * usart, uint8_t dma_channel, uint8_t * buff, uint16_t size,
+		TaskHandle_t * task, uint32_t irq_prio)
+{
+	rx->usart = usart;
+	rx->dma = _channels[dma_channel - 1];
+	rx->dma_flags = (DMA_ISR_GIF1 | DMA_ISR_TCIF1 | DMA_ISR_HTIF1 | DMA_ISR_TEIF1) << (4 * (dma_channel - 1));
+	rx->task = task;
+	rx->buff = buff;
+	rx->size = size;
+	rx->pos = 0;
+	rx->tail = 0;
+	rx->pending = 0;
+
+	__HAL_RCC_DMA1_CLK_ENABLE();
+
+	rx->dma->CCR = 0;
+	rx->dma->CPAR = (uint32_t)&usart->DR;
+	rx->dma->CMAR = (uint32_t)buff;
+	rx->dma->CNDTR = size;
+	DMA1->IFCR = rx->dma_flags;
+	rx->dma->CCR = DMA_CCR_PL_1 | DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_EN;
+
+	HAL_NVIC_SetPriority(_irqs[dma_channel - 1], irq_prio, 0);
+	HAL_NVIC_EnableIRQ(_irqs[dma_channel - 1]);
+
+	// Bytes go to the DMA, the USART interrupts only on idle line and errors
+	CLEAR_BIT(usart->CR1, USART_CR1_RXNEIE);
+	SET_BIT(usart->CR3, USART_CR3_DMAR | USART_CR3_EIE);
+	SET_BIT(usart->CR1, USART_CR1_IDLEIE | USART_CR1_PEIE);
+}
+
+
+uint16_t uartrx_span(uartrx_t * rx, const uint8_t ** data)
+{
+	uint32_t pending;
+
+	taskENTER_CRITICAL();
+	pending = rx->pending;
+	if(pending > rx->size)
+	{
+		// Overwritten before we got to it, skip to what the DMA has written last
+		rx->overruns += pending - rx->size;
+		rx->pending = pending = rx->size;
+		rx->tail = rx->pos;
+	}
+	taskEXIT_CRITICAL();
+
+	if(pending == 0)
+		return 0;
+
+	*data = rx->buff + rx->tail;
+	return pending < rx->size - rx->tail ? pending : rx->size - rx->tail;
+}
+
+
+void uartrx_consume(uartrx_t * rx, uint16_t len)
+{
+	rx->tail = (rx->tail + len) % rx->size;
+
+	taskENTER_CRITICAL();
+	rx->pending -= len;
+	taskEXIT_CRITICAL();
+}
+
+
+void uartrx_usart_irq(uartrx_t * rx)
+{
+	const uint32_t sr = READ_REG(rx->usart->SR);
+
+	if(sr & (USART_SR_PE | USART_SR_FE | USART_SR_ORE | USART_SR_NE))
+		rx->errors++;
+
+	// SR then DR clears IDLE and the error flags. The byte in DR, if any, is already taken by the DMA
+	if(sr & (USART_SR_IDLE | USART_SR_PE | USART_SR_FE | USART_SR_ORE | USART_SR_NE))
+	{
+		READ_REG(rx->usart->DR);
+		_update(rx);
+	}
+}
+
+
+void uartrx_dma_irq(uartrx_t * rx)
+{
+	DMA1->IFCR = rx->dma_flags;
+	_update(rx);
+}
@@ -9,13 +9,19 @@
 #include <stm32f10x_can.h>
 
 #include <mavlink/zikush/mavlink.h>
+#include <zikush_config.h>
+
+#include <zikush_canroutes.h>
+#define CANMAVLINK_REASM_SLOTS	PCU_CAN_REASM_SLOTS
 #include <canmavlink.h>
+#include <canmavlink_stats.h>
 
-#include <zikush_config.h>
 #include "canlink.h"
 
 extern volatile uint32_t global_ms;
 
+static canmavlink_stats_t _stats;
+
 bool canlink_init(void)
 {
 	RCC_APB1PeriphClockCmd(RCC_APB1Periph_CAN1, ENABLE);
@@ -46,31 +52,20 @@ bool canlink_init(void)
 		.CAN_TTCM = DISABLE,
 		.CAN_ABOM = DISABLE,
 		.CAN_AWUM = DISABLE,
-		.CAN_NART = ENABLE,
+		.CAN_NART = DISABLE, //A frame losing arbitration waits for the bus, see canlink_send()
 		.CAN_RFLM = DISABLE,
 		.CAN_TXFP = DISABLE
 	};
 	CAN_Init(CAN1, &caninit);
 
-	CAN_FilterInitTypeDef canfilter =
-	{
-		.CAN_FilterMaskIdLow = 0xFE,
-		.CAN_FilterIdLow = MAVLINK_MSG_ID_ZIKUSH_CMD_PREFLIGHTRESET | MAVLINK_MSG_ID_ZIKUSH_CMD_POWEROFF,
-		.CAN_FilterMaskIdHigh = 0xFF,
-		.CAN_FilterIdHigh = MAVLINK_MSG_ID_ZIKUSH_CMD_POWERBUS,
-		.CAN_FilterMode = CAN_FilterMode_IdMask,
-		.CAN_FilterActivation = ENABLE,
-		.CAN_FilterFIFOAssignment = CAN_Filter_FIFO0,
-		.CAN_FilterScale = CAN_FilterScale_16bit,
-		.CAN_FilterNumber = 0,
-	};
-	CAN_FilterInit(&canfilter);
+	canmavlink_filter_t filters[ZIKUSH_CANROUTES_COUNT];
+	uint8_t filtercount = canmavlink_filters_build(filters, CANMAVLINK_FILTERS_CAPACITY(PROBEWIDE_CAN_FILTERBANKS, PROBEWIDE_CAN_EXTID),
+			zikush_canroutes, ZIKUSH_CANROUTES_COUNT, ZIKUSH_PCU);
+	canmavlink_filters_apply(CAN1, 0, PROBEWIDE_CAN_FILTERBANKS, filters, filtercount, PROBEWIDE_CAN_EXTID);
 
 	CAN_ITConfig(CAN1, CAN_IT_FMP0, ENABLE);
 	NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
 
-	mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
-
 	return true;
 }
 
@@ -79,23 +74,55 @@ void canlink_send(mavlink_message_t * msg)
 	__disable_irq();
 
 	static CanTxMsg frames[34];
+#if PROBEWIDE_CAN_EXTID
+	uint8_t framecount = canmavlink_msg_to_frames_shortest(frames, msg);
+#else
 	uint8_t framecount = canmavlink_msg_to_frames(frames, msg);
+#endif
 
 	for(int i = 0; i < framecount; i++)
 	{
-		uint32_t mailbox;
-		mailbox = CAN_Transmit(CAN1, frames + i);
-
-		uint8_t pending;
-		uint32_t timeout;
-		do {
-			pending = CAN_TransmitStatus(CAN1, mailbox);
-		} while(pending == CAN_TxStatus_Pending && --timeout != 0);
+		uint8_t mailbox = CAN_Transmit(CAN1, frames + i);
+		if(mailbox == CAN_TxStatus_NoMailBox)
+			break;
+
+		// The hardware retries the frame until it is acknowledged, one nobody takes is cancelled after
+		// PROBEWIDE_CAN_TX_TIMEOUT_MS. Interrupts are off, so milliseconds are counted by the SysTick flag
+		uint32_t elapsed = 0;
+		(void)SysTick->CTRL; //clears COUNTFLAG
+		while(CAN_TransmitStatus(CAN1, mailbox) == CAN_TxStatus_Pending)
+		{
+			if((SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) && ++elapsed >= PROBEWIDE_CAN_TX_TIMEOUT_MS)
+			{
+				CAN_CancelTransmit(CAN1, mailbox);
+				while( !(CAN1->TSR & (CAN_TSR_RQCP0 << mailbox * 8)) ){}
+				break;
+			}
+		}
+
+		uint32_t tsr = CAN1->TSR;
+		if(tsr & (CAN_TSR_RQCP0 << mailbox * 8))
+			canmavlink_stats_tx_done(&_stats, CAN1, mailbox, tsr);
+
+		if( !(tsr & (CAN_TSR_TXOK0 << mailbox * 8)) )
+			break; //the rest of the message is no use without this frame
 	}
 
 	__enable_irq();
 }
 
+void canlink_send_stats(void)
+{
+	mavlink_message_t msg;
+	mavlink_zikush_can_stats_t report;
+
+	canmavlink_stats_report(&_stats, CAN1, global_ms, &report);
+	report.reasm_evicted = canmavlink_get_reasm()->evicted;
+
+	mavlink_msg_zikush_can_stats_encode(0, ZIKUSH_PCU, &msg, &report);
+	canlink_send(&msg);
+}
+
 void USB_LP_CAN1_RX0_IRQHandler(void)
 {
 	static CanRxMsg frame;
@@ -104,7 +131,10 @@ void USB_LP_CAN1_RX0_IRQHandler(void)
 
 	mavlink_zikush_cmd_powerbus_t powercmd;
 
+	canmavlink_stats_rx_overrun(&_stats, CAN1);
+
 	CAN_Receive(CAN1, CAN_FIFO0, &frame);
+	canmavlink_stats_rx(&_stats, frame.IDE == CAN_Id_Extended, frame.DLC);
 
 	volatile uint8_t result = canmavlink_parse_frame(&frame, &msg, &status);
 
@@ -15,5 +15,8 @@ bool canlink_init(void);
 
 void canlink_send(mavlink_message_t * msg);
 
+// Sends ZIKUSH_CAN_STATS, rates are over the time since the previous call
+void canlink_send_stats(void);
+
 
 #endif /* CANLINK_H_ */
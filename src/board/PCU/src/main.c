@@ -10,6 +10,7 @@
 #include <mavlink/zikush/mavlink.h>
 
 #include "pcu_inahelpers.h"
+#include "canlink.h"
 #include "delay.h"
 
 #include "zikush_config.h"
@@ -61,9 +62,8 @@ int main()
 
 	canlink_init();
 
-	mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
-
 	uint16_t cyclenum = 0;
+	uint32_t can_stats_time = global_ms;
 	mavlink_message_t msg;
 	while(1)
 	{
@@ -92,6 +92,12 @@ int main()
 			canlink_send(&msg);
 		}
 
+		if(global_ms - can_stats_time >= PROBEWIDE_CAN_STATS_PERIOD_MS)
+		{
+			can_stats_time += PROBEWIDE_CAN_STATS_PERIOD_MS;
+			canlink_send_stats();
+		}
+
 		if(cyclenum % PCU_CURRSENDPERIOD_CYCL == 0)
 		{
 			powerstate.time_boot_ms = global_ms;
@@ -11,12 +11,14 @@
 
 #include <zikush_config.h>
 
+#include <zikush_canroutes.h>
 #include "canmavlink_hal.h"
+#include <canmavlink_stats.h>
+
+static canmavlink_stats_t _stats;
 
 void can_init(void)
 {
-    mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
-
     __HAL_RCC_CAN1_FORCE_RESET();
     HAL_Delay(100);
     __HAL_RCC_CAN1_RELEASE_RESET();
@@ -30,7 +32,7 @@ void can_init(void)
     hcan.Init.TimeTriggeredMode = DISABLE;
     hcan.Init.AutoBusOff = DISABLE;
     hcan.Init.AutoWakeUp = DISABLE;
-    hcan.Init.AutoRetransmission = DISABLE; //ENABLE;
+    hcan.Init.AutoRetransmission = ENABLE; //A frame losing arbitration waits for the bus, see can_mavlink_send()
     hcan.Init.ReceiveFifoLocked = DISABLE;
     hcan.Init.TransmitFifoPriority = DISABLE;
     HAL_StatusTypeDef rc;
@@ -38,7 +40,11 @@ void can_init(void)
     if (rc != HAL_OK)
         Error_Handler();
 
-    mavlink_get_channel_status(ZIKUSH_SCU)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
+    // Only messages routed to the SCU pass, none for now, so the banks stay disabled and nothing is received
+    canmavlink_filter_t filters[ZIKUSH_CANROUTES_COUNT];
+    uint8_t filtercount = canmavlink_filters_build(filters, CANMAVLINK_FILTERS_CAPACITY(PROBEWIDE_CAN_FILTERBANKS, PROBEWIDE_CAN_EXTID),
+            zikush_canroutes, ZIKUSH_CANROUTES_COUNT, ZIKUSH_SCU);
+    canmavlink_filters_apply(hcan.Instance, 0, PROBEWIDE_CAN_FILTERBANKS, filters, filtercount, PROBEWIDE_CAN_EXTID);
 
     HAL_CAN_Start(&hcan);
 }
@@ -46,20 +52,54 @@ void can_init(void)
 void can_mavlink_send(mavlink_message_t * msg)
 {
     CANMAVLINK_TX_FRAME_T frames[CANMAVLINK_MAXFRAMES];
+#if PROBEWIDE_CAN_EXTID
+    volatile uint8_t framecount = canmavlink_msg_to_frames_shortest(frames, msg);
+#else
     volatile uint8_t framecount = canmavlink_msg_to_frames(frames, msg);
+#endif
     for(int i = 0; i < framecount; i++)
 #include "mavlink/zikush/mavlink.h"
 
     {
         uint32_t mailbox;
         CANMAVLINK_TX_FRAME_T * frame = frames+i;
-        HAL_CAN_AddTxMessage(&hcan, &frame->Header, frame->Data, &mailbox);
+        if(HAL_CAN_AddTxMessage(&hcan, &frame->Header, frame->Data, &mailbox) != HAL_OK)
+            break;
 
+        // The hardware retries the frame until it is acknowledged, one nobody takes is cancelled after PROBEWIDE_CAN_TX_TIMEOUT_MS
+        uint32_t start = HAL_GetTick();
         bool pending;
         do {
             pending = HAL_CAN_IsTxMessagePending(&hcan, mailbox); //TODO consider yielding here, but notice that for proper canmavlink functionality messages should come serially
+            if(pending && HAL_GetTick() - start >= PROBEWIDE_CAN_TX_TIMEOUT_MS)
+            {
+                HAL_CAN_AbortTxRequest(&hcan, mailbox);
+                while(HAL_CAN_IsTxMessagePending(&hcan, mailbox)){}
+                break;
+            }
         } while(pending);
 
+        uint32_t tsr = hcan.Instance->TSR;
+        canmavlink_stats_tx_done(&_stats, hcan.Instance, mailbox >> 1, tsr); //CAN_TX_MAILBOX0..2 are 1, 2, 4
+
+        if( !(tsr & (CAN_TSR_TXOK0 << (mailbox >> 1) * 8)) )
+            break; //the rest of the message is no use without this frame
+
         //hcan = frames + i; //DELICIOUS!!
     }
 }
+
+void can_stats_update(void)
+{
+    uint32_t now = HAL_GetTick();
+
+    if(now - _stats.stamp < PROBEWIDE_CAN_STATS_PERIOD_MS)
+        return;
+
+    mavlink_message_t msg;
+    mavlink_zikush_can_stats_t report;
+
+    canmavlink_stats_report(&_stats, hcan.Instance, now, &report); //SCU takes nothing from the bus, rx stays zero
+    mavlink_msg_zikush_can_stats_encode(0, ZIKUSH_SCU, &msg, &report);
+    can_mavlink_send(&msg);
+}
@@ -13,5 +13,8 @@
 void can_init(void);
 void can_mavlink_send(mavlink_message_t * msg);
 
+// Sends ZIKUSH_CAN_STATS every PROBEWIDE_CAN_STATS_PERIOD_MS, call it from the main loop
+void can_stats_update(void);
+
 
 #endif /* APPLICATION_USER_CAN_H_ */
@@ -40,11 +40,10 @@ void heartbeat_send(void)
 {
     const uint32_t freq = 1;
     static uint32_t t_prev = 0, t_now = 0;
-    if((t_now = HAL_GetTick()) - t_prev > 1000 / freq)
-    {
-        t_prev = t_now;
+    if((t_now = HAL_GetTick()) - t_prev < 1000 / freq)
         return;
-    }
+
+    t_prev = t_now;
     can_mavlink_send(&msg_heartbeat);
 
 }
@@ -52,9 +51,6 @@ void heartbeat_send(void)
 
 int the_main(void)
 {
-    mavlink_get_channel_status(MAVLINK_COMM_0)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
-
-    mavlink_get_channel_status(ZIKUSH_SCU)->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
     can_init();
 
     lsm6ds3_register_spi(&hlsm6, &hspi2, LSM_CS_GPIO_Port, LSM_CS_Pin);
@@ -92,6 +88,7 @@ int the_main(void)
         sensors_bme280_update();
         sensors_external_update();
         heartbeat_send();
+        can_stats_update();
 
 
         //camera_system_update(&hcam);
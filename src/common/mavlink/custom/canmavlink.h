@@ -17,17 +17,49 @@
 
 #define FIRSTFRAME_FLAG	1
 
-#define CAN_STDID_PACK(COMPID, FFFLAG, MSGID) ( (COMPID & 0x03) << 9 | \
-												(FFFLAG & 0x01) << 8 | (MSGID & 0xFF) )
-#define CAN_STDID_COMPID(FRAMEP)	( (FRAMEP->StdId >> 9) & 0x03 )
-#define CAN_STDID_FFFLAG(FRAMEP)	( (FRAMEP->StdId >> 8) & 0x01 )
-#define CAN_STDID_MSGID(FRAMEP)		( (FRAMEP->StdId >> 0) & 0xFF )
+// Arbitration priority of a message goes in the top identifier bits of both formats, the lower value wins
+#define CANMAVLINK_PRIO_HIGHEST	0
+#define CANMAVLINK_PRIO_LOWEST	3
+
+// A board takes priorities from its table by defining it before canmavlink is included, see zikush_canroutes.h
+#ifndef CANMAVLINK_MSG_PRIORITY
+#define CANMAVLINK_MSG_PRIORITY(MSGID)	CANMAVLINK_PRIO_LOWEST
+#endif
+
+// Standard identifier format: priority(2) | compid(2) | first frame flag(1) | lower msgid bits(6).
+// The whole msgid is in the first frame
+#define CAN_STDID_PACK(PRIO, COMPID, FFFLAG, MSGID) ( (PRIO & 0x03) << 9 | (COMPID & 0x03) << 7 | \
+												(FFFLAG & 0x01) << 6 | (MSGID & 0x3F) )
+#define CAN_STDID_PRIO(FRAMEP)		( (FRAMEP->StdId >> 9) & 0x03 )
+#define CAN_STDID_COMPID(FRAMEP)	( (FRAMEP->StdId >> 7) & 0x03 )
+#define CAN_STDID_FFFLAG(FRAMEP)	( (FRAMEP->StdId >> 6) & 0x01 )
+#define CAN_STDID_MSGID(FRAMEP)		( (FRAMEP->StdId >> 0) & 0x3F )
 
 #define ISFIRSTFRAME(FRAMEP) (CAN_STDID_FFFLAG(FRAMEP) & FIRSTFRAME_FLAG)
-#define FIRSTFRAMEDATALEN	4
+#define FIRSTFRAMEDATALEN	5	//MAVLink 1: len, seq, sysid, compid, msgid
+#define FIRSTFRAMEDATALEN2	8	//MAVLink 2: len, compat_flags, seq, sysid, compid, msgid, msgid >> 8, msgid >> 16
 
 #define CHANLENGTH(MSG)	(MSG->len + 2)
 
+// Extended identifier format. Header fields go in the identifier itself, so there is no first frame:
+// priority(2) | compid(2) | msgid(8) | frame index(6) | seq(8) | MAVLink 2 flag(1) | last frame flag(1) | sysid(1)
+#define CAN_EXTID_PACK(PRIO, COMPID, INDEX, MSGID, SEQ, V2FLAG, LASTFLAG, SYSID) ( (uint32_t)(PRIO & 0x03) << 27 | \
+												(uint32_t)(COMPID & 0x03) << 25 | (uint32_t)(MSGID & 0xFF) << 17 | \
+												(uint32_t)(INDEX & 0x3F) << 11 | (uint32_t)(SEQ & 0xFF) << 3 | \
+												(V2FLAG & 0x01) << 2 | ((LASTFLAG) & 0x01) << 1 | (SYSID & 0x01) )
+#define CAN_EXTID_PRIO(FRAMEP)		( (FRAMEP->ExtId >> 27) & 0x03 )
+#define CAN_EXTID_COMPID(FRAMEP)	( (FRAMEP->ExtId >> 25) & 0x03 )
+#define CAN_EXTID_MSGID(FRAMEP)		( (FRAMEP->ExtId >> 17) & 0xFF )
+#define CAN_EXTID_INDEX(FRAMEP)		( (FRAMEP->ExtId >> 11) & 0x3F )
+#define CAN_EXTID_SEQ(FRAMEP)		( (FRAMEP->ExtId >> 3) & 0xFF )
+#define CAN_EXTID_V2FLAG(FRAMEP)	( (FRAMEP->ExtId >> 2) & 0x01 )
+#define CAN_EXTID_LASTFLAG(FRAMEP)	( (FRAMEP->ExtId >> 1) & 0x01 )
+#define CAN_EXTID_SYSID(FRAMEP)		( (FRAMEP->ExtId >> 0) & 0x01 )
+
+// Whether a message header could be packed into an extended identifier
+#define CANMAVLINK_EXTID_FITS(MSG)	( (MSG)->sysid < 2 && (MSG)->compid < 4 && (MSG)->msgid < 256 && \
+										(MSG)->incompat_flags == 0 && (MSG)->compat_flags == 0 )
+
 
 /**
  * @brief Pack a message to send it over a CAN bus
@@ -40,90 +72,420 @@
 MAVLINK_HELPER uint8_t canmavlink_msg_to_frames(CanTxMsg * frames, const mavlink_message_t *msg)
 {
 	uint8_t length = msg->len;
+	uint8_t prio = CANMAVLINK_MSG_PRIORITY(msg->msgid);
 	CanTxMsg * firstframe = frames;
 
+	firstframe->IDE = CAN_ID_STD;
+	firstframe->RTR = CAN_RTR_DATA;
+	firstframe->StdId = CAN_STDID_PACK(prio, msg->compid, FIRSTFRAME_FLAG, msg->msgid);
+
 	if (msg->magic == MAVLINK_STX_MAVLINK1) {
-		firstframe->IDE = CAN_ID_STD;
-		firstframe->RTR = CAN_RTR_DATA;
-		firstframe->DLC = 4;
-		firstframe->StdId = CAN_STDID_PACK(msg->compid, FIRSTFRAME_FLAG, msg->msgid);
+		firstframe->DLC = FIRSTFRAMEDATALEN;
 		firstframe->Data[0] = length;
 		firstframe->Data[1] = msg->seq;
 		firstframe->Data[2] = msg->sysid;
 		firstframe->Data[3] = msg->compid;
+		firstframe->Data[4] = (uint8_t)msg->msgid;
 
-		for(uint8_t i = 0; true;)
-		{
-			CanTxMsg * currframe = frames +  i / CAN2_MAX_DLC + 1;
+	} else {
+		// Signature wouldn't fit, signing is not used onboard anyway. It is the only incompat flag defined,
+		// so the byte is left out of the first frame
+		if(msg->incompat_flags != 0) return 0;
+
+		// Payload is already truncated by mavlink_finalize_message(), so trailing zeros cost no frames
+		firstframe->DLC = FIRSTFRAMEDATALEN2;
+		firstframe->Data[0] = length;
+		firstframe->Data[1] = msg->compat_flags;
+		firstframe->Data[2] = msg->seq;
+		firstframe->Data[3] = msg->sysid;
+		firstframe->Data[4] = msg->compid;
+		firstframe->Data[5] = (uint8_t)msg->msgid;
+		firstframe->Data[6] = (uint8_t)(msg->msgid >> 8);
+		firstframe->Data[7] = (uint8_t)(msg->msgid >> 16);
+	}
+
+	for(uint8_t i = 0; true;)
+	{
+		CanTxMsg * currframe = frames + DIVIDE_ROUND_UP(i, CAN2_MAX_DLC) + 1;
 
-			uint8_t copylen = MIN(length - i, CAN2_MAX_DLC);
-			memcpy(currframe->Data, _MAV_PAYLOAD(msg) + i, copylen);
-			i += copylen;
+		uint8_t copylen = MIN(length - i, CAN2_MAX_DLC);
+		memcpy(currframe->Data, _MAV_PAYLOAD(msg) + i, copylen);
+		i += copylen;
 
-			currframe->IDE = CAN_ID_STD;
-			currframe->RTR = CAN_RTR_DATA;
-			currframe->DLC = copylen;
-			currframe->StdId = CAN_STDID_PACK(msg->compid, !FIRSTFRAME_FLAG, msg->msgid);
+		currframe->IDE = CAN_ID_STD;
+		currframe->RTR = CAN_RTR_DATA;
+		currframe->DLC = copylen;
+		currframe->StdId = CAN_STDID_PACK(prio, msg->compid, !FIRSTFRAME_FLAG, msg->msgid);
 
-			if(copylen < 7) //We should append CRC
-			{
-				currframe->Data[copylen] = (uint8_t)(msg->checksum & 0xFF);
-				currframe->Data[copylen + 1] = (uint8_t)(msg->checksum >> 8);
-				currframe->DLC += 2;
+		if(copylen < 7) //We should append CRC
+		{
+			currframe->Data[copylen] = (uint8_t)(msg->checksum & 0xFF);
+			currframe->Data[copylen + 1] = (uint8_t)(msg->checksum >> 8);
+			currframe->DLC += 2;
 
-				break;
-			}
+			break;
 		}
+	}
 
-		return DIVIDE_ROUND_UP( (length + 2), CAN2_MAX_DLC) + 1; //Length counted with CRC, added one for FF
+	return DIVIDE_ROUND_UP( (length + 2), CAN2_MAX_DLC) + 1; //Length counted with CRC, added one for FF
+}
 
-	} else {
-		//TODO MAVLINK 2 support not implemented yet
+/**
+ * @brief Pack a message to send it over a CAN bus using extended identifiers. There is no first frame,
+ * but every frame is 20 bits longer, so it pays off for short messages mostly
+ *
+ * @arg frames - pointer to a buffer for frames to be sent. Assumed to be big enough (33 frames maximum)
+ * @arg msg - message to encode
+ *
+ * @return A number of CAN frames used to encode a message, or 0 if its header doesn't fit
+ * an identifier (see CANMAVLINK_EXTID_FITS). canmavlink_msg_to_frames() should be used then
+ */
+MAVLINK_HELPER uint8_t canmavlink_msg_to_frames_ext(CanTxMsg * frames, const mavlink_message_t *msg)
+{
+	if(!CANMAVLINK_EXTID_FITS(msg)) return 0;
+
+	uint8_t length = msg->len;
+	uint8_t framecount = DIVIDE_ROUND_UP( (length + 2), CAN2_MAX_DLC); //Length counted with CRC
+	uint8_t v2flag = msg->magic != MAVLINK_STX_MAVLINK1;
+	uint8_t prio = CANMAVLINK_MSG_PRIORITY(msg->msgid);
+
+	for(uint8_t n = 0; n < framecount; n++)
+	{
+		CanTxMsg * currframe = frames + n;
+		uint16_t offset = n * CAN2_MAX_DLC;
+		uint8_t copylen = MIN(length + 2 - offset, CAN2_MAX_DLC);
+
+		for(uint8_t i = 0; i < copylen; i++) //CRC just follows the payload
+		{
+			uint16_t pos = offset + i;
+
+			if(pos < length)
+				currframe->Data[i] = _MAV_PAYLOAD(msg)[pos];
+			else if(pos == length)
+				currframe->Data[i] = (uint8_t)(msg->checksum & 0xFF);
+			else
+				currframe->Data[i] = (uint8_t)(msg->checksum >> 8);
+		}
+
+		currframe->IDE = CAN_ID_EXT;
+		currframe->RTR = CAN_RTR_DATA;
+		currframe->DLC = copylen;
+		currframe->ExtId = CAN_EXTID_PACK(prio, msg->compid, n, msg->msgid, msg->seq, v2flag, n == framecount - 1, msg->sysid);
 	}
 
-	return 0;
+	return framecount;
 }
 
+// Bits per frame without data and stuffing: SOF, identifier, control, CRC, ACK, EOF and interframe space
+#define CAN_STDFRAME_OVERHEAD	47
+#define CAN_EXTFRAME_OVERHEAD	67
+
 /**
- * @brief Parse a can frame. Does implicit logic channels separation based on compid (0-3)
+ * @brief Pack a message using whichever identifier format takes less bus time. Extended identifiers
+ * save the first frame but cost 20 bits on every frame, so they win for short messages only
  *
- * @arg frame - pointer to a frame to be parsed
- * @arg r_message - pointer to a message location where a parsing result would be written
- * @arg r_mavlink_status - pointer to a status structure
+ * @arg frames - pointer to a buffer for frames to be sent. Assumed to be big enough (34 frames maximum)
+ * @arg msg - message to encode
  *
- * @return A parsing status
+ * @return A number of CAN frames used to encode a message
  */
-MAVLINK_HELPER uint8_t canmavlink_parse_frame(CanRxMsg * frame, mavlink_message_t* r_message, mavlink_status_t* r_mavlink_status)
+MAVLINK_HELPER uint8_t canmavlink_msg_to_frames_shortest(CanTxMsg * frames, const mavlink_message_t *msg)
+{
+	uint16_t datalen = msg->len + MAVLINK_NUM_CHECKSUM_BYTES;
+	uint16_t framecount = DIVIDE_ROUND_UP(datalen, CAN2_MAX_DLC);
+	uint16_t hdrlen = msg->magic == MAVLINK_STX_MAVLINK1 ? FIRSTFRAMEDATALEN : FIRSTFRAMEDATALEN2;
+
+	uint16_t stdbits = (framecount + 1) * CAN_STDFRAME_OVERHEAD + (datalen + hdrlen) * 8;
+	uint16_t extbits = framecount * CAN_EXTFRAME_OVERHEAD + datalen * 8;
+
+	if(extbits < stdbits && CANMAVLINK_EXTID_FITS(msg))
+		return canmavlink_msg_to_frames_ext(frames, msg);
+
+	return canmavlink_msg_to_frames(frames, msg);
+}
+
+#ifndef CANMAVLINK_REASM_SLOTS
+#define CANMAVLINK_REASM_SLOTS	4	//Messages being reassembled at once
+#endif
+
+// Reassembly table clock. It counts parsed frames unless a board defines it as its tick counter,
+// together with a timeout in those ticks
+#ifndef CANMAVLINK_REASM_CLOCK
+#define CANMAVLINK_REASM_CLOCK(TABLE)	((TABLE)->frames)
+#define CANMAVLINK_REASM_TIMEOUT	256
+#endif
+
+// Messages are told apart by everything the identifier carries. Extended ones have sysid, compid, msgid
+// and seq. Standard consecutive frames have compid and lower msgid bits only, so two messages in standard
+// frames with the same of those still can't interleave: that is why PROBEWIDE_CAN_EXTID is on by default
+// and standard frames are left to messages which don't fit an extended identifier or are shorter so.
+// Std keys have the top bit set, extended identifiers are 29 bits long so keys never collide
+#define CAN_STDID_KEY(FRAMEP)	( 0x80000000 | (FRAMEP->StdId & ~(FIRSTFRAME_FLAG << 6)) )
+#define CAN_EXTID_KEY(FRAMEP)	( FRAMEP->ExtId & ~((uint32_t)0x3F << 11 | 0x01 << 1) )
+
+typedef struct {
+	mavlink_message_t msg;
+	mavlink_status_t status;	//Parse state of this message only, counters are kept per channel
+	uint32_t key;
+	uint32_t stamp;				//Last frame time, for timeouts and LRU eviction
+	bool busy;
+} canmavlink_slot_t;
+
+typedef struct {
+	canmavlink_slot_t slots[CANMAVLINK_REASM_SLOTS];
+	uint32_t frames;
+	uint32_t evicted;			//Incomplete messages dropped by timeout or for a newer one
+} canmavlink_reasm_t;
+
+#ifndef CANMAVLINK_GET_REASM
+// As channel buffers in mavlink helpers, the table is static in every translation unit using it
+MAVLINK_HELPER canmavlink_reasm_t * canmavlink_get_reasm(void)
+{
+	static canmavlink_reasm_t table;
+	return &table;
+}
+#endif
+
+// Look a message up in the reassembly table. A first frame always gets a slot: the one of the same
+// message restarted, a free one or the least recently used one
+MAVLINK_HELPER canmavlink_slot_t * _canmavlink_get_slot(canmavlink_reasm_t * table, uint32_t key, bool first)
+{
+	uint32_t now = CANMAVLINK_REASM_CLOCK(table);
+	canmavlink_slot_t * found = NULL, * victim = NULL;
+
+	for(int i = 0; i < CANMAVLINK_REASM_SLOTS; i++)
+	{
+		canmavlink_slot_t * slot = &table->slots[i];
+
+		if(slot->busy && now - slot->stamp > CANMAVLINK_REASM_TIMEOUT)
+		{
+			slot->busy = false;
+			table->evicted++;
+		}
+
+		if(!slot->busy)
+		{
+			if(victim == NULL || victim->busy) victim = slot;
+		}
+		else if(slot->key == key)
+			found = slot;
+		else if(victim == NULL || (victim->busy && now - slot->stamp > now - victim->stamp))
+			victim = slot;
+	}
+
+	if(found == NULL && first)
+	{
+		found = victim;
+		if(found->busy) table->evicted++;
+
+		memset(&found->status, 0, sizeof(found->status));
+		found->key = key;
+		found->busy = true;
+	}
+
+	if(found != NULL) found->stamp = now;
+	return found;
+}
+
+// Common tail of the frame parsers. Counters and user info, the same as in mavlink_frame_char_buffer()
+MAVLINK_HELPER uint8_t _canmavlink_parse_finish(mavlink_message_t * msgbuf, mavlink_status_t * msgstat, mavlink_status_t * chanstat,
+		mavlink_message_t* r_message, mavlink_status_t* r_mavlink_status)
+{
+	chanstat->parse_error += msgstat->parse_error;
+	msgstat->parse_error = 0;
+
+	// Also a piece from original mavlink
+	// If a message has been sucessfully decoded, check index
+	if (msgstat->msg_received == MAVLINK_FRAMING_OK)
+	{
+		// Interleaved messages could complete out of order, an older one doesn't move the sequence back
+		uint8_t gap = msgbuf->seq - chanstat->current_rx_seq;
+		if (gap != 0 && gap < 128)
+		{
+			// Count all the dropped packets
+			chanstat->packet_rx_drop_count += gap - 1;
+			// Set the current msg seq
+			chanstat->current_rx_seq = msgbuf->seq;
+		}
+		// Initial condition: If no packet has been received so far, drop count is undefined
+		if (chanstat->packet_rx_success_count == 0)
+		{
+			chanstat->packet_rx_drop_count = 0;
+			chanstat->current_rx_seq = msgbuf->seq;
+		}
+		// Count this packet as received
+		chanstat->packet_rx_success_count++;
+	}
+
+	// Provide user info about parsing
+	r_message->len = msgbuf->len; // Provide visibility on how far we are into current msg
+	r_mavlink_status->parse_state = msgstat->parse_state;
+	r_mavlink_status->packet_idx = msgstat->packet_idx;
+	r_mavlink_status->current_rx_seq = chanstat->current_rx_seq+1;
+	r_mavlink_status->packet_rx_success_count = chanstat->packet_rx_success_count;
+	r_mavlink_status->packet_rx_drop_count = chanstat->parse_error;
+	r_mavlink_status->flags = msgstat->flags;
+	chanstat->parse_error = 0;
+
+	if (msgstat->msg_received == MAVLINK_FRAMING_BAD_CRC) {
+		/*
+		  the CRC came out wrong. We now need to overwrite the
+		  msg CRC with the one on the wire so that if the
+		  caller decides to forward the message anyway that
+		  mavlink_msg_to_send_buffer() won't overwrite the
+		  checksum
+		 */
+		r_message->checksum = msgbuf->ck[0] | (msgbuf->ck[1]<<8);
+	}
+
+	return msgstat->msg_received;
+}
+
+// Parse a frame with an extended identifier. Frames of a message are all 8 bytes long except the last one,
+// so the frame index tells whether something has been lost in between
+MAVLINK_HELPER void _canmavlink_parse_ext_frame(CanRxMsg * frame, mavlink_message_t * msgbuf, mavlink_status_t * msgstat,
+		mavlink_message_t* r_message)
 {
-	if(frame->IDE != CAN_ID_STD) return MAVLINK_FRAMING_INCOMPLETE;
+	uint8_t * buff = (uint8_t *)_MAV_PAYLOAD_NON_CONST(msgbuf);
+	uint8_t dlc = frame->DLC;
+
+	if(CAN_EXTID_INDEX(frame) == 0)
+	{
+		msgbuf->magic = CAN_EXTID_V2FLAG(frame) ? MAVLINK_STX : MAVLINK_STX_MAVLINK1;
+		msgbuf->msgid = CAN_EXTID_MSGID(frame);
+		msgbuf->seq = CAN_EXTID_SEQ(frame);
+		msgbuf->sysid = CAN_EXTID_SYSID(frame);
+		msgbuf->compid = CAN_EXTID_COMPID(frame);
+		msgbuf->incompat_flags = 0;
+		msgbuf->compat_flags = 0;
+
+		msgstat->flags = CAN_EXTID_V2FLAG(frame) ? 0 : MAVLINK_STATUS_FLAG_IN_MAVLINK1;
+		msgstat->packet_idx = 0;
+		msgstat->parse_state = MAVLINK_PARSE_STATE_GOT_MSGID3;
+	}
+
+	msgstat->msg_received = MAVLINK_FRAMING_INCOMPLETE;
+
+	// packet_idx counts frames there, since payload with CRC could be longer than 255
+	uint16_t offset = CAN_EXTID_INDEX(frame) * CAN2_MAX_DLC;
+	uint16_t total = offset + dlc;
+
+	if( msgstat->parse_state != MAVLINK_PARSE_STATE_GOT_MSGID3 ||
+		CAN_EXTID_INDEX(frame) != msgstat->packet_idx ||
+		CAN_EXTID_SEQ(frame) != msgbuf->seq || CAN_EXTID_MSGID(frame) != msgbuf->msgid ||
+		(!CAN_EXTID_LASTFLAG(frame) && dlc != CAN2_MAX_DLC) ||
+		total > MAVLINK_MAX_PAYLOAD_LEN + MAVLINK_NUM_CHECKSUM_BYTES )
+	{
+		msgstat->parse_state = MAVLINK_PARSE_STATE_IDLE;
+		msgstat->parse_error++;
+		return;
+	}
+
+	memcpy(buff + offset, frame->Data, dlc);
+	msgstat->packet_idx++;
+
+	if(!CAN_EXTID_LASTFLAG(frame))
+		return;
 
-	uint8_t chan = CAN_STDID_COMPID(frame); // Implicit logic channel separation
+	msgstat->parse_state = MAVLINK_PARSE_STATE_IDLE;
+	if(total < MAVLINK_NUM_CHECKSUM_BYTES)
+	{
+		msgstat->parse_error++;
+		return;
+	}
+
+	msgbuf->len = total - MAVLINK_NUM_CHECKSUM_BYTES;
+	msgstat->packet_idx = msgbuf->len;
+	msgbuf->ck[0] = buff[msgbuf->len];
+	msgbuf->ck[1] = buff[msgbuf->len + 1];
+
+	// CRC goes over the header in the wire order, as if the message came in a regular MAVLink stream
+	mavlink_start_checksum(msgbuf);
+	mavlink_update_checksum(msgbuf, msgbuf->len);
+	if(msgbuf->magic != MAVLINK_STX_MAVLINK1)
+	{
+		mavlink_update_checksum(msgbuf, msgbuf->incompat_flags);
+		mavlink_update_checksum(msgbuf, msgbuf->compat_flags);
+	}
+	mavlink_update_checksum(msgbuf, msgbuf->seq);
+	mavlink_update_checksum(msgbuf, msgbuf->sysid);
+	mavlink_update_checksum(msgbuf, msgbuf->compid);
+	mavlink_update_checksum(msgbuf, msgbuf->msgid & 0xFF);
+	if(msgbuf->magic != MAVLINK_STX_MAVLINK1) //Upper msgid bytes are always zero there
+	{
+		mavlink_update_checksum(msgbuf, 0);
+		mavlink_update_checksum(msgbuf, 0);
+	}
+
+	for(int i = 0; i < msgbuf->len; i++)
+		mavlink_update_checksum(msgbuf, buff[i]);
+
+	const mavlink_msg_entry_t *e = mavlink_get_msg_entry(msgbuf->msgid);
+	uint8_t crc_extra = e?e->crc_extra:0;
+	mavlink_update_checksum(msgbuf, crc_extra);
+
+	if (e && msgbuf->len < e->msg_len) {
+		memset(buff + msgbuf->len, 0, e->msg_len - msgbuf->len);
+	}
 
-	mavlink_message_t * msgbuf = mavlink_get_channel_buffer(chan);
-	mavlink_status_t * msgstat = mavlink_get_channel_status(chan);
+	if( *(uint16_t *)msgbuf->ck != msgbuf->checksum )
+		msgstat->msg_received = MAVLINK_FRAMING_BAD_CRC;
+	else
+		msgstat->msg_received = MAVLINK_FRAMING_OK;
+
+	memcpy(r_message, msgbuf, sizeof(mavlink_message_t));
+}
+
+// Parse a frame with a standard identifier. The first frame carries the header, consecutive ones
+// the payload and then CRC
+MAVLINK_HELPER void _canmavlink_parse_std_frame(CanRxMsg * frame, mavlink_message_t * msgbuf, mavlink_status_t * msgstat,
+		mavlink_message_t* r_message)
+{
 	uint8_t copylen = 0;
 
 	if(ISFIRSTFRAME(frame)) //We should process 1st frame differently
 	{
-		if(frame->DLC != FIRSTFRAMEDATALEN) return 0;
 		copylen = frame->DLC;
 
-		msgbuf->msgid = CAN_STDID_MSGID(frame);
-		msgbuf->magic = MAVLINK_STX_MAVLINK1; //FIXME maybe we should add 2.0?
 		mavlink_start_checksum(msgbuf);
 		msgbuf->len = frame->Data[0];
-		msgbuf->seq = frame->Data[1];
-		msgbuf->sysid = frame->Data[2];
-		msgbuf->compid = frame->Data[3];
 
-		msgstat->packet_idx = 0;
+		if(copylen == FIRSTFRAMEDATALEN)
+		{
+			msgbuf->magic = MAVLINK_STX_MAVLINK1;
+			msgbuf->seq = frame->Data[1];
+			msgbuf->sysid = frame->Data[2];
+			msgbuf->compid = frame->Data[3];
+			msgbuf->msgid = frame->Data[4];
+			msgbuf->incompat_flags = 0;
+			msgbuf->compat_flags = 0;
+
+			msgstat->flags = MAVLINK_STATUS_FLAG_IN_MAVLINK1;
+		}
+		else
+		{
+			msgbuf->magic = MAVLINK_STX;
+			msgbuf->incompat_flags = 0;
+			msgbuf->compat_flags = frame->Data[1];
+			msgbuf->seq = frame->Data[2];
+			msgbuf->sysid = frame->Data[3];
+			msgbuf->compid = frame->Data[4];
+			msgbuf->msgid = frame->Data[5] | (uint32_t)frame->Data[6] << 8 | (uint32_t)frame->Data[7] << 16;
+
+			msgstat->flags = 0;
+		}
 
-		msgstat->flags = MAVLINK_STATUS_FLAG_IN_MAVLINK1;
-		msgbuf->incompat_flags = 0;
-		msgbuf->compat_flags = 0;
+		msgstat->packet_idx = 0;
 		msgstat->parse_state = MAVLINK_PARSE_STATE_GOT_MSGID3;
 
-		r_mavlink_status->msg_received = MAVLINK_FRAMING_INCOMPLETE;
+		msgstat->msg_received = MAVLINK_FRAMING_INCOMPLETE;
+
+		if((msgbuf->msgid & 0x3F) != CAN_STDID_MSGID(frame)) //Consecutive frames would be keyed wrong
+		{
+			msgstat->parse_state = MAVLINK_PARSE_STATE_IDLE;
+			msgstat->parse_error++;
+			return;
+		}
 
 	} else	// If it's a consecutive frame, just copy
 	{
@@ -133,16 +495,25 @@ MAVLINK_HELPER uint8_t canmavlink_parse_frame(CanRxMsg * frame, mavlink_message_
 		msgstat->packet_idx += copylen;
 	}
 
-	for(int i = 0; i < copylen; i++) //Handle CRC for header and data
+	if( ISFIRSTFRAME(frame) ) //Header goes to CRC in the wire order, MAVLink 2 incompat_flags are zero
 	{
-		mavlink_update_checksum(msgbuf, frame->Data[i]);
-	}
+		mavlink_update_checksum(msgbuf, frame->Data[0]);
+		if(msgbuf->magic != MAVLINK_STX_MAVLINK1)
+			mavlink_update_checksum(msgbuf, 0);
 
-	if( ISFIRSTFRAME(frame) )
-				mavlink_update_checksum(msgbuf, msgbuf->msgid & 0xFF);
+		for(int i = 1; i < copylen; i++)
+			mavlink_update_checksum(msgbuf, frame->Data[i]);
+	}
+	else
+	{
+		for(int i = 0; i < copylen; i++) //Handle CRC for data
+			mavlink_update_checksum(msgbuf, frame->Data[i]);
+	}
 
 	if(frame->DLC - copylen == 2) //We've got CRC
 	{
+		msgstat->parse_state = MAVLINK_PARSE_STATE_IDLE;
+
 		//Proper handling of predefined messages' properties (copied from mavlink code)
 		const mavlink_msg_entry_t *e = mavlink_get_msg_entry(msgbuf->msgid);
 		uint8_t crc_extra = e?e->crc_extra:0;
@@ -168,45 +539,54 @@ MAVLINK_HELPER uint8_t canmavlink_parse_frame(CanRxMsg * frame, mavlink_message_
 
 		memcpy(r_message, msgbuf, sizeof(mavlink_message_t));
 	}
-
-	// Also a piece from original mavlink
-	// If a message has been sucessfully decoded, check index
-	if (msgstat->msg_received == MAVLINK_FRAMING_OK)
+	else if(frame->DLC != copylen) //Frames have been lost, lengths don't match anymore
 	{
-		// Count all the dropped packets
-		int16_t drop = msgbuf->seq - msgstat->current_rx_seq - 1;
-		drop = drop > 0 ? drop:0;
-		msgstat->packet_rx_drop_count += drop;
-		// Set the current msg seq
-		msgstat->current_rx_seq = msgbuf->seq;
-		// Initial condition: If no packet has been received so far, drop count is undefined
-		if (msgstat->packet_rx_success_count == 0) msgstat->packet_rx_drop_count = 0;
-		// Count this packet as received
-		msgstat->packet_rx_success_count++;
+		msgstat->parse_state = MAVLINK_PARSE_STATE_IDLE;
+		msgstat->parse_error++;
 	}
+}
 
-	// Provide user info about parsing
-	r_message->len = msgbuf->len; // Provide visibility on how far we are into current msg
-	r_mavlink_status->parse_state = msgstat->parse_state;
-	r_mavlink_status->packet_idx = msgstat->packet_idx;
-	r_mavlink_status->current_rx_seq = msgstat->current_rx_seq+1;
-	r_mavlink_status->packet_rx_success_count = msgstat->packet_rx_success_count;
-	r_mavlink_status->packet_rx_drop_count = msgstat->parse_error;
-	r_mavlink_status->flags = msgstat->flags;
-	msgstat->parse_error = 0;
+/**
+ * @brief Parse a can frame. Messages are reassembled in a table keyed by the identifier fields, so frames of
+ * different messages could interleave on the bus. Counters are kept per channel, which is compid (0-3)
+ *
+ * @arg frame - pointer to a frame to be parsed
+ * @arg r_message - pointer to a message location where a parsing result would be written
+ * @arg r_mavlink_status - pointer to a status structure
+ *
+ * @return A parsing status
+ */
+MAVLINK_HELPER uint8_t canmavlink_parse_frame(CanRxMsg * frame, mavlink_message_t* r_message, mavlink_status_t* r_mavlink_status)
+{
+	canmavlink_reasm_t * table = canmavlink_get_reasm();
+	table->frames++;
 
-	if (msgstat->msg_received == MAVLINK_FRAMING_BAD_CRC) {
-		/*
-		  the CRC came out wrong. We now need to overwrite the
-		  msg CRC with the one on the wire so that if the
-		  caller decides to forward the message anyway that
-		  mavlink_msg_to_send_buffer() won't overwrite the
-		  checksum
-		 */
-		r_message->checksum = msgbuf->ck[0] | (msgbuf->ck[1]<<8);
+	bool ext = frame->IDE == CAN_ID_EXT;
+	if(!ext && frame->IDE != CAN_ID_STD) return MAVLINK_FRAMING_INCOMPLETE;
+
+	bool first = ext ? CAN_EXTID_INDEX(frame) == 0 : ISFIRSTFRAME(frame);
+	// First frame length tells MAVLink 1 from MAVLink 2
+	if(!ext && first && frame->DLC != FIRSTFRAMEDATALEN && frame->DLC != FIRSTFRAMEDATALEN2) return 0;
+
+	uint8_t chan = ext ? CAN_EXTID_COMPID(frame) : CAN_STDID_COMPID(frame);
+	mavlink_status_t * chanstat = mavlink_get_channel_status(chan);
+
+	canmavlink_slot_t * slot = _canmavlink_get_slot(table, ext ? CAN_EXTID_KEY(frame) : CAN_STDID_KEY(frame), first);
+	if(slot == NULL) //Beginning of the message has been lost or it has been evicted
+	{
+		chanstat->parse_error++;
+		return MAVLINK_FRAMING_INCOMPLETE;
 	}
 
-	return msgstat->msg_received;
+	if(ext)
+		_canmavlink_parse_ext_frame(frame, &slot->msg, &slot->status, r_message);
+	else
+		_canmavlink_parse_std_frame(frame, &slot->msg, &slot->status, r_message);
+
+	if(slot->status.parse_state == MAVLINK_PARSE_STATE_IDLE) //Complete or broken
+		slot->busy = false;
+
+	return _canmavlink_parse_finish(&slot->msg, &slot->status, chanstat, r_message, r_mavlink_status);
 }
 
 #undef MIN
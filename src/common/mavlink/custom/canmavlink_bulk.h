@@ -0,0 +1,224 @@
+#ifndef CANMAVLINK_BULK
+#define CANMAVLINK_BULK
+
+/*
+ * Windowed bulk transfer over canmavlink, for pictures and spectra. A sender announces a transfer with header
+ * messages, then sends data messages numbered from zero (seqnr of ENCAPSULATED_DATA and alike). The receiver
+ * answers every one with ZIKUSH_BULK_ACK: the first packet it misses, a bitmap of those received after it and
+ * a window, how many packets from the first missing one the sender may have in flight. The window is free room
+ * of the receiver, so it paces the sender, zero pauses it.
+ *
+ * A node sends its frames in order and CAN keeps it, so a packet missing below one received later has been lost
+ * and goes again at once. If nothing is acknowledged for a timeout, everything in flight goes again. Only the
+ * protocol state is kept here, messages are built and sent by the caller
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CANMAVLINK_BULK_MAXWINDOW	32	//width of bitmaps
+
+// What canmavlink_bulk_tx_poll() gives besides packet numbers
+#define CANMAVLINK_BULK_WAIT	(-1)	//nothing to send now
+#define CANMAVLINK_BULK_HEADER	(-2)	//send header messages (again)
+#define CANMAVLINK_BULK_DONE	(-3)	//every packet acknowledged
+#define CANMAVLINK_BULK_FAILED	(-4)	//receiver is silent for the abort timeout
+
+typedef struct {
+	uint16_t packets;
+	uint16_t next;		//first packet not acknowledged
+	uint16_t sent;		//packets below were sent at least once
+	uint8_t window;
+	bool started;		//receiver has answered the header
+	bool header;		//header should go
+	uint32_t acked;		//bit i: next + i acknowledged selectively
+	uint32_t lost;		//bit i: next + i should go again
+	uint16_t order[CANMAVLINK_BULK_MAXWINDOW];	//when a packet in flight went last, by seq % CANMAVLINK_BULK_MAXWINDOW
+	uint16_t sendcount;
+	uint32_t acktime;	//last acknowledgment, ms
+	uint32_t rtotime;	//last progress, header or retransmission timeout, ms
+	uint32_t timeout, abort;	//ms
+	uint32_t retransmits;
+} canmavlink_bulk_tx_t;
+
+typedef struct {
+	uint32_t msgid;		//data messages of the transfer
+	uint16_t packets;
+	uint16_t next;		//first packet missing
+	uint32_t received;	//bit i: next + 1 + i received, as ZIKUSH_BULK_ACK has it
+	uint8_t compid;		//sender
+	bool active;
+	uint32_t stamp;		//last message of the transfer, ms
+	uint32_t duplicates;
+} canmavlink_bulk_rx_t;
+
+
+/**
+ * @brief Start a transfer. Nothing goes until the receiver answers the header
+ *
+ * @arg packets - data messages in the transfer
+ * @arg now - time in ms, wrapping
+ * @arg timeout - retransmit everything in flight if nothing is acknowledged for that long
+ * @arg abort - give up if the receiver is silent for that long
+ */
+static inline void canmavlink_bulk_tx_start(canmavlink_bulk_tx_t * tx, uint16_t packets, uint32_t now, uint32_t timeout, uint32_t abort)
+{
+	*tx = (canmavlink_bulk_tx_t){ .packets = packets, .header = true, .acktime = now, .rtotime = now, .timeout = timeout, .abort = abort };
+}
+
+/**
+ * @brief What should go next
+ *
+ * @return A packet number, or CANMAVLINK_BULK_WAIT, _HEADER, _DONE, _FAILED
+ */
+static inline int32_t canmavlink_bulk_tx_poll(canmavlink_bulk_tx_t * tx, uint32_t now)
+{
+	if(tx->next >= tx->packets)
+		return CANMAVLINK_BULK_DONE;
+
+	if(now - tx->acktime > tx->abort)
+		return CANMAVLINK_BULK_FAILED;
+
+	if(!tx->started)
+		return (tx->header || now - tx->rtotime > tx->timeout) ? CANMAVLINK_BULK_HEADER : CANMAVLINK_BULK_WAIT;
+
+	if(now - tx->rtotime > tx->timeout)
+	{
+		for(uint16_t i = 0; i < (uint16_t)(tx->sent - tx->next); i++)
+			if( !(tx->acked & (1UL << i)) )
+				tx->lost |= 1UL << i;
+
+		tx->rtotime = now;
+	}
+
+	uint32_t limit = (uint32_t)tx->next + tx->window;
+	if(limit > tx->packets)
+		limit = tx->packets;
+
+	if(tx->lost && (uint32_t)tx->next + __builtin_ctz(tx->lost) < limit)
+		return tx->next + __builtin_ctz(tx->lost);
+
+	if(tx->sent < limit)
+		return tx->sent;
+
+	return CANMAVLINK_BULK_WAIT;
+}
+
+// Header messages are queued
+static inline void canmavlink_bulk_tx_header_sent(canmavlink_bulk_tx_t * tx, uint32_t now)
+{
+	tx->header = false;
+	tx->rtotime = now;
+}
+
+// A packet from canmavlink_bulk_tx_poll() is queued
+static inline void canmavlink_bulk_tx_sent(canmavlink_bulk_tx_t * tx, uint16_t seq)
+{
+	tx->order[seq % CANMAVLINK_BULK_MAXWINDOW] = tx->sendcount++;
+
+	if(seq == tx->sent)
+	{
+		tx->sent++;
+	}
+	else
+	{
+		tx->lost &= ~(1UL << (uint16_t)(seq - tx->next));
+		tx->retransmits++;
+	}
+}
+
+/**
+ * @brief Take ZIKUSH_BULK_ACK fields. Stale ones, with next below what is already acknowledged, are ignored
+ */
+static inline void canmavlink_bulk_tx_ack(canmavlink_bulk_tx_t * tx, uint16_t next, uint32_t received, uint8_t window, uint32_t now)
+{
+	if(next < tx->next || next > tx->sent)
+		return;
+
+	tx->started = true;
+	tx->acktime = now;
+	tx->window = window < CANMAVLINK_BULK_MAXWINDOW ? window : CANMAVLINK_BULK_MAXWINDOW;
+
+	if(next > tx->next)
+	{
+		uint16_t shift = next - tx->next;
+		tx->acked = shift < 32 ? tx->acked >> shift : 0;
+		tx->lost = shift < 32 ? tx->lost >> shift : 0;
+		tx->next = next;
+		tx->rtotime = now;
+	}
+
+	uint32_t acked = received << 1;
+	if(acked & ~tx->acked)
+		tx->rtotime = now;
+
+	tx->acked |= acked;
+	tx->lost &= ~tx->acked;
+
+	if(!tx->acked)
+		return;
+
+	// Holes which went before the last acknowledged packet are lost
+	uint8_t top = 31 - __builtin_clz(tx->acked);
+	uint16_t toporder = tx->order[(uint16_t)(tx->next + top) % CANMAVLINK_BULK_MAXWINDOW];
+
+	for(uint8_t i = 0; i < top; i++)
+		if( !(tx->acked & (1UL << i)) && (int16_t)(tx->order[(uint16_t)(tx->next + i) % CANMAVLINK_BULK_MAXWINDOW] - toporder) < 0 )
+			tx->lost |= 1UL << i;
+}
+
+
+// A header came. The sender repeats it only until it is answered, so nothing has been received yet
+static inline void canmavlink_bulk_rx_start(canmavlink_bulk_rx_t * rx, uint8_t compid, uint32_t msgid, uint16_t packets, uint32_t now)
+{
+	*rx = (canmavlink_bulk_rx_t){ .msgid = msgid, .packets = packets, .compid = compid, .active = true, .stamp = now, .duplicates = rx->duplicates };
+}
+
+/**
+ * @brief Account a data packet of the transfer
+ *
+ * @return False if it is a duplicate or out of the window, it should be dropped then
+ */
+static inline bool canmavlink_bulk_rx_packet(canmavlink_bulk_rx_t * rx, uint16_t seq, uint32_t now)
+{
+	rx->stamp = now;
+
+	if(seq < rx->next || seq >= rx->packets)
+	{
+		rx->duplicates++;
+		return false;
+	}
+
+	uint16_t offset = seq - rx->next;
+	if(offset > CANMAVLINK_BULK_MAXWINDOW)
+		return false;
+
+	if(offset == 0)
+	{
+		rx->next++;
+		while(rx->received & 1)
+		{
+			rx->received >>= 1;
+			rx->next++;
+		}
+		rx->received >>= 1;
+	}
+	else if(rx->received & (1UL << (offset - 1)))
+	{
+		rx->duplicates++;
+		return false;
+	}
+	else
+	{
+		rx->received |= 1UL << (offset - 1);
+	}
+
+	return true;
+}
+
+static inline bool canmavlink_bulk_rx_done(const canmavlink_bulk_rx_t * rx)
+{
+	return rx->next >= rx->packets;
+}
+
+#endif //#ifndef CANMAVLINK_BULK
@@ -0,0 +1,169 @@
+#ifndef CANMAVLINK_FILTERS
+#define CANMAVLINK_FILTERS
+
+/*
+ * bxCAN acceptance filters for canmavlink traffic, built from a routing table. Filters match the lower
+ * msgid byte, which extended identifiers carry. Standard ones have six lower bits of it only, so ids 64 apart
+ * pass the same filter there. Priority bits are not matched. Filters are written to the registers directly,
+ * so it is the same for F1 and F4 whatever HAL a board uses. Include it after the device header
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// 16 bit mask mode holds two filters in a bank, extended frames need a 32 bit one each
+#define CANMAVLINK_FILTERS_CAPACITY(BANKS, EXT)	( (EXT) ? (BANKS) * 2 / 3 : (BANKS) * 2 )
+
+typedef struct {
+	uint32_t msgid;
+	uint8_t nodes;	//bit per compid taking the message
+	uint8_t priority;	//CANMAVLINK_PRIO_HIGHEST..CANMAVLINK_PRIO_LOWEST, see CANMAVLINK_MSG_PRIORITY
+} canmavlink_route_t;
+
+typedef struct {
+	uint8_t id;
+	uint8_t mask;	//lower msgid byte matches if (msgid & mask) == id
+} canmavlink_filter_t;
+
+// 16 bit filter: STDID[10:0] | RTR | IDE | EXID[17:15], msgid bits are at StdId[5:0]. RTR and IDE should be zero
+#define CANMAVLINK_FILTER16(FILTER)	( (uint32_t)(((FILTER).mask & 0x3F) << 5 | 0x18) << 16 | (uint32_t)((FILTER).id & 0x3F) << 5 )
+
+// 32 bit filter: EXID[28:0] | IDE | RTR | 0, msgid is at ExtId[24:17]. IDE should be set, RTR zero
+#define CANMAVLINK_FILTER32_ID(FILTER)		( (uint32_t)(FILTER).id << 20 | 0x04 )
+#define CANMAVLINK_FILTER32_MASK(FILTER)	( (uint32_t)(FILTER).mask << 20 | 0x06 )
+
+static inline uint16_t _canmavlink_filter_width(canmavlink_filter_t filter)
+{
+	return 1 << (8 - __builtin_popcount(filter.mask));
+}
+
+static inline canmavlink_filter_t _canmavlink_filter_merge(canmavlink_filter_t a, canmavlink_filter_t b)
+{
+	canmavlink_filter_t merged;
+	merged.mask = a.mask & b.mask & ~(a.id ^ b.id);
+	merged.id = a.id & merged.mask;
+	return merged;
+}
+
+static inline bool _canmavlink_filter_covers(canmavlink_filter_t a, canmavlink_filter_t b)
+{
+	return (a.mask & b.mask) == a.mask && (b.id & a.mask) == a.id;
+}
+
+// Drop filters the one at index keeps covered, returns a new count
+static inline uint8_t _canmavlink_filters_drop_covered(canmavlink_filter_t * filters, uint8_t count, int index)
+{
+	for(int i = 0; i < count; i++)
+	{
+		if(i == index || !_canmavlink_filter_covers(filters[index], filters[i]))
+			continue;
+
+		filters[i] = filters[--count];
+		if(index == count) index = i;
+		i--;
+	}
+
+	return count;
+}
+
+/**
+ * @brief Build filters for messages routed to a node. If there are more than the banks hold, two filters
+ * which cost the least extra ids are merged until the rest fits. Those ids are dropped in software as before
+ *
+ * @arg filters - buffer for routecount filters
+ * @arg maxcount - how many filters the banks hold, CANMAVLINK_FILTERS_CAPACITY()
+ * @arg routes, routecount - routing table
+ * @arg node - compid of the node
+ *
+ * @return A number of filters built
+ */
+static inline uint8_t canmavlink_filters_build(canmavlink_filter_t * filters, uint8_t maxcount,
+		const canmavlink_route_t * routes, uint8_t routecount, uint8_t node)
+{
+	uint8_t count = 0;
+
+	for(int r = 0; r < routecount; r++)
+	{
+		if(routes[r].nodes & (1 << node))
+		{
+			filters[count] = (canmavlink_filter_t){ (uint8_t)routes[r].msgid, 0xFF };
+			count = _canmavlink_filters_drop_covered(filters, count + 1, count);
+		}
+	}
+
+	while(count > maxcount && count > 1)
+	{
+		int besta = 0, bestb = 1;
+		int32_t bestcost = INT32_MAX;
+
+		for(int a = 0; a < count; a++)
+			for(int b = a + 1; b < count; b++)
+			{
+				int32_t cost = _canmavlink_filter_width(_canmavlink_filter_merge(filters[a], filters[b]))
+						- _canmavlink_filter_width(filters[a]) - _canmavlink_filter_width(filters[b]);
+
+				if(cost < bestcost)
+				{
+					bestcost = cost;
+					besta = a;
+					bestb = b;
+				}
+			}
+
+		filters[besta] = _canmavlink_filter_merge(filters[besta], filters[bestb]);
+		filters[bestb] = filters[--count];
+
+		// The wider filter could cover some others now
+		count = _canmavlink_filters_drop_covered(filters, count, besta);
+	}
+
+	return count;
+}
+
+/**
+ * @brief Write filters to the bxCAN. Standard frames go to 16 bit mask banks, two filters each. If extended
+ * frames are enabled, every filter also takes a 32 bit bank after those. The rest of the banks are disabled
+ *
+ * @arg can - CAN instance (its filter registers, for CAN2 on F4 those are the CAN1 ones)
+ * @arg firstbank, bankcount - banks given to this instance
+ * @arg filters, count - filters from canmavlink_filters_build()
+ * @arg ext - whether extended frames should be accepted as well
+ */
+static inline void canmavlink_filters_apply(CAN_TypeDef * can, uint8_t firstbank, uint8_t bankcount,
+		const canmavlink_filter_t * filters, uint8_t count, bool ext)
+{
+	uint8_t bank = firstbank;
+
+	can->FMR |= CAN_FMR_FINIT;
+
+	for(int i = firstbank; i < firstbank + bankcount; i++)
+		can->FA1R &= ~(1UL << i);
+
+	for(int i = 0; i < count && bank < firstbank + bankcount; i += 2, bank++)
+	{
+		uint32_t bit = 1UL << bank;
+
+		can->FM1R &= ~bit;	//mask mode
+		can->FS1R &= ~bit;	//16 bit
+		can->FFA1R &= ~bit;	//FIFO 0
+		can->sFilterRegister[bank].FR1 = CANMAVLINK_FILTER16(filters[i]);
+		can->sFilterRegister[bank].FR2 = CANMAVLINK_FILTER16(filters[i + 1 < count ? i + 1 : i]);
+		can->FA1R |= bit;
+	}
+
+	for(int i = 0; ext && i < count && bank < firstbank + bankcount; i++, bank++)
+	{
+		uint32_t bit = 1UL << bank;
+
+		can->FM1R &= ~bit;
+		can->FS1R |= bit;	//32 bit
+		can->FFA1R &= ~bit;
+		can->sFilterRegister[bank].FR1 = CANMAVLINK_FILTER32_ID(filters[i]);
+		can->sFilterRegister[bank].FR2 = CANMAVLINK_FILTER32_MASK(filters[i]);
+		can->FA1R |= bit;
+	}
+
+	can->FMR &= ~CAN_FMR_FINIT;
+}
+
+#endif //#ifndef CANMAVLINK_FILTERS
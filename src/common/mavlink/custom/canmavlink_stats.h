@@ -0,0 +1,133 @@
+#ifndef CANMAVLINK_STATS
+#define CANMAVLINK_STATS
+
+/*
+ * Bus load and error accounting of a node, reported as ZIKUSH_CAN_STATS. Drivers count frames, bits are
+ * worst-case lengths with stuffing, as research/can-busload/busload.py has them, so loads are upper bounds.
+ * Error state is read from the registers, so it is the same for F1 and F4 whatever HAL a board uses.
+ * Include it after the device header and the mavlink one
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+	uint32_t tx_frames, tx_bits;
+	uint32_t rx_frames, rx_bits;
+	uint16_t rx_overruns;	//FIFO overruns, the hardware drops a frame each
+	uint16_t rx_dropped;	//frames the software had no room for
+	uint16_t tx_timeouts;	//requests cancelled while the last try lost arbitration, the bus was too busy to get through.
+							//The hardware retries lost arbitration by itself, those retries are not seen at all
+	uint16_t tx_errors;		//cancelled requests which failed otherwise. Nodes which never cancel have both at zero
+	uint16_t busoffs;
+	bool busoff;
+
+	// At the last report, rates are counted from there
+	uint32_t stamp;
+	uint32_t tx_frames_last, tx_bits_last, rx_frames_last, rx_bits_last;
+} canmavlink_stats_t;
+
+// Worst case frame length in bits, from SOF to the end of interframe space
+static inline uint16_t canmavlink_frame_bits(bool ext, uint8_t dlc)
+{
+	return ext ? 67 + 8 * dlc + (54 + 8 * dlc - 1) / 4 : 47 + 8 * dlc + (34 + 8 * dlc - 1) / 4;
+}
+
+// Bus-off is counted on the way in. ABOM off leaves a node there until it is initialised again
+static inline void _canmavlink_stats_errstate(canmavlink_stats_t * stats, CAN_TypeDef * can)
+{
+	bool busoff = (can->ESR & CAN_ESR_BOFF) != 0;
+
+	if(busoff && !stats->busoff)
+		stats->busoffs++;
+
+	stats->busoff = busoff;
+}
+
+/**
+ * @brief Account a finished transmission request, from the TX IRQ or after waiting for a mailbox
+ *
+ * @arg mailbox - 0..2
+ * @arg tsr - TSR read before RQCP of the mailbox is cleared or the mailbox is loaded again
+ */
+static inline void canmavlink_stats_tx_done(canmavlink_stats_t * stats, CAN_TypeDef * can, uint8_t mailbox, uint32_t tsr)
+{
+	tsr >>= mailbox * 8; //RQCP, TXOK, ALST and TERR of the mailbox 0 are in the lowest byte
+
+	if(tsr & CAN_TSR_TXOK0)
+	{
+		stats->tx_frames++;
+		stats->tx_bits += canmavlink_frame_bits(can->sTxMailBox[mailbox].TIR & CAN_TI0R_IDE, can->sTxMailBox[mailbox].TDTR & CAN_TDT0R_DLC);
+		return;
+	}
+
+	if(tsr & CAN_TSR_ALST0)
+		stats->tx_timeouts++;
+	else
+		stats->tx_errors++;
+
+	_canmavlink_stats_errstate(stats, can);
+}
+
+// Account a received frame
+static inline void canmavlink_stats_rx(canmavlink_stats_t * stats, bool ext, uint8_t dlc)
+{
+	stats->rx_frames++;
+	stats->rx_bits += canmavlink_frame_bits(ext, dlc);
+}
+
+// Count and clear a FIFO 0 overrun, from the RX IRQ. Frames in the FIFO stay there
+static inline void canmavlink_stats_rx_overrun(canmavlink_stats_t * stats, CAN_TypeDef * can)
+{
+	if(can->RF0R & CAN_RF0R_FOVR0)
+	{
+		stats->rx_overruns++;
+		can->RF0R = CAN_RF0R_FOVR0; //rc_w1, writing zero to RFOM0 releases nothing
+	}
+}
+
+static inline uint16_t _canmavlink_stats_rate(uint32_t count, uint32_t ms)
+{
+	uint32_t rate = count / ms * 1000 + count % ms * 1000 / ms;
+	return rate > UINT16_MAX ? UINT16_MAX : rate;
+}
+
+/**
+ * @brief Fill a report. Rates are over the time since the previous one. reasm_evicted is up to the caller,
+ * the reassembly table is static in the translation unit parsing frames
+ *
+ * @arg now - time in ms
+ */
+static inline void canmavlink_stats_report(canmavlink_stats_t * stats, CAN_TypeDef * can, uint32_t now, mavlink_zikush_can_stats_t * report)
+{
+	uint32_t elapsed = now - stats->stamp ? now - stats->stamp : 1;
+	uint32_t esr = can->ESR;
+
+	_canmavlink_stats_errstate(stats, can);
+
+	uint32_t tx_frames = stats->tx_frames, tx_bits = stats->tx_bits;
+	uint32_t rx_frames = stats->rx_frames, rx_bits = stats->rx_bits;
+
+	report->time_boot_ms = now;
+	report->tx_fps = _canmavlink_stats_rate(tx_frames - stats->tx_frames_last, elapsed);
+	report->tx_bps = _canmavlink_stats_rate(tx_bits - stats->tx_bits_last, elapsed);
+	report->rx_fps = _canmavlink_stats_rate(rx_frames - stats->rx_frames_last, elapsed);
+	report->rx_bps = _canmavlink_stats_rate(rx_bits - stats->rx_bits_last, elapsed);
+	report->rx_overruns = stats->rx_overruns;
+	report->rx_dropped = stats->rx_dropped;
+	report->tx_timeouts = stats->tx_timeouts;
+	report->tx_errors = stats->tx_errors;
+	report->busoffs = stats->busoffs;
+	report->tec = (esr & CAN_ESR_TEC) >> 16;
+	report->rec = (esr & CAN_ESR_REC) >> 24;
+	report->state = esr & (CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF);
+	report->reasm_evicted = 0;
+
+	stats->stamp = now;
+	stats->tx_frames_last = tx_frames;
+	stats->tx_bits_last = tx_bits;
+	stats->rx_frames_last = rx_frames;
+	stats->rx_bits_last = rx_bits;
+}
+
+#endif //#ifndef CANMAVLINK_STATS
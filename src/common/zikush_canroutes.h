@@ -0,0 +1,92 @@
+/*
+ * 	Which node takes which message from the CAN bus, and how urgent it is
+ *
+ * 	Acceptance filters of every node are built from this table (see canmavlink_filters.h), and the ICU
+ * 	router forwards only what some other node takes. A message not listed here never reaches software.
+ * 	Messages from the ground are routed by msgid the same way as onboard ones.
+ *
+ * 	Priority goes in the top bits of CAN identifiers, so a level always wins arbitration over the lower ones
+ * 	whatever compid sends it. With the flight profile at 45 kbit/s (about 14% load), worst-case latencies
+ * 	(busload.py -2 -l) are 20 ms for power commands, 36 ms for ZIKUSH_POWER_STATE, 60 ms for other commands
+ * 	and heartbeats, 165 ms for telemetry and 345 ms for a spectrum. Telemetry stays bounded only while SCU
+ * 	rates are under about 5 times the profile ones (busload.py -s). Pictures take the UART backbone, over
+ * 	CAN (CCU_BULK_OVER_CAN) one would hold the bus for about 10 s and nothing of the bulk level would be
+ * 	bounded. That counts from the head of the sender's queue: a node sends its own
+ * 	messages in order, so an urgent one still waits for the frames this node has queued before.
+ * 	The bounds need automatic retransmission (NART off) on every node: a frame losing arbitration goes again
+ * 	when the bus is free instead of being dropped with the whole message. Error frames are not counted
+ * 	This header goes before canmavlink, which takes priorities from it (CANMAVLINK_MSG_PRIORITY)
+ */
+
+#ifndef ZIKUSH_CANROUTES_H_
+#define ZIKUSH_CANROUTES_H_
+
+#ifdef CANMAVLINK
+#error "zikush_canroutes.h goes before canmavlink, encoders take message priorities from it"
+#endif
+
+#include <mavlink/zikush/mavlink.h>
+#include <canmavlink_filters.h>
+
+#define ZIKUSH_CANROUTE_ICU	(1 << ZIKUSH_ICU)
+#define ZIKUSH_CANROUTE_PCU	(1 << ZIKUSH_PCU)
+#define ZIKUSH_CANROUTE_SCU	(1 << ZIKUSH_SCU)
+#define ZIKUSH_CANROUTE_CCU	(1 << ZIKUSH_CCU)
+
+// Arbitration priorities, the lower wins. research/can-busload/busload.py -l gives worst-case latencies
+#define ZIKUSH_CANPRIO_URGENT		0	//power commands and state
+#define ZIKUSH_CANPRIO_CONTROL		1	//other commands, heartbeats
+#define ZIKUSH_CANPRIO_TELEMETRY	2
+#define ZIKUSH_CANPRIO_BULK			3	//pictures and spectra, also anything not listed
+
+static const canmavlink_route_t zikush_canroutes[] = {
+		// Commands
+		{ MAVLINK_MSG_ID_ZIKUSH_CMD_PREFLIGHTRESET,	ZIKUSH_CANROUTE_PCU, ZIKUSH_CANPRIO_URGENT },
+		{ MAVLINK_MSG_ID_ZIKUSH_CMD_POWEROFF,			ZIKUSH_CANROUTE_PCU, ZIKUSH_CANPRIO_URGENT },
+		{ MAVLINK_MSG_ID_ZIKUSH_CMD_POWERBUS,			ZIKUSH_CANROUTE_PCU, ZIKUSH_CANPRIO_URGENT },
+		{ MAVLINK_MSG_ID_ZIKUSH_CMD_TAKE_SPECTRUM,		ZIKUSH_CANROUTE_CCU, ZIKUSH_CANPRIO_CONTROL },
+		{ MAVLINK_MSG_ID_ZIKUSH_CMD_TAKE_PHOTO,		ZIKUSH_CANROUTE_CCU | ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_CONTROL }, //SCU asks for it on motion events
+		{ MAVLINK_MSG_ID_ZIKUSH_BULK_ACK,				ZIKUSH_CANROUTE_CCU, ZIKUSH_CANPRIO_CONTROL }, //flow control of pictures and spectra
+
+		// Telemetry, goes to SD and the radio
+		{ MAVLINK_MSG_ID_HEARTBEAT,					ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_CONTROL },
+		{ MAVLINK_MSG_ID_ZIKUSH_POWER_STATE,			ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_URGENT },
+		{ MAVLINK_MSG_ID_ZIKUSH_POWER_CONSUMED,		ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_TELEMETRY },
+		{ MAVLINK_MSG_ID_SCALED_PRESSURE,				ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_TELEMETRY },
+		{ MAVLINK_MSG_ID_SCALED_PRESSURE2,			ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_TELEMETRY },
+		{ MAVLINK_MSG_ID_ZIKUSH_HUMIDITY,				ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_TELEMETRY },
+		{ MAVLINK_MSG_ID_ATTITUDE_QUATERNION,			ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_TELEMETRY },
+		{ MAVLINK_MSG_ID_LOCAL_POSITION_NED,			ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_TELEMETRY },
+		{ MAVLINK_MSG_ID_ZIKUSH_CAN_STATS,				ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_TELEMETRY },
+		{ MAVLINK_MSG_ID_DATA_TRANSMISSION_HANDSHAKE,	ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_BULK },
+		{ MAVLINK_MSG_ID_ENCAPSULATED_DATA,			ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_BULK },
+		{ MAVLINK_MSG_ID_ZIKUSH_PICTURE_HEADER,		ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_BULK },
+		{ MAVLINK_MSG_ID_ZIKUSH_SPECTRUM_INTENSITY_HEADER,				ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_BULK },
+		{ MAVLINK_MSG_ID_ZIKUSH_SPECTRUM_INTENSITY_ENCAPSULATED_DATA,	ZIKUSH_CANROUTE_ICU, ZIKUSH_CANPRIO_BULK },
+};
+
+#define ZIKUSH_CANROUTES_COUNT	(sizeof(zikush_canroutes) / sizeof(zikush_canroutes[0]))
+
+// Nodes taking a message, 0 if nobody
+static inline uint8_t zikush_canroute_nodes(uint32_t msgid)
+{
+	for(int i = 0; i < ZIKUSH_CANROUTES_COUNT; i++)
+		if(zikush_canroutes[i].msgid == msgid)
+			return zikush_canroutes[i].nodes;
+
+	return 0;
+}
+
+// Arbitration priority of a message, the lowest if it is not listed
+static inline uint8_t zikush_canroute_priority(uint32_t msgid)
+{
+	for(int i = 0; i < ZIKUSH_CANROUTES_COUNT; i++)
+		if(zikush_canroutes[i].msgid == msgid)
+			return zikush_canroutes[i].priority;
+
+	return ZIKUSH_CANPRIO_BULK;
+}
+
+#define CANMAVLINK_MSG_PRIORITY(MSGID)	zikush_canroute_priority(MSGID)
+
+#endif /* ZIKUSH_CANROUTES_H_ */
@@ -3,6 +3,13 @@
 
 /* Probe-wide params */
 #define PROBEWIDE_CAN_TICKRATE	360000 //tickrate, not a bitrate. br = tr / (1 + 5 + 2) (according to current time quantum utilisation)
+#define PROBEWIDE_CAN_EXTID	1 //send short messages with extended identifiers, those carry sysid and seq for reassembly
+#define PROBEWIDE_CAN_FILTERBANKS	14 //bxCAN filter banks of a node. F103 has 14, F407 gives the other 14 to CAN2
+#define PROBEWIDE_CAN_BULK_WINDOW	4 //packets of a bulk transfer in flight at most, no more than CANMAVLINK_BULK_MAXWINDOW
+#define PROBEWIDE_CAN_BULK_RTO_MS	2000 //bulk sender retransmits if nothing is acknowledged for that long
+#define PROBEWIDE_CAN_BULK_ABORT_MS	10000 //bulk transfer is given up if the other side is silent for that long
+#define PROBEWIDE_CAN_STATS_PERIOD_MS	5000 //every node sends ZIKUSH_CAN_STATS that often, rates are averaged over it
+#define PROBEWIDE_CAN_TX_TIMEOUT_MS	100 //nodes sending frame by frame cancel one nobody acknowledges after that, the hardware retries it until then
 
 
 
@@ -32,19 +39,31 @@
 #define ICU_TASKS_CBBNE_STACKSIZE	512
 #define ICU_TASKS_CBBNE_TASKPRIORITY	4 //FIXME handle
 
-#define ICU_TASKS_IRIDIUM_STACKSIZE	2048
+#define ICU_TASKS_IRIDIUM_STACKSIZE	512
 #define ICU_TASKS_IRIDIUM_TASKPRIORITY	5
 #define ICU_TASKS_IRIDIUM_QUEUE_SIZE	3 //defined in sizes of mavlink_msg_t
 
 
-#define ICU_IR_UART_RX_BUFFER_SIZE	200
-#define ICU_IR_UART_RX_QUEUE_WAIT	((1*40*1000)/portTICK_PERIOD_MS)
+#define ICU_IR_UART_RX_BUFFER_SIZE	256		//DMA ring, see uartrx.h
+#define ICU_IR_TICK					((100)/portTICK_PERIOD_MS) //timeouts of the modem driver
 #define ICU_IR_UART_TX_HAL_WAIT		((20*1000)/portTICK_PERIOD_MS)
 #define ICU_IR_TX_ACCUMULATOR_SIZE		340
-#define ICU_IR_TASK_PERIOD			((1*60*1000)/portTICK_PERIOD_MS)
+#define ICU_IR_PACK_SLOTS			16		//messages waiting for a session, no more than 32
+#define ICU_IR_PACK_FRAMESIZE		72		//longest message for Iridium, serialized: ICU_DOWNLINK_PAYLOAD + 8 of a plain frame
+#define ICU_IR_SESSION_PERIOD		(1*60*1000)	//ms, see irsched.h
+#define ICU_IR_PROBE_PERIOD			(10*60*1000)	//ms, a session even without signal
+#define ICU_IR_BACKOFF_MIN			(15*1000)	//ms, after the first failed session
+#define ICU_IR_BACKOFF_MAX			(10*60*1000)	//ms
+#define ICU_IR_SIGIND_MIN			2		//CIEV signal (0-5) worth a session
 #define ICU_IR_ROUTE_WAIT			((10*1000)/portTICK_PERIOD_MS)
 #define ICU_IR_PROCESS_UPLINK		1
 #define ICU_IR_UART_RX_IT_PRIO		14
+#define ICU_IR_COMPACT				1		//compact downlink encoding, see downlink.h
+
+#define ICU_DOWNLINK_STREAMS		10		//per link
+#define ICU_DOWNLINK_PAYLOAD		64		//longer messages go plain, ZIKUSH_ICU_STATS is 57
+#define ICU_DOWNLINK_KEYFRAME_PERIOD	10	//messages of a stream
+#define ICU_DOWNLINK_KEYFRAMES_KEPT	4	//per stream, encoded and not acknowledged yet. No more than the ground decoder keeps
 
 #define ICU_SD_SESSFOLDERNAMEFMT	"0:/zikush/sess%04d"
 #define ICU_SD_SESSNUMBOUNDARY	10000
@@ -57,18 +76,26 @@
 #define ICU_RADIO_RXBUFFLEN	1
 #define ICU_RADIO_TXBUFFLEN	1024
 #define ICU_RADIO_IRQ_PRIO	15
+#define ICU_RADIO_COMPACT	0 //compact downlink encoding, the radio ground path takes plain MAVLink only
+#define ICU_RADIO_BULK_RATE	1500 //bytes per second of pictures and spectra, about 40% of the 30 kbps air rate
+#define ICU_RADIO_BULK_BURST	600 //bytes, two picture packets
 
 #define ICU_CAN_RXBUFFSIZE	68 //in sizes of CANMAVLINK_RX_FRAME_T
+#define ICU_CAN_TXRINGSIZE	69 //in sizes of CANMAVLINK_TX_FRAME_T, two longest messages and one empty slot
 #define ICU_CAN_IRQ_PRIO	13
 
 #define ICU_GPS_FORCECHECKSUMM	false
-#define ICU_GPS_IRQ_PRIO	16
+#define ICU_GPS_IRQ_PRIO	14 //below configMAX_SYSCALL_INTERRUPT_PRIORITY, the ISR notifies the task
+#define ICU_GPS_BAUDRATE	9600 //up to 115200 for 10 Hz receivers
+#define ICU_GPS_RXBUFFLEN	1024 //DMA ring, about 90 ms at 115200
+#define ICU_GPS_EPOCH_GAP_MS	50 //quiet line after which the epoch is sent
 
 #define ICU_CBBNE_IRQ_PRIO	12
-#define ICU_CBBNE_BAUDRATE	9600
-#define ICU_CBBNE_BUFFLEN	1024 //in bytes
-#define ICU_CBBNE_BUFFCOUNT	4
-#define ICU_CBBNE_PERIOD_MS	300//in ms
+#define ICU_CBBNE_BAUDRATE	115200 //the ring holds ~350 ms of it while the card is busy
+#define ICU_CBBNE_BUFFLEN	1024 //in bytes, written to the card as soon as full
+#define ICU_CBBNE_BUFFCOUNT	4 //blocks in the DMA ring
+#define ICU_CBBNE_PERIOD_MS	300//in ms, quiet line after which the rest is written and synced
+#define ICU_CBBNE_MAVLINK_CHAN	MAVLINK_COMM_1 //parser state of the backbone, COMM_0 belongs to Iridium
 
 /* Params for PCU */
 #define PCU_INA_ICU_ADDR	INA219_I2CADDR_A1_GND_A0_VSP
@@ -82,6 +109,7 @@
 #define PCU_POWERSENDPERIOD_CYCL	10
 
 #define PCU_CAN_TIMEOUT_MS	100
+#define PCU_CAN_REASM_SLOTS	2 //only short commands come to the PCU, a slot is ~300 bytes
 
 
 
@@ -94,8 +122,12 @@
 #define CCU_SPECTRUM_X_START	0
 #define CCU_SPECTRUM_X_END		376
 
-#define CCU_DMA_IRQ_PRIO	0
+#define CCU_DMA_IRQ_PRIO	2 //row sums run in the DCMI DMA IRQ, below CAN
 #define CCU_CAN_IRQ_PRIO	1
+#define CCU_CAN_TXRINGSIZE	69 //in sizes of CANMAVLINK_TX_FRAME_T, two longest messages and one empty slot
+
+#define CCU_BULK_OVER_CAN	0 //pictures go to the ICU over CAN with flow control, over the UART2 backbone otherwise
+#define CCU_SPECTRUM_OVER_CAN	1 //spectra the same way. A few packets each, they take the bus, acknowledged and resent if lost
 
 #define CCU_TESTMODE	//Take picture every second and enable UART3 output
 
@@ -4,13 +4,28 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
-../src/main.c 
+../src/fanout.c \
+../src/filelog.c \
+../src/logger.c \
+../src/main.c \
+../src/mavstat.c \
+../src/udpbatch.c 
 
 OBJS += \
-./src/main.o 
+./src/fanout.o \
+./src/filelog.o \
+./src/logger.o \
+./src/main.o \
+./src/mavstat.o \
+./src/udpbatch.o 
 
 C_DEPS += \
-./src/main.d 
+./src/fanout.d \
+./src/filelog.d \
+./src/logger.d \
+./src/main.d \
+./src/mavstat.d \
+./src/udpbatch.d 
 
 
 # Each subdirectory must supply rules for building sources it contributes
@@ -0,0 +1,472 @@
+/*
+ * 	Fan-out of the received stream to several consumers
+ */
+
+#define _GNU_SOURCE //for accept4() and sendmmsg()
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "fanout.h"
+#include "logger.h"
+
+#define RINGMASK (FANOUT_RINGLEN - 1)
+
+#ifndef MIN
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#endif
+
+static const char * _typenames[] = { "udp", "tcp", "file" };
+
+
+static void _ring_write(fanout_sink_t * sink, unsigned int pos, const void * data, unsigned int len)
+{
+	unsigned int offset = pos & RINGMASK;
+	unsigned int first = MIN(len, FANOUT_RINGLEN - offset);
+
+	memcpy(sink->ring + offset, data, first);
+	memcpy(sink->ring, (const uint8_t *)data + first, len - first);
+}
+
+static void _ring_read(fanout_sink_t * sink, unsigned int pos, void * data, unsigned int len)
+{
+	unsigned int offset = pos & RINGMASK;
+	unsigned int first = MIN(len, FANOUT_RINGLEN - offset);
+
+	memcpy(data, sink->ring + offset, first);
+	memcpy((uint8_t *)data + first, sink->ring, len - first);
+}
+
+
+static int _open_udp(fanout_sink_t * sink)
+{
+	char host[256];
+	const char * colon = strrchr(sink->target, ':');
+	if(colon == NULL || colon - sink->target >= (int)sizeof(host))
+		return EINVAL;
+
+	memcpy(host, sink->target, colon - sink->target);
+	host[colon - sink->target] = 0;
+
+	sink->udp = calloc(1, sizeof(udpbatch_t));
+	if(sink->udp == NULL)
+		return ENOMEM;
+
+	return udpbatch_open(sink->udp, host, colon + 1);
+}
+
+static int _open_tcp(fanout_sink_t * sink)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	struct addrinfo * addr = NULL;
+	int err = getaddrinfo(NULL, sink->target, &hints, &addr);
+	if(err != 0)
+		return err;
+
+	sink->listenfd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+	if(sink->listenfd < 0)
+	{
+		freeaddrinfo(addr);
+		return errno;
+	}
+
+	int one = 1;
+	setsockopt(sink->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	err = 0;
+	if(bind(sink->listenfd, addr->ai_addr, addr->ai_addrlen) != 0 || listen(sink->listenfd, FANOUT_TCP_MAXCLIENTS) != 0)
+	{
+		err = errno;
+		close(sink->listenfd);
+		sink->listenfd = -1;
+	}
+
+	freeaddrinfo(addr);
+	return err;
+}
+
+static int _open_file(fanout_sink_t * sink)
+{
+	sink->file = calloc(1, sizeof(filelog_t));
+	if(sink->file == NULL)
+		return ENOMEM;
+
+	return filelog_open(sink->file, sink->target);
+}
+
+
+static void _tcp_accept(fanout_sink_t * sink)
+{
+	int fd;
+	while( (fd = accept4(sink->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 )
+	{
+		int slot;
+		for(slot = 0; slot < FANOUT_TCP_MAXCLIENTS; slot++)
+			if(sink->clients[slot] < 0)
+				break;
+
+		if(slot == FANOUT_TCP_MAXCLIENTS)
+		{
+			logger_printf(LOGGER_ERROR, "tcp %s: too many clients, rejecting\n", sink->target);
+			close(fd);
+			continue;
+		}
+
+		sink->clients[slot] = fd;
+		logger_printf(LOGGER_INFO, "tcp %s: client %d connected\n", sink->target, slot);
+	}
+}
+
+static void _tcp_close(fanout_sink_t * sink, int client)
+{
+	logger_printf(LOGGER_INFO, "tcp %s: client %d disconnected\n", sink->target, client);
+	close(sink->clients[client]);
+	sink->clients[client] = -1;
+	sink->pending_len[client] = 0;
+}
+
+//Sends what is left of the last record, false if the client is closed or still has some left
+static bool _tcp_flush(fanout_sink_t * sink, int client)
+{
+	int left = sink->pending_len[client] - sink->pending_off[client];
+	if(left <= 0)
+		return true;
+
+	int rc = send(sink->clients[client], sink->pending[client] + sink->pending_off[client], left, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		_tcp_close(sink, client);
+		return false;
+	}
+
+	if(rc > 0)
+		sink->pending_off[client] += rc;
+
+	if(sink->pending_off[client] < sink->pending_len[client])
+		return false;
+
+	sink->pending_len[client] = 0;
+	return true;
+}
+
+static void _tcp_send(fanout_sink_t * sink, const uint8_t * data, int len)
+{
+	for(int i = 0; i < FANOUT_TCP_MAXCLIENTS; i++)
+	{
+		if(sink->clients[i] < 0)
+			continue;
+
+		if(!_tcp_flush(sink, i))
+		{
+			//Client doesn't keep up, the record is lost for it as a whole. Records are radio chunks, not MAVLink
+			//frames, so the client stays on chunk boundaries only: a frame split across chunks is lost, the parser resyncs
+			if(sink->clients[i] >= 0)
+				atomic_fetch_add(&sink->lagged, 1);
+			continue;
+		}
+
+		int rc = send(sink->clients[i], data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(rc == len)
+			continue;
+
+		if(rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			_tcp_close(sink, i);
+			continue;
+		}
+
+		//The rest goes when the socket has room
+		if(rc < 0)
+			rc = 0;
+		memcpy(sink->pending[i], data + rc, len - rc);
+		sink->pending_len[i] = len - rc;
+		sink->pending_off[i] = 0;
+	}
+}
+
+static void _drain(fanout_sink_t * sink)
+{
+	static __thread uint8_t record[FANOUT_MAXRECORD];
+
+	unsigned int tail = atomic_load_explicit(&sink->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&sink->head, memory_order_acquire);
+
+	while(tail != head)
+	{
+		uint16_t len;
+		_ring_read(sink, tail, &len, sizeof(len));
+		_ring_read(sink, tail + sizeof(len), record, len);
+		tail += sizeof(len) + len;
+
+		//Space is given back before the output, so the radio loop could use it already
+		atomic_store_explicit(&sink->tail, tail, memory_order_release);
+
+		switch(sink->type)
+		{
+		case FANOUT_SINK_UDP:
+			udpbatch_push(sink->udp, record, len);
+			break;
+
+		case FANOUT_SINK_TCP:
+			_tcp_send(sink, record, len);
+			break;
+
+		case FANOUT_SINK_FILE:
+			filelog_push(sink->file, record, len);
+			break;
+		}
+
+		atomic_fetch_add(&sink->records, 1);
+		atomic_fetch_add(&sink->bytes, len);
+
+		if(tail == head)
+			head = atomic_load_explicit(&sink->head, memory_order_acquire);
+	}
+
+	if(sink->type == FANOUT_SINK_UDP)
+	{
+		udpbatch_flush(sink->udp);
+		atomic_store(&sink->errors, sink->udp->dropped);
+	}
+	else if(sink->type == FANOUT_SINK_FILE)
+		atomic_store(&sink->errors, sink->file->errors);
+}
+
+static void * _sink_thread(void * arg)
+{
+	fanout_sink_t * sink = (fanout_sink_t *)arg;
+
+	// TCP clients with a pending rest are polled for room in their sockets
+	struct pollfd fds[2 + FANOUT_TCP_MAXCLIENTS] = {
+		{ .fd = sink->wakefd, .events = POLLIN },
+		{ .fd = sink->type == FANOUT_SINK_TCP ? sink->listenfd : -1, .events = POLLIN },
+	};
+
+	struct timespec lastcommit, now;
+	clock_gettime(CLOCK_MONOTONIC, &lastcommit);
+
+	while(1)
+	{
+		//Has to be checked before draining, so nothing pushed before fanout_stop() is lost
+		bool running = atomic_load(&sink->running);
+
+		int timeout = -1;
+		if(!running)
+			timeout = 0;
+		else if(sink->type == FANOUT_SINK_FILE)
+			timeout = FILELOG_COMMIT_PERIOD_MS;
+
+		for(int i = 0; i < FANOUT_TCP_MAXCLIENTS; i++)
+		{
+			fds[2 + i].fd = sink->pending_len[i] > 0 ? sink->clients[i] : -1;
+			fds[2 + i].events = POLLOUT;
+		}
+
+		if(poll(fds, 2 + FANOUT_TCP_MAXCLIENTS, timeout) > 0)
+		{
+			eventfd_t dummy;
+			if(fds[0].revents & POLLIN)
+				eventfd_read(sink->wakefd, &dummy);
+
+			if(fds[1].revents & POLLIN)
+				_tcp_accept(sink);
+
+			for(int i = 0; i < FANOUT_TCP_MAXCLIENTS; i++)
+				if(fds[2 + i].revents)
+					_tcp_flush(sink, i);
+		}
+
+		_drain(sink);
+
+		if(sink->type == FANOUT_SINK_FILE)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int elapsed_ms = (now.tv_sec - lastcommit.tv_sec) * 1000 + (now.tv_nsec - lastcommit.tv_nsec) / 1000000;
+			if(elapsed_ms >= FILELOG_COMMIT_PERIOD_MS)
+			{
+				filelog_commit(sink->file);
+				lastcommit = now;
+			}
+		}
+
+		if(!running)
+			break;
+	}
+
+	return NULL;
+}
+
+
+static void _sink_free(fanout_sink_t * sink)
+{
+	if(sink->udp)
+	{
+		udpbatch_close(sink->udp);
+		free(sink->udp);
+	}
+
+	if(sink->file)
+	{
+		filelog_close(sink->file);
+		free(sink->file);
+	}
+
+	if(sink->listenfd >= 0)
+		close(sink->listenfd);
+
+	for(int i = 0; i < FANOUT_TCP_MAXCLIENTS; i++)
+		if(sink->clients[i] >= 0)
+			close(sink->clients[i]);
+
+	if(sink->wakefd >= 0)
+		close(sink->wakefd);
+
+	free(sink);
+}
+
+int fanout_add(fanout_t * self, fanout_sink_type_t type, const char * target)
+{
+	if(self->count == FANOUT_MAXSINKS)
+		return ENOSPC;
+
+	fanout_sink_t * sink = calloc(1, sizeof(fanout_sink_t));
+	if(sink == NULL)
+		return ENOMEM;
+
+	sink->type = type;
+	sink->target = target;
+	sink->listenfd = -1;
+	for(int i = 0; i < FANOUT_TCP_MAXCLIENTS; i++)
+		sink->clients[i] = -1;
+
+	sink->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(sink->wakefd < 0)
+	{
+		int err = errno;
+		_sink_free(sink);
+		return err;
+	}
+
+	int err = EINVAL;
+	switch(type)
+	{
+	case FANOUT_SINK_UDP:	err = _open_udp(sink);	break;
+	case FANOUT_SINK_TCP:	err = _open_tcp(sink);	break;
+	case FANOUT_SINK_FILE:	err = _open_file(sink);	break;
+	}
+
+	if(err != 0)
+	{
+		_sink_free(sink);
+		return err;
+	}
+
+	self->sinks[self->count++] = sink;
+	return 0;
+}
+
+int fanout_start(fanout_t * self)
+{
+	for(int i = 0; i < self->count; i++)
+	{
+		fanout_sink_t * sink = self->sinks[i];
+
+		atomic_store(&sink->running, true);
+		int err = pthread_create(&sink->thread, NULL, _sink_thread, sink);
+		if(err != 0)
+		{
+			atomic_store(&sink->running, false);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+void fanout_push(fanout_t * self, const uint8_t * data, int len)
+{
+	for(int i = 0; i < self->count; i++)
+	{
+		fanout_sink_t * sink = self->sinks[i];
+
+		unsigned int head = atomic_load_explicit(&sink->head, memory_order_relaxed);
+		unsigned int tail = atomic_load_explicit(&sink->tail, memory_order_acquire);
+
+		const uint8_t * chunk = data;
+		int left = len;
+		while(left > 0)
+		{
+			uint16_t reclen = MIN(left, FANOUT_MAXRECORD);
+			chunk += reclen;
+			left -= reclen;
+
+			if(FANOUT_RINGLEN - (head - tail) < sizeof(reclen) + reclen)
+			{
+				atomic_fetch_add_explicit(&sink->dropped, 1, memory_order_relaxed);
+				continue;
+			}
+
+			_ring_write(sink, head, &reclen, sizeof(reclen));
+			_ring_write(sink, head + sizeof(reclen), chunk - reclen, reclen);
+			head += sizeof(reclen) + reclen;
+		}
+
+		atomic_store_explicit(&sink->head, head, memory_order_release);
+
+		unsigned int fill = head - tail;
+		if(fill > atomic_load_explicit(&sink->maxfill, memory_order_relaxed))
+			atomic_store_explicit(&sink->maxfill, fill, memory_order_relaxed);
+	}
+}
+
+void fanout_kick(fanout_t * self)
+{
+	for(int i = 0; i < self->count; i++)
+	{
+		fanout_sink_t * sink = self->sinks[i];
+		if(atomic_load_explicit(&sink->head, memory_order_relaxed) != atomic_load_explicit(&sink->tail, memory_order_relaxed))
+			eventfd_write(sink->wakefd, 1);
+	}
+}
+
+void fanout_stop(fanout_t * self)
+{
+	for(int i = 0; i < self->count; i++)
+	{
+		fanout_sink_t * sink = self->sinks[i];
+
+		if(atomic_exchange(&sink->running, false))
+		{
+			eventfd_write(sink->wakefd, 1);
+			pthread_join(sink->thread, NULL);
+		}
+
+		_sink_free(sink);
+		self->sinks[i] = NULL;
+	}
+
+	self->count = 0;
+}
+
+const char * fanout_sink_typename(const fanout_sink_t * sink)
+{
+	return _typenames[sink->type];
+}
+
+unsigned int fanout_take_maxfill(fanout_sink_t * sink)
+{
+	return atomic_exchange_explicit(&sink->maxfill, 0, memory_order_relaxed);
+}
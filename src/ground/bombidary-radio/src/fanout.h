@@ -0,0 +1,88 @@
+/*
+ * 	Fan-out of the received stream to several consumers
+ *
+ * 	Every sink has its own single-producer single-consumer ring and its own
+ * 	output thread. The radio loop only copies data into the rings, so a slow
+ * 	consumer can't stall it: when a ring is full the chunk is dropped for that
+ * 	sink only and counted.
+ */
+
+#ifndef FANOUT_H_
+#define FANOUT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "udpbatch.h"
+#include "filelog.h"
+
+#define FANOUT_MAXSINKS			8
+#define FANOUT_RINGLEN			(256 * 1024)		//per sink, should be a power of two
+#define FANOUT_MAXRECORD		UDPBATCH_MAXDGRAM	//bigger chunks are split into several records
+#define FANOUT_TCP_MAXCLIENTS	8
+
+typedef enum
+{
+	FANOUT_SINK_UDP,	//target is "host:port"
+	FANOUT_SINK_TCP,	//target is a port to listen on, every connected client gets the stream
+	FANOUT_SINK_FILE,	//target is a file name, existing files are not overwritten
+} fanout_sink_type_t;
+
+typedef struct
+{
+	fanout_sink_type_t type;
+	const char * target;
+
+	// Ring of records, each one is a 16-bit length followed by data.
+	// head is moved only by the radio loop, tail only by the sink thread
+	uint8_t ring[FANOUT_RINGLEN];
+	atomic_uint head, tail;
+
+	int wakefd; //eventfd, radio loop kicks the sink thread through it
+	pthread_t thread;
+	atomic_bool running;
+
+	udpbatch_t * udp;
+	filelog_t * file;
+	int listenfd;
+	int clients[FANOUT_TCP_MAXCLIENTS];
+
+	// The rest of a record a client socket didn't take. It goes out before anything else, records which
+	// come meanwhile are dropped whole for that client, so its stream stays made of whole records.
+	// A record is a radio chunk, which may start or end in the middle of a MAVLink frame
+	uint8_t pending[FANOUT_TCP_MAXCLIENTS][FANOUT_MAXRECORD];
+	int pending_len[FANOUT_TCP_MAXCLIENTS], pending_off[FANOUT_TCP_MAXCLIENTS];
+
+	// Statistics. records/bytes are the ones which went out,
+	// dropped ones didn't fit into the ring, lagged ones were dropped for a TCP client behind its pending rest
+	atomic_uint records, bytes, dropped, lagged, errors;
+	atomic_uint maxfill; //max ring fill in bytes since the last fanout_take_maxfill()
+} fanout_sink_t;
+
+typedef struct
+{
+	fanout_sink_t * sinks[FANOUT_MAXSINKS];
+	int count;
+} fanout_t;
+
+//Opens a sink output right away, so errors are reported at startup. Returns 0 or an errno code
+int fanout_add(fanout_t * self, fanout_sink_type_t type, const char * target);
+
+//Starts sink threads
+int fanout_start(fanout_t * self);
+
+//Queues data to every sink. Doesn't wake sinks up, call fanout_kick() after a batch of pushes
+void fanout_push(fanout_t * self, const uint8_t * data, int len);
+
+void fanout_kick(fanout_t * self);
+
+//Lets sinks write out everything queued, stops their threads and closes outputs
+void fanout_stop(fanout_t * self);
+
+const char * fanout_sink_typename(const fanout_sink_t * sink);
+
+unsigned int fanout_take_maxfill(fanout_sink_t * sink);
+
+#endif /* FANOUT_H_ */
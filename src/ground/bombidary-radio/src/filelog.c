@@ -0,0 +1,99 @@
+/*
+ * 	Raw stream log with group commit
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "filelog.h"
+
+#ifndef MIN
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#endif
+
+static int _write_out(filelog_t * self)
+{
+	int done = 0;
+
+	while(done < self->bufflen)
+	{
+		int rc = write(self->fd, self->buff + done, self->bufflen - done);
+		if(rc < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			self->errors++;
+			break;
+		}
+
+		done += rc;
+	}
+
+	self->written += done;
+	if(done > 0)
+		self->dirty = true;
+
+	//Whatever is left after an error is lost, otherwise we would stall here forever
+	self->bufflen = 0;
+	return done;
+}
+
+int filelog_open(filelog_t * self, const char * filename)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(self->fd < 0)
+		return errno;
+
+	return 0;
+}
+
+void filelog_push(filelog_t * self, const uint8_t * data, int len)
+{
+	while(len > 0)
+	{
+		int copylen = MIN(len, FILELOG_BUFFLEN - self->bufflen);
+		memcpy(self->buff + self->bufflen, data, copylen);
+		self->bufflen += copylen;
+
+		data += copylen;
+		len -= copylen;
+
+		if(self->bufflen == FILELOG_BUFFLEN)
+			_write_out(self);
+	}
+}
+
+int filelog_commit(filelog_t * self)
+{
+	if(self->bufflen > 0)
+		_write_out(self);
+
+	if(!self->dirty)
+		return 0;
+
+	if(fsync(self->fd) != 0)
+	{
+		self->errors++;
+		return errno;
+	}
+
+	self->dirty = false;
+	self->commits++;
+	return 0;
+}
+
+void filelog_close(filelog_t * self)
+{
+	if(self->fd < 0)
+		return;
+
+	filelog_commit(self);
+	close(self->fd);
+	self->fd = -1;
+}
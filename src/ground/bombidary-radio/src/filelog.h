@@ -0,0 +1,35 @@
+/*
+ * 	Raw stream log with group commit. Data is accumulated in memory, written in big
+ * 	chunks and fsync'ed periodically instead of after every received packet
+ */
+
+#ifndef FILELOG_H_
+#define FILELOG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FILELOG_BUFFLEN			(64 * 1024)	//write() is issued when this much is accumulated
+#define FILELOG_COMMIT_PERIOD_MS	1000		//how often data is forced to the storage
+
+typedef struct
+{
+	int fd;
+	uint8_t buff[FILELOG_BUFFLEN];
+	int bufflen;
+	bool dirty; //written, but not yet fsync'ed
+
+	uint32_t written, commits, errors;
+} filelog_t;
+
+//Creates a new file. Refuses to overwrite an existing one. Returns 0 or errno
+int filelog_open(filelog_t * self, const char * filename);
+
+void filelog_push(filelog_t * self, const uint8_t * data, int len);
+
+//Writes everything accumulated and fsyncs the file. Should be called every FILELOG_COMMIT_PERIOD_MS
+int filelog_commit(filelog_t * self);
+
+void filelog_close(filelog_t * self);
+
+#endif /* FILELOG_H_ */
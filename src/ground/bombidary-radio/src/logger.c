@@ -0,0 +1,162 @@
+/*
+ * 	Asynchronous rate-limited logger for the ground radio receiver
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logger.h"
+
+typedef struct
+{
+	char line[LOGGER_LINELEN];
+} logger_slot_t;
+
+static struct
+{
+	logger_slot_t slots[LOGGER_SLOTS];
+	unsigned int head, tail; //free-running, masked on access
+
+	logger_level_t min_level;
+	double tokens;
+	struct timespec lastrefill;
+	uint32_t suppressed; //dropped by the rate limiter or because the ring was full
+
+	bool running;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} _logger = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static double _elapsed(const struct timespec * from, const struct timespec * to)
+{
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+//Token bucket. Should be called with the mutex taken
+static bool _take_token(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	_logger.tokens += _elapsed(&_logger.lastrefill, &now) * LOGGER_RATE;
+	if(_logger.tokens > LOGGER_BURST)
+		_logger.tokens = LOGGER_BURST;
+	_logger.lastrefill = now;
+
+	if(_logger.tokens < 1)
+		return false;
+
+	_logger.tokens -= 1;
+	return true;
+}
+
+static void * _logger_thread(void * arg)
+{
+	(void)arg;
+	logger_slot_t slot;
+
+	pthread_mutex_lock(&_logger.mutex);
+	while(1)
+	{
+		while(_logger.head == _logger.tail && _logger.suppressed == 0 && _logger.running)
+			pthread_cond_wait(&_logger.cond, &_logger.mutex);
+
+		if(_logger.head == _logger.tail && _logger.suppressed == 0)
+			break; //stopped and everything is printed
+
+		uint32_t suppressed = _logger.suppressed;
+		_logger.suppressed = 0;
+
+		bool haveline = _logger.head != _logger.tail;
+		if(haveline)
+		{
+			slot = _logger.slots[_logger.tail % LOGGER_SLOTS];
+			_logger.tail++;
+		}
+
+		//Doing the slow part without the lock, so producers are never stalled by the terminal
+		pthread_mutex_unlock(&_logger.mutex);
+
+		if(haveline)
+			fputs(slot.line, stdout);
+		if(suppressed)
+			printf("logger: %u lines suppressed\n", suppressed);
+		fflush(stdout);
+
+		pthread_mutex_lock(&_logger.mutex);
+	}
+	pthread_mutex_unlock(&_logger.mutex);
+
+	return NULL;
+}
+
+int logger_init(logger_level_t min_level)
+{
+	_logger.min_level = min_level;
+	_logger.tokens = LOGGER_BURST;
+	clock_gettime(CLOCK_MONOTONIC, &_logger.lastrefill);
+	_logger.running = true;
+
+	return pthread_create(&_logger.thread, NULL, _logger_thread, NULL);
+}
+
+void logger_printf(logger_level_t level, const char * fmt, ...)
+{
+	if(level < _logger.min_level)
+		return;
+
+	//Formatting is done before taking the lock to keep the critical section short
+	char line[LOGGER_LINELEN];
+	struct timespec now;
+	struct tm time_info;
+	clock_gettime(CLOCK_REALTIME, &now);
+	localtime_r(&now.tv_sec, &time_info);
+
+	int len = strftime(line, sizeof(line), "%H:%M:%S; ", &time_info);
+
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(line + len, sizeof(line) - len, fmt, args);
+	va_end(args);
+
+	len = strlen(line);
+	if(len == sizeof(line) - 1) //truncated, but still keep the line ending
+		line[len - 1] = '\n';
+
+	pthread_mutex_lock(&_logger.mutex);
+
+	//Errors are never rate-limited, but still could be dropped if the ring is full
+	if( (level < LOGGER_ERROR && !_take_token()) || _logger.head - _logger.tail >= LOGGER_SLOTS)
+		_logger.suppressed++;
+	else
+	{
+		memcpy(_logger.slots[_logger.head % LOGGER_SLOTS].line, line, len + 1);
+		_logger.head++;
+	}
+
+	pthread_cond_signal(&_logger.cond);
+	pthread_mutex_unlock(&_logger.mutex);
+}
+
+void logger_stop(void)
+{
+	pthread_mutex_lock(&_logger.mutex);
+	if(!_logger.running)
+	{
+		pthread_mutex_unlock(&_logger.mutex);
+		return;
+	}
+
+	_logger.running = false;
+	pthread_cond_signal(&_logger.cond);
+	pthread_mutex_unlock(&_logger.mutex);
+
+	pthread_join(_logger.thread, NULL);
+}
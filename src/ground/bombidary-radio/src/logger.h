@@ -0,0 +1,36 @@
+/*
+ * 	Asynchronous rate-limited logger for the ground radio receiver
+ *
+ * 	Producers only format a line into a ring of fixed-size slots, the actual
+ * 	output is done by a separate thread. So it's safe to log from the radio
+ * 	IRQ callback and from the main loop without stalling on a slow terminal.
+ */
+
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LOGGER_LINELEN		128	//max length of a single line, longer lines are truncated
+#define LOGGER_SLOTS		64	//should be a power of two
+#define LOGGER_RATE			20	//lines per second allowed in a long run
+#define LOGGER_BURST		40	//lines which could be printed at once
+
+typedef enum
+{
+	LOGGER_DEBUG = 0,
+	LOGGER_INFO,
+	LOGGER_ERROR,
+} logger_level_t;
+
+//Starts the output thread. Lines with level below min_level are thrown away right in the caller
+int logger_init(logger_level_t min_level);
+
+//Formats a line and queues it for output. Never blocks on the output itself
+void logger_printf(logger_level_t level, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+//Prints everything queued and stops the output thread
+void logger_stop(void);
+
+#endif /* LOGGER_H_ */
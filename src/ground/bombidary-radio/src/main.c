@@ -1,5 +1,11 @@
+#define _GNU_SOURCE //for sendmmsg() in udpbatch.h and permuting getopt()
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -8,11 +14,18 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <pigpio.h>
 #include <sx1268.h>
 
-#define RXBUFFLEN (1024 * 100)
+#include "logger.h"
+#include "fanout.h"
+#include "mavstat.h"
+
+// Should be a power of two: RXLEN() takes an unsigned difference modulo the length
+#define RXBUFFLEN (1024 * 128)
 
 #define CSPIN	8
 #define BUSYPIN	27
@@ -21,22 +34,166 @@
 #define RXENPIN	23
 #define TXENPIN	24
 
+#define STATS_PERIOD_MS	10000
+
 void irqcallback(int gpio, int level, uint32_t tick, void * userdata);
 
 #define INADDR(A,B,C,D) ((A << 24) | (B << 16) | (C << 8) | D)
 
+typedef struct
+{
+	sx1268_t * radio;
+	int wakefd; //eventfd, IRQ callback pokes the main loop through it
+	volatile uint32_t irqs;
+} irqctx_t;
+
+static fanout_t fanout;
+static mavstat_t mavstat;
+
+static void _to_fanout(const uint8_t * frame, int len, void * arg)
+{
+	fanout_push(&fanout, frame, len);
+}
+
+// fifo_rx is full when head == tail and it is not empty, RXLEN() gives 0 in that case
+static int _rx_available(sx1268_t * radio)
+{
+	int rxlen = RXLEN((*radio));
+	if(rxlen == 0 && !radio->fifo_rx.empty)
+		rxlen = radio->fifo_rx.length;
+
+	return rxlen;
+}
+
+static int _timerfd_open(int period_ms)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd < 0)
+		return fd;
+
+	struct itimerspec spec = {
+		.it_interval = { period_ms / 1000, (period_ms % 1000) * 1000000 },
+		.it_value = { period_ms / 1000, (period_ms % 1000) * 1000000 },
+	};
+	timerfd_settime(fd, 0, &spec, NULL);
+	return fd;
+}
+
+static void _usage(const char * name)
+{
+	printf("Usage: %s [-v] [-m] [-u host:port]... [-t port]... [-f file]... [host [file]]\n"
+			"	-u	send the stream to a UDP address\n"
+			"	-t	listen on a TCP port, every client gets the stream\n"
+			"	-f	write the stream to a file, never overwrites existing ones\n"
+			"	-m	forward only valid MAVLink frames\n"
+			"	-v	verbose\n"
+			"Without sinks given the stream goes to UDP host:11000 (192.168.0.1 by default)\n"
+			"and to the file (./lastlog.bin by default)\n", name);
+}
+
+static int _add_sink(fanout_sink_type_t type, const char * target)
+{
+	int err = fanout_add(&fanout, type, target);
+	if(err != 0)
+	{
+		// udp and tcp sinks could fail in getaddrinfo(), its codes are negative
+		logger_printf(LOGGER_ERROR, "Can't open sink %s: %s\n", target, err > 0 ? strerror(err) : gai_strerror(err));
+		return err;
+	}
+
+	logger_printf(LOGGER_INFO, "sink %d: %s %s\n", fanout.count - 1, fanout_sink_typename(fanout.sinks[fanout.count - 1]), target);
+	return 0;
+}
+
+static void _epoll_add(int epollfd, int fd)
+{
+	struct epoll_event evt = { .events = EPOLLIN, .data.fd = fd };
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &evt);
+}
+
 int main(int argc, char ** argv)
 {
 	int  err;
-	sx1268_t radio;
-	uint8_t rxbuff[RXBUFFLEN];
-	uint8_t tmpbuff[RXBUFFLEN];
+	static sx1268_t radio;
+	static uint8_t rxbuff[RXBUFFLEN];
+	static uint8_t tmpbuff[RXBUFFLEN];
+	static irqctx_t irqctx;
+
+	bool verbose = false;
+	bool mavonly = false;
+	int opt;
+	while( (opt = getopt(argc, argv, "vmu:t:f:h")) != -1 )
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose = true;
+			break;
+
+		case 'm':
+			mavonly = true;
+			break;
+
+		case 'u':
+		case 't':
+		case 'f':
+			break; //sinks are opened below, when the logger is running
+
+		default:
+			_usage(argv[0]);
+			return opt == 'h' ? 0 : EINVAL;
+		}
+	}
+
+	// Signals are handled by the main loop through signalfd, so they are blocked before the first thread starts:
+	// the logger, fanout and pigpio ones inherit the mask
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	logger_init(verbose ? LOGGER_DEBUG : LOGGER_INFO);
+	logger_printf(LOGGER_INFO, "Ouuff... You did it!\n");
 
-	printf("Ouuff... You did it!\n");
+	err = 0;
+	optind = 1;
+	while( (opt = getopt(argc, argv, "vmu:t:f:h")) != -1 && err == 0 )
+	{
+		switch(opt)
+		{
+		case 'u': err = _add_sink(FANOUT_SINK_UDP, optarg);	break;
+		case 't': err = _add_sink(FANOUT_SINK_TCP, optarg);	break;
+		case 'f': err = _add_sink(FANOUT_SINK_FILE, optarg);	break;
+		}
+	}
+
+	// Old style invocation: bombidary-radio [host [file]]
+	if(err == 0 && fanout.count == 0)
+	{
+		static char udptarget[300];
+		snprintf(udptarget, sizeof(udptarget), "%s:11000", optind < argc ? argv[optind] : "192.168.0.1");
+
+		err = _add_sink(FANOUT_SINK_UDP, udptarget);
+		if(err == 0)
+			err = _add_sink(FANOUT_SINK_FILE, optind + 1 < argc ? argv[optind + 1] : "./lastlog.bin");
+	}
+
+	if(err != 0)
+	{
+		fanout_stop(&fanout);
+		logger_stop();
+		return err;
+	}
 
+	irqctx.radio = &radio;
+	irqctx.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	gpioCfgSetInternals(gpioCfgGetInternals() | PI_CFG_NOSIGHANDLER);
 	if (( err = gpioInitialise() ) < 0)
 	{
-		printf("pigpio initialisation failed with code %d! Exitting\n", err);
+		logger_printf(LOGGER_ERROR, "pigpio initialisation failed with code %d! Exitting\n", err);
+		logger_stop();
 		return err;
 	}
 
@@ -48,7 +205,7 @@ int main(int argc, char ** argv)
 	gpioSetMode(BUSYPIN, PI_INPUT);
 
 	gpioSetMode(IRQPIN, PI_INPUT);
-	gpioSetISRFuncEx(IRQPIN, RISING_EDGE, 0, irqcallback, &radio);
+	gpioSetISRFuncEx(IRQPIN, RISING_EDGE, 0, irqcallback, &irqctx);
 
 	gpioSetMode(NRSTPIN, PI_OUTPUT);
 	gpioWrite(NRSTPIN, PI_HIGH);
@@ -66,79 +223,120 @@ int main(int argc, char ** argv)
 
 	sx1268_init(&radio);
 
-	const char* hostname="192.168.0.1";
-
-	if(argc > 1)
-		hostname = argv[1];
+	mavstat_init(&mavstat);
+	fanout_start(&fanout);
 
-	const char* portname="11000";
-	struct addrinfo hints;
-	memset(&hints,0,sizeof(hints));
-	hints.ai_family=AF_UNSPEC;
-	hints.ai_socktype=SOCK_DGRAM;
-	hints.ai_protocol=0;
-	hints.ai_flags=AI_ADDRCONFIG;
-	struct addrinfo* addr=0;
-	err = getaddrinfo(hostname,portname,&hints,&addr);
+	int epollfd = epoll_create1(EPOLL_CLOEXEC);
+	int statsfd = _timerfd_open(STATS_PERIOD_MS);
+	int sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
 
-	int sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-	printf("addr: %s	port: %s	sock: %d   addr err: %d\n", hostname, portname, sock, err);
+	_epoll_add(epollfd, irqctx.wakefd);
+	_epoll_add(epollfd, statsfd);
+	_epoll_add(epollfd, sigfd);
 
-	char * filename = "./lastlog.bin";
+	// An IRQ could have come before the callback was set up, so we check the fifo at least once
+	eventfd_write(irqctx.wakefd, 1);
 
-	if(argc > 2)
-		filename = argv[2];
-
-	int file = open(filename, O_WRONLY | O_CREAT | O_EXCL, S_IROTH);
-	if(file != 0 && errno == EEXIST)
+	uint32_t rxbytes = 0, rxchunks = 0;
+	bool running = true;
+	while(running)
 	{
-		printf("File %s already exists, I wouldn't overwrite it\n", filename);
-		return errno;
-	}
-	printf("filename: %s	file: %d\n", filename, file);
-
-	bool verbose = true;
-	if(argc > 3)
-		verbose = strcmp(argv[3], "-v") == 0;
-
-	while(1) {
-		if( RXLEN(radio) != 0)
+		struct epoll_event evts[4];
+		int evtcount = epoll_wait(epollfd, evts, 4, -1);
+		if(evtcount < 0)
 		{
-			time_t current_time;
-			struct tm * time_info;
-			char timeString[9];  // space for "HH:MM:SS\0"
+			if(errno == EINTR)
+				continue;
 
-			time(&current_time);
-			time_info = localtime(&current_time);
+			logger_printf(LOGGER_ERROR, "epoll_wait failed with %d\n", errno);
+			break;
+		}
 
-			strftime(timeString, sizeof(timeString), "%H:%M:%S", time_info);
+		for(int i = 0; i < evtcount; i++)
+		{
+			int fd = evts[i].data.fd;
+			uint64_t dummy;
 
-			int rxlen = RXLEN(radio);
-			sx1268_status_t status = sx1268_receive(&radio, tmpbuff, rxlen);
-			printf("%s; received %d bytes; status %d\n", timeString, rxlen, status);
+			if(fd == irqctx.wakefd)
+			{
+				eventfd_read(fd, &dummy);
+
+				// Taking everything that has been received so far. Every chunk becomes a datagram,
+				// but all of them go out with a single syscall
+				int rxlen;
+				while( (rxlen = _rx_available(&radio)) != 0 )
+				{
+					sx1268_status_t status = sx1268_receive(&radio, tmpbuff, rxlen);
+					if(status != SX1268_OK)
+					{
+						logger_printf(LOGGER_ERROR, "receive of %d bytes failed with status %d\n", rxlen, status);
+						break;
+					}
+
+					logger_printf(LOGGER_DEBUG, "received %d bytes\n", rxlen);
+
+					// Stream is always parsed for statistics, but forwarded as is unless asked otherwise
+					if(mavonly)
+						mavstat_parse(&mavstat, tmpbuff, rxlen, _to_fanout, NULL);
+					else
+					{
+						mavstat_parse(&mavstat, tmpbuff, rxlen, NULL, NULL);
+						fanout_push(&fanout, tmpbuff, rxlen);
+					}
+
+					rxbytes += rxlen;
+					rxchunks++;
+				}
+
+				fanout_kick(&fanout);
+			}
 
-			int res = sendto(sock, tmpbuff, rxlen, 0, addr->ai_addr, addr->ai_addrlen);
-			if(res != rxlen || verbose)
-				printf("Pushed to socket, res %d\n", res);
+			else if(fd == statsfd)
+			{
+				read(fd, &dummy, sizeof(dummy));
+
+				logger_printf(LOGGER_INFO, "irqs %u; rx %u bytes in %u chunks\n", irqctx.irqs, rxbytes, rxchunks);
+				logger_printf(LOGGER_INFO, "mavlink: %u frames %u bytes; lost %u; bad crc %u; junk %u bytes\n",
+						mavstat.frames, mavstat.bytes, mavstat.lost, mavstat.crc_errors, mavstat.rxbytes - mavstat.bytes);
+
+				mavstat_report(&mavstat, _to_fanout, NULL);
+				fanout_kick(&fanout);
+
+				for(int s = 0; s < fanout.count; s++)
+				{
+					fanout_sink_t * sink = fanout.sinks[s];
+					logger_printf(LOGGER_INFO, "sink %d %s: out %u records %u bytes; dropped %u; lagged %u; errors %u; max fill %u\n",
+							s, fanout_sink_typename(sink), sink->records, sink->bytes,
+							sink->dropped, sink->lagged, sink->errors, fanout_take_maxfill(sink));
+				}
+			}
 
-			res = write(file, tmpbuff, rxlen);
-			if(res != rxlen || verbose)
-				printf("Writed to file, res %d\n", res);
-			else
+			else if(fd == sigfd)
 			{
-				if(fsync(file) != 0)
-					printf("fsync failed with %d\n", errno);
+				struct signalfd_siginfo info;
+				read(fd, &info, sizeof(info));
+
+				logger_printf(LOGGER_INFO, "Got signal %u, stopping\n", info.ssi_signo);
+				running = false;
 			}
 		}
-		usleep(500);
 	}
 
+	gpioSetISRFuncEx(IRQPIN, RISING_EDGE, 0, NULL, NULL);
+	gpioTerminate();
+
+	fanout_stop(&fanout);
+	logger_stop();
 
 	return 0;
 }
 
 void irqcallback(int gpio, int level, uint32_t tick, void * userdata)
 {
-	printf("IRQ!\n");
-	sx1268_event(userdata);
+	irqctx_t * ctx = (irqctx_t *)userdata;
+
+	sx1268_event(ctx->radio);
+	ctx->irqs++;
+
+	eventfd_write(ctx->wakefd, 1);
 }
@@ -0,0 +1,145 @@
+/*
+ * 	Inline MAVLink framing of the received stream and link statistics
+ */
+
+#include <string.h>
+
+#include "mavstat.h"
+
+static mavstat_source_t * _get_source(mavstat_t * self, uint8_t sysid, uint8_t compid, bool create)
+{
+	for(int i = 0; i < self->sourcecount; i++)
+		if(self->sources[i].sysid == sysid && self->sources[i].compid == compid)
+			return &self->sources[i];
+
+	if(!create || self->sourcecount == MAVSTAT_MAXSOURCES)
+		return NULL;
+
+	mavstat_source_t * source = &self->sources[self->sourcecount++];
+	memset(source, 0, sizeof(*source));
+	source->sysid = sysid;
+	source->compid = compid;
+	return source;
+}
+
+static mavstat_msgid_t * _get_msgid(mavstat_t * self, uint32_t msgid)
+{
+	for(int i = 0; i < self->msgidcount; i++)
+		if(self->msgids[i].msgid == msgid)
+			return &self->msgids[i];
+
+	if(self->msgidcount == MAVSTAT_MAXMSGIDS)
+		return NULL;
+
+	mavstat_msgid_t * entry = &self->msgids[self->msgidcount++];
+	memset(entry, 0, sizeof(*entry));
+	entry->msgid = msgid;
+	return entry;
+}
+
+static int _frame_len(const mavlink_message_t * msg)
+{
+	if(msg->magic == MAVLINK_STX_MAVLINK1)
+		return MAVLINK_CORE_HEADER_MAVLINK1_LEN + 1 + msg->len + MAVLINK_NUM_CHECKSUM_BYTES;
+
+	int len = MAVLINK_CORE_HEADER_LEN + 1 + msg->len + MAVLINK_NUM_CHECKSUM_BYTES;
+	if(msg->incompat_flags & MAVLINK_IFLAG_SIGNED)
+		len += MAVLINK_SIGNATURE_BLOCK_LEN;
+
+	return len;
+}
+
+static void _on_valid(mavstat_t * self, const mavlink_message_t * msg, mavstat_frame_cb_t on_frame, void * arg)
+{
+	int framelen = _frame_len(msg);
+
+	self->frames++;
+	self->bytes += framelen;
+
+	mavstat_source_t * source = _get_source(self, msg->sysid, msg->compid, true);
+	if(source)
+	{
+		if(source->frames > 0)
+		{
+			uint8_t gap = msg->seq - source->lastseq - 1;
+			source->lost += gap;
+			self->lost += gap;
+		}
+
+		source->lastseq = msg->seq;
+		source->frames++;
+		source->bytes += framelen;
+	}
+
+	mavstat_msgid_t * entry = _get_msgid(self, msg->msgid);
+	if(entry)
+	{
+		entry->frames++;
+		entry->bytes += framelen;
+	}
+
+	if(on_frame)
+	{
+		// The frame is packed back from the parsed message. It's the same bytes as received,
+		// since MAVLink 2 senders trim payloads the same way
+		uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+		uint16_t len = mavlink_msg_to_send_buffer(frame, msg);
+		on_frame(frame, len, arg);
+	}
+}
+
+void mavstat_init(mavstat_t * self)
+{
+	memset(self, 0, sizeof(*self));
+}
+
+void mavstat_parse(mavstat_t * self, const uint8_t * data, int len, mavstat_frame_cb_t on_frame, void * arg)
+{
+	self->rxbytes += len;
+
+	for(int i = 0; i < len; i++)
+	{
+		// The parsed message is left in self->rxmsg, no need to copy it on every byte
+		uint8_t rc = mavlink_frame_char_buffer(&self->rxmsg, &self->rxstatus, data[i], NULL, NULL);
+
+		if(rc == MAVLINK_FRAMING_OK)
+			_on_valid(self, &self->rxmsg, on_frame, arg);
+
+		else if(rc == MAVLINK_FRAMING_BAD_CRC || rc == MAVLINK_FRAMING_BAD_SIGNATURE)
+		{
+			self->crc_errors++;
+
+			// Header could be damaged as well, so new sources are not created from broken frames
+			mavstat_source_t * source = _get_source(self, self->rxmsg.sysid, self->rxmsg.compid, false);
+			if(source)
+				source->crc_errors++;
+		}
+	}
+}
+
+void mavstat_report(mavstat_t * self, mavstat_frame_cb_t on_frame, void * arg)
+{
+	mavlink_message_t msg;
+	uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+	uint32_t junk = self->rxbytes - self->bytes;
+
+	for(int i = 0; i < self->sourcecount; i++)
+	{
+		mavstat_source_t * source = &self->sources[i];
+		mavlink_msg_zikush_ground_rx_stats_pack(MAVSTAT_SYSID, MAVSTAT_COMPID, &msg,
+				source->sysid, source->compid, source->frames, source->lost, source->crc_errors, source->bytes, junk);
+
+		uint16_t len = mavlink_msg_to_send_buffer(frame, &msg);
+		on_frame(frame, len, arg);
+	}
+
+	for(int i = 0; i < self->msgidcount; i++)
+	{
+		mavstat_msgid_t * entry = &self->msgids[i];
+		mavlink_msg_zikush_ground_rx_msgid_stats_pack(MAVSTAT_SYSID, MAVSTAT_COMPID, &msg,
+				entry->msgid, entry->frames, entry->bytes);
+
+		uint16_t len = mavlink_msg_to_send_buffer(frame, &msg);
+		on_frame(frame, len, arg);
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ * 	Inline MAVLink framing of the received stream and link statistics
+ *
+ * 	Counts valid frames, sequence gaps and CRC failures per (sysid, compid) and
+ * 	frames/bytes per message id. Statistics are reported as ZIKUSH_GROUND_RX_STATS
+ * 	and ZIKUSH_GROUND_RX_MSGID_STATS messages.
+ */
+
+#ifndef MAVSTAT_H_
+#define MAVSTAT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mavlink/zikush/mavlink.h"
+
+#define MAVSTAT_MAXSOURCES	16
+#define MAVSTAT_MAXMSGIDS	64
+#define MAVSTAT_SYSID		255						//the receiver reports as a ground station
+#define MAVSTAT_COMPID		MAV_COMP_ID_UDP_BRIDGE
+
+typedef struct
+{
+	uint8_t sysid, compid;
+	uint8_t lastseq;
+
+	uint32_t frames, lost, crc_errors, bytes;
+} mavstat_source_t;
+
+typedef struct
+{
+	uint32_t msgid;
+	uint32_t frames, bytes;
+} mavstat_msgid_t;
+
+typedef struct
+{
+	// parser state
+	mavlink_message_t rxmsg;
+	mavlink_status_t rxstatus;
+
+	mavstat_source_t sources[MAVSTAT_MAXSOURCES];
+	int sourcecount;
+	mavstat_msgid_t msgids[MAVSTAT_MAXMSGIDS];
+	int msgidcount;
+
+	uint32_t rxbytes; //everything fed into the parser
+	uint32_t frames, lost, crc_errors, bytes; //for all sources
+} mavstat_t;
+
+//Called for every frame: a valid one in mavstat_parse() or a report in mavstat_report()
+typedef void (*mavstat_frame_cb_t)(const uint8_t * frame, int len, void * arg);
+
+void mavstat_init(mavstat_t * self);
+
+//Feeds received bytes to the parser. on_frame could be NULL if only statistics are needed
+void mavstat_parse(mavstat_t * self, const uint8_t * data, int len, mavstat_frame_cb_t on_frame, void * arg);
+
+//Packs statistics into MAVLink frames, one per source and one per message id
+void mavstat_report(mavstat_t * self, mavstat_frame_cb_t on_frame, void * arg);
+
+#endif /* MAVSTAT_H_ */
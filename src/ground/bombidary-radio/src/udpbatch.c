@@ -0,0 +1,111 @@
+/*
+ * 	Batched UDP output. Datagrams are collected and sent with a single sendmmsg() call
+ */
+
+#define _GNU_SOURCE //for sendmmsg()
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "udpbatch.h"
+
+#ifndef MIN
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#endif
+
+int udpbatch_open(udpbatch_t * self, const char * host, const char * port)
+{
+	memset(self, 0, sizeof(*self));
+	self->sock = -1;
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = 0;
+	hints.ai_flags = AI_ADDRCONFIG;
+
+	struct addrinfo * addr = NULL;
+	int err = getaddrinfo(host, port, &hints, &addr);
+	if(err != 0)
+		return err;
+
+	self->sock = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK, addr->ai_protocol);
+	if(self->sock < 0)
+	{
+		freeaddrinfo(addr);
+		return errno;
+	}
+
+	memcpy(&self->addr, addr->ai_addr, addr->ai_addrlen);
+	self->addrlen = addr->ai_addrlen;
+	freeaddrinfo(addr);
+
+	for(int i = 0; i < UDPBATCH_MAXMSGS; i++)
+	{
+		self->iovs[i].iov_base = self->data[i];
+		self->msgs[i].msg_hdr.msg_iov = &self->iovs[i];
+		self->msgs[i].msg_hdr.msg_iovlen = 1;
+		self->msgs[i].msg_hdr.msg_name = &self->addr;
+		self->msgs[i].msg_hdr.msg_namelen = self->addrlen;
+	}
+
+	return 0;
+}
+
+void udpbatch_push(udpbatch_t * self, const uint8_t * data, int len)
+{
+	while(len > 0)
+	{
+		if(self->count == UDPBATCH_MAXMSGS)
+			udpbatch_flush(self);
+
+		int copylen = MIN(len, UDPBATCH_MAXDGRAM);
+		memcpy(self->data[self->count], data, copylen);
+		self->iovs[self->count].iov_len = copylen;
+		self->count++;
+
+		data += copylen;
+		len -= copylen;
+	}
+}
+
+int udpbatch_flush(udpbatch_t * self)
+{
+	int done = 0;
+
+	while(done < self->count)
+	{
+		int rc = sendmmsg(self->sock, self->msgs + done, self->count - done, 0);
+		if(rc < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			//Socket buffer is full or network is down. There is nobody to retransmit for,
+			//so the rest of the batch is just dropped and the radio path goes on
+			self->dropped += self->count - done;
+			break;
+		}
+
+		done += rc;
+	}
+
+	self->sent += done;
+	self->count = 0;
+	return done;
+}
+
+void udpbatch_close(udpbatch_t * self)
+{
+	if(self->sock < 0)
+		return;
+
+	udpbatch_flush(self);
+	close(self->sock);
+	self->sock = -1;
+}
@@ -0,0 +1,39 @@
+/*
+ * 	Batched UDP output. Datagrams are collected and sent with a single sendmmsg() call
+ */
+
+#ifndef UDPBATCH_H_
+#define UDPBATCH_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define UDPBATCH_MAXMSGS	32	//datagrams in one sendmmsg() call
+#define UDPBATCH_MAXDGRAM	1024	//bytes in one datagram, bigger chunks are split
+
+typedef struct
+{
+	int sock;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	struct mmsghdr msgs[UDPBATCH_MAXMSGS];
+	struct iovec iovs[UDPBATCH_MAXMSGS];
+	uint8_t data[UDPBATCH_MAXMSGS][UDPBATCH_MAXDGRAM];
+	int count;
+
+	uint32_t sent, dropped; //in datagrams
+} udpbatch_t;
+
+//Resolves host:port and opens a socket. Returns 0 or getaddrinfo()/errno error code
+int udpbatch_open(udpbatch_t * self, const char * host, const char * port);
+
+//Queues data, splitting it into datagrams. Flushes by itself when the batch is full
+void udpbatch_push(udpbatch_t * self, const uint8_t * data, int len);
+
+//Sends everything queued. Returns the number of datagrams the kernel has accepted
+int udpbatch_flush(udpbatch_t * self);
+
+void udpbatch_close(udpbatch_t * self);
+
+#endif /* UDPBATCH_H_ */
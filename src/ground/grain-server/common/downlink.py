@@ -0,0 +1,264 @@
+""" Декодер компактного даунлинка ICU (см. src/board/ICU/Inc/downlink.h)
+
+Поток (compid, msgid) приходит ключевыми кадрами и дельтами относительно ключевого кадра, который борт
+считает доставленным. Схема полей строится по zikush.xml так же, как ее строит mavgen, так что декодер не
+зависит от сгенерированного pymavlink. На выходе - обычные кадры MAVLink 1 и 2, их можно отдавать в parse_buffer.
+"""
+
+import os
+import struct
+import xml.etree.ElementTree as ET
+from collections import OrderedDict
+
+DOWNLINK_STX = 0xA5
+DOWNLINK_HEADER_LEN = 5
+DOWNLINK_KEYFLAG = 0x80
+
+MAVLINK1_STX = 0xFE
+MAVLINK1_NON_PAYLOAD_LEN = 8
+MAVLINK2_STX = 0xFD
+MAVLINK2_NON_PAYLOAD_LEN = 12
+MAVLINK2_IFLAG_SIGNED = 0x01
+MAVLINK2_SIGNATURE_LEN = 13
+
+_TYPE_SIZES = {
+    "char": 1, "uint8_t": 1, "int8_t": 1,
+    "uint16_t": 2, "int16_t": 2,
+    "uint32_t": 4, "int32_t": 4, "float": 4,
+    "uint64_t": 8, "int64_t": 8, "double": 8,
+}
+
+
+def _crc_accumulate(data, crc=0xFFFF):
+    """ CRC-16/MCRF4XX, как в MAVLink """
+    for byte in data:
+        tmp = (byte ^ crc) & 0xFF
+        tmp = (tmp ^ (tmp << 4)) & 0xFF
+        crc = ((crc >> 8) ^ (tmp << 8) ^ (tmp << 3) ^ (tmp >> 4)) & 0xFFFF
+    return crc
+
+
+class Element:
+    """ Элемент полезной нагрузки: поле или один элемент массива """
+    def __init__(self, type_, offset):
+        self.type = type_
+        self.offset = offset
+        self.size = _TYPE_SIZES[type_]
+        self.is_float = type_ in ("float", "double")
+        self.is_signed = type_.startswith("int")
+
+
+class Schema:
+    """ Раскладка сообщения на проводе в MAVLink 1, без расширений """
+    def __init__(self, msgid, name, fields):
+        self.msgid = msgid
+        self.name = name
+
+        # mavgen сортирует поля по размеру типа, устойчиво
+        ordered = sorted(fields, key=lambda f: _TYPE_SIZES[f[0]], reverse=True)
+
+        crc = _crc_accumulate((name + " ").encode())
+        self.elements = []
+        offset = 0
+        for type_, fname, array_length in ordered:
+            crc = _crc_accumulate((type_ + " ").encode(), crc)
+            crc = _crc_accumulate((fname + " ").encode(), crc)
+            if array_length:
+                crc = _crc_accumulate([array_length], crc)
+
+            for _ in range(array_length or 1):
+                self.elements.append(Element(type_, offset))
+                offset += _TYPE_SIZES[type_]
+
+        self.crc_extra = (crc & 0xFF) ^ (crc >> 8)
+        self.length = offset
+
+
+def load_schemas(path):
+    """ Схемы всех сообщений из xml файла и его include-ов, по msgid """
+    schemas = {}
+    root = ET.parse(path).getroot()
+
+    for include in root.findall("include"):
+        schemas.update(load_schemas(os.path.join(os.path.dirname(path), include.text.strip())))
+
+    for message in root.iter("message"):
+        fields = []
+        for child in message:
+            if child.tag == "extensions":
+                break
+            if child.tag != "field":
+                continue
+
+            type_ = child.get("type")
+            array_length = 0
+            if "[" in type_:
+                type_, array_length = type_.rstrip("]").split("[")
+                array_length = int(array_length)
+            if type_ == "uint8_t_mavlink_version":
+                type_ = "uint8_t"
+
+            fields.append((type_, child.get("name"), array_length))
+
+        msgid = int(message.get("id"))
+        schemas[msgid] = Schema(msgid, message.get("name"), fields)
+
+    return schemas
+
+
+def _varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, pos
+
+
+def _unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+class DownlinkDecoder:
+    """ Собирает из компактных кадров обычные кадры MAVLink 1
+
+    Состояние (ключевые кадры) живет между вызовами feed(), поэтому декодер один на весь линк.
+    """
+
+    KEYFRAMES_KEPT = 4
+    """ Сколько последних ключевых кадров потока помнить. Борт переключается на новый только после подтверждения,
+        а дельты от старого могут еще лежать в его очереди. Столько же, сколько ICU_DOWNLINK_KEYFRAMES_KEPT борта:
+        от ключевого кадра старше он сам отказывается """
+
+    def __init__(self, msgdef_path, sysid=0):
+        self._schemas = load_schemas(msgdef_path)
+        self._sysid = sysid
+        self._keyframes = {}
+        self._seq = 0
+
+        self.decoded = 0
+        self.dropped = 0
+        """ Кадры с плохой crc и дельты, ключевых кадров которых у нас нет """
+
+    def feed(self, data):
+        """ Разбирает буфер из целых кадров: пейлоад SBD или пакет радио. Возвращает список кадров MAVLink """
+        data = bytes(data)
+        frames = []
+        pos = 0
+
+        while pos + 1 < len(data):
+            stx = data[pos]
+
+            if stx == MAVLINK1_STX:
+                end = pos + data[pos + 1] + MAVLINK1_NON_PAYLOAD_LEN
+                frames.append(data[pos:end])
+                pos = end
+                continue
+
+            if stx == MAVLINK2_STX and pos + 2 < len(data):
+                # Узлы CAN шлют MAVLink 2, такие кадры идут как есть
+                end = pos + data[pos + 1] + MAVLINK2_NON_PAYLOAD_LEN
+                if data[pos + 2] & MAVLINK2_IFLAG_SIGNED:
+                    end += MAVLINK2_SIGNATURE_LEN
+                frames.append(data[pos:end])
+                pos = end
+                continue
+
+            if stx != DOWNLINK_STX or pos + DOWNLINK_HEADER_LEN > len(data):
+                pos += 1
+                continue
+
+            end = pos + DOWNLINK_HEADER_LEN + data[pos + 1] + 2
+            frame = self._decode(data[pos:end])
+            if frame is None:
+                self.dropped += 1
+                pos += 1
+                continue
+
+            self.decoded += 1
+            frames.append(frame)
+            pos = end
+
+        return frames
+
+    def _decode(self, frame):
+        if len(frame) < DOWNLINK_HEADER_LEN + 2:
+            return None
+
+        _, length, ctl, compid, msgid = frame[:DOWNLINK_HEADER_LEN]
+        schema = self._schemas.get(msgid)
+        if schema is None:
+            return None
+
+        body = frame[DOWNLINK_HEADER_LEN:-2]
+        crc = _crc_accumulate(frame[1:-2])
+        crc = _crc_accumulate([schema.crc_extra], crc)
+        if crc != struct.unpack("<H", frame[-2:])[0]:
+            return None
+
+        num = ctl & ~DOWNLINK_KEYFLAG
+        keyframes = self._keyframes.setdefault((compid, msgid), OrderedDict())
+
+        try:
+            if ctl & DOWNLINK_KEYFLAG:
+                payload = self._keyframe(schema, body)
+                keyframes[num] = payload
+                keyframes.move_to_end(num)
+                while len(keyframes) > self.KEYFRAMES_KEPT:
+                    keyframes.popitem(last=False)
+            else:
+                if num not in keyframes:
+                    return None
+                payload = self._delta(schema, body, keyframes[num])
+        except IndexError:
+            return None
+
+        return self._mavlink1(schema, compid, payload)
+
+    @staticmethod
+    def _keyframe(schema, body):
+        payload = bytearray(schema.length)
+        pos = 0
+
+        for el in schema.elements:
+            if el.is_float:
+                payload[el.offset:el.offset + el.size] = body[pos:pos + el.size]
+                pos += el.size
+                continue
+
+            value, pos = _varint(body, pos)
+            if el.is_signed:
+                value = _unzigzag(value)
+            mask = (1 << 8 * el.size) - 1
+            payload[el.offset:el.offset + el.size] = (value & mask).to_bytes(el.size, "little")
+
+        return bytes(payload)
+
+    @staticmethod
+    def _delta(schema, body, ref):
+        payload = bytearray(ref)
+        count = len(schema.elements)
+        bitmap = body[:(count + 7) // 8]
+        pos = len(bitmap)
+
+        for index, el in enumerate(schema.elements):
+            if not bitmap[index // 8] & (1 << index % 8):
+                continue
+
+            delta, pos = _varint(body, pos)
+            mask = (1 << 8 * el.size) - 1
+            value = int.from_bytes(ref[el.offset:el.offset + el.size], "little") + _unzigzag(delta)
+            payload[el.offset:el.offset + el.size] = (value & mask).to_bytes(el.size, "little")
+
+        return bytes(payload)
+
+    def _mavlink1(self, schema, compid, payload):
+        frame = bytes([MAVLINK1_STX, len(payload), self._seq, self._sysid, compid, schema.msgid]) + payload
+        self._seq = (self._seq + 1) & 0xFF
+
+        crc = _crc_accumulate(frame[1:])
+        crc = _crc_accumulate([schema.crc_extra], crc)
+        return frame + struct.pack("<H", crc)
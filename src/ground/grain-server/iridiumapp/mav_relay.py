@@ -8,14 +8,20 @@ import socket
 
 from .network.mo_server import MOServiceServer
 from .messages.mobile_originated import MOMessage
+from ..common.downlink import DownlinkDecoder
 
 # нужны переменные окружения MAVLINK10 и MAVLINK_DIALECT=zikush
 from pymavlink.mavutil import mavlink_connection, mavudp, mavlogfile
 from pymavlink.dialects.v10.zikush import MAVLink
 _log = logging.getLogger(__name__)
 
+_MSGDEF_DEFAULT = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)),
+    "..", "..", "..", "common", "mavlink", "message_definitions", "v1.0", "zikush.xml"
+)
 
-def build_req_handler_cls(mav_handler):
+
+def build_req_handler_cls(mav_handler, decoder):
 
     class ReqHandler(BaseRequestHandler):
         def handle(self):
@@ -50,17 +56,20 @@ def build_req_handler_cls(mav_handler):
             if not pay:
                 _log.warning("no payload present")
             else:
-                for char in msg.payload.raw_payload:
-                    msg = main_mav.parse_char(char)
-                    if msg:
-                        _log.info("got mav message: %s" % msg)
-                        mav_handler(msg)
+                # Борт шлет компактные кадры, декодер собирает из них обычные
+                for frame in decoder.feed(msg.payload.raw_payload):
+                    for mav_msg in main_mav.parse_buffer(frame) or []:
+                        _log.info("got mav message: %s" % mav_msg)
+                        mav_handler(mav_msg)
+
+                if decoder.dropped:
+                    _log.warning("compact frames dropped so far: %d" % decoder.dropped)
 
     return ReqHandler
 
 
 # noinspection PyBroadException
-def main(listen_addr, relay_addr, log_dir: str):
+def main(listen_addr, relay_addr, log_dir: str, msgdef: str):
 
     os.makedirs(log_dir, exist_ok=True)
     blog_fpath = os.path.join(
@@ -81,7 +90,9 @@ def main(listen_addr, relay_addr, log_dir: str):
             relay_mav.mav.send(msg)
             log_mav.mav.send(msg)
 
-        RequestHandler = build_req_handler_cls(relay_mav_msg)
+        # Ключевые кадры переживают сеансы, так что декодер один на все
+        decoder = DownlinkDecoder(msgdef)
+        RequestHandler = build_req_handler_cls(relay_mav_msg, decoder)
 
         server = MOServiceServer(
             server_address=listen_addr,
@@ -127,6 +138,8 @@ def main_exec():
                         required=True)
     parser.add_argument("--relay-port", action="store", dest="relay_port", nargs="?", type=int,
                         required=True)
+    parser.add_argument("--msgdef", action="store", dest="msgdef", nargs="?", type=str,
+                        default=_MSGDEF_DEFAULT)
 
     args = parser.parse_args(sys.argv[1:])
 
@@ -134,7 +147,7 @@ def main_exec():
     relay_addr = args.relay_addr, args.relay_port
     log_dir = args.log_dir
 
-    return main(listen_addr, relay_addr, log_dir)
+    return main(listen_addr, relay_addr, log_dir, args.msgdef)
 
 
 if __name__ == "__main__":